@@ -148,7 +148,7 @@ void listDelNode(list *list, listNode *node){
 	else
 		list->tail = node->prev;
 
-	list->free(node);
+	if(list->free) list->free(listNodeValue(node));
 	zfree(node);
 	list->len--;
 }
@@ -338,6 +338,44 @@ void listRewindTail(list *list, listIter *li){
 	li->next = list->tail;
 }
 
+/**
+ * Detach the 'count' nodes from 'first' to 'last', in this order, from the
+ * list, and return them as a new list with the same methods. The nodes are
+ * moved, not copied, so the caller frees them with listRelease() on the new
+ * list.
+ *
+ * On error, NULL is returned and the list remains unchanged.
+ *
+ * T = O(1)
+ */
+list *listDetachRange(list *list, listNode *first, listNode *last, unsigned long count){
+	struct list *run = listCreate();
+
+	if(run == NULL) return NULL;
+
+	if(first->prev)
+		first->prev->next = last->next;
+	else
+		list->head = last->next;
+
+	if(last->next)
+		last->next->prev = first->prev;
+	else
+		list->tail = first->prev;
+
+	list->len -= count;
+
+	first->prev = NULL;
+	last->next = NULL;
+	run->head = first;
+	run->tail = last;
+	run->len = count;
+	run->dup = list->dup;
+	run->free = list->free;
+	run->match = list->match;
+	return run;
+}
+
 /**
  *
  */
@@ -42,7 +42,7 @@ typedef struct list{
 
 #define listLength(l) ((l)->len)
 #define listFirst(l) ((l)->head)
-#define listLast(l) ((l)->last)
+#define listLast(l) ((l)->tail)
 #define listPrevNode(l) ((l)->prev)
 #define listNextNode(l) ((l)->next)
 #define listNodeValue(l) ((l)->val)
@@ -72,6 +72,7 @@ listNode *listIndex(list *list, long index);
 void listRewind(list *list, listIter *li);
 void listRewindTail(list *list, listIter *li);
 void listRotate(list *list);
+list *listDetachRange(list *list, listNode *first, listNode *last, unsigned long count);
 
 #define AL_START_HEAD 0
 #define AL_START_TAIL 1
@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "chunkindex.h"
+#include "zmalloc.h"
+
+/*-----------------------------------------------------------------------------
+ * Skiplist of chunks
+ *----------------------------------------------------------------------------*/
+
+static chunkIndexChunk *ciCreateChunk(int level, listNode *first, unsigned long count){
+	chunkIndexChunk *x = zmalloc(sizeof(*x) + level * sizeof(struct chunkIndexLevel));
+	int i;
+
+	x->first = first;
+	x->count = count;
+	for(i = 0; i < level; i++){
+		x->level[i].forward = NULL;
+		x->level[i].span = 0;
+	}
+	return x;
+}
+
+static int ciRandomLevel(void){
+	int level = 1;
+	while((random() & 0xFFFF) < (CHUNKINDEX_P * 0xFFFF))
+		level++;
+	return level > CHUNKINDEX_MAXLEVEL ? CHUNKINDEX_MAXLEVEL : level;
+}
+
+/**
+ * Descend to the last chunk whose first node is before position 'bound',
+ * that is the chunk holding the node at bound-1, or the header if bound
+ * is 0.
+ *
+ * update[i] is set to the last chunk of level i before 'bound', and
+ * rank[i] to the position of its first node: the path to update when the
+ * chunk returned grows or shrinks.
+ */
+static chunkIndexChunk *ciSeek(chunkIndex *ci, unsigned long bound, chunkIndexChunk **update, unsigned long *rank){
+	chunkIndexChunk *x = ci->header;
+	unsigned long traversed = 0;
+	int i;
+
+	for(i = ci->level-1; i >= 0; i--){
+		while(x->level[i].forward && traversed + x->level[i].span < bound){
+			traversed += x->level[i].span;
+			x = x->level[i].forward;
+		}
+		update[i] = x;
+		rank[i] = traversed;
+	}
+	return x;
+}
+
+/**
+ * Add 'delta' nodes to the chunk at the end of the path 'update'.
+ * The caller updates the count of the chunk.
+ */
+static void ciAdjust(chunkIndex *ci, chunkIndexChunk **update, long delta){
+	int i;
+
+	for(i = 0; i < ci->level; i++)
+		update[i]->level[i].span += delta;
+	ci->len += delta;
+}
+
+/**
+ * Link a new chunk of 'count' nodes, that are not in the index yet, at
+ * position 'pos', right after the chunk at the end of the path 'update'.
+ */
+static chunkIndexChunk *ciInsertChunk(chunkIndex *ci, chunkIndexChunk **update, unsigned long *rank,
+                                      unsigned long pos, listNode *first, unsigned long count){
+	chunkIndexChunk *x;
+	int i, level = ciRandomLevel();
+
+	if(level > ci->level){
+		for(i = ci->level; i < level; i++){
+			update[i] = ci->header;
+			rank[i] = 0;
+			ci->header->level[i].span = ci->len;
+		}
+		ci->level = level;
+	}
+
+	x = ciCreateChunk(level, first, count);
+	for(i = 0; i < level; i++){
+		x->level[i].forward = update[i]->level[i].forward;
+		x->level[i].span = update[i]->level[i].span - (pos - rank[i]) + count;
+
+		update[i]->level[i].forward = x;
+		update[i]->level[i].span = pos - rank[i];
+	}
+
+	//The levels above the new chunk jump over its nodes
+	for(i = level; i < ci->level; i++)
+		update[i]->level[i].span += count;
+
+	ci->len += count;
+	ci->chunks++;
+	return x;
+}
+
+/**
+ * Unlink and free the chunk x with its nodes, 'update' being the path to
+ * the chunks before it, as returned by ciSeek() with the position of its
+ * first node.
+ */
+static void ciDeleteChunk(chunkIndex *ci, chunkIndexChunk *x, chunkIndexChunk **update){
+	int i;
+
+	for(i = 0; i < ci->level; i++){
+		if(update[i]->level[i].forward == x){
+			update[i]->level[i].span += x->level[i].span - x->count;
+			update[i]->level[i].forward = x->level[i].forward;
+		}else{
+			update[i]->level[i].span -= x->count;
+		}
+	}
+	while(ci->level > 1 && ci->header->level[ci->level-1].forward == NULL)
+		ci->level--;
+
+	ci->len -= x->count;
+	ci->chunks--;
+	zfree(x);
+}
+
+/**
+ * Move the second half of the chunk x, starting at position 'pos', to
+ * a new chunk.
+ */
+static void ciSplit(chunkIndex *ci, chunkIndexChunk *x, unsigned long pos){
+	chunkIndexChunk *update[CHUNKINDEX_MAXLEVEL];
+	unsigned long rank[CHUNKINDEX_MAXLEVEL], moved = x->count - CHUNKINDEX_CHUNK, i;
+	listNode *ln = x->first;
+
+	for(i = 0; i < CHUNKINDEX_CHUNK; i++) ln = ln->next;
+
+	ciSeek(ci, pos+1, update, rank);
+	x->count -= moved;
+	ciAdjust(ci, update, -(long)moved);
+	ciInsertChunk(ci, update, rank, pos + x->count, ln, moved);
+}
+
+/**
+ * Merge the chunk x, starting at position 'pos', with the next one when
+ * both are small enough, so that deletes do not leave a trail of tiny
+ * chunks behind them.
+ */
+static void ciTryMerge(chunkIndex *ci, chunkIndexChunk *x, unsigned long pos){
+	chunkIndexChunk *update[CHUNKINDEX_MAXLEVEL], *next = x->level[0].forward;
+	unsigned long rank[CHUNKINDEX_MAXLEVEL], moved;
+
+	if(next == NULL || x->count >= CHUNKINDEX_CHUNK/2 ||
+	   x->count + next->count > CHUNKINDEX_CHUNK) return;
+
+	moved = next->count;
+	ciSeek(ci, pos + x->count, update, rank);
+	ciDeleteChunk(ci, next, update);
+
+	ciSeek(ci, pos+1, update, rank);
+	x->count += moved;
+	ciAdjust(ci, update, moved);
+}
+
+/*-----------------------------------------------------------------------------
+ * API
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Create the index of the nodes of the list l.
+ *
+ * T = O(N)
+ */
+chunkIndex *chunkIndexCreate(list *l){
+	chunkIndexChunk *update[CHUNKINDEX_MAXLEVEL];
+	unsigned long rank[CHUNKINDEX_MAXLEVEL];
+	chunkIndex *ci = zmalloc(sizeof(*ci));
+	listNode *ln = l->head;
+	int i;
+
+	ci->header = ciCreateChunk(CHUNKINDEX_MAXLEVEL, NULL, 0);
+	ci->chunks = 0;
+	ci->len = 0;
+	ci->level = 1;
+
+	for(i = 0; i < CHUNKINDEX_MAXLEVEL; i++){
+		update[i] = ci->header;
+		rank[i] = 0;
+	}
+
+	//Chunks are appended, so the path to the end of the index is just the
+	//last chunk of every level
+	while(ln != NULL){
+		chunkIndexChunk *x;
+		listNode *first = ln;
+		unsigned long count = 0, pos = ci->len;
+
+		while(ln != NULL && count < CHUNKINDEX_CHUNK){
+			ln = ln->next;
+			count++;
+		}
+		x = ciInsertChunk(ci, update, rank, pos, first, count);
+		for(i = 0; i < ci->level && update[i]->level[i].forward == x; i++){
+			update[i] = x;
+			rank[i] = pos;
+		}
+	}
+	return ci;
+}
+
+void chunkIndexRelease(chunkIndex *ci){
+	chunkIndexChunk *x, *next;
+
+	if(ci == NULL) return;
+
+	x = ci->header->level[0].forward;
+	while(x != NULL){
+		next = x->level[0].forward;
+		zfree(x);
+		x = next;
+	}
+	zfree(ci->header);
+	zfree(ci);
+}
+
+/**
+ * Return the node at position 'pos', that must be in range.
+ *
+ * T = O(log N)
+ */
+listNode *chunkIndexNode(chunkIndex *ci, unsigned long pos){
+	chunkIndexChunk *update[CHUNKINDEX_MAXLEVEL], *x;
+	unsigned long rank[CHUNKINDEX_MAXLEVEL], offset;
+	listNode *ln;
+
+	assert(pos < ci->len);
+
+	x = ciSeek(ci, pos+1, update, rank);
+	ln = x->first;
+	for(offset = pos - rank[0]; offset > 0; offset--) ln = ln->next;
+	return ln;
+}
+
+/**
+ * Add 'node', just linked into the list at position 'pos', to the index.
+ *
+ * T = O(log N)
+ */
+void chunkIndexInsert(chunkIndex *ci, unsigned long pos, listNode *node){
+	chunkIndexChunk *update[CHUNKINDEX_MAXLEVEL], *x;
+	unsigned long rank[CHUNKINDEX_MAXLEVEL];
+
+	assert(pos <= ci->len);
+
+	if(ci->len == 0){
+		ciSeek(ci, 0, update, rank);
+		ciInsertChunk(ci, update, rank, 0, node, 1);
+		return;
+	}
+
+	if(pos == 0){
+		//A new head starts the first chunk
+		x = ciSeek(ci, 1, update, rank);
+		x->first = node;
+	}else{
+		//Otherwise the node joins the chunk of the node before it
+		x = ciSeek(ci, pos, update, rank);
+	}
+	x->count++;
+	ciAdjust(ci, update, 1);
+
+	if(x->count >= CHUNKINDEX_CHUNK*2) ciSplit(ci, x, rank[0]);
+}
+
+/**
+ * Remove 'node', at position 'pos', from the index. The node must still
+ * be linked into the list.
+ *
+ * T = O(log N)
+ */
+void chunkIndexDelete(chunkIndex *ci, unsigned long pos, listNode *node){
+	chunkIndexChunk *update[CHUNKINDEX_MAXLEVEL], *x;
+	unsigned long rank[CHUNKINDEX_MAXLEVEL];
+
+	assert(pos < ci->len);
+
+	x = ciSeek(ci, pos+1, update, rank);
+	if(x->count == 1){
+		ciSeek(ci, pos, update, rank);
+		ciDeleteChunk(ci, x, update);
+		return;
+	}
+
+	if(x->first == node) x->first = node->next;
+	x->count--;
+	ciAdjust(ci, update, -1);
+	ciTryMerge(ci, x, rank[0]);
+}
+
+/**
+ * Remove the 'count' nodes starting at position 'start' from the index.
+ * 'next' is the node that follows them, the nodes themselves are not
+ * accessed so they may be unlinked already.
+ *
+ * Chunks that are entirely in the range are dropped as a whole.
+ *
+ * T = O(M log N), M being the number of chunks touched
+ */
+void chunkIndexDeleteRange(chunkIndex *ci, unsigned long start, unsigned long count, listNode *next){
+	chunkIndexChunk *update[CHUNKINDEX_MAXLEVEL], *x;
+	unsigned long rank[CHUNKINDEX_MAXLEVEL], offset, n;
+
+	assert(start + count <= ci->len);
+
+	while(count > 0){
+		x = ciSeek(ci, start+1, update, rank);
+		offset = start - rank[0];
+
+		if(offset == 0 && count >= x->count){
+			count -= x->count;
+			ciSeek(ci, start, update, rank);
+			ciDeleteChunk(ci, x, update);
+			continue;
+		}
+
+		n = x->count - offset;
+		if(n > count) n = count;
+
+		//The range ends inside this chunk
+		if(offset == 0) x->first = next;
+		x->count -= n;
+		ciAdjust(ci, update, -(long)n);
+		count -= n;
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef __CHUNKINDEX_H
+#define __CHUNKINDEX_H
+#include "adlist.h"
+
+/**
+ * A positional index over the nodes of a linked list.
+ *
+ * Consecutive nodes of the list are grouped in chunks, and the chunks are
+ * linked in a skiplist where the span of a forward pointer counts the list
+ * nodes it jumps over, the same way the spans of the sorted set skiplist
+ * count its elements. Finding the node at a position is a O(log N) descent
+ * to its chunk, then a walk of less than 2*CHUNKINDEX_CHUNK nodes.
+ *
+ * The index does not see the list: the caller reports every node it links
+ * or unlinks, together with its position.
+ */
+#define CHUNKINDEX_CHUNK 64
+#define CHUNKINDEX_MAXLEVEL 32
+#define CHUNKINDEX_P 0.25
+
+typedef struct chunkIndexChunk{
+	//First node of the chunk
+	listNode *first;
+
+	//Number of nodes of the chunk
+	unsigned long count;
+
+	struct chunkIndexLevel{
+		struct chunkIndexChunk *forward;
+
+		//Nodes from the first one of this chunk to the first one of
+		//forward, or to the end of the list
+		unsigned long span;
+	}level[];
+}chunkIndexChunk;
+
+typedef struct chunkIndex{
+	//Has no nodes, only the levels
+	chunkIndexChunk *header;
+
+	//Number of chunks
+	unsigned long chunks;
+
+	//Number of nodes
+	unsigned long len;
+
+	int level;
+}chunkIndex;
+
+chunkIndex *chunkIndexCreate(list *l);
+void chunkIndexRelease(chunkIndex *ci);
+listNode *chunkIndexNode(chunkIndex *ci, unsigned long pos);
+void chunkIndexInsert(chunkIndex *ci, unsigned long pos, listNode *node);
+void chunkIndexDelete(chunkIndex *ci, unsigned long pos, listNode *node);
+void chunkIndexDeleteRange(chunkIndex *ci, unsigned long start, unsigned long count, listNode *next);
+
+#endif
@@ -12,25 +12,80 @@ void slotToKeyFlush(void);
  *         C-level DB API                                               *
  ************************************************************************/
 
+/* Find the entry of the key and update its access time.
+ * Returns NULL if the key does not exist.
+ */
+static dictEntry *lookupKeyEntry(redisDb *db, robj *key){
+
+    dictEntry *de = dictFind(db->dict, key->ptr);
+
+    //The access time is kept in the entry, see keyMetadata
+    if(de && server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+        dictGetKeyMetadata(de)->lru = LRU_CLOCK();
+
+    return de;
+}
+
+/* Return the value of the entry as an object. A packed value is turned
+ * into an object, that replaces it in the entry: the callers keep using
+ * and modifying the object they got as the value of the key.
+ */
+robj *dbEntryValueObject(dictEntry *de){
+    void *v = dictGetVal(de);
+
+    if(dbValueIsPacked(v)){
+        v = dbUnpackValue(v);
+        de->v.val = v;
+    }
+    return v;
+}
+
 /* Get the value from database by key,
  * if existed returns the object, otherwise returns NULL.
  */
 robj *lookupKey(redisDb *db, robj *key){
 
-    dictEntry *de = dictFind(db->dict, key->ptr);
+    dictEntry *de = lookupKeyEntry(db, key);
     
     //If this element is existed.
-    if(de){
-        robj *val = dictGetVal(de);
+    if(de) return dbEntryValueObject(de);
 
-        if(server.rdb_child_pid == -1 && server.aof_child_pid == -1)
-            val->lru = LRU_CLOCK();
-        
-        return val;
-    }
     return NULL;
 }
 
+/* Like lookupKeyWirte(), but a packed value is returned as it is instead of
+ * being turned into an object, so the result is either an robj or a packed
+ * value, see dbValueIsPacked(). Used by the commands that serve small
+ * strings without an object, such as GET and INCR.
+ */
+void *lookupKeyWriteRaw(redisDb *db, robj *key){
+    dictEntry *de;
+    void *v;
+
+    expireIfNeeded(db, key);
+
+    if((de = lookupKeyEntry(db, key)) == NULL) return NULL;
+
+    v = dictGetVal(de);
+    if(!dbValueIsPacked(v) && ((robj*)v)->type == REDIS_HASH)
+        v = hashTypeExpireIfNeeded(db, key, v);
+    return v;
+}
+
+/* Like lookupKeyRead(), but a packed value is returned as it is, see
+ * lookupKeyWriteRaw().
+ */
+void *lookupKeyReadRaw(redisDb *db, robj *key){
+    void *v = lookupKeyWriteRaw(db, key);
+
+    if(v == NULL)
+        server.stat_keyspace_misses++;
+    else
+        server.stat_keyspace_hits++;
+
+    return v;
+}
+
 /* In order to execute the read operation, to check if a key
  * is existed in the database, and update the hit/miss hit message.
  * if existed return the object, otherwise returns NULL.
@@ -44,6 +99,10 @@ robj *lookupKeyRead(redisDb *db, robj *key){
 
     val = lookupKey(db, key);
 
+    //Drop the hash fields whose TTL is reached
+    if(val != NULL && val->type == REDIS_HASH)
+        val = hashTypeExpireIfNeeded(db, key, val);
+
     if(val == NULL)
         server.stat_keyspace_misses++;
     else
@@ -59,9 +118,15 @@ robj *lookupKeyRead(redisDb *db, robj *key){
  */
 robj *lookupKeyWirte(redisDb *db, robj *key){
     
+    robj *val;
+
     expireIfNeeded(db, key);
 
-    return lookupKey(db, key);
+    val = lookupKey(db, key);
+    if(val != NULL && val->type == REDIS_HASH)
+        val = hashTypeExpireIfNeeded(db, key, val);
+
+    return val;
 }
 
 /* This only enhance the function of lookupKeyRead.
@@ -86,21 +151,187 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply){
     return o;
 }
 
-/* Add the key to the DB. It is up to the caller to increment the reference
- * counter of the value if needed.
+/* Every entry of the keyspace dict carries a keyMetadata, this is the
+ * entryMetadataBytes callback of its dict type.
  */
-void dbAdd(redisDb *db, robj *key, robj *val){
+size_t dbDictEntryMetadataBytes(dict *d){
+    REDIS_NOTUSED(d);
+    return sizeof(keyMetadata);
+}
+
+/* The valDestructor of the keyspace dict: a packed value owns no memory.
+ */
+void dbDictValDestructor(void *privdata, void *val){
+    REDIS_NOTUSED(privdata);
+
+    if(val == NULL || dbValueIsPacked(val)) return;
+    decrRefCount(val);
+}
+
+/************************************************************************
+ *         Packed values                                                *
+ ************************************************************************/
+
+/* Pack the integer into a value pointer.
+ * Returns NULL if it does not fit in 62 bits.
+ */
+void *dbPackLongLong(long long value){
+
+    //Only a 64 bit pointer has room for a value
+    if(sizeof(void*) < sizeof(uint64_t)) return NULL;
+
+    if(value < REDIS_PACKED_INT_MIN || value > REDIS_PACKED_INT_MAX) return NULL;
+
+    return (void*)(uintptr_t)(((uint64_t)value << 2) | REDIS_PACKED_INT);
+}
+
+/* Pack the string object o into a value pointer, an integer encoded object
+ * as an integer, a string of up to REDIS_PACKED_STR_MAX bytes as its bytes.
+ * The caller keeps its reference to o.
+ *
+ * Returns NULL if the object can't be packed.
+ */
+void *dbPackValue(robj *o){
+    uint64_t u;
+    size_t len, j;
+    unsigned char *s;
+
+    if(sizeof(void*) < sizeof(uint64_t) || o->type != REDIS_STRING) return NULL;
+
+    if(o->encoding == REDIS_ENCODING_INT) return dbPackLongLong((long)o->ptr);
+
+    s = o->ptr;
+    len = sdslen(o->ptr);
+    if(len > REDIS_PACKED_STR_MAX) return NULL;
+
+    u = (len << 2) | REDIS_PACKED_STR;
+    for(j = 0; j < len; j++) u |= (uint64_t)s[j] << (8*(j+1));
+    return (void*)(uintptr_t)u;
+}
+
+/* Write the string of the packed value v into buf, that holds at least
+ * REDIS_PACKED_BUFLEN bytes, and return its length. The string is not
+ * null terminated.
+ */
+size_t dbPackedValueToString(void *v, char *buf){
+    uint64_t u = (uintptr_t)v;
+    size_t len, j;
+
+    if((u & 3) == REDIS_PACKED_INT)
+        return ll2string(buf, REDIS_PACKED_BUFLEN, (long long)((int64_t)u >> 2));
+
+    len = (u & 0xff) >> 2;
+    for(j = 0; j < len; j++) buf[j] = (u >> (8*(j+1))) & 0xff;
+    return len;
+}
+
+/* Get the packed value v as an integer.
+ * Returns REDIS_ERR if it is a string that is not an integer.
+ */
+int dbPackedValueGetLongLong(void *v, long long *value){
+    uint64_t u = (uintptr_t)v;
+    char buf[REDIS_PACKED_BUFLEN];
+    size_t len;
+
+    if((u & 3) == REDIS_PACKED_INT){
+        *value = (long long)((int64_t)u >> 2);
+        return REDIS_OK;
+    }
+
+    len = dbPackedValueToString(v, buf);
+    return string2ll(buf, len, value) ? REDIS_OK : REDIS_ERR;
+}
+
+/* Create a string object, with a reference count of 1, holding the packed
+ * value v.
+ */
+robj *dbUnpackValue(void *v){
+    uint64_t u = (uintptr_t)v;
+    char buf[REDIS_PACKED_BUFLEN];
+
+    if((u & 3) == REDIS_PACKED_INT)
+        return createStringObjectFromLongLong((long long)((int64_t)u >> 2));
+
+    return createStringObject(buf, dbPackedValueToString(v, buf));
+}
+
+/* Reply with the packed value v as a bulk string.
+ */
+void addReplyBulkPackedValue(redisClient *c, void *v){
+    char buf[REDIS_PACKED_BUFLEN];
+
+    addReplyBulkCBuffer(c, buf, dbPackedValueToString(v, buf));
+}
+
+/* Add the key with the value v, an robj or a packed value, to the DB,
+ * with 'lru' as its last access time.
+ */
+static void dbAddValueWithLRU(redisDb *db, robj *key, void *v, unsigned int lru){
 
     //Make a copy of the input key parameter
     sds copy = sdsdup(key->ptr);
 
-    int retval = dictAdd(db->dict, copy, val);
+    dictEntry *de = dictAddRaw(db->dict, copy);
+
+    redisAssertWithInfo(NULL, key, de != NULL);
 
-    redisAssertWithInfo(NULL, key, retval == REDIS_OK);
+    dictSetVal(db->dict, de, v);
+    dictGetKeyMetadata(de)->lru = lru;
 
     //If the server enable cluster mode, save the value into the slot.
-    if(server.cluster_enable) slotToKeyAdd(key);
+    if(server.cluster_enabled) slotToKeyAdd(key);
+}
+
+/* Add the key with the value v, an robj or a packed value, to the DB.
+ */
+static void dbAddValue(redisDb *db, robj *key, void *v){
+    dbAddValueWithLRU(db, key, v, LRU_CLOCK());
+}
+
+/* Replace the value of an existing key with v, an robj or a packed value.
+ */
+static void dbOverWriteValue(redisDb *db, robj *key, void *v){
+    dictEntry *de = dictFind(db->dict, key->ptr);
+    void *old;
+
+    //The node must exist.
+    redisAssertWithInfo(NULL, key, de != NULL);
+
+    old = dictGetVal(de);
+    if(server.lazyfree_lazy_server_del && !dbValueIsPacked(old)){
+        //Take the old value out of the dict before releasing it lazily
+        incrRefCount(old);
+        dictReplace(db->dict, key->ptr, v);
+        freeObjectAsync(old);
+    }else{
+        dictReplace(db->dict, key->ptr, v);
+    }
+
+    //A new value is a fresh access of the key
+    dictGetKeyMetadata(de)->lru = LRU_CLOCK();
+}
 
+/* Add the key with the packed value v, see dbPackValue(), to the DB.
+ */
+void dbAddPacked(redisDb *db, robj *key, void *v){
+    dbAddValue(db, key, v);
+}
+
+/* Replace the value of an existing key with the packed value v.
+ */
+void dbOverWritePacked(redisDb *db, robj *key, void *v){
+    dbOverWriteValue(db, key, v);
+}
+
+/* Add the key to the DB. It is up to the caller to increment the reference
+ * counter of the value if needed.
+ */
+void dbAdd(redisDb *db, robj *key, robj *val){
+
+    dbAddValue(db, key, val);
+
+    //A hash with field TTLs, e.g. renamed or loaded, joins the active expire
+    if(val->type == REDIS_HASH) hashTypeRegisterExpires(db, key, val);
 }
 
 /* OverWrite an existing key with a new value. Incrementing the reference
@@ -111,12 +342,10 @@ void dbAdd(redisDb *db, robj *key, robj *val){
  * The program is aborted if the key was not already present.
  */
 void dbOverWrite(redisDb *db, robj *key, robj *val){
-    dictEntry *de = dictFind(db->dict, key->ptr);
 
-    //The node must exist.
-    redisAssertWithInfo(NULL, key, de != NULL);
+    dbOverWriteValue(db, key, val);
 
-    dictReplace(db->dict, key, val);
+    if(val->type == REDIS_HASH) hashTypeRegisterExpires(db, key, val);
 }
 
 /* High level set operation. This function is used to set 
@@ -127,17 +356,33 @@ void dbOverWrite(redisDb *db, robj *key, robj *val){
  * 2) Clients WATCHing for the destination key notified.
  * 
  * 3) The expire time of the key is reset (the key will be persistent)
+ *
+ * A small string is packed into the entry instead, see dbPackValue(), and
+ * the reference count of val is left untouched.
  */
 void setKey(redisDb * db, robj *key, robj *val){
+    void *packed = dbPackValue(val);
+    int exists;
+
+    //The old value is replaced whatever it is, so it is not looked up as
+    //an object, that would unpack it for nothing
+    expireIfNeeded(db, key);
+    exists = dictFind(db->dict, key->ptr) != NULL;
 
     //Add or overwrite the key-value pair in database.
-    if(lookupKeyWirte(db, key) == NULL){
-        dbAdd(db, key, val);
+    if(packed){
+        if(exists)
+            dbOverWritePacked(db, key, packed);
+        else
+            dbAddPacked(db, key, packed);
     }else{
-        dbOverWrite(db, key, val);
-    }
+        if(exists)
+            dbOverWrite(db, key, val);
+        else
+            dbAdd(db, key, val);
 
-    incrRefCount(val);
+        incrRefCount(val);
+    }
 
     removeExpire(db, key);
 
@@ -182,17 +427,31 @@ robj *dbRandomKey(redisDb *db){
     }
 }
 
-/* Delete a key, value, and associated expiration entry if any, from the DB 
+/* Delete a key, value, and associated expiration entry if any, from the DB,
+ * freeing the value lazily if server.lazyfree_lazy_server_del is set.
  */
 int dbDelete(redisDb *db, robj *key){
+    return server.lazyfree_lazy_server_del ? dbAsyncDelete(db, key) :
+                                             dbSyncDelete(db, key);
+}
+
+/* Delete a key, value, and associated expiration entry if any, from the DB,
+ * freeing the value right away.
+ */
+int dbSyncDelete(redisDb *db, robj *key){
 
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if(dictSize(db->expires) > 0) dictDelete(db->expires, key->ptr);
 
+    //The hash is no longer a candidate of the field active expire
+    if(db->hash_expires && dictSize(db->hash_expires) > 0)
+        dictDelete(db->hash_expires, key->ptr);
+
     //delete key-value pair
     if(dictDelete(db->dict, key->ptr) == DICT_OK){
         if(server.cluster_enabled) slotToKeyDel(key);
+        return 1;
     }else{
         return 0;
     }
@@ -250,18 +509,36 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o){
  *Empty the database data
  */
 long long emptyDb(void(callback)(void *)){
+    return emptyDbGeneric(0, callback);
+}
+
+/* Empty a single database, handing its dicts to the lazy free thread if
+ * 'async' is true. The callback is only used by the synchronous flush.
+ */
+static void emptyDbDicts(redisDb *db, int async, void(callback)(void *)){
+    if(async){
+        emptyDbAsync(db);
+        return;
+    }
+    dictEmpty(db->dict, callback);
+    dictEmpty(db->expires, callback);
+    if(db->hash_expires) dictEmpty(db->hash_expires, callback);
+}
+
+/* Empty all the databases, returning the number of keys removed.
+ */
+long long emptyDbGeneric(int async, void(callback)(void *)){
     int j;
     long long removed = 0;
 
     //Empty the whole databse
-    for(j = 0; server.dbnum; j++){
+    for(j = 0; j < server.dbnum; j++){
         
         //record the removed number
         removed += dictSize(server.db[j].dict);
 
         //Remove the whole key-value pairs
-        dictEmpty(server.db[j].dict, callback);
-        dictEmpty(server.db[j].dict, callback);
+        emptyDbDicts(server.db+j, async, callback);
     }
 
     //If this open the cluster mode, we still need to remove slot recode.
@@ -310,9 +587,29 @@ void signalFlushedDb(int dbid){
  * 与类型无关的数据库操作。
  *----------------------------------------------------------------------------*/
 
+/* Parse the optional ASYNC argument of FLUSHDB and FLUSHALL. Returns
+ * REDIS_ERR, after replying with an error, on a syntax error.
+ */
+static int getFlushCommandFlags(redisClient *c, int *async){
+    *async = 0;
+    if(c->argc > 1){
+        if(c->argc > 2 || strcasecmp(c->argv[1]->ptr, "async")){
+            addReply(c, shared.syntaxerr);
+            return REDIS_ERR;
+        }
+        *async = 1;
+    }
+    return REDIS_OK;
+}
+
 /* clean the database that the client specific
+ *
+ * FLUSHDB [ASYNC]
  */
 void flushdbCommand(redisClient *c){
+    int async;
+
+    if(getFlushCommandFlags(c, &async) == REDIS_ERR) return;
 
     server.dirty += dictSize(c->db->dict);
 
@@ -320,8 +617,7 @@ void flushdbCommand(redisClient *c){
     signalFlushedDb(c->db->id);
 
     //empty the dict and expire
-    dictEmpty(c->db->dict, NULL);
-    dictEmpty(c->db->expires, NULL);
+    emptyDbDicts(c->db, async, NULL);
 
     //If open the cluster mode, remove the slot recored
     if(server.cluster_enabled) slotToKeyFlush();
@@ -330,14 +626,19 @@ void flushdbCommand(redisClient *c){
 }
 
 /* Clean all the database in redisServer
+ *
+ * FLUSHALL [ASYNC]
  */
 void flushallCommand(redisClient *c){
+    int async;
+
+    if(getFlushCommandFlags(c, &async) == REDIS_ERR) return;
 
     //Send info 
     signalFlushedDb(-1);
 
     //clean all the database
-    server.dirty += emptyDb(NULL);
+    server.dirty += emptyDbGeneric(async, NULL);
     addReply(c, shared.ok);
 
     //If we are save the new RDB, then cancel.
@@ -363,14 +664,18 @@ void flushallCommand(redisClient *c){
     server.dirty++;
 }
 
-void delCommand(redisClient *c){
+/* DEL frees the values right away, UNLINK hands the large ones to the
+ * lazy free thread, so that its latency does not depend on their size.
+ */
+static void delGenericCommand(redisClient *c, int lazy){
     int deleted = 0, j;
 
     for(j = 1; j < c->argc; j++){
     
         expireIfNeeded(c->db, c->argv[j]);
 
-        if(dbDelete(c->db, c->argv[j]){
+        if(lazy ? dbAsyncDelete(c->db, c->argv[j]) :
+                  dbSyncDelete(c->db, c->argv[j])){
             
             //delete success then notify
             signalModifiedKey(c->db, c->argv[j]);
@@ -383,6 +688,14 @@ void delCommand(redisClient *c){
     addReplyLongLong(c, deleted);
 }
 
+void delCommand(redisClient *c){
+    delGenericCommand(c, 0);
+}
+
+void unlinkCommand(redisClient *c){
+    delGenericCommand(c, 1);
+}
+
 void existsCommand(redisClient *c){
 
     expireIfNeeded(c->db, c->argv[1]);
@@ -425,3 +738,125 @@ void randomkeyCommand(redisClient *c){
     addReply(c, shared.nullbulk);
 }
 
+/* Common part of RENAME and RENAMENX. The value, packed or not, moves to the
+ * new key together with its expire and its access time: a renamed key was
+ * not accessed, so it must not look like a fresh one to the eviction.
+ */
+static void renameGenericCommand(redisClient *c, int nx){
+    dictEntry *de;
+    void *v;
+    unsigned int lru;
+    long long expire;
+
+    //When the source and the destination are the same key, reply an error
+    if(sdscmp(c->argv[1]->ptr, c->argv[2]->ptr) == 0){
+        addReply(c, shared.sameobjecterr);
+        return;
+    }
+
+    expireIfNeeded(c->db, c->argv[1]);
+    if((de = dictFind(c->db->dict, c->argv[1]->ptr)) == NULL){
+        addReply(c, shared.nokeyerr);
+        return;
+    }
+
+    v = dictGetVal(de);
+    lru = dictGetKeyMetadata(de)->lru;
+    expire = getExpire(c->db, c->argv[1]);
+
+    expireIfNeeded(c->db, c->argv[2]);
+    if(dbExists(c->db, c->argv[2])){
+        if(nx){
+            addReply(c, shared.czero);
+            return;
+        }
+        dbDelete(c->db, c->argv[2]);
+    }
+
+    //The value is referenced by the new key before the old one goes away
+    if(!dbValueIsPacked(v)) incrRefCount(v);
+    dbAddValueWithLRU(c->db, c->argv[2], v, lru);
+    if(!dbValueIsPacked(v) && ((robj*)v)->type == REDIS_HASH)
+        hashTypeRegisterExpires(c->db, c->argv[2], v);
+    if(expire != -1) setExpire(c->db, c->argv[2], expire);
+    dbDelete(c->db, c->argv[1]);
+
+    signalModifiedKey(c->db, c->argv[1]);
+    signalModifiedKey(c->db, c->argv[2]);
+    notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "rename_from",
+        c->argv[1], c->db->id);
+    notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "rename_to",
+        c->argv[2], c->db->id);
+    server.dirty++;
+    addReply(c, nx ? shared.cone : shared.ok);
+}
+
+void renameCommand(redisClient *c){
+    renameGenericCommand(c, 0);
+}
+
+void renamenxCommand(redisClient *c){
+    renameGenericCommand(c, 1);
+}
+
+/* MOVE key db: the key keeps its expire and its access time in the target
+ * DB, see renameGenericCommand().
+ */
+void moveCommand(redisClient *c){
+    redisDb *src, *dst;
+    dictEntry *de;
+    void *v;
+    unsigned int lru;
+    long long expire;
+    int srcid;
+
+    if(server.cluster_enabled){
+        addReplyError(c, "MOVE is not allowed in cluster mode");
+        return;
+    }
+
+    //Obtain the source and the target DB
+    src = c->db;
+    srcid = c->db->id;
+    if(selectDb(c, atoi(c->argv[2]->ptr)) == REDIS_ERR){
+        addReply(c, shared.outofrangeerr);
+        return;
+    }
+    dst = c->db;
+    selectDb(c, srcid);
+
+    //If the user is moving using as target the same DB as the source
+    if(src == dst){
+        addReply(c, shared.sameobjecterr);
+        return;
+    }
+
+    expireIfNeeded(src, c->argv[1]);
+    if((de = dictFind(src->dict, c->argv[1]->ptr)) == NULL){
+        addReply(c, shared.czero);
+        return;
+    }
+
+    //Return zero if the key already exists in the target DB
+    expireIfNeeded(dst, c->argv[1]);
+    if(dbExists(dst, c->argv[1])){
+        addReply(c, shared.czero);
+        return;
+    }
+
+    v = dictGetVal(de);
+    lru = dictGetKeyMetadata(de)->lru;
+    expire = getExpire(src, c->argv[1]);
+
+    if(!dbValueIsPacked(v)) incrRefCount(v);
+    dbAddValueWithLRU(dst, c->argv[1], v, lru);
+    if(!dbValueIsPacked(v) && ((robj*)v)->type == REDIS_HASH)
+        hashTypeRegisterExpires(dst, c->argv[1], v);
+    if(expire != -1) setExpire(dst, c->argv[1], expire);
+    dbDelete(src, c->argv[1]);
+
+    signalModifiedKey(src, c->argv[1]);
+    signalModifiedKey(dst, c->argv[1]);
+    server.dirty++;
+    addReply(c, shared.cone);
+}
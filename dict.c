@@ -29,6 +29,19 @@ static int dict_can_resize = 1;
 //force hash ratio
 static unsigned int dict_force_resize_ratio = 5;
 
+/**
+ * Prefetch hint used by the batched lookups, a no-op where the compiler
+ * has no builtin for it.
+ */
+#if defined(__GNUC__)
+#define dictPrefetch(addr) __builtin_prefetch(addr)
+#else
+#define dictPrefetch(addr) ((void)(addr))
+#endif
+
+//Keys hashed per round by dictFindBatch()
+#define DICT_BATCH_SIZE 16
+
 /*-----------private prototype-----------*/
 
 static int _dictExpandIfNeeded(dict *ht);
@@ -380,6 +393,7 @@ dictEntry *dictAddRaw(dict *d, void *key){
 	int index;
 	dictEntry *entry;
 	dictht *ht;
+	size_t metasize;
 
 	//If it is allowed, perform one step rehash
 	//Here is the point, the rehash is a time-consume
@@ -396,8 +410,10 @@ dictEntry *dictAddRaw(dict *d, void *key){
 	//Choose the table to insert according to 
 	//whether we are perform rehash
 	ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-	//Allocate new space for the new entry
-	entry = zmalloc(sizeof(dictEntry));
+	//Allocate new space for the new entry, and its metadata if any
+	metasize = dictMetadataSize(d);
+	entry = zmalloc(sizeof(dictEntry) + metasize);
+	if(metasize > 0) memset(dictMetadata(entry), 0, metasize);
 	
 	entry->next = ht->table[index];
 	ht->table[index] = entry;
@@ -594,6 +610,55 @@ dictEntry *dictFind(dict *d, const void *key){
 	return NULL;
 }
 
+/**
+ * Look up 'count' keys at once, found[i] is set to the entry of keys[i] or
+ * to NULL when the key is not in the dictionary.
+ *
+ * dictFind() stalls on a cache miss for the bucket and then for every entry
+ * of the chain. Here the keys are handled DICT_BATCH_SIZE at a time: all
+ * the hashes are computed and the buckets prefetched first, then the head
+ * entries are prefetched, and only then the chains are walked, so the
+ * misses of a round overlap.
+ *
+ * While rehashing the keys may be in either table, the lookups fall back
+ * to dictFind() which also moves the rehash forward.
+ */
+void dictFindBatch(dict *d, const void **keys, dictEntry **found, int count){
+	unsigned int h[DICT_BATCH_SIZE];
+	dictEntry *he;
+	int i, j, n;
+
+	if(d->ht[0].size == 0 || dictIsRehashing(d)){
+		for(i = 0; i < count; i++) found[i] = dictFind(d, keys[i]);
+		return;
+	}
+
+	for(i = 0; i < count; i += n){
+		n = (count - i < DICT_BATCH_SIZE) ? count - i : DICT_BATCH_SIZE;
+
+		//Hash the keys and prefetch their buckets
+		for(j = 0; j < n; j++){
+			h[j] = dictHashKey(d, keys[i+j]) & d->ht[0].sizemask;
+			dictPrefetch(&d->ht[0].table[h[j]]);
+		}
+
+		//Prefetch the head entry of every chain
+		for(j = 0; j < n; j++){
+			he = d->ht[0].table[h[j]];
+			if(he) dictPrefetch(he);
+			found[i+j] = he;
+		}
+
+		//Walk the chains
+		for(j = 0; j < n; j++){
+			he = found[i+j];
+			while(he && !dictCompareKeys(d, keys[i+j], he->key))
+				he = he->next;
+			found[i+j] = he;
+		}
+	}
+}
+
 /**
  * Get the specific node value
  */
@@ -752,6 +817,52 @@ dictEntry *dictGetRandomKey(dict *d){
 	return he;
 }
 
+/**
+ * Sample up to 'count' distinct entries from the hash table, storing them
+ * into 'des'. Instead of picking every entry at random, a random bucket is
+ * picked and the entries are collected walking the following buckets, so
+ * the cost is proportional to 'count' and not to the table size.
+ *
+ * The entries are not uniformly distributed, and fewer than 'count' entries
+ * may be returned when too many empty buckets are met. Returns the number of
+ * entries stored into 'des'.
+ */
+unsigned int dictGetRandomKeys(dict *d, dictEntry **des, unsigned int count){
+	unsigned long i, idx, maxsize, maxsteps;
+	unsigned int stored = 0, tables, j;
+	dictEntry *he;
+
+	if(dictSize(d) < count) count = dictSize(d);
+	maxsteps = count * 10;
+
+	//Help the rehashing a bit, like the other lookups do
+	for(j = 0; j < count && dictIsRehashing(d); j++)
+		_dictRehashStep(d);
+
+	tables = dictIsRehashing(d) ? 2 : 1;
+	maxsize = d->ht[0].sizemask;
+	if(tables > 1 && maxsize < d->ht[1].sizemask)
+		maxsize = d->ht[1].sizemask;
+
+	i = random() & maxsize;
+	while(stored < count && maxsteps--){
+		for(j = 0; j < tables; j++){
+			//Buckets of ht[0] below rehashidx were already moved
+			if(tables == 2 && j == 0 && i < (unsigned long)d->rehashidx) continue;
+			if(i >= d->ht[j].size) continue;
+
+			he = d->ht[j].table[i];
+			while(he){
+				des[stored++] = he;
+				if(stored == count) return stored;
+				he = he->next;
+			}
+		}
+		i = (i + 1) & maxsize;
+	}
+	return stored;
+}
+
 
 /**
  * Our hash table is a power of two
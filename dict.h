@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef __DICT_H
 #define __DICT_H
@@ -30,6 +31,8 @@ typedef struct dictEntry{
 	//Point to next node
 	struct dictEntry *next;
 
+	//Extra bytes allocated with the entry, see entryMetadataBytes
+	void *metadata[];
 
 }dictEntry;
 
@@ -53,6 +56,10 @@ typedef struct dictType{
 	//destory value function
 	void (*valDestructor)(void *privadata, void *obj);
 
+	//bytes of metadata to allocate with every entry, zeroed on insert,
+	//NULL for none. Left out by most types, that get no metadata.
+	size_t (*entryMetadataBytes)(struct dict *d);
+
 }dictType;
 
 typedef struct dictht{
@@ -133,10 +140,10 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 //Set value for given entry
 #define dictSetVal(d, entry, _val_) do{\
 	if((d)->type->valDup) \
-		entry->v.val = (d)->type->valDup((p)->privadata, _val_); \
+		entry->v.val = (d)->type->valDup((d)->privdata, _val_); \
 	else \
 		entry->v.val = (_val_); \
-while(0)
+}while(0)
 
 // set a signed integer for the node value
 #define dictSetSignedIntegerVal(entry, _val_) \
@@ -178,6 +185,11 @@ while(0)
 //Get unsigned integer value in specific node
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
 
+//Metadata of the entry, and its size for the given dictionary
+#define dictMetadata(he) ((void*)(he)->metadata)
+#define dictMetadataSize(d) ((d)->type->entryMetadataBytes ? \
+	(d)->type->entryMetadataBytes(d) : 0)
+
 //Return the slots number of given dictory
 #define dictSlots(d) ((d)->ht[0].size + (d)->ht[1].size)
 
@@ -198,6 +210,7 @@ int dictDelete(dict *d, const void *key);
 int dictDeleteNoFree(dict *d, const void *key);
 void dictRelease(dict *d);
 dictEntry *dictFind(dict *d, const void *key);
+void dictFindBatch(dict *d, const void **keys, dictEntry **found, int count);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
@@ -205,9 +218,9 @@ dictIterator *dictGetSafeIterator(dict *d);
 dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
-int dictGetRandomKeys(dict *d, dictEntry ***des, int count);
+unsigned int dictGetRandomKeys(dict *d, dictEntry **des, unsigned int count);
 void dictPrintStats(dict *d);
-unsigned int dictGetHashFunction(const void *key, int len);
+unsigned int dictGenHashFunction(const void *key, int len);
 unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void *));
 void dictEnableResize(void);
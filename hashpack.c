@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hashpack.h"
+#include "dict.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+
+//First byte of a five bytes length
+#define HASHPACK_LEN_BIG 0x80
+
+//Bytes needed to encode the length l
+#define hpLenSize(l) ((l) < HASHPACK_LEN_BIG ? 1 : 5)
+
+/*-----------------------------------------------------------------------------
+ * Blob
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Encode the length 'len' into p, returns the bytes written
+ */
+static unsigned int hpEncodeLen(unsigned char *p, uint32_t len){
+	if(len < HASHPACK_LEN_BIG){
+		p[0] = len;
+		return 1;
+	}
+	p[0] = HASHPACK_LEN_BIG;
+	memcpy(p+1, &len, 4);
+	memrev32ifbe(p+1);
+	return 5;
+}
+
+/**
+ * Decode the length at p into *len, returns the bytes it takes
+ */
+static unsigned int hpDecodeLen(const unsigned char *p, unsigned int *len){
+	uint32_t l;
+
+	if(p[0] < HASHPACK_LEN_BIG){
+		*len = p[0];
+		return 1;
+	}
+	memcpy(&l, p+1, 4);
+	memrev32ifbe(&l);
+	*len = l;
+	return 5;
+}
+
+/**
+ * Like hpDecodeLen(), for untrusted data: the length and the 'len' bytes
+ * that follow it must fit in 'avail' bytes. Returns 0 if they don't.
+ *
+ * A length must also take the bytes hpEncodeLen() gives it, as the updates
+ * size the old pairs with hpLenSize(): a five bytes length below 128 is
+ * refused too.
+ */
+static unsigned int hpDecodeLenSafe(const unsigned char *p, size_t avail, unsigned int *len){
+	unsigned int n;
+
+	if(avail < 1) return 0;
+	if(p[0] >= HASHPACK_LEN_BIG && (p[0] != HASHPACK_LEN_BIG || avail < 5)) return 0;
+
+	n = hpDecodeLen(p, len);
+	if(n != hpLenSize(*len)) return 0;
+	if(*len > avail - n) return 0;
+	return n;
+}
+
+/**
+ * Decode the pair at offset 'off', returns its size in bytes
+ */
+static uint32_t hpPair(hashpack *hp, uint32_t off, unsigned char **f, unsigned int *flen,
+                       unsigned char **v, unsigned int *vlen){
+	unsigned char *p = hp->blob + off;
+
+	p += hpDecodeLen(p, flen);
+	*f = p;
+	p += *flen;
+	p += hpDecodeLen(p, vlen);
+	*v = p;
+	p += *vlen;
+	return p - (hp->blob + off);
+}
+
+/**
+ * Returns the field of the pair at offset 'off'
+ */
+static unsigned char *hpField(hashpack *hp, uint32_t off, unsigned int *flen){
+	unsigned char *p = hp->blob + off;
+
+	return p + hpDecodeLen(p, flen);
+}
+
+/**
+ * Make room for 'add' more bytes at the end of the blob
+ */
+static void hpReserve(hashpack *hp, uint32_t add){
+	uint32_t need = hp->bytes + add;
+
+	if(need <= hp->alloc) return;
+	hp->alloc = need < 1024*1024 ? need*2 : need + 1024*1024;
+	hp->blob = zrealloc(hp->blob, hp->alloc);
+}
+
+/*-----------------------------------------------------------------------------
+ * Index
+ *----------------------------------------------------------------------------*/
+
+static uint32_t hpSlotGet(hashpack *hp, uint32_t i){
+	if(hp->width == 2) return ((uint16_t*)hp->index)[i];
+	return ((uint32_t*)hp->index)[i];
+}
+
+static void hpSlotSet(hashpack *hp, uint32_t i, uint32_t s){
+	if(hp->width == 2)
+		((uint16_t*)hp->index)[i] = s;
+	else
+		((uint32_t*)hp->index)[i] = s;
+}
+
+/**
+ * The slots of an index for 'len' fields, filled at most at 3/4
+ */
+static uint32_t hpIndexSize(uint32_t len){
+	uint32_t size = 4;
+
+	while((uint64_t)size*3 < (uint64_t)len*4) size <<= 1;
+	return size;
+}
+
+/**
+ * True when the slots are too narrow for the offsets of the blob, or
+ * when the blob shrank enough to go back to two bytes slots.
+ */
+static int hpWidthMismatch(hashpack *hp){
+	return (hp->width == 2 && hp->bytes > UINT16_MAX) ||
+	       (hp->width == 4 && hp->bytes <= UINT16_MAX/2);
+}
+
+/**
+ * Search the field f. Returns the offset of its pair, or -1 when it is
+ * missing. Either way *slot is set to the slot of the field, or to the
+ * empty slot it would take.
+ */
+static int64_t hpLookup(hashpack *hp, unsigned char *f, unsigned int flen, uint32_t *slot){
+	uint32_t mask, i, s;
+
+	if(hp->size == 0) return -1;
+
+	mask = hp->size - 1;
+	i = dictGenHashFunction(f, flen) & mask;
+	while((s = hpSlotGet(hp, i)) != 0){
+		unsigned int len;
+		unsigned char *field = hpField(hp, s-1, &len);
+
+		if(len == flen && memcmp(field, f, flen) == 0){
+			*slot = i;
+			return s-1;
+		}
+		i = (i+1) & mask;
+	}
+	*slot = i;
+	return -1;
+}
+
+/**
+ * Index again every pair of the blob, into 'size' slots
+ */
+static void hpRebuildIndex(hashpack *hp, uint32_t size){
+	uint32_t off = 0, mask = size - 1;
+
+	zfree(hp->index);
+	hp->width = hp->bytes <= UINT16_MAX ? 2 : 4;
+	hp->index = zcalloc(size * hp->width);
+	hp->size = size;
+
+	while(off < hp->bytes){
+		unsigned char *f, *v;
+		unsigned int flen, vlen;
+		uint32_t plen = hpPair(hp, off, &f, &flen, &v, &vlen);
+		uint32_t i = dictGenHashFunction(f, flen) & mask;
+
+		while(hpSlotGet(hp, i) != 0) i = (i+1) & mask;
+		hpSlotSet(hp, i, off+1);
+		off += plen;
+	}
+}
+
+/**
+ * The pairs after offset 'off' moved by 'delta' bytes
+ *
+ * T = O(size), like the memmove() of the blob that moved them
+ */
+static void hpShiftOffsets(hashpack *hp, uint32_t off, int64_t delta){
+	uint32_t i, s;
+
+	for(i = 0; i < hp->size; i++){
+		s = hpSlotGet(hp, i);
+		if(s > off+1) hpSlotSet(hp, i, (uint32_t)(s + delta));
+	}
+}
+
+/**
+ * Empty the slot i. The following slots of the same cluster are moved
+ * back when that brings them closer to their home slot, so a lookup never
+ * stops early and no tombstone is needed.
+ */
+static void hpSlotRemove(hashpack *hp, uint32_t i){
+	uint32_t mask = hp->size - 1, j = i, s, k;
+
+	hpSlotSet(hp, i, 0);
+	while(1){
+		unsigned char *f;
+		unsigned int flen;
+
+		j = (j+1) & mask;
+		if((s = hpSlotGet(hp, j)) == 0) break;
+
+		f = hpField(hp, s-1, &flen);
+		k = dictGenHashFunction(f, flen) & mask;
+
+		//It stays where it is if its home slot is cyclically in (i, j]
+		if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+
+		hpSlotSet(hp, i, s);
+		hpSlotSet(hp, j, 0);
+		i = j;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * API
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Create an empty packed hash
+ */
+hashpack *hashpackNew(void){
+	hashpack *hp = zmalloc(sizeof(*hp));
+
+	hp->len = 0;
+	hp->bytes = hp->alloc = 0;
+	hp->size = 0;
+	hp->width = 2;
+	hp->blob = NULL;
+	hp->index = NULL;
+	return hp;
+}
+
+void hashpackFree(hashpack *hp){
+	zfree(hp->blob);
+	zfree(hp->index);
+	zfree(hp);
+}
+
+/**
+ * Returns the number of field/value pairs
+ */
+uint32_t hashpackLen(hashpack *hp){
+	return hp->len;
+}
+
+/**
+ * Search the field f. Returns 1 and its value into *vstr, *vlen when
+ * it exists, otherwise 0.
+ *
+ * T = O(1)
+ */
+int hashpackFind(hashpack *hp, unsigned char *f, unsigned int flen, unsigned char **vstr, unsigned int *vlen){
+	unsigned char *field;
+	unsigned int len;
+	uint32_t slot;
+	int64_t off = hpLookup(hp, f, flen, &slot);
+
+	if(off == -1) return 0;
+	hpPair(hp, off, &field, &len, vstr, vlen);
+	return 1;
+}
+
+/**
+ * Set the value of field f. Returns 1 if the field existed and its value
+ * was replaced, 0 if the pair was added.
+ *
+ * A new pair is appended to the blob. A new value replaces the old one
+ * where it is, the bytes after it move and so do their offsets.
+ */
+int hashpackSet(hashpack *hp, unsigned char *f, unsigned int flen, unsigned char *v, unsigned int vlen){
+	uint32_t slot, newsz;
+	int64_t off = hpLookup(hp, f, flen, &slot);
+	unsigned char *p;
+
+	if(off != -1){
+		unsigned char *oldf, *oldv;
+		unsigned int oldflen, oldvlen;
+		uint32_t vpos, oldsz;
+
+		hpPair(hp, off, &oldf, &oldflen, &oldv, &oldvlen);
+		vpos = (oldf - hp->blob) + oldflen;
+		oldsz = hpLenSize(oldvlen) + oldvlen;
+		newsz = hpLenSize(vlen) + vlen;
+
+		if(newsz > oldsz) hpReserve(hp, newsz - oldsz);
+		memmove(hp->blob + vpos + newsz, hp->blob + vpos + oldsz, hp->bytes - vpos - oldsz);
+		p = hp->blob + vpos;
+		p += hpEncodeLen(p, vlen);
+		memcpy(p, v, vlen);
+		hp->bytes = hp->bytes - oldsz + newsz;
+
+		if(newsz != oldsz){
+			if(hpWidthMismatch(hp))
+				hpRebuildIndex(hp, hp->size);
+			else
+				hpShiftOffsets(hp, off, (int64_t)newsz - oldsz);
+		}
+		return 1;
+	}
+
+	newsz = hpLenSize(flen) + flen + hpLenSize(vlen) + vlen;
+	hpReserve(hp, newsz);
+	p = hp->blob + hp->bytes;
+	p += hpEncodeLen(p, flen);
+	memcpy(p, f, flen);
+	p += flen;
+	p += hpEncodeLen(p, vlen);
+	memcpy(p, v, vlen);
+
+	off = hp->bytes;
+	hp->bytes += newsz;
+	hp->len++;
+
+	if((uint64_t)hp->len*4 > (uint64_t)hp->size*3 || hpWidthMismatch(hp))
+		hpRebuildIndex(hp, hpIndexSize(hp->len));
+	else
+		hpSlotSet(hp, slot, off+1);
+	return 0;
+}
+
+/**
+ * Delete the field f. Returns 1 if it was deleted, 0 if it was missing.
+ */
+int hashpackDelete(hashpack *hp, unsigned char *f, unsigned int flen){
+	unsigned char *field, *value;
+	unsigned int len, vlen;
+	uint32_t slot, plen;
+	int64_t off = hpLookup(hp, f, flen, &slot);
+
+	if(off == -1) return 0;
+
+	//The slots are fixed before the blob moves, the lookups read fields
+	plen = hpPair(hp, off, &field, &len, &value, &vlen);
+	hpSlotRemove(hp, slot);
+
+	memmove(hp->blob + off, hp->blob + off + plen, hp->bytes - off - plen);
+	hp->bytes -= plen;
+	hp->len--;
+
+	if(hpWidthMismatch(hp))
+		hpRebuildIndex(hp, hp->size);
+	else
+		hpShiftOffsets(hp, off, -(int64_t)plen);
+
+	//Give back the memory of a blob that shrank a lot
+	if(hp->alloc > 1024 && hp->bytes < hp->alloc/4){
+		hp->alloc = hp->bytes*2;
+		hp->blob = zrealloc(hp->blob, hp->alloc);
+	}
+	return 1;
+}
+
+/**
+ * Iterate the pairs. *pos starts at 0, every call returns 1 and the pair
+ * at *pos, then moves *pos to the next pair. Returns 0 at the end.
+ */
+int hashpackNext(hashpack *hp, uint32_t *pos, unsigned char **f, unsigned int *flen, unsigned char **v, unsigned int *vlen){
+	if(*pos >= hp->bytes) return 0;
+	*pos += hpPair(hp, *pos, f, flen, v, vlen);
+	return 1;
+}
+
+/**
+ * Bytes used by the packed hash
+ */
+size_t hashpackBlobLen(hashpack *hp){
+	return sizeof(*hp) + hp->alloc + (size_t)hp->size * hp->width;
+}
+
+/**
+ * Create a packed hash from a blob, as found in hp->blob. The index is
+ * built again. Returns NULL if the blob is not a valid, non empty list
+ * of pairs with distinct fields.
+ */
+hashpack *hashpackFromBlob(const unsigned char *buf, size_t len){
+	hashpack *hp;
+	uint32_t off = 0, count = 0;
+
+	if(len == 0 || len > UINT32_MAX) return NULL;
+
+	//Check the pairs first, and count them
+	while(off < len){
+		unsigned int n, flen, vlen;
+
+		if((n = hpDecodeLenSafe(buf+off, len-off, &flen)) == 0) return NULL;
+		off += n + flen;
+		if((n = hpDecodeLenSafe(buf+off, len-off, &vlen)) == 0) return NULL;
+		off += n + vlen;
+		count++;
+	}
+
+	hp = hashpackNew();
+	hp->blob = zmalloc(len);
+	memcpy(hp->blob, buf, len);
+	hp->bytes = hp->alloc = len;
+	hp->len = count;
+	hp->size = hpIndexSize(count);
+	hp->width = len <= UINT16_MAX ? 2 : 4;
+	hp->index = zcalloc(hp->size * hp->width);
+
+	off = 0;
+	while(off < hp->bytes){
+		unsigned char *f, *v;
+		unsigned int flen, vlen;
+		uint32_t slot, plen = hpPair(hp, off, &f, &flen, &v, &vlen);
+
+		//Duplicated field
+		if(hpLookup(hp, f, flen, &slot) != -1){
+			hashpackFree(hp);
+			return NULL;
+		}
+		hpSlotSet(hp, slot, off+1);
+		off += plen;
+	}
+	return hp;
+}
+
+#ifdef HASHPACK_TEST_MAIN
+#include <stdio.h>
+#include <assert.h>
+
+int main(void){
+	//"f" => "v" with the length of the value on five bytes
+	unsigned char bad[] = {1, 'f', HASHPACK_LEN_BIG, 1, 0, 0, 0, 'v'};
+	unsigned char good[] = {1, 'f', 1, 'v', 1, 'g', 1, 'w'};
+	unsigned char big[200], *v;
+	unsigned int vlen;
+	hashpack *hp;
+
+	printf("Refuse a non canonical length: ");
+	assert(hashpackFromBlob(bad, sizeof(bad)) == NULL);
+	printf("OK\n");
+
+	printf("Load then set a longer and a shorter value: ");
+	hp = hashpackFromBlob(good, sizeof(good));
+	assert(hp != NULL && hashpackLen(hp) == 2);
+	memset(big, 'x', sizeof(big));
+	assert(hashpackSet(hp, (unsigned char*)"f", 1, big, sizeof(big)) == 1);
+	assert(hashpackFind(hp, (unsigned char*)"g", 1, &v, &vlen) && vlen == 1 && v[0] == 'w');
+	assert(hashpackFind(hp, (unsigned char*)"f", 1, &v, &vlen) && vlen == sizeof(big));
+	assert(hashpackSet(hp, (unsigned char*)"f", 1, (unsigned char*)"y", 1) == 1);
+	assert(hashpackFind(hp, (unsigned char*)"g", 1, &v, &vlen) && vlen == 1 && v[0] == 'w');
+	assert(hashpackFind(hp, (unsigned char*)"f", 1, &v, &vlen) && vlen == 1 && v[0] == 'y');
+	assert(hp->bytes == sizeof(good));
+	hashpackFree(hp);
+	printf("OK\n");
+	return 0;
+}
+#endif
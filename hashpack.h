@@ -0,0 +1,51 @@
+#ifndef __HASHPACK_H
+#define __HASHPACK_H
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A packed hash: the field/value pairs are stored one after the other
+ * into a single blob, and an open addressing table of offsets into the
+ * blob finds a field in O(1).
+ *
+ * Every pair of the blob is
+ *
+ * | field length | field | value length | value |
+ *
+ * where a length takes one byte below 128, and five bytes otherwise.
+ *
+ * A slot of the index is the offset of a pair plus one, 0 being an empty
+ * slot. Slots take two bytes while the blob is smaller than 64k, four
+ * bytes after that.
+ */
+typedef struct hashpack{
+	//Number of field/value pairs
+	uint32_t len;
+
+	//Used and allocated bytes of the blob
+	uint32_t bytes, alloc;
+
+	//Slots of the index, a power of two, 0 when empty
+	uint32_t size;
+
+	//Bytes of a slot, 2 or 4
+	uint8_t width;
+
+	//The pairs
+	unsigned char *blob;
+
+	//The slots
+	unsigned char *index;
+}hashpack;
+
+hashpack *hashpackNew(void);
+void hashpackFree(hashpack *hp);
+uint32_t hashpackLen(hashpack *hp);
+int hashpackFind(hashpack *hp, unsigned char *f, unsigned int flen, unsigned char **vstr, unsigned int *vlen);
+int hashpackSet(hashpack *hp, unsigned char *f, unsigned int flen, unsigned char *v, unsigned int vlen);
+int hashpackDelete(hashpack *hp, unsigned char *f, unsigned int flen);
+int hashpackNext(hashpack *hp, uint32_t *pos, unsigned char **f, unsigned int *flen, unsigned char **v, unsigned int *vlen);
+size_t hashpackBlobLen(hashpack *hp);
+hashpack *hashpackFromBlob(const unsigned char *buf, size_t len);
+
+#endif
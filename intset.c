@@ -359,6 +359,145 @@ uint8_t intsetFind(intset *is, int64_t value){
 	return valenc <= intrev32ifbe(is->encoding) && intsetSearch(is, value, NULL);
 }
 
+/**
+ * Search 'value' starting from position '*pos', which must not be past the
+ * position 'value' has or would have.
+ *
+ * The positions *pos, *pos+1, *pos+3, *pos+7 ... are probed until one holds
+ * an element >= value, then the last gap is binary searched. Looking up an
+ * increasing sequence of M values in a set of N elements this way, passing
+ * the same 'pos' along, costs O(M log(N/M)) instead of O(M log N), which is
+ * what set intersections need.
+ *
+ * '*pos' is set to the position of the first element >= value. Returns 1
+ * when the element is equal to value.
+ */
+uint8_t intsetSearchFrom(intset *is, int64_t value, uint32_t *pos){
+	uint32_t len = intrev32ifbe(is->length);
+	uint32_t lo = *pos, hi = *pos, mid, step = 1;
+
+	//Gallop forward, every element before lo is < value
+	while(hi < len && _intsetGet(is, hi) < value){
+		lo = hi + 1;
+		hi += step;
+		step <<= 1;
+	}
+	if(hi > len) hi = len;
+
+	//The element at hi, if any, is >= value
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(_intsetGet(is, mid) < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*pos = lo;
+	return lo < len && _intsetGet(is, lo) == value;
+}
+
+/**
+ * Build the union of 'count' intsets with a k-way merge.
+ * The result is allocated once, with room for the sum of the lengths
+ * and the widest encoding of the inputs, then shrunk to its real length.
+ *
+ * T = O(N*K), N the sum of the lengths
+ */
+intset *intsetUnion(intset **sets, int count){
+	uint32_t *cursor = zcalloc(sizeof(uint32_t) * count);
+	uint32_t total = 0, len = 0, enc = INTSET_ENC_INT16;
+	int64_t v, min;
+	intset *is;
+	int j, best;
+
+	for(j = 0; j < count; j++){
+		total += intrev32ifbe(sets[j]->length);
+		if(intrev32ifbe(sets[j]->encoding) > enc)
+			enc = intrev32ifbe(sets[j]->encoding);
+	}
+
+	is = zmalloc(sizeof(intset) + total * enc);
+	is->encoding = intrev32ifbe(enc);
+	is->length = 0;
+
+	while(1){
+		//Pick the smallest head among the sets not exhausted yet
+		best = -1;
+		min = 0;
+		for(j = 0; j < count; j++){
+			if(cursor[j] == intrev32ifbe(sets[j]->length)) continue;
+			v = _intsetGet(sets[j], cursor[j]);
+			if(best == -1 || v < min){
+				best = j;
+				min = v;
+			}
+		}
+		if(best == -1) break;
+
+		//Skip the same value in every set
+		for(j = 0; j < count; j++){
+			if(cursor[j] < intrev32ifbe(sets[j]->length) &&
+			   _intsetGet(sets[j], cursor[j]) == min) cursor[j]++;
+		}
+		_intsetSet(is, len++, min);
+	}
+	zfree(cursor);
+
+	is->length = intrev32ifbe(len);
+	if(len < total) is = zrealloc(is, sizeof(intset) + len * enc);
+	return is;
+}
+
+/**
+ * Build the elements of 'is' not present in any of the 'count' intsets.
+ * The result takes the encoding of 'is' and is allocated once.
+ *
+ * T = O(M*K*log(N/M)), M the length of 'is'
+ */
+intset *intsetDiff(intset *is, intset **others, int count){
+	uint32_t *cursor = zcalloc(sizeof(uint32_t) * count);
+	uint32_t total = intrev32ifbe(is->length), len = 0, pos;
+	uint32_t enc = intrev32ifbe(is->encoding);
+	intset *res = zmalloc(sizeof(intset) + total * enc);
+	int64_t v;
+	int j;
+
+	res->encoding = is->encoding;
+	for(pos = 0; pos < total; pos++){
+		v = _intsetGet(is, pos);
+		for(j = 0; j < count; j++){
+			if(intsetSearchFrom(others[j], v, &cursor[j])) break;
+		}
+		if(j == count) _intsetSet(res, len++, v);
+	}
+	zfree(cursor);
+
+	res->length = intrev32ifbe(len);
+	if(len < total) res = zrealloc(res, sizeof(intset) + len * enc);
+	return res;
+}
+
+/**
+ * Keep only the elements whose 'keep' flag is set, 'keep' has one flag
+ * per element. The set is compacted in place and shrunk.
+ *
+ * T = O(N)
+ */
+intset *intsetRetain(intset *is, const uint8_t *keep){
+	uint32_t total = intrev32ifbe(is->length), len = 0, pos;
+
+	for(pos = 0; pos < total; pos++){
+		if(!keep[pos]) continue;
+		if(len != pos) _intsetSet(is, len, _intsetGet(is, pos));
+		len++;
+	}
+	is->length = intrev32ifbe(len);
+	if(len < total)
+		is = zrealloc(is, sizeof(intset) + len * intrev32ifbe(is->encoding));
+	return is;
+}
+
 /**
  * Return a random number from the integer set
  * This is useful when the set is not empty.
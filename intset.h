@@ -17,6 +17,10 @@ intset *intsetNew(void);
 intset *intsetAdd(intset *is, int64_t value, uint8_t *success);
 intset *intsetRemove(intset *is, int64_t value, int *success);
 uint8_t intsetFind(intset *is, int64_t value);
+uint8_t intsetSearchFrom(intset *is, int64_t value, uint32_t *pos);
+intset *intsetUnion(intset **sets, int count);
+intset *intsetDiff(intset *is, intset **others, int count);
+intset *intsetRetain(intset *is, const uint8_t *keep);
 int64_t intsetRandom(intset *is);
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);
 uint32_t intsetLen(intset *is);
@@ -0,0 +1,255 @@
+#include "redis.h"
+
+/*-----------------------------------------------------------------------------
+ * The lazy free thread
+ *
+ * Freeing a value walks all of its elements, which takes seconds for a
+ * value of millions of elements. Values above server.lazyfree_threshold
+ * elements are instead unlinked from the keyspace by the main thread, and
+ * handed to a background thread that frees them.
+ *
+ * The jobs are pushed on a lock-free stack: the main thread links a job
+ * with a compare and swap, the free thread takes the whole stack at once
+ * with an exchange. The mutex and the condition are only used by the free
+ * thread to sleep while there is nothing to free.
+ *
+ * The reference counts of the objects are atomic, so an element shared
+ * with a value still in the keyspace, or a shared integer, may be released
+ * by the free thread while the main thread uses it.
+ *----------------------------------------------------------------------------*/
+
+#define LAZYFREE_JOB_OBJECT 0   /* ptr[0] is an object */
+#define LAZYFREE_JOB_DB 1       /* ptr[0..2] are the dicts of a flushed db */
+#define LAZYFREE_JOB_LIST 2     /* ptr[0] is a list of detached nodes */
+
+#define LAZYFREE_THREAD_STACK_SIZE (1024*1024*4)
+
+typedef struct lazyfreeJob{
+	struct lazyfreeJob *next;
+	int type;
+	void *ptr[3];
+
+	//Elements to free, as counted by lazyfreeGetFreeEffort()
+	unsigned long effort;
+}lazyfreeJob;
+
+static lazyfreeJob *lazyfree_jobs = NULL;
+static unsigned long long lazyfree_pending = 0;
+static int lazyfree_sleeping = 0;
+static int lazyfree_started = 0;
+static pthread_t lazyfree_thread;
+static pthread_mutex_t lazyfree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazyfree_cond = PTHREAD_COND_INITIALIZER;
+
+static void lazyfreeRunJob(lazyfreeJob *job){
+	switch(job->type){
+	case LAZYFREE_JOB_OBJECT:
+		decrRefCount(job->ptr[0]);
+		break;
+	case LAZYFREE_JOB_DB:
+		dictRelease(job->ptr[0]);
+		dictRelease(job->ptr[1]);
+		if(job->ptr[2]) dictRelease(job->ptr[2]);
+		break;
+	case LAZYFREE_JOB_LIST:
+		listRelease(job->ptr[0]);
+		break;
+	default:
+		redisPanic("Unknown lazy free job type");
+	}
+	__atomic_sub_fetch(&lazyfree_pending, job->effort, __ATOMIC_RELAXED);
+}
+
+static void *lazyfreeThreadMain(void *arg){
+	lazyfreeJob *job, *next, *queue;
+	sigset_t sigset;
+
+	REDIS_NOTUSED(arg);
+
+	//The watchdog signal must be delivered to the main thread
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	while(1){
+		job = __atomic_exchange_n(&lazyfree_jobs, NULL, __ATOMIC_ACQUIRE);
+
+		if(job == NULL){
+			//Say we are going to sleep before looking at the stack again, so
+			//that a push either is seen here or sees lazyfree_sleeping set
+			pthread_mutex_lock(&lazyfree_mutex);
+			__atomic_store_n(&lazyfree_sleeping, 1, __ATOMIC_SEQ_CST);
+			while(__atomic_load_n(&lazyfree_jobs, __ATOMIC_SEQ_CST) == NULL)
+				pthread_cond_wait(&lazyfree_cond, &lazyfree_mutex);
+			__atomic_store_n(&lazyfree_sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&lazyfree_mutex);
+			continue;
+		}
+
+		//The stack gives the newest job first, free in push order
+		queue = NULL;
+		while(job){
+			next = job->next;
+			job->next = queue;
+			queue = job;
+			job = next;
+		}
+
+		while(queue){
+			next = queue->next;
+			lazyfreeRunJob(queue);
+			zfree(queue);
+			queue = next;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Start the free thread on the first job, so that a server that never
+ * frees lazily does not pay for it.
+ */
+static void lazyfreeInit(void){
+	pthread_attr_t attr;
+	size_t stacksize;
+
+	//The allocator is shared with the free thread from now on
+	zmalloc_enable_thread_safeness();
+
+	pthread_attr_init(&attr);
+	pthread_attr_getstacksize(&attr, &stacksize);
+	if(!stacksize) stacksize = 1;
+	while(stacksize < LAZYFREE_THREAD_STACK_SIZE) stacksize *= 2;
+	pthread_attr_setstacksize(&attr, stacksize);
+
+	if(pthread_create(&lazyfree_thread, &attr, lazyfreeThreadMain, NULL) != 0){
+		redisLog(REDIS_WARNING, "Fatal: Can't initialize the lazy free thread.");
+		exit(1);
+	}
+	lazyfree_started = 1;
+}
+
+static void lazyfreePush(int type, void *p0, void *p1, void *p2, unsigned long effort){
+	lazyfreeJob *job = zmalloc(sizeof(*job));
+
+	if(!lazyfree_started) lazyfreeInit();
+
+	job->type = type;
+	job->ptr[0] = p0;
+	job->ptr[1] = p1;
+	job->ptr[2] = p2;
+	job->effort = effort;
+	__atomic_add_fetch(&lazyfree_pending, effort, __ATOMIC_RELAXED);
+
+	job->next = __atomic_load_n(&lazyfree_jobs, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&lazyfree_jobs, &job->next, job, 1,
+	                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	if(__atomic_load_n(&lazyfree_sleeping, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&lazyfree_mutex);
+		pthread_cond_signal(&lazyfree_cond);
+		pthread_mutex_unlock(&lazyfree_mutex);
+	}
+}
+
+/**
+ * Return the number of allocations freeing the object walks. Compact
+ * encodings are a single allocation, whatever their size.
+ */
+static unsigned long lazyfreeGetFreeEffort(robj *o){
+	if(o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_LINKEDLIST){
+		return listLength((list*)o->ptr);
+	}else if(o->type == REDIS_SET && o->encoding == REDIS_ENCODING_HT){
+		return dictSize((dict*)o->ptr);
+	}else if(o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_SKIPLIST){
+		return ((zset*)o->ptr)->zsl->length;
+	}else if(o->type == REDIS_HASH && o->encoding == REDIS_ENCODING_HT){
+		return dictSize((dict*)o->ptr);
+	}else{
+		return 1;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * API
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Release the caller's reference to o. When it is the last one and the
+ * value is large, the free thread frees it.
+ */
+void freeObjectAsync(robj *o){
+	unsigned long effort = lazyfreeGetFreeEffort(o);
+
+	if(effort > server.lazyfree_threshold && o->refcount == 1)
+		lazyfreePush(LAZYFREE_JOB_OBJECT, o, NULL, NULL, effort);
+	else
+		decrRefCount(o);
+}
+
+/**
+ * Like dbSyncDelete(), but the value is released with freeObjectAsync().
+ *
+ * Returns 1 if the key was deleted, 0 if it did not exist.
+ */
+int dbAsyncDelete(redisDb *db, robj *key){
+	dictEntry *de;
+	void *val;
+	int packed;
+
+	if(dictSize(db->expires) > 0) dictDelete(db->expires, key->ptr);
+	if(db->hash_expires && dictSize(db->hash_expires) > 0)
+		dictDelete(db->hash_expires, key->ptr);
+
+	de = dictFind(db->dict, key->ptr);
+	if(de == NULL) return 0;
+
+	//Keep the value alive across the delete, that only drops the
+	//reference of the keyspace. A packed value has nothing to free.
+	val = dictGetVal(de);
+	packed = dbValueIsPacked(val);
+	if(!packed) incrRefCount(val);
+	dictDelete(db->dict, key->ptr);
+	if(server.cluster_enabled) slotToKeyDel(key);
+
+	if(!packed) freeObjectAsync(val);
+	return 1;
+}
+
+/**
+ * Empty the db in O(1): its dicts are replaced by empty ones, and the old
+ * ones are freed, with their keys and values, by the free thread.
+ */
+void emptyDbAsync(redisDb *db){
+	dict *oldict = db->dict, *oldexpires = db->expires, *oldhash = db->hash_expires;
+
+	db->dict = dictCreate(oldict->type, NULL);
+	db->expires = dictCreate(oldexpires->type, NULL);
+	db->hash_expires = oldhash ? dictCreate(oldhash->type, NULL) : NULL;
+
+	lazyfreePush(LAZYFREE_JOB_DB, oldict, oldexpires, oldhash, dictSize(oldict));
+}
+
+/**
+ * Release 'run', a list of nodes detached by listDetachRange(), with the
+ * values of its nodes.
+ *
+ * Runs up to server.lazyfree_threshold nodes are cheap enough to be freed
+ * right away. Longer ones go to the free thread, so that the latency of
+ * the caller does not depend on how many nodes it detached.
+ */
+void lazyfreeListRun(list *run){
+	if(run == NULL) return;
+
+	if(listLength(run) <= server.lazyfree_threshold)
+		listRelease(run);
+	else
+		lazyfreePush(LAZYFREE_JOB_LIST, run, NULL, NULL, listLength(run));
+}
+
+/**
+ * Return the number of elements queued and not freed yet, for INFO.
+ */
+unsigned long long lazyfreeGetPendingObjects(void){
+	return __atomic_load_n(&lazyfree_pending, __ATOMIC_RELAXED);
+}
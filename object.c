@@ -62,7 +62,6 @@ robj *createEmbeddedStringObject(char *ptr, size_t len){
  *
  * The current limit of 39 is chosen so that the biggest string object
  * we allocate as EMBSTR will still fit into the 64 byte arena of jemalloc. */
-#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 39
 robj *createStringObject(char *ptr, size_t len){
 	if(len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT)
 		return createEmbeddedStringObject(ptr, len);
@@ -171,11 +170,9 @@ robj *dupStringObject(robj *o){
 
 robj *createListObject(void){
 
-	list *l = listCreate();
+	list *l = listTypeCreateList();
 
 	robj *o = createObject(REDIS_LIST, l);
-	
-	listSetFreeMethod(l, decrRefCountVoid);
 
 	o->encoding = REDIS_ENCODING_LINKEDLIST;
 	
@@ -235,31 +232,40 @@ robj *createHashObject(){
 	return o;
 }
 
+/* Sorted set objects carry the pointer of their ziplist offset index right
+ * after the robj, see zsetIndex(), so they are never made by createObject().
+ */
+static robj *createZsetObjectWithPtr(void *ptr, int encoding){
+
+	robj *o = zmalloc(sizeof(*o) + sizeof(struct zzlIndex*));
+
+	o->type = REDIS_ZSET;
+	o->encoding = encoding;
+	o->refcount = 1;
+	o->ptr = ptr;
+	o->lru = LRU_CLOCK();
+	zsetIndex(o) = NULL;
+	return o;
+}
+
 robj *createZsetObject(void){
 	
 	zset *zs = zmalloc(sizeof(zset));
 
-	robj *o;
-	
 	zs->dict = dictCreate(&zsetDictType, NULL);
 	zs->zsl = zslCreate();
 
-	o = createObject(REDIS_ZSET, zs);
-
-	o->encoding = REDIS_ENCODING_SKIPLIST;
-
-	return o;
+	return createZsetObjectWithPtr(zs, REDIS_ENCODING_SKIPLIST);
 }
 
 robj *createZsetZiplistObject(){
+	return createZsetObjectFromZiplist(ziplistNew());
+}
 
-	unsigned char *zl = ziplistNew();
-
-	robj *o = createObject(REDIS_ZSET, zl);
-
-	o->encoding = REDIS_ENCODING_ZIPLIST;
-
-	return o;
+/* Create a ziplist encoded sorted set object holding `zl`.
+ */
+robj *createZsetObjectFromZiplist(unsigned char *zl){
+	return createZsetObjectWithPtr(zl, REDIS_ENCODING_ZIPLIST);
 }
 
 /* Free the list object
@@ -269,7 +275,7 @@ void freeListObject(robj *o){
 	switch (o->encoding)
 	{
 	case REDIS_ENCODING_LINKEDLIST:
-		listRelease((list *)o->ptr);
+		listTypeReleaseList((list *)o->ptr);
 		break;
 
 	case REDIS_ENCODING_ZIPLIST:
@@ -294,6 +300,10 @@ void freeSetObject(robj *o){
 			dictRelease((dict *)o->ptr);
 		break;
 
+		case REDIS_ENCODING_ROARING:
+			roaringFree(o->ptr);
+		break;
+
 		default:
 			redisPanic("Unknown set encoding type");
 	}
@@ -306,9 +316,11 @@ void freeZsetObject(robj *o){
 		case REDIS_ENCODING_SKIPLIST:
 			zs = o->ptr;
 			dictRelease((dict *)zs->dict);
-			zfree(zs->zsl);
+			zslFree(zs->zsl);
+			zfree(zs);
 			break;
 		case REDIS_ENCODING_ZIPLIST:
+			zzlIndexRelease(o);
 			zfree(o->ptr);
 			break;
 		default:
@@ -324,6 +336,7 @@ void freeHashObject(robj *o) {
     switch (o->encoding) {
 
     case REDIS_ENCODING_HT:
+        hashTypeReleaseExpires(o);
         dictRelease((dict*) o->ptr);
         break;
 
@@ -331,25 +344,35 @@ void freeHashObject(robj *o) {
         zfree(o->ptr);
         break;
 
+    case REDIS_ENCODING_HASHPACK:
+        hashpackFree(o->ptr);
+        break;
+
     default:
         redisPanic("Unknown hash encoding type");
         break;
     }
 }
 
+/**
+ * The reference count is updated atomically: the lazy free thread releases
+ * the elements of the values it frees, that may be shared with the main
+ * thread.
+ */
 void incrRefCount(robj *o){
-	o->refcount++;
+	__atomic_add_fetch(&o->refcount, 1, __ATOMIC_RELAXED);
 }
 
 /**
  * decrement the reference count
  */
 void decrRefCount(robj *o){
+	int refcount = __atomic_sub_fetch(&o->refcount, 1, __ATOMIC_ACQ_REL);
 
-	if(o->refcount <= 0) redisPanic("decrRefCount against refcount <= 0");
+	if(refcount < 0) redisPanic("decrRefCount against refcount <= 0");
 
 	//Release the object
-	if(o->refcount == 1){
+	if(refcount == 0){
 		switch(o->type){
 			case REDIS_STRING: freeStringObject(o); break;
 			case REDIS_LIST: freeListObject(o); break;
@@ -359,8 +382,6 @@ void decrRefCount(robj *o){
 			default: redisPanic("Unknown object type"); break;
 		}
 		zfree(o);
-	}else{
-		o->refcount--;
 	}
 }
 
@@ -475,6 +496,12 @@ int isObjectRepresentableAsLongLong(robj *o, long long *llval){
 }
 
 /* Try to encode a string object to save memory
+ *
+ * Besides the values of the keyspace, every element stored into a linked
+ * list, a hash table set or hash, or a skiplist goes through this function
+ * first, so that the short ones take a single EMBSTR allocation as well.
+ * The object passed may be released: callers store the returned one, in
+ * c->argv too when the object came from there.
  */
 robj *tryObjectEncoding(robj *o){
 	long value;
@@ -506,11 +533,10 @@ robj *tryObjectEncoding(robj *o){
 	len = sdslen(s);
 	if(len <= 21 && string2l(s, len, &value)){
 		/* This object is encodable as a long. Try to use a shared object.
-         * Note that we avoid using shared integers when maxmemory is used
-         * because every object needs to have a private LRU field for the LRU
-         * algorithm to work well. */
-		if(server.maxmemory == 0 &&
-		   value >= 0 &&
+         * This is fine with maxmemory too: the LRU of a key is kept in its
+         * dict entry (see keyMetadata), not in the value, so a shared
+         * integer does not mix up the access times of its keys. */
+		if(value >= 0 &&
 		   value < REDIS_SHARED_INTEGERS){
 			
 			decrRefCount(o);
@@ -534,6 +560,7 @@ robj *tryObjectEncoding(robj *o){
 
 		if(o->encoding == REDIS_ENCODING_EMBSTR) return o;
 		emb = createEmbeddedStringObject(s, sdslen(s));
+		decrRefCount(o);
 		return emb;
 	}
 	/* We can't encode the object...
@@ -814,33 +841,151 @@ char *strEncoding(int encoding){
 		case REDIS_ENCODING_INTSET: return "intset";
 		case REDIS_ENCODING_SKIPLIST: return "skiplist";
 		case REDIS_ENCODING_EMBSTR: return "embstr";
+		case REDIS_ENCODING_ROARING: return "roaring";
+		case REDIS_ENCODING_HASHPACK: return "hashpack";
 		default : return "unknown";
 	}
 }
 
-/* Given an object returns the min number of milliseconds the object was never
- * requested, using an approximated LRU algorithm. */
-unsigned long long estimateObjectIdleTime(robj *o){
+/* Milliseconds elapsed since the LRU clock was 'lru', the clock wrapping
+ * around every REDIS_LRU_CLOCK_MAX ticks. */
+static unsigned long long estimateIdleTime(unsigned lru){
 	unsigned long long lruclock = LRU_CLOCK();
 	
-	if(lruclock >= o->lru){
-		return (lruclock - o->lru) * REDIS_LRU_CLOCK_RESOLUTION;
+	if(lruclock >= lru){
+		return (lruclock - lru) * REDIS_LRU_CLOCK_RESOLUTION;
 	}else{
-		return (lruclock + (REDIS_LRU_CLOCK_MAX - o->lru)) * REDIS_LRU_CLOCK_RESOLUTION;
+		return (lruclock + (REDIS_LRU_CLOCK_MAX - lru)) * REDIS_LRU_CLOCK_RESOLUTION;
+	}
+}
+
+/* Given an object returns the min number of milliseconds the object was never
+ * requested, using an approximated LRU algorithm. */
+unsigned long long estimateObjectIdleTime(robj *o){
+	return estimateIdleTime(o->lru);
+}
+
+/* Same for a key of the keyspace, given its entry in db->dict. This is the
+ * one to use for keys: their value may be shared with other keys, so its
+ * own LRU field says nothing about the key. */
+unsigned long long estimateKeyIdleTime(dictEntry *de){
+	return estimateIdleTime(dictGetKeyMetadata(de)->lru);
+}
+
+/*------------------------------------------------------------
+ *          Active compaction
+ *------------------------------------------------------------*/
+
+/* Re-encode an aggregate value into its compact encoding once it has
+ * shrunk well below the limits. Returns 1 if it was converted. */
+int tryObjectCompaction(robj *o){
+	switch(o->type){
+	case REDIS_LIST: return listTypeTryCompaction(o);
+	case REDIS_SET: return setTypeTryCompaction(o);
+	case REDIS_ZSET: return zsetTryCompaction(o);
+	case REDIS_HASH: return hashTypeTryCompaction(o);
+	default: return 0;
+	}
+}
+
+static void activeCompactScanCallback(void *privdata, const dictEntry *de){
+	robj *o = dictGetVal(de);
+	size_t before = zmalloc_used_memory(), after;
+
+	REDIS_NOTUSED(privdata);
+
+	//A packed value is as compact as it gets
+	if(dbValueIsPacked(o)) return;
+
+	if(!tryObjectCompaction(o)) return;
+
+	after = zmalloc_used_memory();
+	server.stat_compact_objects++;
+	if(after < before) server.stat_compact_bytes += before - after;
+}
+
+/* Writes convert a value to a bigger encoding as soon as it crosses a limit,
+ * and never back, so a hash that briefly grew past hash_max_ziplist_entries
+ * would stay a hash table forever.
+ *
+ * Called by serverCron(), this walks the keyspace with dictScan() and
+ * re-encodes the values that have shrunk well below the limits of their
+ * compact encoding. It takes at most ACTIVE_COMPACT_TIME_PERC percent of the
+ * CPU time, resumes where it stopped at the next call, and stops early once
+ * every db was visited.
+ *
+ * Only writes shrink values, so after a full pass that converted nothing the
+ * scan pauses until the keyspace was written to, and for at least
+ * ACTIVE_COMPACT_IDLE_DELAY milliseconds, doubled after every idle pass in a
+ * row up to ACTIVE_COMPACT_IDLE_DELAY_MAX. */
+void activeCompactCycle(void){
+	static unsigned int current_db = 0;
+	static unsigned long cursor = 0;
+	static long long pass_objects = 0, pass_dirty = 0, idle_delay = 0, resume_at = 0;
+	long long start = ustime(), timelimit;
+	unsigned int iteration = 0, dbs = 0;
+
+	//Converting while a child is saving would copy the pages of the values
+	if(server.loading || server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+
+	if(resume_at){
+		if(mstime() < resume_at || server.dirty == pass_dirty) return;
+		resume_at = 0;
+	}
+
+	timelimit = 1000000*ACTIVE_COMPACT_TIME_PERC/server.hz/100;
+	if(timelimit <= 0) timelimit = 1;
+
+	while(dbs < (unsigned int)server.dbnum){
+		redisDb *db = server.db+(current_db % server.dbnum);
+
+		//A new pass starts from the first db
+		if(current_db % server.dbnum == 0 && cursor == 0){
+			pass_objects = server.stat_compact_objects;
+			pass_dirty = server.dirty;
+		}
+
+		if(dictSize(db->dict) != 0)
+			cursor = dictScan(db->dict, cursor, activeCompactScanCallback, NULL);
+		else
+			cursor = 0;
+
+		//The whole db was visited, go on with the next one
+		if(cursor == 0){
+			current_db++;
+			dbs++;
+
+			//End of a pass, back off if it converted nothing
+			if(current_db % server.dbnum == 0){
+				if(server.stat_compact_objects == pass_objects){
+					idle_delay = idle_delay ? idle_delay*2 : ACTIVE_COMPACT_IDLE_DELAY;
+					if(idle_delay > ACTIVE_COMPACT_IDLE_DELAY_MAX)
+						idle_delay = ACTIVE_COMPACT_IDLE_DELAY_MAX;
+					resume_at = mstime() + idle_delay;
+					break;
+				}
+				idle_delay = 0;
+			}
+		}
+
+		if((++iteration & 15) == 0 && ustime()-start > timelimit) break;
 	}
 }
 
 /* This is a helper function for the OBJECT command. We need to lookup keys
  * without any modification of LRU or other parameters.
  *
+ * The value is returned as it is stored, an robj or a packed value (see
+ * dbValueIsPacked()): inspecting a key must not unpack it.
+ *
  * OBJECT 命令的辅助函数，用于在不修改 LRU 时间的情况下，尝试获取 key 对象
  */
-robj *objectCommandLookup(redisClient *c, robj *key){
+void *objectCommandLookup(redisClient *c, robj *key){
 	dictEntry *de;
 
 	if((de = dictFind(c->db->dict, key->ptr)) == NULL) return NULL;
 
-	return (robj*)dictGetVal(de);
+	return dictGetVal(de);
 }
 
 /*
@@ -848,8 +993,8 @@ robj *objectCommandLookup(redisClient *c, robj *key){
  *
  * 如果对象不存在，那么向客户端发送回复 reply 。
  */
-robj *objectCommandLookupOrReply(redisClient *c, robj *key, robj *reply) {
-    robj *o = objectCommandLookup(c,key);
+void *objectCommandLookupOrReply(redisClient *c, robj *key, robj *reply) {
+    void *o = objectCommandLookup(c,key);
 
     if (!o) addReply(c, reply);
     return o;
@@ -858,21 +1003,35 @@ robj *objectCommandLookupOrReply(redisClient *c, robj *key, robj *reply) {
 /* Object command allows to inspect the internals of an Redis Object.
  * Usage: OBJECT <verb> ... arguments ... */
 void objectCommand(redisClient *c){
-	robj *o;
+	void *o;
 
 	//if you want to inspect the refcount of the object
 	if(!strcasecmp(c->argv[1]->ptr, "refcount") && c->argc == 3){
 		if((o = objectCommandLookupOrReply(c, c->argv[2], shared.nullbulk)) == NULL)
 			return ;
-		addReplyLongLong(c, o->refcount);
+		//A packed value lives in its entry only, nothing else refers to it
+		addReplyLongLong(c, dbValueIsPacked(o) ? 1 : ((robj*)o)->refcount);
 	}else if(!strcasecmp(c->argv[1]->ptr, "encoding") && c->argc == 3){
+		int encoding;
+
 		if((o = objectCommandLookupOrReply(c, c->argv[2], shared.nullbulk)) == NULL)
 			return;
-		addReplyBulkCString(c,strEncoding(o->encoding));
+		//A packed value reports the encoding of the object it stands for
+		if(dbValueIsPacked(o))
+			encoding = (((uintptr_t)o & 3) == REDIS_PACKED_INT) ?
+				REDIS_ENCODING_INT : REDIS_ENCODING_EMBSTR;
+		else
+			encoding = ((robj*)o)->encoding;
+		addReplyBulkCString(c,strEncoding(encoding));
 	}else if (!strcasecmp(c->argv[1]->ptr,"idletime") && c->argc == 3) {
-        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
-                == NULL) return;
-        addReplyLongLong(c,estimateObjectIdleTime(o)/1000);
+        dictEntry *de;
+
+        //The access time is the one of the key, not of its value
+        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+            addReply(c,shared.nullbulk);
+            return;
+        }
+        addReplyLongLong(c,estimateKeyIdleTime(de)/1000);
     } else {
         addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime)");
     }
@@ -530,6 +530,18 @@ robj *rdbGenericLoadStringObject(rio *rdb, int encode){
     if(len == REDIS_RDB_LENERR) return NULL;
 
     //当来到这里时，说明数据既不是压缩数据，也不是可以容纳在32位空间的数字，那么我们就把他们当作普通字符串对待
+    //Short strings, the elements of collections mostly, are read straight
+    //into an EMBSTR object instead of a RAW one converted afterwards
+    if(encode && len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT){
+        robj *o = createEmbeddedStringObject(NULL, len);
+
+        if(len && rioRead(rdb, o->ptr, len) == 0){
+            decrRefCount(o);
+            return NULL;
+        }
+        return o;
+    }
+
     val = sdsnewlen(NULL, len);
     if(len && rioRead(rdb, val, len) == 0){
         sdsfree(val);
@@ -643,6 +655,8 @@ int rdbSaveObjectType(rio *rdb, robj *o){
         case REDIS_SET:
             if(o->encoding == REDIS_ENCODING_INTSET){
                 return rdbSaveType(rdb, REDIS_RDB_TYPE_SET_INTSET);
+            }else if(o->encoding == REDIS_ENCODING_ROARING){
+                return rdbSaveType(rdb, REDIS_RDB_TYPE_SET_ROARING);
             }else if(o->encoding == REDIS_ENCODING_HT){
                 return rdbSaveType(rdb, REDIS_RDB_TYPE_SET);
             }else{
@@ -650,7 +664,7 @@ int rdbSaveObjectType(rio *rdb, robj *o){
             }
         case REDIS_ZSET:
             if (o->encoding == REDIS_ENCODING_ZIPLIST)
-                return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET_ZIPLIST);
+                return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET_ZIPLIST_BIN);
             else if (o->encoding == REDIS_ENCODING_SKIPLIST)
                 return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET);
             else
@@ -659,6 +673,10 @@ int rdbSaveObjectType(rio *rdb, robj *o){
         case REDIS_HASH:
             if (o->encoding == REDIS_ENCODING_ZIPLIST)
                 return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_ZIPLIST);
+            else if (o->encoding == REDIS_ENCODING_HASHPACK)
+                return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_HASHPACK);
+            else if (o->encoding == REDIS_ENCODING_HT && hashTypeExpires(o))
+                return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_TTL);
             else if (o->encoding == REDIS_ENCODING_HT)
                 return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH);
             else
@@ -749,6 +767,16 @@ int rdbSaveObject(rio *rdb, robj *o){
              */
             if((n = rdbSaveRawString(rdb, o->ptr,len)) == -1) return -1;
                 nwritten += n;
+        }else if(o->encoding == REDIS_ENCODING_ROARING){
+            //The bitmap is made of separate containers, serialize it first
+            size_t len = roaringSerializedLen(o->ptr);
+            unsigned char *buf = zmalloc(len);
+
+            roaringSerialize(o->ptr, buf);
+            n = rdbSaveRawString(rdb, buf, len);
+            zfree(buf);
+            if(n == -1) return -1;
+            nwritten += n;
         }else{
             redisPainc("Unknown set encoding");
         }
@@ -793,6 +821,11 @@ int rdbSaveObject(rio *rdb, robj *o){
             size_t len = ziplistBlobLen(o->ptr);
             if((n = rdbSaveRawString(rdb, o->ptr, len)) == -1) return -1;
             nwritten += n;
+        }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+            //Only the pairs are saved, the index is built again on load
+            hashpack *hp = o->ptr;
+            if((n = rdbSaveRawString(rdb, hp->blob, hp->bytes)) == -1) return -1;
+            nwritten += n;
         }else if(o->encoding == REDIS_ENCODING_HT){
             dictIterator *di = dictGetIterator(o->ptr);
             dictEntry *de;
@@ -811,6 +844,26 @@ int rdbSaveObject(rio *rdb, robj *o){
                 nwritten += n;
             } 
             dictReleaseIterator(di);
+
+            /* REDIS_RDB_TYPE_HASH_TTL: the number of fields with a TTL, then
+             * every such field followed by its expire time. */
+            if(hashTypeExpires(o)){
+                hashFieldExpires *hfe = hashTypeExpires(o);
+                unsigned long j;
+
+                if((n = rdbSaveLen(rdb, hfe->len)) == -1) return -1;
+                nwritten += n;
+                for(j = 0; j < hfe->len; j++){
+                    sds field = dictGetKey(hfe->heap[j].de);
+
+                    if((n = rdbSaveRawString(rdb, (unsigned char*)field, sdslen(field))) == -1)
+                        return -1;
+                    nwritten += n;
+                    if((n = rdbSaveMillisecondTime(rdb, hfe->heap[j].when)) == -1)
+                        return -1;
+                    nwritten += n;
+                }
+            }
         }else{
             redisPainc("Unknow hash encoding");
         }
@@ -832,6 +885,7 @@ off_t rdbSavedObjectLen(robj *o) {
 }
 
 /* Save a key value pair, with expire time, type, key ,value.
+ * 'val' may also be a packed value taken from the keyspace.
  * If error occurs return -1
  * On success if te key was actually saved 1 is returned, otherwise 0 is
  * returned(the key was expired).
@@ -846,6 +900,18 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val,
         if(rdbSaveType(rdb, REDIS_RDB_OPCODE_EXPIRETIME_MS) == -1) return -1;
         if(rdbSaveMillisecondTime(rdb, expiretime) == -1) return -1;
     }
+    /*A packed value of the keyspace, see dbPackValue(), is a string saved
+     *from its bytes, with no object */
+    if(dbValueIsPacked(val)){
+        char buf[REDIS_PACKED_BUFLEN];
+        size_t len = dbPackedValueToString(val, buf);
+
+        if(rdbSaveType(rdb, REDIS_RDB_TYPE_STRING) == -1) return -1;
+        if(rdbSaveStringObject(rdb, key) == -1) return -1;
+        if(rdbSaveRawString(rdb, (unsigned char*)buf, len) == -1) return -1;
+        return 1;
+    }
+
     /*After save the expire time, we go on to save the type, key, value */
     if(rdbSaveObjectType(rdb, val) == -1) return -1;
     if(rdbSaveStringObject(rdb, key) == -1) return -1;
@@ -1303,13 +1369,17 @@ robj *rdbLoadObject(int rdbType, rio *rdb){
         if(zsetLength(o) <= server.zset_max_ziplist_entries && 
            maxelelen < server.zset_max_ziplist_value)
                 zsetConvert(o, REDIS_ENCODING_ZIPLIST);
-    }else if(rdbType == REDIS_RDB_TYPE_HASH){
+    }else if(rdbType == REDIS_RDB_TYPE_HASH || rdbType == REDIS_RDB_TYPE_HASH_TTL){
         //Load the hash Object
         if((len = rdbLoadLen(rdb, NULL)) == REDIS_RDB_LENERR) return NULL;
-        
-        o = createHashObject();
 
-        if(len > server.hash_max_ziplist_entries){
+        if(len > server.hash_max_ziplist_entries &&
+           len <= server.hash_max_hashpack_entries &&
+           rdbType == REDIS_RDB_TYPE_HASH){
+            //Too big for a ziplist, small enough for a packed hash
+            o = createObject(REDIS_HASH, hashpackNew());
+            o->encoding = REDIS_ENCODING_HASHPACK;
+        }else if(len > server.hash_max_ziplist_entries){
             //If it exceed the limit of the ziplist, we use the 
             //dictionray implementation.
             dict *d = dictCreate(&hashDictType, NULL);
@@ -1346,11 +1416,26 @@ robj *rdbLoadObject(int rdbType, rio *rdb){
                    sdslen(value->ptr) > server.hash_max_ziplist_value){
                     decrRefCount(key);
                     decrRefCount(value);
+                    //The remaining pairs go to the hash table
                     hashTypeConvert(o, REDIS_ENCODING_HT);
-                    break;
+                    continue;
                 }
                 decrRefCount(key);
                 decrRefCount(value);
+            }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+                if((key = rdbLoadStringObject(rdb)) == NULL) return NULL;
+                redisAssert(sdsEncodedObject(key));
+                if((value = rdbLoadStringObject(rdb)) == NULL) return NULL;
+                redisAssert(sdsEncodedObject(value));
+
+                hashpackSet(o->ptr, key->ptr, sdslen(key->ptr), value->ptr, sdslen(value->ptr));
+
+                //Long elements go to a hash table, like for the ziplist
+                if(sdslen(key->ptr) > server.hash_max_ziplist_value ||
+                   sdslen(value->ptr) > server.hash_max_ziplist_value)
+                    hashTypeConvert(o, REDIS_ENCODING_HT);
+                decrRefCount(key);
+                decrRefCount(value);
             }else if(o->encoding == REDIS_ENCODING_HT){
                 if((key = rdbLoadStringObject(rdb)) == NULL) return NULL;
                 redisAssert(sdsEncodedObject(key));
@@ -1361,16 +1446,64 @@ robj *rdbLoadObject(int rdbType, rio *rdb){
                 value = tryObjectEncoding(value);
 
                 //Add the pair to the hash table
-                retVal = dictAdd(o, key, value);
-                redisAssert(retVal == REDIS_OK);
+                retVal = dictAdd(o->ptr, key, value);
+                redisAssert(retVal == DICT_OK);
             }else{
                 redisPainc("Unknown hastable encoding");
             }
         }
+
+        if(rdbType == REDIS_RDB_TYPE_HASH_TTL){
+            uint32_t ttls;
+
+            if((ttls = rdbLoadLen(rdb, NULL)) == REDIS_RDB_LENERR) return NULL;
+            if(ttls && o->encoding == REDIS_ENCODING_ZIPLIST)
+                hashTypeConvert(o, REDIS_ENCODING_HT);
+
+            /* Fields already expired are kept, the lookups and the active
+             * expire cycle delete them once the server is up. */
+            while(ttls--){
+                robj *field;
+                long long when;
+
+                if((field = rdbLoadStringObject(rdb)) == NULL) return NULL;
+                when = rdbLoadMillsecondTime(rdb);
+                if(hashTypeExists(o, field))
+                    hashTypeSetFieldExpire(o, field, when);
+                decrRefCount(field);
+            }
+        }
+    }else if(rdbType == REDIS_RDB_TYPE_HASH_HASHPACK){
+        hashpack *hp;
+        robj *aux = rdbLoadStringObject(rdb);
+        if(aux == NULL) return NULL;
+
+        //A blob that is not a valid packed hash is handled like a short read
+        hp = hashpackFromBlob((unsigned char*)aux->ptr, sdslen(aux->ptr));
+        decrRefCount(aux);
+        if(hp == NULL) return NULL;
+
+        o = createObject(REDIS_HASH, hp);
+        o->encoding = REDIS_ENCODING_HASHPACK;
+        if(hashTypeLength(o) > server.hash_max_hashpack_entries)
+            hashTypeConvert(o, REDIS_ENCODING_HT);
+    }else if(rdbType == REDIS_RDB_TYPE_SET_ROARING){
+        roaring *r;
+        robj *aux = rdbLoadStringObject(rdb);
+        if(aux == NULL) return NULL;
+
+        //A blob that is not a valid bitmap is handled like a short read
+        r = roaringDeserialize((unsigned char*)aux->ptr, sdslen(aux->ptr));
+        decrRefCount(aux);
+        if(r == NULL) return NULL;
+
+        o = createObject(REDIS_SET, r);
+        o->encoding = REDIS_ENCODING_ROARING;
     }else if(rdbType == REDIS_RDB_TYPE_HASH_ZIPLIST ||
              rdbType == REDIS_RDB_TYPE_LIST_ZIPLIST ||
              rdbType == REDIS_RDB_TYPE_SET_INTSET ||
              rdbType == REDIS_RDB_TYPE_ZSET_ZIPLIST ||
+             rdbType == REDIS_RDB_TYPE_ZSET_ZIPLIST_BIN ||
              rdbType == REDIS_RDB_TYPE_HASH_ZIPLIST){
         
         robj *aux = rdbLoadStringObject(rdb);
@@ -1448,12 +1581,23 @@ robj *rdbLoadObject(int rdbType, rio *rdb){
             o->encoding = REDIS_ENCODING_INTSET;
             //Check if we need to convert the encoding
             if(intsetLen(o->ptr) > server.set_max_intset_entries)
-                setTypeConvert(o, REDIS_ENCODING_HT);
+                setTypeConvertLargeIntset(o);
             break;
         
+        /* Ziplists saved before the binary double encoding keep their
+         * scores as strings, zzlGetScore() still reads them, and every
+         * score written from now on is a binary double. */
         case REDIS_RDB_TYPE_ZSET_ZIPLIST:
-            o->type = REDIS_ZSET;
-            o->encoding = REDIS_ENCODING_ZIPLIST;
+        case REDIS_RDB_TYPE_ZSET_ZIPLIST_BIN:
+            {
+                //A sorted set object has room for its index pointer, so the
+                //loaded ziplist moves to a new object
+                robj *zobj = createZsetObjectFromZiplist(o->ptr);
+
+                o->ptr = NULL;
+                decrRefCount(o);
+                o = zobj;
+            }
 
             // 检查是否需要转换编码
             if (zsetLength(o) > server.zset_max_ziplist_entries)
@@ -1467,7 +1611,7 @@ robj *rdbLoadObject(int rdbType, rio *rdb){
 
             // 检查是否需要转换编码
             if (hashTypeLength(o) > server.hash_max_ziplist_entries)
-                hashTypeConvert(o, REDIS_ENCODING_HT);
+                hashTypeConvert(o, hashTypeGrownEncoding(o));
             break;
         
         default:
@@ -1573,6 +1717,7 @@ int rdbLoad(char *filename){
 
     while(1){
         robj *key, *val;
+        void *packed;
         expiretime = -1;
 
         /* 这个地方有点歧义，其实他这里的操作就是读取1个字节
@@ -1643,8 +1788,14 @@ int rdbLoad(char *filename){
             continue;
         }
 
-        /* Add the new object in the hash table */
-        dbAdd(db, key, val);
+        /* Add the new object in the hash table, a small string packed into
+         * its entry */
+        if((packed = dbPackValue(val)) != NULL){
+            dbAddPacked(db, key, packed);
+            decrRefCount(val);
+        }else{
+            dbAdd(db, key, val);
+        }
 
         /* Set the expire time */
         if(expiretime != -1) setExpire(db, key, expiretime);
@@ -12,7 +12,7 @@
  *
  * RDB 的版本，当新版本不向就版本兼容时，增一
  */
-#define REDIS_RDB_VERSION 6
+#define REDIS_RDB_VERSION 10
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -73,12 +73,21 @@
 #define REDIS_RDB_TYPE_SET_INTSET 11
 #define REDIS_RDB_TYPE_ZSET_ZIPLIST 12
 #define REDIS_RDB_TYPE_HASH_ZIPLIST 13
+/* Ziplist encoded sorted set whose scores may use the ziplist binary double
+ * encoding, older versions can't read it so it has its own type. */
+#define REDIS_RDB_TYPE_ZSET_ZIPLIST_BIN 14
+/* Set of integers encoded as a roaring bitmap, see roaringSerialize(). */
+#define REDIS_RDB_TYPE_SET_ROARING 15
+/* Hash table encoded hash followed by the expire times of its fields. */
+#define REDIS_RDB_TYPE_HASH_TTL 16
+/* Packed hash, saved as its blob, see hashpack.h. */
+#define REDIS_RDB_TYPE_HASH_HASHPACK 17
 
 /* Test if a type is an object type.
  *
  * 检查给定类型是否对象
  */
-#define rdbIsObjectType(t)  ((t >= 0 && t <= 4) || (t >= 9 && t <= 13))
+#define rdbIsObjectType(t)  ((t >= 0 && t <= 4) || (t >= 9 && t <= 17))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType).
  *
@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <limits.h>
@@ -25,10 +26,14 @@
 #include "sds.h"
 #include "dict.h"
 #include "adlist.h"
+#include "chunkindex.h"
+#include "timewheel.h"
 #include "zmalloc.h"
 #include "anet.h"
 #include "ziplist.h"
 #include "intset.h"
+#include "roaring.h"
+#include "hashpack.h"
 #include "version.h"
 #include "util.h"
 
@@ -50,6 +55,7 @@
 #define REDIS_MAX_WRITE_PER_EVENT (1024*64)
 #define REDIS_SHARED_SELECT_CMDS 10
 #define REDIS_SHARED_INTEGERS 10000
+#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 39 /* Fits a 64 bytes allocation */
 #define REDIS_SHARED_BULKHDR_LEN 32
 #define REDIS_MAX_LOGMSG_LEN    1024 /* Default maximum length of syslog messages */
 #define REDIS_AOF_REWRITE_PERC  100
@@ -91,6 +97,8 @@
 #define REDIS_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define REDIS_DEFAULT_MIN_SLAVES_TO_WRITE 0
 #define REDIS_DEFAULT_MIN_SLAVES_MAX_LAG 10
+#define REDIS_DEFAULT_LAZYFREE_THRESHOLD 64 /* Elements freed inline at most */
+#define REDIS_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
 #define REDIS_IP_STR_LEN INET6_ADDRSTRLEN
 #define REDIS_PEER_ID_LEN (REDIS_IP_STR_LEN+32) /* Must be enough for ip:port */
 #define REDIS_BINDADDR_MAX 16
@@ -101,6 +109,22 @@
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for keys collection */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
+#define ACTIVE_EXPIRE_HASH_FIELDS_LOOKUPS_PER_LOOP 20 /* Hashes sampled per loop. */
+#define ACTIVE_EXPIRE_HASH_FIELDS_PER_KEY 100 /* Fields expired per visited hash. */
+#define ACTIVE_EXPIRE_HASH_FIELDS_TIME_PERC 10 /* CPU max % for fields collection */
+#define ACTIVE_COMPACT_TIME_PERC 5 /* CPU max % for re-encoding shrunk values */
+#define ACTIVE_COMPACT_IDLE_DELAY 1000 /* Milliseconds of pause after an idle pass */
+#define ACTIVE_COMPACT_IDLE_DELAY_MAX 60000 /* Cap of the doubling pause */
+#define REDIS_COMPACT_RATIO 2 /* Re-encode values at 1/ratio of the encoding limits */
+
+/* Units */
+#define UNIT_SECONDS 0
+#define UNIT_MILLISECONDS 1
+
+/* Command propagation flags, see propagate() function */
+#define REDIS_PROPAGATE_NONE 0
+#define REDIS_PROPAGATE_AOF 1
+#define REDIS_PROPAGATE_REPL 2
 
 /* Protocol and I/O related defines */
 #define REDIS_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
@@ -109,6 +133,7 @@
 #define REDIS_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define REDIS_MBULK_BIG_ARG     (1024*32)
 #define REDIS_LONGSTR_SIZE      21          /* Bytes needed for long -> str */
+#define REDIS_HASH_MAX_HASHPACK_ENTRIES 4096 /* hash_max_hashpack_entries default */
 // 指示 AOF 程序每累积这个量的写入数据
 // 就执行一次显式的 fsync
 #define REDIS_AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
@@ -155,6 +180,8 @@
 #define REDIS_ENCODING_INTSET 6
 #define REDIS_ENCODING_SKIPLIST 7
 #define REDIS_ENCODING_EMBSTR 8
+#define REDIS_ENCODING_ROARING 9
+#define REDIS_ENCODING_HASHPACK 10
 
 /*List related stuff*/
 #define REDIS_HEAD 0
@@ -194,6 +221,34 @@ typedef struct redisObject{
 	void *ptr;
 }robj;
 
+/* Metadata allocated with every entry of the keyspace dict, see
+ * dbDictEntryMetadataBytes(). The access time of a key lives here rather
+ * than in its value, so that values such as the shared integers can be
+ * referenced by many keys and still give each key its own LRU. */
+typedef struct keyMetadata{
+	//last access time of the key
+	unsigned lru:REDIS_LRU_BITS;
+}keyMetadata;
+
+#define dictGetKeyMetadata(de) ((keyMetadata*)dictMetadata(de))
+
+/* Small string values of the keyspace are packed into the value pointer of
+ * their dict entry instead of being an robj, see dbPackValue(). The low bit
+ * tells them from an robj pointer, that is always aligned:
+ *
+ * integer:      value << 2 | REDIS_PACKED_INT, for values of 62 bits
+ * short string: len << 2 | REDIS_PACKED_STR in the low byte, the up to 7
+ *               bytes of the string in the bytes above it
+ *
+ * Only 64 bit builds pack values. */
+#define REDIS_PACKED_INT 1
+#define REDIS_PACKED_STR 3
+#define REDIS_PACKED_STR_MAX 7
+#define REDIS_PACKED_INT_MAX (((long long)1 << 61) - 1)
+#define REDIS_PACKED_INT_MIN (-((long long)1 << 61))
+#define REDIS_PACKED_BUFLEN 32  /* Buffer for dbPackedValueToString() */
+#define dbValueIsPacked(v) (((uintptr_t)(v)) & 1)
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
@@ -202,12 +257,12 @@ typedef struct redisDb {
 	dict *dict;
 	//time out keys with a timeout set
 	dict *expires;
-	//blocked keys which waiting for data(BLPOP)
+	//blocked keys which waiting for data(BLPOP), mapped to their blockedKey
 	dict *blocking_keys;
-	//blocked keys that received a PUSH
-	dict *ready_keys;
 	//keys from MULTI/EXEC 
 	dict *watched_keys;
+	//hashes having at least one field with a TTL, created on first use
+	dict *hash_expires;
 
 	int id;
 
@@ -255,16 +310,27 @@ typedef struct blockingState {
     // 阻塞时限
     mstime_t timeout;       /* Blocking operation timeout. If UNIX current time
                              * is > timeout then the operation timed out. */
+    // 阻塞时限在 server.bpop_timeouts 中的节点
+    timeWheelEntry timeout_entry; /* Entry of server.bpop_timeouts while a
+                                   * timeout is armed. */
 
     /* REDIS_BLOCK_LIST */
-    // 造成阻塞的键
+    // 造成阻塞的键，值为客户端在 db->blocking_keys 链表中的节点
     dict *keys;             /* The keys we are waiting to terminate a blocking
-                             * operation such as BLPOP. Otherwise NULL. */
+                             * operation such as BLPOP, mapped to the node of
+                             * the client in the db->blocking_keys list of
+                             * the key. Otherwise NULL. */
     // 在被阻塞的键有新元素进入时，需要将这些新元素添加到哪里的目标键
     // 用于 BRPOPLPUSH 命令
     robj *target;           /* The key that should receive the element,
                              * for BRPOPLPUSH. */
 
+    // BLMPOP COUNT 的元素数量，0 表示只弹出一个元素
+    long count;             /* Elements to pop at once for BLMPOP,
+                             * 0 for a single element (B[LR]POP). */
+    // 弹出元素的方向
+    int where;              /* REDIS_HEAD or REDIS_TAIL */
+
     /* REDIS_BLOCK_WAIT */
     // 等待 ACK 的复制节点数量
     int numreplicas;        /* Number of replicas we are waiting for ACK. */
@@ -273,22 +339,25 @@ typedef struct blockingState {
 
 } blockingState;
 
-/* The following structure represents a node in the server.ready_keys list,
- * where we accumulate all the keys that had clients blocked with a blocking
- * operation such as B[LR]POP, but received new data in the context of the
- * last executed command.
+/* The value of db->blocking_keys: the clients blocked on a key, in the
+ * order they blocked.
  *
- * After the execution of every command or script, we run this list to check
- * if as a result we should serve data to clients blocked, unblocking them.
- * Note that server.ready_keys will not have duplicates as there dictionary
- * also called ready_keys in every structure representing a Redis database,
- * where we make sure to remember if a given key was already added in the
- * server.ready_keys list. */
-// 记录解除了客户端的阻塞状态的键，以及键所在的数据库。
-typedef struct readyList{
+ * When a key with blocked clients receives new data in the context of the
+ * last executed command, its blockedKey is queued into the server.ready_keys
+ * list. After the execution of every command or script, we run this list
+ * to check if as a result we should serve data to clients blocked,
+ * unblocking them. The ready flag keeps a key from being queued twice, and
+ * keeps the structure alive while it is queued even if its last client
+ * goes away. */
+// 被阻塞的键，以及阻塞在这个键上的客户端
+typedef struct blockedKey{
 	redisDb *db;
 	robj *key;
-}readyList;
+	// 阻塞在这个键上的客户端
+	list *clients;
+	// 这个键是否已经在 server.ready_keys 中
+	int ready;
+}blockedKey;
 
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a liked list.
@@ -441,6 +510,15 @@ struct sharedObjectStruct{
     *bulkhdr[REDIS_SHARED_BULKHDR_LEN];  /* "$<value>\r\n" */
 };
 
+/* The levels of a node are not stored as an array of {forward, span} pairs,
+ * which costs 16 bytes per level once padded, but as an array of spans
+ * followed by an array of forward pointers, 12 bytes per level.
+ *
+ *  | obj | score | backward | height | span[0..height-1] | forward[0..height-1] |
+ *
+ * The forward array starts at the first pointer aligned offset after the
+ * spans, so use ZSL_FORWARD() and ZSL_SPAN() to access the levels.
+ */
 typedef struct zskiplistNode{
 
 	robj *obj;
@@ -449,14 +527,22 @@ typedef struct zskiplistNode{
 
 	struct zskiplistNode *backward;
 
-	struct zskiplistLevel{
-		struct zskiplistNode *forward;
+	//Number of levels of this node
+	unsigned int height;
 
-		unsigned int span;
-	}level[];
+	unsigned int span[];
 
 }zskiplistNode;
 
+#define ZSL_FORWARD_OFFSET(height) \
+	((offsetof(zskiplistNode, span) + (height) * sizeof(unsigned int) + \
+	  sizeof(zskiplistNode*) - 1) & ~(sizeof(zskiplistNode*) - 1))
+#define ZSL_FORWARD(x, i) \
+	(((zskiplistNode**)((char*)(x) + ZSL_FORWARD_OFFSET((x)->height)))[i])
+#define ZSL_SPAN(x, i) ((x)->span[i])
+#define ZSL_NODE_SIZE(height) \
+	(ZSL_FORWARD_OFFSET(height) + (height) * sizeof(zskiplistNode*))
+
 typedef struct zskiplist{
 
 	struct zskiplistNode *header, *tail;
@@ -478,6 +564,12 @@ typedef struct zset{
 
 }zset;
 
+/* Sorted set objects are allocated with room for one more pointer after the
+ * robj, the offset index of their ziplist, see zzlIndexGet() in t_zset.c.
+ * NULL until a range count builds it. */
+struct zzlIndex;
+#define zsetIndex(o) (*(struct zzlIndex**)((robj*)(o)+1))
+
 /*-----------------------------------------------------------------------------
  * Global server state
  *----------------------------------------------------------------------------*/
@@ -643,6 +735,12 @@ struct redisServer {
     // PSYNC 执行失败的次数
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
 
+    // 主动压缩重新编码的对象数量
+    long long stat_compact_objects; /* Values re-encoded by activeCompactCycle() */
+
+    // 主动压缩回收的内存字节数
+    long long stat_compact_bytes;   /* Bytes reclaimed by activeCompactCycle() */
+
 
     /* slowlog */
 
@@ -891,7 +989,13 @@ struct redisServer {
     /* Blocked clients */
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
-    list *ready_keys;        /* List of readyList structures for BLPOP & co */
+    list *ready_keys;        /* List of blockedKey structures for BLPOP & co */
+    timeWheel *bpop_timeouts; /* Timeouts of clients blocked by lists */
+
+    /* Lazy free */
+    unsigned long lazyfree_threshold; /* Values with more elements than this
+                                       * are freed by the lazy free thread */
+    int lazyfree_lazy_server_del; /* dbDelete() and overwrites free lazily */
 
 
     /* Sort parameters - qsort_r() is only available under BSD so we
@@ -905,6 +1009,7 @@ struct redisServer {
     /* Zip structure config, see redis.conf for more information  */
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
+    size_t hash_max_hashpack_entries;
     size_t list_max_ziplist_entries;
     size_t list_max_ziplist_value;
     size_t set_max_intset_entries;
@@ -1004,7 +1109,25 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 unsigned int zsetLength(robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
+int zsetTryCompaction(robj *zobj);
 unsigned long zslGetRank(zskiplist *zsl, double score, robj *o);
+void zzlIndexRelease(robj *zobj);
+unsigned long zzlCountInRange(robj *zobj, zrangespec *range, unsigned long *first);
+unsigned long zzlCountInLexRange(robj *zobj, zlexrangespec *range, unsigned long *first);
+zskiplistNode *zslAppend(zskiplist *zsl, zskiplistNode **last, unsigned long *lastrank, double score, robj *obj);
+unsigned long zsetRankRangeByScore(robj *zobj, zrangespec *range, unsigned long *first);
+unsigned long zsetRankRangeByLex(robj *zobj, zlexrangespec *range, unsigned long *first);
+
+/* The list of a linked list encoded list object. It starts with the adlist
+ * list, so o->ptr is a list for the adlist API, and carries the positional
+ * index of its nodes (see chunkindex.h), NULL until a lookup builds it.
+ * The other users of adlist don't pay for it. */
+typedef struct listTypeList{
+    list l;
+    chunkIndex *index;
+}listTypeList;
+
+#define listTypeListIndex(l) (((listTypeList*)(l))->index)
 
 /* Structure to hold list iteration abstraction.
  *
@@ -1027,6 +1150,9 @@ typedef struct {
     // 链表节点的指针，迭代双端链表编码的列表时使用
     listNode *ln;
 
+    // Position of ln, to keep the index of a linked list in sync
+    long index;
+
 } listTypeIterator;
 
 /* Structure for an entry while iterating over a list.
@@ -1045,6 +1171,9 @@ typedef struct {
     // 双端链表节点指针
     listNode *ln;       /* Entry in linked list */
 
+    // Position of ln
+    long index;
+
 } listTypeEntry;
 
 /**Structure to hold set iteration abstraction.
@@ -1058,6 +1187,8 @@ typedef struct{
 	int ii;
 	//The iterator for iterate the hashtable
 	dictIterator *di;
+	//The iterator for iterate the roaring bitmap
+	roaringIterator ri;
 
 }setTypeIterator;
 
@@ -1084,11 +1215,48 @@ typedef struct {
     // 在迭代 HT 编码的哈希对象时使用
     dictIterator *di;
     dictEntry *de;
+
+    // 迭代 HASHPACK 编码的哈希对象时使用：
+    // 下一对域值在 blob 中的位置，以及当前的域和值
+    uint32_t hpos;
+    unsigned char *hfstr, *hvstr;
+    unsigned int hflen, hvlen;
 } hashTypeIterator;
 
 #define REDIS_HASH_KEY 1
 #define REDIS_HASH_VALUE 2
 
+/* Expire times of the fields of a hash. Only hashes encoded as hash tables
+ * may have one, and it is attached to the privdata of their dict, so hashes
+ * without any field TTL pay nothing for the feature.
+ *
+ * The fields are kept in a binary min-heap ordered by deadline, the dict
+ * maps every field to its heap entry so it can be updated or removed in
+ * O(log N). */
+typedef struct hashFieldExpireEntry {
+
+    // 过期时间，毫秒精度的 UNIX 时间戳
+    long long when;
+
+    // fields 字典中的节点，节点的值是该项在堆中的位置
+    dictEntry *de;
+} hashFieldExpireEntry;
+
+typedef struct hashFieldExpires {
+
+    // 域 -> 堆中的位置
+    dict *fields;
+
+    // 按过期时间排序的最小堆
+    hashFieldExpireEntry *heap;
+
+    // 堆中已用和已分配的项数
+    unsigned long len, alloc;
+} hashFieldExpires;
+
+/* The field expires of a REDIS_ENCODING_HT hash, NULL if it has none. */
+#define hashTypeExpires(o) ((hashFieldExpires*)((dict*)(o)->ptr)->privdata)
+
 /*-----------------------------------------------------------------------------
  * Extern declarations
  *----------------------------------------------------------------------------*/
@@ -1136,6 +1304,7 @@ void addReplyBulk(redisClient *c, robj *obj);
 void addReplyBulkCString(redisClient *c, char *s);
 void addReplyBulkCBuffer(redisClient *c, void *p, size_t len);
 void addReplyBulkLongLong(redisClient *c, long long ll);
+void addReplyBulkZiplistEntry(redisClient *c, unsigned char *p); /* t_list.c */
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReply(redisClient *c, robj *obj);
 void addReplySds(redisClient *c, sds s);
@@ -1153,6 +1322,7 @@ char *getClientPeerId(redisClient *client);
 sds catClientInfoString(sds s, redisClient *client);
 sds getAllClientsInfoString(void);
 void rewriteClientCommandVector(redisClient *c, int argc, ...);
+void replaceClientCommandVector(redisClient *c, int argc, robj **argv);
 void rewriteClientCommandArgument(redisClient *c, int i, robj *newval);
 unsigned long getClientOutputBufferMemoryUsage(redisClient *c);
 void freeClientsInAsyncFreeQueue(void);
@@ -1212,6 +1382,7 @@ unsigned int getLRUClock(void);
 void listTypeTryConversion(robj *subject, robj *value);
 void listTypePush(robj *subj, robj *value, int where);
 robj* listTypePop(robj *subject, int where);
+unsigned long listTypePopMany(robj *subject, int where, unsigned long count, robj **values);
 unsigned long listTypeLength(robj *subject);
 listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char direction);
 void listTypeReleaseIterator(listTypeIterator *li);
@@ -1220,14 +1391,20 @@ robj *listTypeGet(listTypeEntry *entry);
 void listTypeInsert(listTypeEntry *entry, robj *value, int where);
 int listTypeEqual(listTypeEntry *entry);
 void listTypeDelete(listTypeEntry *entry);
+listNode *listTypeIndexNode(list *l, long index);
+list *listTypeCreateList(void);
+void listTypeReleaseList(list *l);
 void listTypeConvert(robj *subject, int enc);
+int listTypeTryCompaction(robj *subject);
 void unblockClientWaitingData(redisClient *c);
+void handleBlockedClientsTimeout(void);
 void handleClientBlockedOnList(void);
 void popGenericCommand(redisClient *c, int where);
 
 /*Set data type*/
 robj *setTypeCreate(robj *value);
 int setTypeAdd(robj *subject, robj *value);
+int setTypeAddInteger(robj *subject, long long llval);
 int setTypeRemove(robj *subject, robj *value);
 int setTypeIsMember(robj *subject, robj *value);
 setTypeIterator *setTypeInitIterator(robj *subject);
@@ -1237,14 +1414,21 @@ robj *setTypeNextObject(setTypeIterator *si);
 int setTypeRandomElement(robj *setobj, robj **objele, int64_t *llele);
 unsigned long setTypeSize(robj *subject);
 void setTypeConvert(robj *subject, int enc);
+void setTypeConvertLargeIntset(robj *setobj);
+int setTypeTryCompaction(robj *setobj);
 
 /*Hash data type*/
 void hashTypeConvert(robj *o, int enc);
+int hashTypeTryCompaction(robj *o);
+int hashTypeGrownEncoding(robj *o);
+int hashTypeGetFromHashpack(robj *o, robj *field, unsigned char **vstr, unsigned int *vlen);
+void hashTypeCurrentFromHashpack(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen);
 void hashTypeTryConversion(robj *subject, robj **argv, int start, int end);
 void hashTypeTryObjectEncoding(robj *subject, robj **o1, robj **o2);
 robj *hashTypeGetObject(robj *o, robj *key);
 int hashTypeExists(robj *o, robj *key);
 int hashTypeSet(robj *o, robj *key, robj *value);
+unsigned long hashTypeSetMulti(robj *o, robj **argv, int start, int end);
 int hashTypeDelete(robj *o, robj *key);
 unsigned long hashTypeLength(robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
@@ -1257,6 +1441,14 @@ void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
 void hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what, robj **dst);
 robj *hashTypeCurrentObject(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWirteOrCreate(redisClient *c, robj *key);
+void hashTypeSetFieldExpire(robj *o, robj *field, long long when);
+long long hashTypeGetFieldExpire(robj *o, robj *field);
+int hashTypeRemoveFieldExpire(robj *o, robj *field);
+void hashTypeReleaseExpires(robj *o);
+void hashTypeRegisterExpires(redisDb *db, robj *key, robj *o);
+unsigned long hashTypeExpireFields(redisDb *db, robj *key, robj *o, long long now, unsigned long max);
+robj *hashTypeExpireIfNeeded(redisDb *db, robj *key, robj *o);
+void activeExpireHashFieldsCycle(void);
 
 /* MULTI/EXEC/WATCH... */
 void unwatchAllKeys(redisClient *c);
@@ -1279,14 +1471,29 @@ robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWirte(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(redisClient *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply);
+void *lookupKeyReadRaw(redisDb *db, robj *key);
+void *lookupKeyWriteRaw(redisDb *db, robj *key);
+robj *dbEntryValueObject(dictEntry *de);
 void dbAdd(redisDb *db, robj *key, robj *val);
 void dbOverWrite(redisDb *db, robj *key, robj *val);
+size_t dbDictEntryMetadataBytes(dict *d);
+void dbDictValDestructor(void *privdata, void *val);
+void *dbPackValue(robj *o);
+void *dbPackLongLong(long long value);
+robj *dbUnpackValue(void *v);
+size_t dbPackedValueToString(void *v, char *buf);
+int dbPackedValueGetLongLong(void *v, long long *value);
+void dbAddPacked(redisDb *db, robj *key, void *v);
+void dbOverWritePacked(redisDb *db, robj *key, void *v);
+void addReplyBulkPackedValue(redisClient *c, void *v);
 void setKey(redisDb *db, robj *key, robj *val);
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
+int dbSyncDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 long long emptyDb(void(callback)(void*));
+long long emptyDbGeneric(int async, void(callback)(void*));
 int selectDb(redisClient *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
@@ -1314,6 +1521,8 @@ robj *createEmbeddedStringObject(char *ptr, size_t len);
 robj *dupStringObject(robj *o);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
+int tryObjectCompaction(robj *o);
+void activeCompactCycle(void);
 robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
 robj *createStringObjectFromLongLong(long long value);
@@ -1325,6 +1534,7 @@ robj *createIntsetObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
 robj *createZsetZiplistObject(void);
+robj *createZsetObjectFromZiplist(unsigned char *zl);
 int getLongFromObjectOrReply(redisClient *c, robj *o, long *target, const char *msg);
 int checkType(redisClient *c, robj *o, int type);
 int getLongLongFromObjectOrReply(redisClient *c, robj *o, long long *target, const char *msg);
@@ -1337,8 +1547,16 @@ int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
+unsigned long long estimateKeyIdleTime(dictEntry *de);
 #define sdsEncodedObject(objptr) (objptr->encoding == REDIS_ENCODING_RAW || objptr->encoding == REDIS_ENCODING_EMBSTR)
 
+/* Lazy free */
+void freeObjectAsync(robj *o);
+int dbAsyncDelete(redisDb *db, robj *key);
+void emptyDbAsync(redisDb *db);
+void lazyfreeListRun(list *run);
+unsigned long long lazyfreeGetPendingObjects(void);
+
 /* Command prototypes */
 /* String related commands*/
 void setCommand(redisClient *c);
@@ -1367,6 +1585,8 @@ void lrangeCommand(redisClient *c);
 void ltrimCommand(redisClient *c);
 void lsetCommand(redisClient *c);
 void lremCommand(redisClient *c);
+void lmpopCommand(redisClient *c);
+void blmpopCommand(redisClient *c);
 /*hash map related command*/
 void hsetCommand(redisClient *c);
 void hsetnxCommand(redisClient *c);
@@ -1382,6 +1602,13 @@ void hexistsCommand(redisClient *c);
 void hscanCommand(redisClient *c);
 void hincrByCommand(redisClient *c);
 void hincrByfloatCommand(redisClient *c);
+void hexpireCommand(redisClient *c);
+void hpexpireCommand(redisClient *c);
+void hexpireatCommand(redisClient *c);
+void hpexpireatCommand(redisClient *c);
+void httlCommand(redisClient *c);
+void hpttlCommand(redisClient *c);
+void hpersistCommand(redisClient *c);
 /*Set relate Command*/
 void saddCommand(redisClient *c);
 void sremCommand(redisClient *c);
@@ -1392,6 +1619,7 @@ void spopCommand(redisClient *c);
 void srandmemberCommand(redisClient *c);
 void sinterCommand(redisClient *c);
 void sinterstoreCommand(redisClient *c);
+void sintercardCommand(redisClient *c);
 void sunionCommand(redisClient *c);
 void sunionstoreCommand(redisClient *c);
 void sdiffCommand(redisClient *c);
@@ -1405,6 +1633,7 @@ void zrangebyscoreCommand(redisClient *c);
 void zrevrangebyscoreCommand(redisClient *c);
 void zrangebylexCommand(redisClient *c);
 void zrevrangebylexCommand(redisClient *c);
+void zrangestoreCommand(redisClient *c);
 void zcountCommand(redisClient *c);
 void zlexcountCommand(redisClient *c);
 void zrevrangeCommand(redisClient *c);
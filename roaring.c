@@ -0,0 +1,843 @@
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+
+/**
+ * Key and low 16 bits of a value. The shift is arithmetic, so negative
+ * values get negative keys and (key, low) sorts like the value itself.
+ */
+#define ROARING_KEY(v) ((int64_t)(v) >> 16)
+#define ROARING_LOW(v) ((uint16_t)((uint64_t)(v) & 0xffff))
+#define ROARING_VALUE(key, low) ((int64_t)(((uint64_t)(key) << 16) | (low)))
+
+//A bitmap container holds its words in data, 4 uint16_t slots per word
+#define ROARING_BITMAP_SLOTS (ROARING_BITMAP_WORDS * 4)
+#define ROARING_WORDS(c) ((uint64_t*)(c)->data)
+
+/*-----------------------------------------------------------------------------
+ * Containers
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Create an empty container with room for 'alloc' uint16_t slots
+ */
+static roaringContainer *containerNew(uint8_t type, uint32_t alloc){
+	roaringContainer *c = zmalloc(sizeof(roaringContainer) + alloc * sizeof(uint16_t));
+
+	c->type = type;
+	c->card = 0;
+	c->len = 0;
+	c->alloc = alloc;
+	if(type == ROARING_BITMAP){
+		memset(c->data, 0, alloc * sizeof(uint16_t));
+		c->len = alloc;
+	}
+	return c;
+}
+
+/**
+ * Make room for 'len' slots, doubling the allocation
+ */
+static roaringContainer *containerGrow(roaringContainer *c, uint32_t len){
+	uint32_t alloc = c->alloc ? c->alloc : 4;
+
+	if(len <= c->alloc) return c;
+	while(alloc < len) alloc *= 2;
+	c = zrealloc(c, sizeof(roaringContainer) + alloc * sizeof(uint16_t));
+	c->alloc = alloc;
+	return c;
+}
+
+static roaringContainer *containerDup(roaringContainer *c){
+	size_t size = sizeof(roaringContainer) + c->len * sizeof(uint16_t);
+	roaringContainer *dup = zmalloc(size);
+
+	memcpy(dup, c, size);
+	dup->alloc = c->len;
+	return dup;
+}
+
+/**
+ * Binary search 'low' among the 'len' sorted values of 'a'. Returns the
+ * position of the value, or where it should be inserted.
+ */
+static uint32_t arraySearch(const uint16_t *a, uint32_t len, uint16_t low, int *found){
+	uint32_t lo = 0, hi = len, mid;
+
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(a[mid] < low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < len && a[lo] == low;
+	return lo;
+}
+
+/**
+ * Return the index of the run holding 'low', -1 when there is none
+ */
+static int runSearch(roaringContainer *c, uint16_t low){
+	uint32_t lo = 0, hi = c->len / 2, mid;
+
+	//Find the first run starting after low
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(c->data[mid*2] <= low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == 0) return -1;
+	lo--;
+	return (uint32_t)low <= (uint32_t)c->data[lo*2] + c->data[lo*2+1] ? (int)lo : -1;
+}
+
+/**
+ * Position of the first set (or clear when 'set' is 0) bit at or after
+ * 'from', 65536 when there is none.
+ */
+static uint32_t wordsNext(const uint64_t *words, uint32_t from, int set){
+	uint32_t w = from >> 6;
+	uint64_t word;
+
+	if(from >= 65536) return 65536;
+	word = set ? words[w] : ~words[w];
+	word &= ~0ULL << (from & 63);
+	while(1){
+		if(word) return w * 64 + __builtin_ctzll(word);
+		if(++w == ROARING_BITMAP_WORDS) return 65536;
+		word = set ? words[w] : ~words[w];
+	}
+}
+
+/**
+ * OR the values of the container into a bitmap of ROARING_BITMAP_WORDS words
+ */
+static void containerToWords(roaringContainer *c, uint64_t *words){
+	uint32_t i, v, end;
+
+	if(c->type == ROARING_ARRAY){
+		for(i = 0; i < c->len; i++)
+			words[c->data[i] >> 6] |= 1ULL << (c->data[i] & 63);
+	}else if(c->type == ROARING_BITMAP){
+		for(i = 0; i < ROARING_BITMAP_WORDS; i++)
+			words[i] |= ROARING_WORDS(c)[i];
+	}else{
+		for(i = 0; i < c->len; i += 2){
+			end = (uint32_t)c->data[i] + c->data[i+1];
+			for(v = c->data[i]; v <= end; v++)
+				words[v >> 6] |= 1ULL << (v & 63);
+		}
+	}
+}
+
+/**
+ * Build a container of the given type from a bitmap holding 'card' values
+ */
+static roaringContainer *containerBuild(const uint64_t *words, uint32_t card, uint8_t type){
+	roaringContainer *c;
+	uint32_t v, end;
+
+	if(type == ROARING_BITMAP){
+		c = containerNew(ROARING_BITMAP, ROARING_BITMAP_SLOTS);
+		memcpy(c->data, words, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+	}else if(type == ROARING_ARRAY){
+		c = containerNew(ROARING_ARRAY, card);
+		for(v = wordsNext(words, 0, 1); v < 65536; v = wordsNext(words, v + 1, 1))
+			c->data[c->len++] = v;
+	}else{
+		c = containerNew(ROARING_RUN, 4);
+		for(v = wordsNext(words, 0, 1); v < 65536; v = wordsNext(words, end, 1)){
+			end = wordsNext(words, v, 0);
+			c = containerGrow(c, c->len + 2);
+			c->data[c->len++] = v;
+			c->data[c->len++] = end - 1 - v;
+		}
+	}
+	c->card = card;
+	return c;
+}
+
+/**
+ * Build the smallest container holding the values of the bitmap, returns
+ * NULL when the bitmap is empty. This is where the layout of a container
+ * is chosen from the density of its values.
+ */
+static roaringContainer *containerFromWords(const uint64_t *words){
+	uint32_t card = 0, runs = 0, w, best;
+	uint64_t carry = 0;
+
+	for(w = 0; w < ROARING_BITMAP_WORDS; w++){
+		card += __builtin_popcountll(words[w]);
+		//A run starts at every set bit whose previous bit is clear
+		runs += __builtin_popcountll(words[w] & ~((words[w] << 1) | carry));
+		carry = words[w] >> 63;
+	}
+	if(card == 0) return NULL;
+
+	best = card <= ROARING_ARRAY_MAX ? card : ROARING_BITMAP_SLOTS;
+	if(runs * 2 < best) return containerBuild(words, card, ROARING_RUN);
+	if(card <= ROARING_ARRAY_MAX) return containerBuild(words, card, ROARING_ARRAY);
+	return containerBuild(words, card, ROARING_BITMAP);
+}
+
+/**
+ * Convert the container to the given type, the old one is freed
+ */
+static roaringContainer *containerConvert(roaringContainer *c, uint8_t type){
+	uint64_t words[ROARING_BITMAP_WORDS];
+	roaringContainer *conv;
+
+	memset(words, 0, sizeof(words));
+	containerToWords(c, words);
+	conv = containerBuild(words, c->card, type);
+	zfree(c);
+	return conv;
+}
+
+/**
+ * Run containers are not modified in place, they are expanded first
+ */
+static roaringContainer *containerUnrun(roaringContainer *c){
+	return containerConvert(c, c->card <= ROARING_ARRAY_MAX ? ROARING_ARRAY : ROARING_BITMAP);
+}
+
+static int containerContains(roaringContainer *c, uint16_t low){
+	int found;
+
+	if(c->type == ROARING_ARRAY){
+		arraySearch(c->data, c->len, low, &found);
+		return found;
+	}else if(c->type == ROARING_BITMAP){
+		return (ROARING_WORDS(c)[low >> 6] >> (low & 63)) & 1;
+	}else{
+		return runSearch(c, low) != -1;
+	}
+}
+
+/**
+ * Add 'low' to the container, that may be reallocated or converted.
+ * Returns 1 when the value was added, 0 when it was already there.
+ */
+static int containerAdd(roaringContainer **cp, uint16_t low){
+	roaringContainer *c = *cp;
+	uint32_t pos;
+	int found;
+
+	if(c->type == ROARING_RUN){
+		if(runSearch(c, low) != -1) return 0;
+		c = *cp = containerUnrun(c);
+	}
+
+	if(c->type == ROARING_ARRAY){
+		pos = arraySearch(c->data, c->len, low, &found);
+		if(found) return 0;
+
+		if(c->card < ROARING_ARRAY_MAX){
+			c = *cp = containerGrow(c, c->len + 1);
+			memmove(c->data + pos + 1, c->data + pos, (c->len - pos) * sizeof(uint16_t));
+			c->data[pos] = low;
+			c->len++;
+			c->card++;
+			return 1;
+		}
+		//The array is full, switch to a bitmap
+		c = *cp = containerConvert(c, ROARING_BITMAP);
+	}
+
+	if((ROARING_WORDS(c)[low >> 6] >> (low & 63)) & 1) return 0;
+	ROARING_WORDS(c)[low >> 6] |= 1ULL << (low & 63);
+	c->card++;
+	return 1;
+}
+
+/**
+ * Remove 'low' from the container, that may be reallocated or converted.
+ * Returns 1 when the value was removed.
+ *
+ * A bitmap goes back to an array only at half of ROARING_ARRAY_MAX, so
+ * adding and removing around the limit doesn't convert it every time.
+ */
+static int containerRemove(roaringContainer **cp, uint16_t low){
+	roaringContainer *c = *cp;
+	uint32_t pos;
+	int found;
+
+	if(c->type == ROARING_RUN){
+		if(runSearch(c, low) == -1) return 0;
+		c = *cp = containerUnrun(c);
+	}
+
+	if(c->type == ROARING_ARRAY){
+		pos = arraySearch(c->data, c->len, low, &found);
+		if(!found) return 0;
+		memmove(c->data + pos, c->data + pos + 1, (c->len - pos - 1) * sizeof(uint16_t));
+		c->len--;
+		c->card--;
+		return 1;
+	}
+
+	if(!((ROARING_WORDS(c)[low >> 6] >> (low & 63)) & 1)) return 0;
+	ROARING_WORDS(c)[low >> 6] &= ~(1ULL << (low & 63));
+	c->card--;
+	if(c->card && c->card <= ROARING_ARRAY_MAX / 2)
+		*cp = containerConvert(c, ROARING_ARRAY);
+	return 1;
+}
+
+/**
+ * Return the value of rank 'rank' in the container, rank < card
+ */
+static uint16_t containerSelect(roaringContainer *c, uint32_t rank){
+	uint32_t i, n;
+
+	if(c->type == ROARING_ARRAY){
+		return c->data[rank];
+	}else if(c->type == ROARING_BITMAP){
+		uint64_t word;
+
+		for(i = 0; i < ROARING_BITMAP_WORDS; i++){
+			word = ROARING_WORDS(c)[i];
+			n = __builtin_popcountll(word);
+			if(rank < n) break;
+			rank -= n;
+		}
+		//Drop the lowest 'rank' set bits of the word
+		while(rank--) word &= word - 1;
+		return i * 64 + __builtin_ctzll(word);
+	}else{
+		for(i = 0; i < c->len; i += 2){
+			n = (uint32_t)c->data[i+1] + 1;
+			if(rank < n) break;
+			rank -= n;
+		}
+		return c->data[i] + rank;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * Bitmap API
+ *----------------------------------------------------------------------------*/
+
+/**
+ * Create an empty bitmap
+ */
+roaring *roaringNew(void){
+	roaring *r = zmalloc(sizeof(roaring));
+
+	r->card = 0;
+	r->len = 0;
+	r->alloc = 0;
+	r->keys = NULL;
+	r->containers = NULL;
+	return r;
+}
+
+void roaringFree(roaring *r){
+	uint32_t i;
+
+	for(i = 0; i < r->len; i++) zfree(r->containers[i]);
+	zfree(r->keys);
+	zfree(r->containers);
+	zfree(r);
+}
+
+roaring *roaringDup(roaring *r){
+	roaring *dup = roaringNew();
+	uint32_t i;
+
+	dup->card = r->card;
+	dup->len = dup->alloc = r->len;
+	if(r->len){
+		dup->keys = zmalloc(sizeof(int64_t) * r->len);
+		dup->containers = zmalloc(sizeof(roaringContainer*) * r->len);
+		memcpy(dup->keys, r->keys, sizeof(int64_t) * r->len);
+		for(i = 0; i < r->len; i++)
+			dup->containers[i] = containerDup(r->containers[i]);
+	}
+	return dup;
+}
+
+/**
+ * Binary search the container of 'key'. Returns its position, or where it
+ * should be inserted.
+ */
+static uint32_t roaringSearchKey(roaring *r, int64_t key, int *found){
+	uint32_t lo = 0, hi = r->len, mid;
+
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(r->keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < r->len && r->keys[lo] == key;
+	return lo;
+}
+
+static void roaringInsertContainer(roaring *r, uint32_t pos, int64_t key, roaringContainer *c){
+	if(r->len == r->alloc){
+		r->alloc = r->alloc ? r->alloc * 2 : 4;
+		r->keys = zrealloc(r->keys, sizeof(int64_t) * r->alloc);
+		r->containers = zrealloc(r->containers, sizeof(roaringContainer*) * r->alloc);
+	}
+	memmove(r->keys + pos + 1, r->keys + pos, sizeof(int64_t) * (r->len - pos));
+	memmove(r->containers + pos + 1, r->containers + pos, sizeof(roaringContainer*) * (r->len - pos));
+	r->keys[pos] = key;
+	r->containers[pos] = c;
+	r->len++;
+}
+
+static void roaringRemoveContainer(roaring *r, uint32_t pos){
+	zfree(r->containers[pos]);
+	memmove(r->keys + pos, r->keys + pos + 1, sizeof(int64_t) * (r->len - pos - 1));
+	memmove(r->containers + pos, r->containers + pos + 1, sizeof(roaringContainer*) * (r->len - pos - 1));
+	r->len--;
+}
+
+/**
+ * Add a value, returns 1 when it was added, 0 when it was already there
+ */
+int roaringAdd(roaring *r, int64_t value){
+	int64_t key = ROARING_KEY(value);
+	uint32_t pos;
+	int found, added;
+
+	pos = roaringSearchKey(r, key, &found);
+	if(!found) roaringInsertContainer(r, pos, key, containerNew(ROARING_ARRAY, 4));
+
+	added = containerAdd(&r->containers[pos], ROARING_LOW(value));
+	r->card += added;
+	return added;
+}
+
+/**
+ * Remove a value, returns 1 when it was removed, 0 when it was not there
+ */
+int roaringRemove(roaring *r, int64_t value){
+	uint32_t pos;
+	int found;
+
+	pos = roaringSearchKey(r, ROARING_KEY(value), &found);
+	if(!found || !containerRemove(&r->containers[pos], ROARING_LOW(value))) return 0;
+
+	r->card--;
+	if(r->containers[pos]->card == 0) roaringRemoveContainer(r, pos);
+	return 1;
+}
+
+int roaringContains(roaring *r, int64_t value){
+	uint32_t pos;
+	int found;
+
+	pos = roaringSearchKey(r, ROARING_KEY(value), &found);
+	return found && containerContains(r->containers[pos], ROARING_LOW(value));
+}
+
+uint64_t roaringCard(roaring *r){
+	return r->card;
+}
+
+/**
+ * Set 'value' to the value of rank 'rank', the smallest value has rank 0.
+ * Returns 0 when the rank is out of range.
+ *
+ * T = O(N) on the number of containers
+ */
+int roaringSelect(roaring *r, uint64_t rank, int64_t *value){
+	uint32_t i;
+
+	if(rank >= r->card) return 0;
+	for(i = 0; i < r->len; i++){
+		if(rank < r->containers[i]->card){
+			*value = ROARING_VALUE(r->keys[i], containerSelect(r->containers[i], rank));
+			return 1;
+		}
+		rank -= r->containers[i]->card;
+	}
+	return 0;
+}
+
+/**
+ * Like roaringSelect() for 'count' ranks, that must be in range and sorted
+ * in increasing order. The containers are walked once for all the ranks.
+ */
+void roaringSelectMany(roaring *r, const uint64_t *ranks, int64_t *values, unsigned long count){
+	uint64_t base = 0;
+	uint32_t i = 0;
+	unsigned long j;
+
+	for(j = 0; j < count; j++){
+		while(ranks[j] - base >= r->containers[i]->card){
+			base += r->containers[i]->card;
+			i++;
+		}
+		values[j] = ROARING_VALUE(r->keys[i], containerSelect(r->containers[i], ranks[j] - base));
+	}
+}
+
+/**
+ * Return a random value of a non empty bitmap
+ */
+int64_t roaringRandom(roaring *r){
+	uint64_t rank = (((uint64_t)random() << 31) ^ (uint64_t)random()) % r->card;
+	int64_t value = 0;
+
+	roaringSelect(r, rank, &value);
+	return value;
+}
+
+void roaringInitIterator(roaring *r, roaringIterator *it){
+	it->r = r;
+	it->ci = 0;
+	it->pos = 0;
+	it->off = 0;
+}
+
+/**
+ * Store the next value into 'value', values come in increasing order.
+ * Returns 0 at the end. The bitmap must not be modified while iterating.
+ */
+int roaringNext(roaringIterator *it, int64_t *value){
+	roaring *r = it->r;
+
+	while(it->ci < r->len){
+		roaringContainer *c = r->containers[it->ci];
+		int64_t key = r->keys[it->ci];
+
+		if(c->type == ROARING_ARRAY){
+			if(it->pos < c->len){
+				*value = ROARING_VALUE(key, c->data[it->pos++]);
+				return 1;
+			}
+		}else if(c->type == ROARING_BITMAP){
+			uint32_t v = wordsNext(ROARING_WORDS(c), it->pos, 1);
+
+			if(v < 65536){
+				it->pos = v + 1;
+				*value = ROARING_VALUE(key, v);
+				return 1;
+			}
+		}else{
+			if(it->pos < c->len){
+				*value = ROARING_VALUE(key, c->data[it->pos] + it->off);
+				if(it->off == c->data[it->pos+1]){
+					it->pos += 2;
+					it->off = 0;
+				}else{
+					it->off++;
+				}
+				return 1;
+			}
+		}
+		it->ci++;
+		it->pos = 0;
+		it->off = 0;
+	}
+	return 0;
+}
+
+#define ROARING_OP_AND 0
+#define ROARING_OP_OR 1
+#define ROARING_OP_ANDNOT 2
+
+/**
+ * Combine two containers of the same key into a new one, NULL when the
+ * result is empty
+ */
+static roaringContainer *containerOp(roaringContainer *a, roaringContainer *b, int op){
+	uint64_t wa[ROARING_BITMAP_WORDS], wb[ROARING_BITMAP_WORDS];
+	uint32_t i;
+
+	memset(wa, 0, sizeof(wa));
+	memset(wb, 0, sizeof(wb));
+	containerToWords(a, wa);
+	containerToWords(b, wb);
+	for(i = 0; i < ROARING_BITMAP_WORDS; i++){
+		if(op == ROARING_OP_AND)
+			wa[i] &= wb[i];
+		else if(op == ROARING_OP_OR)
+			wa[i] |= wb[i];
+		else
+			wa[i] &= ~wb[i];
+	}
+	return containerFromWords(wa);
+}
+
+/**
+ * Apply 'op' between 'r' and 'other', storing the result into 'r'.
+ * Containers are matched by key with a merge, only containers present in
+ * both bitmaps are combined word by word.
+ */
+static void roaringOp(roaring *r, roaring *other, int op){
+	uint32_t alloc = r->len + (op == ROARING_OP_OR ? other->len : 0);
+	int64_t *keys = alloc ? zmalloc(sizeof(int64_t) * alloc) : NULL;
+	roaringContainer **containers = alloc ? zmalloc(sizeof(roaringContainer*) * alloc) : NULL;
+	roaringContainer *c;
+	uint32_t i = 0, j = 0, len = 0;
+	uint64_t card = 0;
+
+	while(i < r->len || j < other->len){
+		if(j == other->len || (i < r->len && r->keys[i] < other->keys[j])){
+			//Only in r
+			if(op == ROARING_OP_AND){
+				zfree(r->containers[i]);
+			}else{
+				keys[len] = r->keys[i];
+				containers[len++] = r->containers[i];
+				card += r->containers[i]->card;
+			}
+			i++;
+		}else if(i == r->len || other->keys[j] < r->keys[i]){
+			//Only in other
+			if(op == ROARING_OP_OR){
+				keys[len] = other->keys[j];
+				containers[len++] = c = containerDup(other->containers[j]);
+				card += c->card;
+			}else if(op == ROARING_OP_AND && i == r->len){
+				break;
+			}
+			j++;
+		}else{
+			c = containerOp(r->containers[i], other->containers[j], op);
+			zfree(r->containers[i]);
+			if(c){
+				keys[len] = r->keys[i];
+				containers[len++] = c;
+				card += c->card;
+			}
+			i++;
+			j++;
+		}
+	}
+	//Containers of r left over by an early stop
+	for(; i < r->len; i++) zfree(r->containers[i]);
+
+	zfree(r->keys);
+	zfree(r->containers);
+	r->keys = keys;
+	r->containers = containers;
+	r->len = len;
+	r->alloc = alloc;
+	r->card = card;
+}
+
+/**
+ * r = r AND other
+ */
+void roaringAnd(roaring *r, roaring *other){
+	roaringOp(r, other, ROARING_OP_AND);
+}
+
+/**
+ * r = r OR other
+ */
+void roaringOr(roaring *r, roaring *other){
+	roaringOp(r, other, ROARING_OP_OR);
+}
+
+/**
+ * r = r AND NOT other
+ */
+void roaringAndNot(roaring *r, roaring *other){
+	roaringOp(r, other, ROARING_OP_ANDNOT);
+}
+
+/**
+ * Rebuild every container with the smallest layout for its values.
+ * Single adds and removes never create run containers, this is called
+ * after bulk changes.
+ */
+void roaringOptimize(roaring *r){
+	uint64_t words[ROARING_BITMAP_WORDS];
+	roaringContainer *c;
+	uint32_t i;
+
+	for(i = 0; i < r->len; i++){
+		memset(words, 0, sizeof(words));
+		containerToWords(r->containers[i], words);
+		c = containerFromWords(words);
+		zfree(r->containers[i]);
+		r->containers[i] = c;
+	}
+}
+
+/**
+ * Return the memory used by the bitmap
+ */
+size_t roaringBlobLen(roaring *r){
+	size_t len = sizeof(roaring) + r->alloc * (sizeof(int64_t) + sizeof(roaringContainer*));
+	uint32_t i;
+
+	for(i = 0; i < r->len; i++)
+		len += sizeof(roaringContainer) + r->containers[i]->alloc * sizeof(uint16_t);
+	return len;
+}
+
+/*-----------------------------------------------------------------------------
+ * Serialization
+ *
+ * uint32_t number of containers, then for every container:
+ * int64_t key, uint8_t type, uint32_t card, uint32_t slots, and 'slots'
+ * uint16_t of data. Integers are little endian, bitmap words are saved as
+ * little endian uint64_t.
+ *----------------------------------------------------------------------------*/
+
+#define ROARING_CONTAINER_HDR (sizeof(int64_t) + 1 + sizeof(uint32_t) * 2)
+
+size_t roaringSerializedLen(roaring *r){
+	size_t len = sizeof(uint32_t);
+	uint32_t i;
+
+	for(i = 0; i < r->len; i++)
+		len += ROARING_CONTAINER_HDR + r->containers[i]->len * sizeof(uint16_t);
+	return len;
+}
+
+/**
+ * Write the bitmap into 'buf', that holds roaringSerializedLen() bytes
+ */
+void roaringSerialize(roaring *r, unsigned char *buf){
+	uint32_t i, j, u32;
+	uint64_t u64;
+	uint16_t u16;
+
+	u32 = r->len;
+	memrev32ifbe(&u32);
+	memcpy(buf, &u32, sizeof(u32));
+	buf += sizeof(u32);
+
+	for(i = 0; i < r->len; i++){
+		roaringContainer *c = r->containers[i];
+
+		u64 = (uint64_t)r->keys[i];
+		memrev64ifbe(&u64);
+		memcpy(buf, &u64, sizeof(u64));
+		buf += sizeof(u64);
+		*buf++ = c->type;
+		u32 = c->card;
+		memrev32ifbe(&u32);
+		memcpy(buf, &u32, sizeof(u32));
+		buf += sizeof(u32);
+		u32 = c->len;
+		memrev32ifbe(&u32);
+		memcpy(buf, &u32, sizeof(u32));
+		buf += sizeof(u32);
+
+		if(c->type == ROARING_BITMAP){
+			for(j = 0; j < ROARING_BITMAP_WORDS; j++){
+				u64 = ROARING_WORDS(c)[j];
+				memrev64ifbe(&u64);
+				memcpy(buf, &u64, sizeof(u64));
+				buf += sizeof(u64);
+			}
+		}else{
+			for(j = 0; j < c->len; j++){
+				u16 = c->data[j];
+				memrev16ifbe(&u16);
+				memcpy(buf, &u16, sizeof(u16));
+				buf += sizeof(u16);
+			}
+		}
+	}
+}
+
+/**
+ * Check a container just loaded, its values must match its type and card
+ */
+static int containerIsValid(roaringContainer *c){
+	uint32_t i, card = 0, end;
+
+	if(c->type == ROARING_ARRAY){
+		if(c->len != c->card || c->card == 0 || c->card > ROARING_ARRAY_MAX) return 0;
+		for(i = 1; i < c->len; i++)
+			if(c->data[i] <= c->data[i-1]) return 0;
+		return 1;
+	}else if(c->type == ROARING_BITMAP){
+		if(c->len != ROARING_BITMAP_SLOTS) return 0;
+		for(i = 0; i < ROARING_BITMAP_WORDS; i++)
+			card += __builtin_popcountll(ROARING_WORDS(c)[i]);
+		return card == c->card && card > 0;
+	}else if(c->type == ROARING_RUN){
+		if(c->len == 0 || c->len % 2) return 0;
+		for(i = 0; i < c->len; i += 2){
+			end = (uint32_t)c->data[i] + c->data[i+1];
+			if(end > 65535) return 0;
+			//Runs are sorted and don't overlap
+			if(i && c->data[i] <= (uint32_t)c->data[i-2] + c->data[i-1]) return 0;
+			card += c->data[i+1] + 1;
+		}
+		return card == c->card;
+	}
+	return 0;
+}
+
+/**
+ * Load a bitmap written by roaringSerialize(). Returns NULL when the
+ * buffer is not a valid bitmap.
+ */
+roaring *roaringDeserialize(const unsigned char *buf, size_t len){
+	const unsigned char *end = buf + len;
+	roaring *r = roaringNew();
+	uint32_t n, i, j, card, slots;
+	uint64_t u64;
+	uint16_t u16;
+	uint8_t type;
+
+	if(len < sizeof(uint32_t)) goto err;
+	memcpy(&n, buf, sizeof(n));
+	memrev32ifbe(&n);
+	buf += sizeof(n);
+
+	for(i = 0; i < n; i++){
+		roaringContainer *c;
+
+		if((size_t)(end - buf) < ROARING_CONTAINER_HDR) goto err;
+		memcpy(&u64, buf, sizeof(u64));
+		memrev64ifbe(&u64);
+		buf += sizeof(u64);
+		type = *buf++;
+		memcpy(&card, buf, sizeof(card));
+		memrev32ifbe(&card);
+		buf += sizeof(card);
+		memcpy(&slots, buf, sizeof(slots));
+		memrev32ifbe(&slots);
+		buf += sizeof(slots);
+
+		if(slots > ROARING_BITMAP_SLOTS || (size_t)(end - buf) < slots * sizeof(uint16_t)) goto err;
+		if(r->len && (int64_t)u64 <= r->keys[r->len-1]) goto err;
+
+		c = containerNew(ROARING_ARRAY, slots ? slots : 1);
+		c->type = type;
+		c->card = card;
+		c->len = slots;
+		if(type == ROARING_BITMAP){
+			for(j = 0; j < slots / 4; j++){
+				memcpy(&ROARING_WORDS(c)[j], buf, sizeof(uint64_t));
+				memrev64ifbe(&ROARING_WORDS(c)[j]);
+				buf += sizeof(uint64_t);
+			}
+		}else{
+			for(j = 0; j < slots; j++){
+				memcpy(&u16, buf, sizeof(u16));
+				memrev16ifbe(&u16);
+				c->data[j] = u16;
+				buf += sizeof(u16);
+			}
+		}
+		roaringInsertContainer(r, r->len, (int64_t)u64, c);
+		if(!containerIsValid(c)) goto err;
+		r->card += card;
+	}
+	if(buf != end) goto err;
+	return r;
+
+err:
+	roaringFree(r);
+	return NULL;
+}
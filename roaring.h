@@ -0,0 +1,91 @@
+#ifndef __ROARING_H
+#define __ROARING_H
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A compressed bitmap of 64 bit integers, in the style of Roaring bitmaps.
+ *
+ * Values are split in their high 48 bits, the key of a container, and their
+ * low 16 bits, stored into that container. Every container uses the smallest
+ * of three layouts for its values:
+ *
+ * ROARING_ARRAY   sorted uint16_t values, up to ROARING_ARRAY_MAX of them
+ * ROARING_BITMAP  65536 bits
+ * ROARING_RUN     sorted (start, length-1) pairs of uint16_t
+ */
+#define ROARING_ARRAY 0
+#define ROARING_BITMAP 1
+#define ROARING_RUN 2
+
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITMAP_WORDS 1024
+
+typedef struct roaringContainer{
+	//ROARING_ARRAY, ROARING_BITMAP or ROARING_RUN
+	uint8_t type;
+
+	//Number of values, up to 65536
+	uint32_t card;
+
+	//Used uint16_t slots of data
+	uint32_t len;
+
+	//Allocated uint16_t slots of data
+	uint32_t alloc;
+
+	//Values, bitmap words or runs
+	uint16_t data[];
+}roaringContainer;
+
+typedef struct roaring{
+	//Number of values in the bitmap
+	uint64_t card;
+
+	//Number of containers
+	uint32_t len;
+
+	//Allocated slots of keys and containers
+	uint32_t alloc;
+
+	//High 48 bits of the values of every container, sorted
+	int64_t *keys;
+
+	roaringContainer **containers;
+}roaring;
+
+typedef struct roaringIterator{
+	roaring *r;
+
+	//Current container
+	uint32_t ci;
+
+	//Position inside the container: value, bit or run index
+	uint32_t pos;
+
+	//Offset inside the current run
+	uint32_t off;
+}roaringIterator;
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringDup(roaring *r);
+int roaringAdd(roaring *r, int64_t value);
+int roaringRemove(roaring *r, int64_t value);
+int roaringContains(roaring *r, int64_t value);
+uint64_t roaringCard(roaring *r);
+int roaringSelect(roaring *r, uint64_t rank, int64_t *value);
+void roaringSelectMany(roaring *r, const uint64_t *ranks, int64_t *values, unsigned long count);
+int64_t roaringRandom(roaring *r);
+void roaringInitIterator(roaring *r, roaringIterator *it);
+int roaringNext(roaringIterator *it, int64_t *value);
+void roaringAnd(roaring *r, roaring *other);
+void roaringOr(roaring *r, roaring *other);
+void roaringAndNot(roaring *r, roaring *other);
+void roaringOptimize(roaring *r);
+size_t roaringBlobLen(roaring *r);
+size_t roaringSerializedLen(roaring *r);
+void roaringSerialize(roaring *r, unsigned char *buf);
+roaring *roaringDeserialize(const unsigned char *buf, size_t len);
+
+#endif
@@ -13,9 +13,18 @@
  */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end){
     int i;
-    if(o->encoding == REDIS_ENCODING_ZIPLIST){
+    unsigned long pairs = (end - start + 1) / 2;
+
+    //Only the compact encodings have a limit on the size of an element
+    if(o->encoding == REDIS_ENCODING_HT){
         return;
     }
+
+    //A batch of more pairs than a ziplist holds would convert it anyway
+    if(o->encoding == REDIS_ENCODING_ZIPLIST && pairs > server.hash_max_ziplist_entries){
+        hashTypeConvert(o, hashTypeLength(o) + pairs <= server.hash_max_hashpack_entries ?
+                           REDIS_ENCODING_HASHPACK : REDIS_ENCODING_HT);
+    }
     for(i = start; i <= end; i++){
         if(sdsEncodedObject(argv[i]) && sdslen(argv[i]->ptr) > server.hash_max_ziplist_value){
             //Convert object to the dict
@@ -42,29 +51,35 @@ void hashTypeTryObjectEncoding(robj *subject, robj **o1, robj **o2){
 }
 
 /**
- * Get the value from from a ziplist encoded hash, indentified by field.
- * Returns -1 when the field cannot be found.
- * 
- * parameters:
- * field : 
- * vstr : which is a string pointer, the value will will eventually save
- *        into here(the ziplist entry save a char array).
- * vlen : the saved string length.
- * ll   : if the ziplist entry is integer, then saved to here.
- */ 
-int hashTypeGetFromZiplist(robj *o, robj *field,
-                           unsigned char **vstr,
-                           unsigned int *vlen, 
-                           long long *vll){
-    
+ * Returns the string of a field or value object, which may be integer
+ * encoded. Integers are printed into buf, that must hold 32 bytes.
+ */
+static unsigned char *hashTypeObjectBuffer(robj *o, char *buf, unsigned int *len){
+    if(sdsEncodedObject(o)){
+        *len = sdslen(o->ptr);
+        return o->ptr;
+    }
+    *len = ll2string(buf, 32, (long)o->ptr);
+    return (unsigned char*)buf;
+}
+
+/**
+ * Find field in a ziplist encoded hash.
+ * Returns the pointer to the entry of its value, or NULL if the field
+ * cannot be found.
+ */
+static unsigned char *hashTypeZiplistFindValue(robj *o, robj *field){
     unsigned char *zl, *fptr = NULL, *vptr = NULL;
-    int ret;
+    unsigned char *fstr;
+    unsigned int flen;
+    char buf[32];
 
     //Make sure this works on the ziplist
     redisAssert(o->encoding == REDIS_ENCODING_ZIPLIST);
 
-    //Get the field, this field may be encoded
-    field = getDecodedObject(field);
+    //The field may be integer encoded, print it on the stack instead of
+    //creating a decoded object for it
+    fstr = hashTypeObjectBuffer(field, buf, &flen);
 
     //Loop through the whole list
     zl = o->ptr;
@@ -73,7 +88,7 @@ int hashTypeGetFromZiplist(robj *o, robj *field,
 
     /*If this list is not empty*/
     if(fptr != NULL){
-        fptr = ziplistFind(fptr, field->ptr, sdslen(field->ptr), 1);
+        fptr = ziplistFind(fptr, fstr, flen, 1);
         //If we find this key in the ziplist
         if(fptr != NULL){
             /*Grab correspond value */
@@ -81,13 +96,27 @@ int hashTypeGetFromZiplist(robj *o, robj *field,
             redisAssert(vptr != NULL);
         }
     }
-    //Here is a ref decrment because the getDecodeObject function
-    //it will return a new object or incr the original reference count
-    //when it is a RAW string.
-    //So here after we use this field, we need to decr this ref for 
-    //GC. 
-    decrRefCount(field);
-    
+    return vptr;
+}
+
+/**
+ * Get the value from from a ziplist encoded hash, indentified by field.
+ * Returns -1 when the field cannot be found.
+ * 
+ * parameters:
+ * field : 
+ * vstr : which is a string pointer, the value will will eventually save
+ *        into here(the ziplist entry save a char array).
+ * vlen : the saved string length.
+ * ll   : if the ziplist entry is integer, then saved to here.
+ */ 
+int hashTypeGetFromZiplist(robj *o, robj *field,
+                           unsigned char **vstr,
+                           unsigned int *vlen, 
+                           long long *vll){
+    unsigned char *vptr = hashTypeZiplistFindValue(o, field);
+    int ret;
+
     //Get the value from the ziplist
     if(vptr != NULL){
         ret = ziplistGet(vptr, vstr, vlen, vll);
@@ -116,6 +145,24 @@ int hashTypeGetFromHashTable(robj *o, robj *field, robj **value){
     return -1;
 }
 
+/**
+ * Get the value from a packed hash, identified by field.
+ * Returns -1 when the field cannot be found.
+ *
+ * The values of a packed hash are always strings, vstr is never NULL
+ * on success.
+ */
+int hashTypeGetFromHashpack(robj *o, robj *field, unsigned char **vstr, unsigned int *vlen){
+    unsigned char *fstr;
+    unsigned int flen;
+    char buf[32];
+
+    redisAssert(o->encoding == REDIS_ENCODING_HASHPACK);
+
+    fstr = hashTypeObjectBuffer(field, buf, &flen);
+    return hashpackFind(o->ptr, fstr, flen, vstr, vlen) ? 0 : -1;
+}
+
 /**
  * High level function of hashTypeGet*() that always returns a Redis
  * object (either new or with refcount incremented), so that the caller
@@ -146,6 +193,12 @@ robj *hashTypeGetObject(robj *o, robj *field){
                 value = createStringObjectFromLongLong(vll);
             }
         }
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *vstr;
+        unsigned int vlen;
+
+        if(hashTypeGetFromHashpack(o, field, &vstr, &vlen) == 0)
+            value = createStringObject((char *)vstr, vlen);
     }else{
         redisPainc("Unknown type");
     }
@@ -168,6 +221,8 @@ int hashTypeExists(robj *o, robj *field){
         if(hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
     }else if(o->encoding == REDIS_ENCODING_HT){
         if(hashTypeGetFromHashTable(o, field, &val) == 0) return 1;
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        if(hashTypeGetFromHashpack(o, field, &vstr, &vlen) == 0) return 1;
     }else{
         redisPainc("Unknown type");
     }
@@ -228,6 +283,18 @@ int hashTypeSet(robj *o, robj *field, robj *value){
          * if ziplist
          */
         if(hashTypeLength(o) > server.hash_max_ziplist_entries)
+            hashTypeConvert(o, hashTypeGrownEncoding(o));
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *fstr, *vstr;
+        unsigned int flen, vlen;
+        char fbuf[32], vbuf[32];
+
+        fstr = hashTypeObjectBuffer(field, fbuf, &flen);
+        vstr = hashTypeObjectBuffer(value, vbuf, &vlen);
+        update = hashpackSet(o->ptr, fstr, flen, vstr, vlen);
+
+        //Too many fields for a packed hash
+        if(hashTypeLength(o) > server.hash_max_hashpack_entries)
             hashTypeConvert(o, REDIS_ENCODING_HT);
     }else if(o->encoding == REDIS_ENCODING_HT){
             //Replace this key in the dictionary
@@ -235,6 +302,8 @@ int hashTypeSet(robj *o, robj *field, robj *value){
                 incrRefCount(field);
             }else{
                 update = 1;
+                //Overwriting the value of a field also drops its TTL
+                if(hashTypeExpires(o)) hashTypeRemoveFieldExpire(o, field);
             }
     }else{
         redisPainc("Unknown type");
@@ -242,6 +311,151 @@ int hashTypeSet(robj *o, robj *field, robj *value){
     return update;
 }
 
+/**
+ * Find the field s of length len among the distinct fields of a batch,
+ * indexed by hashTypeSetMulti(). Returns the pair where the field is first
+ * given, or -1.
+ */
+static int hashBatchLookup(unsigned int *slots, unsigned int mask, robj **dec,
+                           unsigned char *s, unsigned int len){
+    unsigned int h = dictGenHashFunction(s, len) & mask, slot;
+
+    while((slot = slots[h]) != 0){
+        sds field = dec[(slot-1)*2]->ptr;
+
+        if(sdslen(field) == len && memcmp(field, s, len) == 0) return slot-1;
+        h = (h+1) & mask;
+    }
+    return -1;
+}
+
+/**
+ * Set the field/value pairs argv[start..end], as a sequence of hashTypeSet()
+ * would do: a field given many times takes its last value.
+ * Returns the number of fields that were added.
+ *
+ * For a ziplist hash the distinct fields of the batch are indexed once in a
+ * small open addressing table, so a single linear scan of the ziplist finds
+ * every field to update in O(1) each. The ziplist is then rewritten once
+ * with the new values and the new fields appended, instead of a
+ * ziplistFind() and a realloc for every pair. When the final number of
+ * fields is above the limit the hash is converted once and the pairs are
+ * set into the new encoding.
+ *
+ * The caller is expected to call hashTypeTryConversion() first, so that no
+ * field or value is too long for the ziplist.
+ */
+unsigned long hashTypeSetMulti(robj *o, robj **argv, int start, int end){
+    unsigned long added = 0;
+    int i;
+
+    if(o->encoding == REDIS_ENCODING_ZIPLIST){
+        unsigned char *zl = o->ptr, *fptr, *vptr;
+        unsigned char **repl, **app;
+        unsigned int *rlen, *alen, *slots, *last, zlen, pairs, size, k;
+        robj **dec;
+        char *found;
+        int first;
+
+        pairs = (end - start + 1) / 2;
+        zlen = ziplistLen(zl);
+        dec = zmalloc(sizeof(robj*) * pairs * 2);
+        for(k = 0; k < pairs * 2; k++) dec[k] = getDecodedObject(argv[start+k]);
+
+        //Index the distinct fields, last[] is the pair of their last value
+        for(size = 4; size < pairs * 2; size <<= 1);
+        slots = zcalloc(sizeof(unsigned int) * size);
+        last = zmalloc(sizeof(unsigned int) * pairs);
+        found = zcalloc(pairs);
+        for(k = 0; k < pairs; k++){
+            sds field = dec[k*2]->ptr;
+
+            first = hashBatchLookup(slots, size-1, dec, (unsigned char*)field, sdslen(field));
+            if(first == -1){
+                unsigned int h = dictGenHashFunction(field, sdslen(field)) & (size-1);
+
+                while(slots[h] != 0) h = (h+1) & (size-1);
+                slots[h] = k+1;
+                last[k] = k;
+            }else{
+                last[first] = k;
+                //Not a first occurrence, never appended
+                found[k] = 1;
+            }
+        }
+
+        //A single scan of the ziplist finds the fields to update
+        repl = zcalloc(sizeof(unsigned char*) * (zlen + 1));
+        rlen = zmalloc(sizeof(unsigned int) * (zlen + 1));
+        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        for(k = 0; fptr != NULL; k += 2){
+            unsigned char *fstr;
+            unsigned int flen;
+            long long fll;
+            char fbuf[32];
+
+            vptr = ziplistNext(zl, fptr);
+            redisAssert(vptr != NULL);
+            ziplistGet(fptr, &fstr, &flen, &fll);
+            if(fstr == NULL){
+                flen = ll2string(fbuf, sizeof(fbuf), fll);
+                fstr = (unsigned char*)fbuf;
+            }
+            first = hashBatchLookup(slots, size-1, dec, fstr, flen);
+            if(first != -1){
+                robj *value = dec[last[first]*2+1];
+
+                repl[k+1] = value->ptr;
+                rlen[k+1] = sdslen(value->ptr);
+                found[first] = 1;
+            }
+            fptr = ziplistNext(zl, vptr);
+        }
+
+        //The other fields are appended in the order they are first given,
+        //with their last value.
+        app = zmalloc(sizeof(unsigned char*) * pairs * 2);
+        alen = zmalloc(sizeof(unsigned int) * pairs * 2);
+        for(k = 0; k < pairs; k++){
+            robj *field = dec[k*2], *value = dec[last[k]*2+1];
+
+            if(found[k]) continue;
+            app[added*2] = field->ptr;
+            alen[added*2] = sdslen(field->ptr);
+            app[added*2+1] = value->ptr;
+            alen[added*2+1] = sdslen(value->ptr);
+            added++;
+        }
+
+        if(zlen / 2 + added <= server.hash_max_ziplist_entries){
+            o->ptr = ziplistRewrite(zl, repl, rlen, app, alen, added * 2);
+        }else{
+            //Convert once, then every set is O(1)
+            hashTypeConvert(o, zlen / 2 + added <= server.hash_max_hashpack_entries ?
+                               REDIS_ENCODING_HASHPACK : REDIS_ENCODING_HT);
+        }
+
+        for(k = 0; k < pairs * 2; k++) decrRefCount(dec[k]);
+        zfree(dec);
+        zfree(slots);
+        zfree(last);
+        zfree(found);
+        zfree(repl);
+        zfree(rlen);
+        zfree(app);
+        zfree(alen);
+
+        if(o->encoding == REDIS_ENCODING_ZIPLIST) return added;
+        added = 0;
+    }
+
+    for(i = start; i < end; i += 2){
+        hashTypeTryObjectEncoding(o, &argv[i], &argv[i+1]);
+        if(!hashTypeSet(o, argv[i], argv[i+1])) added++;
+    }
+    return added;
+}
+
 /**
  * Delete an element from a hash
  * Returns 1 on  deleted and 0 on not found
@@ -268,7 +482,15 @@ int hashTypeDelete(robj *o, robj *field){
             }
         }
         decrRefCount(field);
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *fstr;
+        unsigned int flen;
+        char buf[32];
+
+        fstr = hashTypeObjectBuffer(field, buf, &flen);
+        deleted = hashpackDelete(o->ptr, fstr, flen);
     }else if(o->encoding == REDIS_ENCODING_HT){
+        if(hashTypeExpires(o)) hashTypeRemoveFieldExpire(o, field);
         if(dictDelete((dict*)o->ptr, field) == DICT_OK){
             deleted = 1;
             /*Always check if the dictionary needs a resize after the delete*/
@@ -289,6 +511,8 @@ unsigned long hashTypeLength(robj *o){
         len = ziplistLen(o->ptr) / 2;
     }else if(o->encoding == REDIS_ENCODING_HT){
         len = dictSize((dict *)o->ptr);
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        len = hashpackLen(o->ptr);
     }else{
         redisPainc("Unknown type");
     }
@@ -309,6 +533,8 @@ hashTypeIterator *hashTypeInitIterator(robj *subject){
         it->vptr = NULL;
     }else if(it->encoding == REDIS_ENCODING_HT){
         it->di = dictGetIterator(subject->ptr);
+    }else if(it->encoding == REDIS_ENCODING_HASHPACK){
+        it->hpos = 0;
     }else{
         redisPainc("Unknown type");
     }
@@ -357,6 +583,9 @@ int hashTypeNext(hashTypeIterator *hi){
         hi->vptr = vptr;
     }else if(hi->encoding == REDIS_ENCODING_HT){
         if((hi->de = dictNext(hi->di)) == NULL) return REDIS_ERR;
+    }else if(hi->encoding == REDIS_ENCODING_HASHPACK){
+        if(!hashpackNext(hi->subject->ptr, &hi->hpos, &hi->hfstr, &hi->hflen,
+                         &hi->hvstr, &hi->hvlen)) return REDIS_ERR;
     }else{
         redisPainc("Unknown type");
     }
@@ -405,6 +634,25 @@ void hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what, robj **dst){
     }
 }
 
+/**
+ * Get the field or value at iterator cursor, for an iterator on a packed
+ * hash. The strings point into the blob of the hash.
+ */
+void hashTypeCurrentFromHashpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen){
+
+    redisAssert(hi->encoding == REDIS_ENCODING_HASHPACK);
+
+    if(what & REDIS_HASH_KEY){
+        *vstr = hi->hfstr;
+        *vlen = hi->hflen;
+    }else{
+        *vstr = hi->hvstr;
+        *vlen = hi->hvlen;
+    }
+}
+
 /**
  * A non copy-on write friendly but higher level version of hashTypeCurrent*()
  * thats returns an object with incremented refcount(or a new object).
@@ -427,6 +675,12 @@ robj *hashTypeCurrentObject(hashTypeIterator *hi, int what){
     }else if(hi->encoding == REDIS_ENCODING_HT){
         hashTypeCurrentFromHashTable(hi, what, &value);
         incrRefCount(value);
+    }else if(hi->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *vstr;
+        unsigned int vlen;
+
+        hashTypeCurrentFromHashpack(hi, what, &vstr, &vlen);
+        value = createStringObject((char *)vstr, vlen);
     }else{
         redisPainc("Unknown type");
     }
@@ -486,43 +740,584 @@ void hashTypeConvertZiplist(robj *o, int enc){
         free(o->ptr);
         o->ptr = d;
         o->encoding = REDIS_ENCODING_HT;
+    }else if(enc == REDIS_ENCODING_HASHPACK){
+        hashpack *hp = hashpackNew();
+        unsigned char *zl = o->ptr, *fptr, *vptr;
+
+        //Integer entries are printed, a packed hash only holds strings
+        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        while(fptr != NULL){
+            unsigned char *fstr, *vstr;
+            unsigned int flen, vlen;
+            long long fll, vll;
+            char fbuf[32], vbuf[32];
+
+            vptr = ziplistNext(zl, fptr);
+            redisAssert(vptr != NULL);
+            ziplistGet(fptr, &fstr, &flen, &fll);
+            ziplistGet(vptr, &vstr, &vlen, &vll);
+            if(fstr == NULL){
+                flen = ll2string(fbuf, sizeof(fbuf), fll);
+                fstr = (unsigned char*)fbuf;
+            }
+            if(vstr == NULL){
+                vlen = ll2string(vbuf, sizeof(vbuf), vll);
+                vstr = (unsigned char*)vbuf;
+            }
+            hashpackSet(hp, fstr, flen, vstr, vlen);
+            fptr = ziplistNext(zl, vptr);
+        }
+
+        zfree(o->ptr);
+        o->ptr = hp;
+        o->encoding = REDIS_ENCODING_HASHPACK;
     }else{
         redisPainc("Unknown type");
     }
 }
 
+/**
+ * Convert a packed hash to a hash table.
+ */
+void hashTypeConvertHashpack(robj *o, int enc){
+
+    redisAssert(o->encoding == REDIS_ENCODING_HASHPACK);
+
+    if(enc == REDIS_ENCODING_HT){
+        hashpack *hp = o->ptr;
+        dict *d = dictCreate(&hashDictType, NULL);
+        unsigned char *fstr, *vstr;
+        unsigned int flen, vlen;
+        uint32_t pos = 0;
+        int ret;
+
+        dictExpand(d, hashpackLen(hp));
+        while(hashpackNext(hp, &pos, &fstr, &flen, &vstr, &vlen)){
+            robj *key = createStringObject((char*)fstr, flen);
+            robj *value = createStringObject((char*)vstr, vlen);
+
+            key = tryObjectEncoding(key);
+            value = tryObjectEncoding(value);
+            ret = dictAdd(d, key, value);
+            redisAssert(ret == DICT_OK);
+        }
+
+        hashpackFree(hp);
+        o->ptr = d;
+        o->encoding = REDIS_ENCODING_HT;
+    }else if(enc == REDIS_ENCODING_ZIPLIST){
+        hashpack *hp = o->ptr;
+        unsigned int n = hashpackLen(hp) * 2, *lens = zmalloc(sizeof(unsigned int) * n), i = 0;
+        unsigned char **strs = zmalloc(sizeof(unsigned char*) * n);
+        uint32_t pos = 0;
+
+        //The strings point into the blob, which is alive until the ziplist is built
+        while(hashpackNext(hp, &pos, &strs[i], &lens[i], &strs[i+1], &lens[i+1])) i += 2;
+
+        o->ptr = ziplistRewrite(ziplistNew(), NULL, NULL, strs, lens, i);
+        o->encoding = REDIS_ENCODING_ZIPLIST;
+        hashpackFree(hp);
+        zfree(strs);
+        zfree(lens);
+    }else{
+        redisPanic("Unknown hash encoding");
+    }
+}
+
+/**
+ * Convert a hash table back to a compact encoding, once the hash has
+ * shrunk. Hashes with field TTLs stay hash tables.
+ */
+void hashTypeConvertDict(robj *o, int enc){
+    dict *d = o->ptr;
+    dictIterator *di;
+    dictEntry *de;
+
+    redisAssert(o->encoding == REDIS_ENCODING_HT && hashTypeExpires(o) == NULL);
+
+    if(enc == REDIS_ENCODING_ZIPLIST){
+        unsigned int n = dictSize(d) * 2, *lens = zmalloc(sizeof(unsigned int) * n), i = 0;
+        unsigned char **strs = zmalloc(sizeof(unsigned char*) * n);
+        robj **objs = zmalloc(sizeof(robj*) * n);
+
+        di = dictGetIterator(d);
+        while((de = dictNext(di)) != NULL){
+            objs[i] = getDecodedObject(dictGetKey(de));
+            objs[i+1] = getDecodedObject(dictGetVal(de));
+            strs[i] = objs[i]->ptr;
+            lens[i] = sdslen(objs[i]->ptr);
+            strs[i+1] = objs[i+1]->ptr;
+            lens[i+1] = sdslen(objs[i+1]->ptr);
+            i += 2;
+        }
+        dictReleaseIterator(di);
+
+        o->ptr = ziplistRewrite(ziplistNew(), NULL, NULL, strs, lens, i);
+        o->encoding = REDIS_ENCODING_ZIPLIST;
+
+        while(i--) decrRefCount(objs[i]);
+        zfree(objs);
+        zfree(strs);
+        zfree(lens);
+    }else if(enc == REDIS_ENCODING_HASHPACK){
+        hashpack *hp = hashpackNew();
+
+        di = dictGetIterator(d);
+        while((de = dictNext(di)) != NULL){
+            unsigned char *fstr, *vstr;
+            unsigned int flen, vlen;
+            char fbuf[32], vbuf[32];
+
+            fstr = hashTypeObjectBuffer(dictGetKey(de), fbuf, &flen);
+            vstr = hashTypeObjectBuffer(dictGetVal(de), vbuf, &vlen);
+            hashpackSet(hp, fstr, flen, vstr, vlen);
+        }
+        dictReleaseIterator(di);
+
+        o->ptr = hp;
+        o->encoding = REDIS_ENCODING_HASHPACK;
+    }else{
+        redisPanic("Unknown hash encoding");
+    }
+    dictRelease(d);
+}
+
+/**
+ * The encoding of a ziplist hash that has more than
+ * hash_max_ziplist_entries fields: a packed hash while the number of
+ * fields allows it, a hash table after that.
+ */
+int hashTypeGrownEncoding(robj *o){
+    return hashTypeLength(o) <= server.hash_max_hashpack_entries ?
+           REDIS_ENCODING_HASHPACK : REDIS_ENCODING_HT;
+}
+
 /**
  *  Do the encoding convert for hash object o.
- *  Current only working on ZIPLIST to HT. 
+ *  Writes only grow hashes: ZIPLIST to HASHPACK or HT, HASHPACK to HT.
+ *  The active compaction shrinks them back, see hashTypeTryCompaction().
  */ 
 void hashTypeConvert(robj *o, int enc){
 
     if(o->encoding == REDIS_ENCODING_ZIPLIST){
         hashTypeConvertZiplist(o, enc);
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        hashTypeConvertHashpack(o, enc);
     }else if(o->encoding == REDIS_ENCODING_HT){
-        redisPanic("Not implemented");
+        hashTypeConvertDict(o, enc);
     } else {
         redisPanic("Unknown hash encoding");
     }
 }
 
+/**
+ * Re-encode a hash whose number of fields has fallen well below the limit
+ * of a compact encoding: 1/REDIS_COMPACT_RATIO of it, so that a hash that
+ * shrinks and grows around the limit is not converted back and forth.
+ * Every field and value has to be short enough for the compact encoding.
+ *
+ * Returns 1 if the hash was converted.
+ */
+int hashTypeTryCompaction(robj *o){
+    unsigned long len = hashTypeLength(o);
+    int enc;
+
+    if(o->encoding == REDIS_ENCODING_ZIPLIST) return 0;
+    if(o->encoding == REDIS_ENCODING_HT && hashTypeExpires(o) != NULL) return 0;
+
+    if(len <= server.hash_max_ziplist_entries / REDIS_COMPACT_RATIO){
+        enc = REDIS_ENCODING_ZIPLIST;
+    }else if(o->encoding == REDIS_ENCODING_HT &&
+             len <= server.hash_max_hashpack_entries / REDIS_COMPACT_RATIO){
+        enc = REDIS_ENCODING_HASHPACK;
+    }else{
+        return 0;
+    }
+
+    if(o->encoding == REDIS_ENCODING_HT){
+        dictIterator *di = dictGetIterator(o->ptr);
+        dictEntry *de;
+        int fits = 1;
+
+        while(fits && (de = dictNext(di)) != NULL){
+            robj *field = dictGetKey(de), *value = dictGetVal(de);
+
+            if((sdsEncodedObject(field) && sdslen(field->ptr) > server.hash_max_ziplist_value) ||
+               (sdsEncodedObject(value) && sdslen(value->ptr) > server.hash_max_ziplist_value))
+                fits = 0;
+        }
+        dictReleaseIterator(di);
+        if(!fits) return 0;
+    }else{
+        unsigned char *fstr, *vstr;
+        unsigned int flen, vlen;
+        uint32_t pos = 0;
+
+        while(hashpackNext(o->ptr, &pos, &fstr, &flen, &vstr, &vlen)){
+            if(flen > server.hash_max_ziplist_value || vlen > server.hash_max_ziplist_value)
+                return 0;
+        }
+    }
+
+    hashTypeConvert(o, enc);
+    return 1;
+}
+
+/*------------------------------------------------------------
+ *          Hash field expires
+ *------------------------------------------------------------*/
+
+static unsigned int hashExpiresSdsHash(const void *key){
+    return dictGenHashFunction(key, sdslen((sds)key));
+}
+
+static int hashExpiresSdsKeyCompare(void *privdata, const void *key1, const void *key2){
+    size_t l1 = sdslen((sds)key1), l2 = sdslen((sds)key2);
+
+    DICT_NOTUSED(privdata);
+
+    if(l1 != l2) return 0;
+    return memcmp(key1, key2, l1) == 0;
+}
+
+static void hashExpiresSdsDestructor(void *privdata, void *key){
+    DICT_NOTUSED(privdata);
+    sdsfree(key);
+}
+
+/* Used both for the fields of a hashFieldExpires (value is the heap position)
+ * and for db->hash_expires (no value). The dict owns its sds keys. */
+static dictType hashExpiresSdsDictType = {
+    hashExpiresSdsHash,         /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    hashExpiresSdsKeyCompare,   /* key compare */
+    hashExpiresSdsDestructor,   /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Put e at position pos of the heap, and tell its dict entry where it is. */
+static void hashFieldExpiresPlace(hashFieldExpires *hfe, unsigned long pos, hashFieldExpireEntry e){
+    hfe->heap[pos] = e;
+    e.de->v.u64 = pos;
+}
+
+static void hashFieldExpiresSiftUp(hashFieldExpires *hfe, unsigned long pos){
+    hashFieldExpireEntry e = hfe->heap[pos];
+
+    while(pos > 0){
+        unsigned long parent = (pos-1)/2;
+
+        if(hfe->heap[parent].when <= e.when) break;
+        hashFieldExpiresPlace(hfe, pos, hfe->heap[parent]);
+        pos = parent;
+    }
+    hashFieldExpiresPlace(hfe, pos, e);
+}
+
+static void hashFieldExpiresSiftDown(hashFieldExpires *hfe, unsigned long pos){
+    hashFieldExpireEntry e = hfe->heap[pos];
+
+    while(1){
+        unsigned long child = pos*2+1;
+
+        if(child >= hfe->len) break;
+        if(child+1 < hfe->len && hfe->heap[child+1].when < hfe->heap[child].when)
+            child++;
+        if(e.when <= hfe->heap[child].when) break;
+        hashFieldExpiresPlace(hfe, pos, hfe->heap[child]);
+        pos = child;
+    }
+    hashFieldExpiresPlace(hfe, pos, e);
+}
+
+/* Remove the heap entry at pos together with its field. */
+static void hashFieldExpiresRemoveAt(hashFieldExpires *hfe, unsigned long pos){
+    sds field = dictGetKey(hfe->heap[pos].de);
+
+    hfe->len--;
+    if(pos != hfe->len){
+        hashFieldExpiresPlace(hfe, pos, hfe->heap[hfe->len]);
+        hashFieldExpiresSiftDown(hfe, pos);
+        hashFieldExpiresSiftUp(hfe, pos);
+    }
+    //The dict frees the field
+    dictDelete(hfe->fields, field);
+}
+
+/**
+ * Set the expire time of field, a unix time in milliseconds.
+ * The hash must be encoded as a hash table, the caller converts it.
+ */
+void hashTypeSetFieldExpire(robj *o, robj *field, long long when){
+    hashFieldExpires *hfe;
+    dictEntry *de;
+
+    redisAssert(o->encoding == REDIS_ENCODING_HT);
+
+    //The index is created with the first TTL of the hash
+    if((hfe = hashTypeExpires(o)) == NULL){
+        hfe = zmalloc(sizeof(*hfe));
+        hfe->fields = dictCreate(&hashExpiresSdsDictType, NULL);
+        hfe->heap = NULL;
+        hfe->len = hfe->alloc = 0;
+        ((dict*)o->ptr)->privdata = hfe;
+    }
+
+    field = getDecodedObject(field);
+    if((de = dictFind(hfe->fields, field->ptr)) != NULL){
+        unsigned long pos = dictGetUnsignedIntegerVal(de);
+        long long old = hfe->heap[pos].when;
+
+        hfe->heap[pos].when = when;
+        if(when < old)
+            hashFieldExpiresSiftUp(hfe, pos);
+        else
+            hashFieldExpiresSiftDown(hfe, pos);
+    }else{
+        if(hfe->len == hfe->alloc){
+            hfe->alloc = hfe->alloc ? hfe->alloc*2 : 4;
+            hfe->heap = zrealloc(hfe->heap, sizeof(hashFieldExpireEntry)*hfe->alloc);
+        }
+        de = dictAddRaw(hfe->fields, sdsdup(field->ptr));
+        hfe->heap[hfe->len].when = when;
+        hfe->heap[hfe->len].de = de;
+        hfe->len++;
+        hashFieldExpiresSiftUp(hfe, hfe->len-1);
+    }
+    decrRefCount(field);
+}
+
+/**
+ * Returns the expire time of field, or -1 when it has none.
+ */
+long long hashTypeGetFieldExpire(robj *o, robj *field){
+    hashFieldExpires *hfe;
+    dictEntry *de;
+
+    if(o->encoding != REDIS_ENCODING_HT || (hfe = hashTypeExpires(o)) == NULL)
+        return -1;
+
+    field = getDecodedObject(field);
+    de = dictFind(hfe->fields, field->ptr);
+    decrRefCount(field);
+
+    return de ? hfe->heap[dictGetUnsignedIntegerVal(de)].when : -1;
+}
+
+/**
+ * Make field persistent again.
+ * Returns 1 if it had an expire time, otherwise 0.
+ */
+int hashTypeRemoveFieldExpire(robj *o, robj *field){
+    hashFieldExpires *hfe;
+    dictEntry *de;
+
+    if(o->encoding != REDIS_ENCODING_HT || (hfe = hashTypeExpires(o)) == NULL)
+        return 0;
+
+    field = getDecodedObject(field);
+    de = dictFind(hfe->fields, field->ptr);
+    decrRefCount(field);
+    if(de == NULL) return 0;
+
+    hashFieldExpiresRemoveAt(hfe, dictGetUnsignedIntegerVal(de));
+
+    //Give the memory back as soon as no field has a TTL
+    if(hfe->len == 0) hashTypeReleaseExpires(o);
+    return 1;
+}
+
+/**
+ * Free the field expires of a hash table encoded hash, if any.
+ */
+void hashTypeReleaseExpires(robj *o){
+    hashFieldExpires *hfe = hashTypeExpires(o);
+
+    if(hfe == NULL) return;
+    dictRelease(hfe->fields);
+    zfree(hfe->heap);
+    zfree(hfe);
+    ((dict*)o->ptr)->privdata = NULL;
+}
+
+/**
+ * Remember that the hash at key has fields with a TTL, so the active
+ * expire cycle can find it. Does nothing for other objects.
+ */
+void hashTypeRegisterExpires(redisDb *db, robj *key, robj *o){
+    if(o->type != REDIS_HASH || o->encoding != REDIS_ENCODING_HT ||
+       hashTypeExpires(o) == NULL) return;
+
+    if(db->hash_expires == NULL)
+        db->hash_expires = dictCreate(&hashExpiresSdsDictType, NULL);
+    if(dictFind(db->hash_expires, key->ptr) == NULL)
+        dictAdd(db->hash_expires, sdsdup(key->ptr), NULL);
+}
+
+/* Send a HDEL for an expired field to the AOF and the slaves, like
+ * propagateExpire() does with a DEL for the keys. */
+static void propagateHashFieldExpire(redisDb *db, robj *key, robj *field){
+    static struct redisCommand *hdel = NULL;
+    robj *argv[3];
+
+    if(hdel == NULL) hdel = lookupCommandByCString("hdel");
+
+    argv[0] = createStringObject("HDEL", 4);
+    argv[1] = key;
+    argv[2] = field;
+    propagate(hdel, db->id, argv, 3, REDIS_PROPAGATE_AOF|REDIS_PROPAGATE_REPL);
+    decrRefCount(argv[0]);
+}
+
+/**
+ * Delete at most max fields of the hash o stored at key whose expire
+ * time is not after now, earliest first. The key is deleted when the
+ * hash ends up empty, so o must not be used after the call if the
+ * returned number of deleted fields is not zero.
+ */
+unsigned long hashTypeExpireFields(redisDb *db, robj *key, robj *o, long long now, unsigned long max){
+    hashFieldExpires *hfe;
+    unsigned long expired = 0;
+    int keyremoved = 0;
+
+    while(expired < max && (hfe = hashTypeExpires(o)) != NULL &&
+          hfe->heap[0].when <= now){
+        sds name = dictGetKey(hfe->heap[0].de);
+        robj *field = createStringObject(name, sdslen(name));
+
+        //hashTypeDelete() drops the heap entry too
+        hashTypeDelete(o, field);
+        propagateHashFieldExpire(db, key, field);
+        decrRefCount(field);
+        expired++;
+
+        if(hashTypeLength(o) == 0){
+            keyremoved = 1;
+            break;
+        }
+    }
+    if(expired == 0) return 0;
+
+    notifyKeyspaceEvent(REDIS_NOTIFY_HASH, "hexpired", key, db->id);
+    if(keyremoved){
+        dbDelete(db, key);
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", key, db->id);
+    }else if(hashTypeExpires(o) == NULL && db->hash_expires){
+        dictDelete(db->hash_expires, key->ptr);
+    }
+    signalModifiedKey(db, key);
+    return expired;
+}
+
+/**
+ * Called by the key lookups: delete the fields of the hash o stored at
+ * key that are already expired. Returns the hash, or NULL if no field
+ * was left and the key was deleted.
+ */
+robj *hashTypeExpireIfNeeded(redisDb *db, robj *key, robj *o){
+    hashFieldExpires *hfe;
+    long long now;
+
+    if(o->encoding != REDIS_ENCODING_HT || (hfe = hashTypeExpires(o)) == NULL)
+        return o;
+
+    /* Fields of a loading dataset are left alone, and slaves wait for the
+     * HDEL of their master, like expireIfNeeded() does for the keys. */
+    if(server.loading || server.masterhost != NULL) return o;
+
+    now = mstime();
+    if(hfe->heap[0].when > now) return o;
+
+    hashTypeExpireFields(db, key, o, now, ULONG_MAX);
+    return dictFetchValue(db->dict, key->ptr);
+}
+
+/**
+ * Incremental active expire of the hash fields, called by serverCron().
+ *
+ * Like activeExpireCycle() does for the keys, every database samples
+ * random hashes of db->hash_expires and expires a bounded number of
+ * fields of each of them, looping while enough of the samples had
+ * expired fields, and the whole cycle returns as soon as it used its
+ * share of CPU time.
+ */
+void activeExpireHashFieldsCycle(void){
+    static unsigned int current_db = 0;
+    long long start = ustime(), timelimit;
+    int j;
+
+    if(!server.active_expire_enabled || server.loading ||
+       server.masterhost != NULL) return;
+
+    timelimit = 1000000*ACTIVE_EXPIRE_HASH_FIELDS_TIME_PERC/server.hz/100;
+    if(timelimit <= 0) timelimit = 1;
+
+    for(j = 0; j < server.dbnum; j++){
+        redisDb *db = server.db+(current_db % server.dbnum);
+        unsigned long num, hits;
+
+        current_db++;
+        if(db->hash_expires == NULL) continue;
+
+        do{
+            long long now = mstime();
+
+            if((num = dictSize(db->hash_expires)) == 0) break;
+            if(num > ACTIVE_EXPIRE_HASH_FIELDS_LOOKUPS_PER_LOOP)
+                num = ACTIVE_EXPIRE_HASH_FIELDS_LOOKUPS_PER_LOOP;
+
+            hits = 0;
+            while(num--){
+                dictEntry *de = dictGetRandomKey(db->hash_expires);
+                sds name = dictGetKey(de);
+                robj *o = dictFetchValue(db->dict, name);
+                robj *key;
+
+                //The key was deleted, overwritten or lost its field TTLs
+                if(o == NULL || dbValueIsPacked(o) || o->type != REDIS_HASH ||
+                   o->encoding != REDIS_ENCODING_HT || hashTypeExpires(o) == NULL){
+                    dictDelete(db->hash_expires, name);
+                    continue;
+                }
+
+                key = createStringObject(name, sdslen(name));
+                if(hashTypeExpireFields(db, key, o, now, ACTIVE_EXPIRE_HASH_FIELDS_PER_KEY))
+                    hits++;
+                decrRefCount(key);
+            }
+
+            if(ustime()-start > timelimit) return;
+        }while(hits > ACTIVE_EXPIRE_HASH_FIELDS_LOOKUPS_PER_LOOP/4);
+    }
+}
+
 /**
  * Hash type Command
  */
-void hsetCommand(redisClient *c){
-    int update;
+
+/**
+ * Set the field/value pairs of HSET and HMSET.
+ * Returns the number of fields that were added, or -1 when an error was
+ * already sent to the client.
+ */
+static long hsetGenericCommand(redisClient *c){
+    unsigned long added;
     robj *o;
 
-    if((o = hashTypeLookupWirteOrCreate(c, c->argv[1])) == NULL) return;
+    if(c->argc < 4 || c->argc % 2 != 0){
+        //Name the command actually called, HSET or HMSET
+        addReplyErrorFormat(c, "wrong number of arguments for '%s' command",
+            (char*)c->argv[0]->ptr);
+        return -1;
+    }
 
-    hashTypeTryConversion(o, c->argv, 2, 3);
-    
-    c->argv[2] = tryObjectEncoding(c->argv[2]);
-    c->argv[3] = tryObjectEncoding(c->argv[3]);
+    if((o = hashTypeLookupWirteOrCreate(c, c->argv[1])) == NULL) return -1;
 
-    update = hashTypeSet(o, c->argv[2], c->argv[3]);
+    //Check the inputs are they exceeds the limit of the node size
+    hashTypeTryConversion(o, c->argv, 2, c->argc - 1);
 
-    addReply(c, update ? shared.czero : shared.cone);
+    added = hashTypeSetMulti(o, c->argv, 2, c->argc - 1);
 
     //Send the signal
     signalModifiedKey(c->db, c->argv[1]);
@@ -532,6 +1327,18 @@ void hsetCommand(redisClient *c){
 
     //incr the server dirty
     server.dirty++;
+    return added;
+}
+
+/**
+ * HSET key field value [field value ...]
+ * Replies with the number of fields that were added.
+ */
+void hsetCommand(redisClient *c){
+    long added;
+
+    if((added = hsetGenericCommand(c)) == -1) return;
+    addReplyLongLong(c, added);
 }
 
 /**
@@ -589,57 +1396,102 @@ void hsetnxCommand(redisClient *c){
 }
 
 void hmsetCommand(redisClient *c){
-    
-    int i;
-    robj *o;
+    if(hsetGenericCommand(c) == -1) return;
 
-    if(c->argc % 2 != 0){
-        addReplyError(c, "wrong number of arguments for HMSET");
-        return;
-    }
+    //Send the reply to the client 
+    addReply(c, shared.ok);
+}
 
-    if((o = hashTypeLookupWirteOrCreate(c, c->argv[1])) == NULL) return;
+/**
+ * Create the integer object of a hash field. It is never a shared
+ * integer, so HINCRBY can update it in place later.
+ */
+static robj *createHashIntegerObject(long long value){
+    robj *o;
 
-    //Check the inputs are they exceeds the limit of the node size
-    hashTypeTryConversion(o, c->argv, 2, c->argc - 1);
-    
-    for(i = 2; i < c->argc; i += 2){
-        hashTypeTryObjectEncoding(o, &c->argv[i], &c->argv[i+1]);
-        hashTypeSet(o, c->argv[i], c->argv[i+1]);
-    }
+    if(value < LONG_MIN || value > LONG_MAX)
+        return createStringObjectFromLongLong(value);
 
-    //Send the reply to the client 
-    addReply(c, shared.ok);
+    o = createObject(REDIS_STRING, NULL);
+    o->encoding = REDIS_ENCODING_INT;
+    o->ptr = (void*)((long)value);
+    return o;
+}
 
-    //Send the key modified signal
-    signalModifiedKey(c->db, c->argv[1]);
+/**
+ * Replace the value of a field that already exists, reached through its
+ * ziplist value entry vptr or its dict entry de. Unlike hashTypeSet()
+ * the field is not searched again, and it keeps its TTL.
+ *
+ * The ziplist may be reallocated or converted, vptr is invalid after
+ * the call.
+ */
+static void hashTypeOverwriteValue(robj *o, unsigned char *vptr, dictEntry *de, robj *value){
+    if(o->encoding == REDIS_ENCODING_ZIPLIST){
+        unsigned char *zl = o->ptr;
 
-    //Send event notification
-    notifyKeyspaceEvent(REDIS_NOTIFY_HASH, "hset", c->argv[1], c->db->id);
+        value = getDecodedObject(value);
+        zl = ziplistDelete(zl, &vptr);
+        zl = ziplistInsert(zl, vptr, value->ptr, sdslen(value->ptr));
+        o->ptr = zl;
 
-    //set the db as dirty
-    server.dirty++;
+        if(sdslen(value->ptr) > server.hash_max_ziplist_value)
+            hashTypeConvert(o, REDIS_ENCODING_HT);
+        decrRefCount(value);
+    }else if(o->encoding == REDIS_ENCODING_HT){
+        incrRefCount(value);
+        decrRefCount(dictGetVal(de));
+        de->v.val = value;
+    }else{
+        redisPanic("Unknown hash encoding");
+    }
 }
 
 void hincrbyCommand(redisClient *c){
     
-    long long value, incr, oldvalue;
-    robj *o, *current, *new;
+    long long value = 0, incr, oldvalue;
+    robj *o, *current = NULL, *new;
+    unsigned char *vptr = NULL;
+    dictEntry *de = NULL;
 
     if(getLongLongFromObjectOrReply(c, c->argv[3], &incr, NULL) == REDIS_ERR) return;
 
     if((o = hashTypeLookupWirteOrCreate(c, c->argv[1])) == NULL) return;
 
-    //check if current field related value is existed.
-    if((current = hashTypeGetObject(o, c->argv[2])) != NULL){
-        //get the value 
-        if(getLongLongFromObjectOrReply(c, current, &value, "hash value is not an integer") != REDIS_OK){
-            decrRefCount(current);
+    //Find the field only once, the same entry is updated below
+    if(o->encoding == REDIS_ENCODING_ZIPLIST){
+        if((vptr = hashTypeZiplistFindValue(o, c->argv[2])) != NULL){
+            unsigned char *vstr = NULL;
+            unsigned int vlen = UINT_MAX;
+            long long vll = LLONG_MAX;
+
+            ziplistGet(vptr, &vstr, &vlen, &vll);
+            if(vstr == NULL){
+                value = vll;
+            }else if(!string2ll((char*)vstr, vlen, &value)){
+                addReplyError(c, "hash value is not an integer");
+                return;
+            }
+        }
+    }else if(o->encoding == REDIS_ENCODING_HT){
+        if((de = dictFind(o->ptr, c->argv[2])) != NULL){
+            current = dictGetVal(de);
+            if(getLongLongFromObjectOrReply(c, current, &value, "hash value is not an integer") != REDIS_OK)
+                return;
+        }
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *vstr;
+        unsigned int vlen;
+
+        if(hashTypeGetFromHashpack(o, c->argv[2], &vstr, &vlen) == 0 &&
+           !string2ll((char*)vstr, vlen, &value)){
+            addReplyError(c, "hash value is not an integer");
             return;
         }
     }else{
-        value = 0;
+        redisPanic("Unknown hash encoding");
     }
+
     //Check if the incr operation will cause over-flow
     oldvalue = value;
     if((oldvalue < 0 && incr < 0 && incr < (LLONG_MIN - oldvalue)) ||
@@ -648,12 +1500,32 @@ void hincrbyCommand(redisClient *c){
            return;
        }
     value = value + incr;
-    //Create a object from the value
-    new = createStringObjectFromLongLong(value);
-    tryObjectEncoding(o, c->argv[2]);
-    //Associate the new value with the key
-    hashTypeSet(o, c->argv[2], new);
-    decrRefCount(new);
+
+    if(vptr != NULL){
+        //The counter still fits its entry: overwrite the integer in the ziplist
+        if(!ziplistReplaceInteger(vptr, value)){
+            new = createStringObjectFromLongLong(value);
+            hashTypeOverwriteValue(o, vptr, NULL, new);
+            decrRefCount(new);
+        }
+    }else if(de != NULL){
+        //An integer object only this field uses is updated in place
+        if(current->encoding == REDIS_ENCODING_INT && current->refcount == 1 &&
+           value >= LONG_MIN && value <= LONG_MAX){
+            current->ptr = (void*)((long)value);
+        }else{
+            new = createHashIntegerObject(value);
+            hashTypeOverwriteValue(o, NULL, de, new);
+            decrRefCount(new);
+        }
+    }else{
+        //A new field, or a packed hash, where hashpackSet() replaces the
+        //value in place
+        new = createHashIntegerObject(value);
+        hashTypeTryObjectEncoding(o, &c->argv[2], NULL);
+        hashTypeSet(o, c->argv[2], new);
+        decrRefCount(new);
+    }
 
     //Returns the result as reply
     addReplyLongLong(c, value);
@@ -668,22 +1540,54 @@ void hincrbyCommand(redisClient *c){
 }
 
 void hincrbyfloatCommand(redisClient *c){
-    long double incr, value;
-    robj *o, *new, *old, *aux;
+    long double incr, value = 0.0;
+    robj *o, *new, *aux;
+    unsigned char *vptr = NULL;
+    dictEntry *de = NULL;
 
     if(getLongDoubleFromObjectOrReply(c, c->argv[3], &incr, NULL) != REDIS_OK) return;
 
     if((o = hashTypeLookupWirteOrCreate(c, c->argv[1])) == NULL) return;
 
-    if((old = hashTypeGetObject(o, c->argv[2])) != NULL){
-        //Try this value if it is a double
-        if(getLongDoubleFromObjectOrReply(c, old, &value, "hash value is not an double") != REDIS_OK){
+    //Find the field only once, the same entry is updated below
+    if(o->encoding == REDIS_ENCODING_ZIPLIST){
+        if((vptr = hashTypeZiplistFindValue(o, c->argv[2])) != NULL){
+            unsigned char *vstr = NULL;
+            unsigned int vlen = UINT_MAX;
+            long long vll = LLONG_MAX;
+
+            ziplistGet(vptr, &vstr, &vlen, &vll);
+            if(vstr == NULL){
+                value = vll;
+            }else{
+                //Try this value if it is a double
+                robj *old = createStringObject((char*)vstr, vlen);
+                int ret = getLongDoubleFromObjectOrReply(c, old, &value, "hash value is not an double");
+
+                decrRefCount(old);
+                if(ret != REDIS_OK) return;
+            }
+        }
+    }else if(o->encoding == REDIS_ENCODING_HT){
+        if((de = dictFind(o->ptr, c->argv[2])) != NULL){
+            if(getLongDoubleFromObjectOrReply(c, dictGetVal(de), &value, "hash value is not an double") != REDIS_OK)
+                return;
+        }
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *vstr;
+        unsigned int vlen;
+
+        if(hashTypeGetFromHashpack(o, c->argv[2], &vstr, &vlen) == 0){
+            robj *old = createStringObject((char*)vstr, vlen);
+            int ret = getLongDoubleFromObjectOrReply(c, old, &value, "hash value is not an double");
+
             decrRefCount(old);
-            return;
+            if(ret != REDIS_OK) return;
         }
     }else{
-        value = 0.0;
+        redisPanic("Unknown hash encoding");
     }
+
     //do the add oepration
     value += incr;
     if(isnan(value) || isinf(value)){
@@ -692,9 +1596,13 @@ void hincrbyfloatCommand(redisClient *c){
     }
     new = createStringObjectFromLongDouble(value);
 
-    tryObjectEncoding(o, c->argv[2]);
     //Associate the new value with the key
-    hashTypeSet(o, c->argv[2], new);
+    if(vptr != NULL || de != NULL){
+        hashTypeOverwriteValue(o, vptr, de, new);
+    }else{
+        hashTypeTryObjectEncoding(o, &c->argv[2], NULL);
+        hashTypeSet(o, c->argv[2], new);
+    }
 
     //Returns the result as reply
     addReplyBulk(c, new);
@@ -756,6 +1664,15 @@ static void addHashFieldToReply(redisClient *c, robj *o, robj *field){
         }else{
             addReplyBulk(c, value);
         }
+    }else if(o->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *vstr;
+        unsigned int vlen;
+
+        if(hashTypeGetFromHashpack(o, field, &vstr, &vlen) < 0){
+            addReply(c, shared.nullbulk);
+        }else{
+            addReplyBulkCBuffer(c, vstr, vlen);
+        }
     }else{
         redisPanic("Unknown hash encoding");
     }
@@ -765,7 +1682,7 @@ void hgetCommand(redisClient *c){
     robj *o;
 
     if((o = lookupKeyReadOrReply(c, c->argv[1], shared.nullbulk)) == NULL ||
-       chechType(c, REDIS_HASH)) return;
+       checkType(c, o, REDIS_HASH)) return;
     
     //Get and return the value
     addHashFieldToReply(c, o, c->argv[2]);
@@ -779,11 +1696,11 @@ void hmgetCommand(redisClient *c){
      * Don't abort when the key cannot be found. Non-existing keys are empty hashes,
      * when HMGET should respond with a series of full bulks.
      */ 
-    if((o = lookupKeyRead(c->db, c->argv[])) == NULL ||
-        chechType(c, o, REDIS_HASH)) return;
+    o = lookupKeyRead(c->db, c->argv[1]);
+    if(o != NULL && checkType(c, o, REDIS_HASH)) return;
     
     //Get mutiple field value
-    addReplyMultiBulkLen(c. c->argc-2);
+    addReplyMultiBulkLen(c, c->argc-2);
     for(i = 2; i < c->argc; i++){
         addHashFieldToReply(c, o, c->argv[i]);
     }
@@ -852,18 +1769,13 @@ static void addHashIteratorCursorToReply(redisClient *c, hashTypeIterator *hi, i
     //use different function to return to client but the `hashTypeCurrent` only returns object
     //This may be the reason.
     if(hi->encoding == REDIS_ENCODING_ZIPLIST){
-        unsigned char *vstr = NULL;
-        unsigned int len = UINT_MAX;
-        long long vll = LLONG_MAX;
-        
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &len, &vll);
-
-        if(vstr){
-            addReplyBulkCBuffer(c, vstr, vlen);
-        }else{
-            addReplyBulkLongLong(c, vll);
-        }
+        addReplyBulkZiplistEntry(c, (what & REDIS_HASH_KEY) ? hi->fptr : hi->vptr);
+    }else if(hi->encoding == REDIS_ENCODING_HASHPACK){
+        unsigned char *vstr;
+        unsigned int vlen;
 
+        hashTypeCurrentFromHashpack(hi, what, &vstr, &vlen);
+        addReplyBulkCBuffer(c, vstr, vlen);
     }else if(hi->encoding == REDIS_ENCODING_HT){
         robj *o = NULL;
         hashTypeCurrentFromHashTable(hi, what, &o);
@@ -876,34 +1788,58 @@ static void addHashIteratorCursorToReply(redisClient *c, hashTypeIterator *hi, i
 
 void genericHgetallCommand(redisClient *c, int flags){
     robj *o;
-    hashTypeIterator *hi;
     int multiplier = 0;
-    int length, count = 0
+    unsigned long length, count = 0;
 
     if((o = lookupKeyReadOrReply(c, c->argv[1], shared.emptymultibulk)) == NULL ||
-        chechType(o, REDIS_HASH)) return;
-    
-    hi = hashTypeInitIterator(o);
+        checkType(c, o, REDIS_HASH)) return;
 
     //Caculate how much item i need to get
     if(flags & REDIS_HASH_KEY) multiplier++;
     if(flags & REDIS_HASH_VALUE) multiplier++;
 
+    //The length is known up front, so the header is sent first and the
+    //items follow in a single pass
     length = hashTypeLength(o) * multiplier;
+    addReplyMultiBulkLen(c, length);
+
+    if(o->encoding == REDIS_ENCODING_ZIPLIST){
+        /* Walk the ziplist pairs directly: no iterator is allocated and
+         * every entry is copied from the ziplist into the reply. */
+        unsigned char *zl = o->ptr;
+        unsigned char *fptr = ziplistIndex(zl, ZIPLIST_HEAD), *vptr;
+
+        while(fptr != NULL){
+            vptr = ziplistNext(zl, fptr);
+            redisAssert(vptr != NULL);
 
-    while(hashTypeNext(hi) != REDIS_ERR){
-        if(flags & REDIS_HASH_KEY){
-            addHashIteratorCursorToReply(c, hi, REDIS_HASH_KEY);
-            count++
+            if(flags & REDIS_HASH_KEY){
+                addReplyBulkZiplistEntry(c, fptr);
+                count++;
+            }
+            if(flags & REDIS_HASH_VALUE){
+                addReplyBulkZiplistEntry(c, vptr);
+                count++;
+            }
+            fptr = ziplistNext(zl, vptr);
         }
-        if(flag &REDIS_HASH_VALUE){
-            addHashIteratorCursorToReply(c, hi, REDIS_HASH_VALUE);
-            count++
+    }else{
+        hashTypeIterator *hi = hashTypeInitIterator(o);
+
+        while(hashTypeNext(hi) != REDIS_ERR){
+            if(flags & REDIS_HASH_KEY){
+                addHashIteratorCursorToReply(c, hi, REDIS_HASH_KEY);
+                count++;
+            }
+            if(flags & REDIS_HASH_VALUE){
+                addHashIteratorCursorToReply(c, hi, REDIS_HASH_VALUE);
+                count++;
+            }
         }
-    }
 
         // 释放迭代器
-    hashTypeReleaseIterator(hi);
+        hashTypeReleaseIterator(hi);
+    }
     redisAssert(count == length);
 }
 
@@ -928,6 +1864,240 @@ void hexistsCommand(redisClient *c){
     addReply(c, hashTypeExists(o, c->argv[2]) ? shared.cone : shared.czero);
 }
 
+/*------------------------------------------------------------
+ *          Hash field expire commands
+ *------------------------------------------------------------*/
+
+#define HASH_EXPIRE_NX (1<<0)   /* Set only if the field has no TTL */
+#define HASH_EXPIRE_XX (1<<1)   /* Set only if the field has a TTL */
+#define HASH_EXPIRE_GT (1<<2)   /* Set only if greater than the current TTL */
+#define HASH_EXPIRE_LT (1<<3)   /* Set only if less than the current TTL */
+
+/**
+ * Parse the FIELDS numfields field [field ...] arguments starting at
+ * argv[j]. Returns the index of the first field, or -1 after sending an
+ * error to the client.
+ */
+static int hashFieldsArgsOrReply(redisClient *c, int j){
+    long long numfields;
+
+    if(j+1 >= c->argc || strcasecmp(c->argv[j]->ptr, "fields")){
+        addReply(c, shared.syntaxerr);
+        return -1;
+    }
+    if(getLongLongFromObjectOrReply(c, c->argv[j+1], &numfields, NULL) != REDIS_OK)
+        return -1;
+    if(numfields <= 0 || numfields != c->argc-j-2){
+        addReplyError(c, "numfields must be positive and match the number of fields");
+        return -1;
+    }
+    return j+2;
+}
+
+/**
+ * HEXPIRE key seconds [NX|XX|GT|LT] FIELDS numfields field [field ...]
+ * HPEXPIRE key milliseconds [NX|XX|GT|LT] FIELDS numfields field [field ...]
+ * HEXPIREAT key unix-time-seconds [NX|XX|GT|LT] FIELDS numfields field [field ...]
+ * HPEXPIREAT key unix-time-milliseconds [NX|XX|GT|LT] FIELDS numfields field [field ...]
+ *
+ * 'basetime' is added to the time, it is the current time for the relative
+ * forms and 0 for the absolute ones.
+ *
+ * Replies for every field: -2 if it does not exist, 0 if the condition
+ * was not met, 1 if the TTL was set, 2 if the field was deleted because
+ * the time is already reached.
+ */
+void hexpireGenericCommand(redisClient *c, long long basetime, int unit){
+    robj *o;
+    long long when, now = mstime();
+    int j = 3, first, flags = 0, set = 0, deleted = 0, keyremoved = 0;
+
+    if(getLongLongFromObjectOrReply(c, c->argv[2], &when, NULL) != REDIS_OK)
+        return;
+    //The time must stay representable in milliseconds once made absolute
+    if(when < 0 || (unit == UNIT_SECONDS && when > LLONG_MAX / 1000)){
+        addReplyError(c, "invalid expire time");
+        return;
+    }
+    if(unit == UNIT_SECONDS) when *= 1000;
+    if(when > LLONG_MAX - basetime){
+        addReplyError(c, "invalid expire time");
+        return;
+    }
+    when += basetime;
+
+    if(j < c->argc){
+        char *opt = c->argv[j]->ptr;
+
+        if(!strcasecmp(opt, "nx")) flags = HASH_EXPIRE_NX;
+        else if(!strcasecmp(opt, "xx")) flags = HASH_EXPIRE_XX;
+        else if(!strcasecmp(opt, "gt")) flags = HASH_EXPIRE_GT;
+        else if(!strcasecmp(opt, "lt")) flags = HASH_EXPIRE_LT;
+        if(flags) j++;
+    }
+    if((first = hashFieldsArgsOrReply(c, j)) == -1) return;
+
+    o = lookupKeyWrite(c->db, c->argv[1]);
+    if(o != NULL && checkType(c, o, REDIS_HASH)) return;
+
+    addReplyMultiBulkLen(c, c->argc-first);
+    for(j = first; j < c->argc; j++){
+        long long current;
+
+        if(o == NULL || !hashTypeExists(o, c->argv[j])){
+            addReplyLongLong(c, -2);
+            continue;
+        }
+
+        //A field without a TTL never expires, so it is never less than when
+        current = hashTypeGetFieldExpire(o, c->argv[j]);
+        if((flags & HASH_EXPIRE_NX && current != -1) ||
+           (flags & HASH_EXPIRE_XX && current == -1) ||
+           (flags & HASH_EXPIRE_GT && (current == -1 || when <= current)) ||
+           (flags & HASH_EXPIRE_LT && current != -1 && when >= current)){
+            addReplyLongLong(c, 0);
+            continue;
+        }
+
+        if(when <= now){
+            hashTypeDelete(o, c->argv[j]);
+            deleted++;
+            addReplyLongLong(c, 2);
+            if(hashTypeLength(o) == 0){
+                dbDelete(c->db, c->argv[1]);
+                keyremoved = 1;
+                o = NULL;
+            }
+        }else{
+            //Only hash tables carry field TTLs
+            if(o->encoding != REDIS_ENCODING_HT)
+                hashTypeConvert(o, REDIS_ENCODING_HT);
+            hashTypeSetFieldExpire(o, c->argv[j], when);
+            set++;
+            addReplyLongLong(c, 1);
+        }
+    }
+
+    if(o != NULL && set) hashTypeRegisterExpires(c->db, c->argv[1], o);
+
+    if(set || deleted){
+        signalModifiedKey(c->db, c->argv[1]);
+        if(set)
+            notifyKeyspaceEvent(REDIS_NOTIFY_HASH, "hexpire", c->argv[1], c->db->id);
+        if(deleted)
+            notifyKeyspaceEvent(REDIS_NOTIFY_HASH, "hdel", c->argv[1], c->db->id);
+        if(keyremoved)
+            notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", c->argv[1], c->db->id);
+        server.dirty += set + deleted;
+
+        /* Propagate the absolute time, so that the replicas and the AOF
+         * expire the fields when the master does, not one replication
+         * delay or one restart later. */
+        if(unit != UNIT_MILLISECONDS || basetime != 0){
+            robj *aux = createStringObject("HPEXPIREAT", 10);
+
+            rewriteClientCommandArgument(c, 0, aux);
+            decrRefCount(aux);
+            aux = createStringObjectFromLongLong(when);
+            rewriteClientCommandArgument(c, 2, aux);
+            decrRefCount(aux);
+        }
+    }
+}
+
+void hexpireCommand(redisClient *c){
+    hexpireGenericCommand(c, mstime(), UNIT_SECONDS);
+}
+
+void hpexpireCommand(redisClient *c){
+    hexpireGenericCommand(c, mstime(), UNIT_MILLISECONDS);
+}
+
+void hexpireatCommand(redisClient *c){
+    hexpireGenericCommand(c, 0, UNIT_SECONDS);
+}
+
+void hpexpireatCommand(redisClient *c){
+    hexpireGenericCommand(c, 0, UNIT_MILLISECONDS);
+}
+
+/**
+ * HTTL key FIELDS numfields field [field ...]
+ * HPTTL key FIELDS numfields field [field ...]
+ *
+ * Replies for every field: -2 if it does not exist, -1 if it has no TTL,
+ * otherwise the remaining time to live.
+ */
+void httlGenericCommand(redisClient *c, int output_ms){
+    robj *o;
+    long long now = mstime();
+    int j, first;
+
+    if((first = hashFieldsArgsOrReply(c, 2)) == -1) return;
+
+    o = lookupKeyRead(c->db, c->argv[1]);
+    if(o != NULL && checkType(c, o, REDIS_HASH)) return;
+
+    addReplyMultiBulkLen(c, c->argc-first);
+    for(j = first; j < c->argc; j++){
+        long long when, ttl;
+
+        if(o == NULL || !hashTypeExists(o, c->argv[j])){
+            addReplyLongLong(c, -2);
+            continue;
+        }
+        if((when = hashTypeGetFieldExpire(o, c->argv[j])) == -1){
+            addReplyLongLong(c, -1);
+            continue;
+        }
+        ttl = when - now;
+        if(ttl < 0) ttl = 0;
+        addReplyLongLong(c, output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+void httlCommand(redisClient *c){
+    httlGenericCommand(c, 0);
+}
+
+void hpttlCommand(redisClient *c){
+    httlGenericCommand(c, 1);
+}
+
+/**
+ * HPERSIST key FIELDS numfields field [field ...]
+ *
+ * Replies for every field: -2 if it does not exist, -1 if it has no TTL,
+ * 1 if the TTL was removed.
+ */
+void hpersistCommand(redisClient *c){
+    robj *o;
+    int j, first, removed = 0;
+
+    if((first = hashFieldsArgsOrReply(c, 2)) == -1) return;
+
+    o = lookupKeyWrite(c->db, c->argv[1]);
+    if(o != NULL && checkType(c, o, REDIS_HASH)) return;
+
+    addReplyMultiBulkLen(c, c->argc-first);
+    for(j = first; j < c->argc; j++){
+        if(o == NULL || !hashTypeExists(o, c->argv[j])){
+            addReplyLongLong(c, -2);
+        }else if(hashTypeRemoveFieldExpire(o, c->argv[j])){
+            removed++;
+            addReplyLongLong(c, 1);
+        }else{
+            addReplyLongLong(c, -1);
+        }
+    }
+
+    if(removed){
+        signalModifiedKey(c->db, c->argv[1]);
+        notifyKeyspaceEvent(REDIS_NOTIFY_HASH, "hpersist", c->argv[1], c->db->id);
+        server.dirty += removed;
+    }
+}
+
 void hscanCommand(redisClient *c){
 
 }
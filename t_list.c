@@ -23,6 +23,98 @@ void listTypeTryConversion(robj *subject, robj *value){
 		listTypeConvert(subject, REDIS_ENCODING_LINKEDLIST);
 }
 
+/*-------------------------------------------------------------------------------------------
+ *					Linked list index
+ *------------------------------------------------------------------------------------------*/
+
+/**
+ * A linked list keeps a chunkIndex of its nodes, so that LINDEX, LSET, LRANGE and
+ * LINSERT reach a node in O(log N) instead of walking from the nearest end.
+ *
+ * The index is built on the first access by position that is not at one of the
+ * ends. Every change of the nodes goes through the functions below, that keep it
+ * in sync. It lives in the listTypeList wrapper, not in the adlist list.
+ */
+
+/**
+ * Create the list of a linked list encoded list object, it frees its values
+ * with decrRefCount().
+ */
+list *listTypeCreateList(void){
+	listTypeList *tl = zmalloc(sizeof(*tl));
+	list *l = &tl->l;
+
+	l->head = l->tail = NULL;
+	l->len = 0;
+	l->dup = NULL;
+	l->free = NULL;
+	l->match = NULL;
+	listSetFreeMethod(l, decrRefCountVoid);
+	tl->index = NULL;
+	return l;
+}
+
+/**
+ * Release the list of a linked list encoded list object, with its index.
+ */
+void listTypeReleaseList(list *l){
+	chunkIndexRelease(listTypeListIndex(l));
+	listRelease(l);
+}
+
+/**
+ * Return the node at 'index' of a linked list, negative indexes count from the tail.
+ * Returns NULL when the index is out of range.
+ */
+listNode *listTypeIndexNode(list *l, long index){
+	unsigned long len = listLength(l);
+
+	if(index < 0) index += (long)len;
+	if(index < 0 || (unsigned long)index >= len) return NULL;
+
+	//The ends need no index
+	if(index == 0) return listFirst(l);
+	if((unsigned long)index == len-1) return listLast(l);
+
+	if(listTypeListIndex(l) == NULL) listTypeListIndex(l) = chunkIndexCreate(l);
+	return chunkIndexNode(listTypeListIndex(l), index);
+}
+
+/**
+ * Link a new node holding 'value' at the head or the tail of a linked list.
+ */
+static void listTypeLinkedPush(list *l, robj *value, int where){
+	if(where == REDIS_HEAD){
+		listAddNodeHead(l, value);
+		if(listTypeListIndex(l)) chunkIndexInsert(listTypeListIndex(l), 0, listFirst(l));
+	}else{
+		listAddNodeTail(l, value);
+		if(listTypeListIndex(l)) chunkIndexInsert(listTypeListIndex(l), listLength(l)-1, listLast(l));
+	}
+}
+
+/**
+ * Link a new node holding 'value' before or after the node ln, which is at
+ * position 'index'.
+ */
+static void listTypeLinkedInsert(list *l, listNode *ln, long index, robj *value, int after){
+	listInsertNode(l, ln, value, after);
+	if(listTypeListIndex(l)){
+		if(after)
+			chunkIndexInsert(listTypeListIndex(l), index+1, ln->next);
+		else
+			chunkIndexInsert(listTypeListIndex(l), index, ln->prev);
+	}
+}
+
+/**
+ * Unlink and free the node ln, which is at position 'index'.
+ */
+static void listTypeLinkedDelete(list *l, listNode *ln, long index){
+	if(listTypeListIndex(l)) chunkIndexDelete(listTypeListIndex(l), index, ln);
+	listDelNode(l, ln);
+}
+
 /**
  * This function pushes an element to the specified list object 'subject', at head
  * or tail position as specified by 'where'.
@@ -58,10 +150,7 @@ void listTypePush(robj *subject, robj *value, int where){
 		//So we decrRef the value object counter.
 		decrRefCount(value);	
 	}else if(subject->encoding == REDIS_ENCODING_LINKEDLIST){
-		if(where == REDIS_HEAD)
-			listAddNodeHead(subject->ptr, value);
-		else
-			listAddNodeTail(subject->ptr, value);
+		listTypeLinkedPush(subject->ptr, value, where);
 		//But for the linked list, it is different, linked list entry has an value field, 
 		//which never do the copy work, they point to the same value object, so we need 
 		//to increment the value object counter. 
@@ -118,7 +207,7 @@ robj *listTypePop(robj *subject, int where){
 		if(ln != NULL){
 			value = listNodeValue(ln);
 			incrRefCount(value);
-			listDelNode(list, ln);
+			listTypeLinkedDelete(list, ln, where == REDIS_HEAD ? 0 : listLength(list)-1);
 		}
 	}else{
 		redisPanic("Unknown list encoding");	
@@ -126,6 +215,58 @@ robj *listTypePop(robj *subject, int where){
 	return value;
 }
 
+/**
+ * Pop up to 'count' elements from the head or the tail of the list into 'values',
+ * in the order they are popped, and return how many were popped. The caller owns
+ * a reference to each of them.
+ *
+ * A ziplist loses all of them with a single ziplistDeleteRange(), and the index
+ * of a linked list is updated once for the whole range.
+ */
+unsigned long listTypePopMany(robj *subject, int where, unsigned long count, robj **values){
+	unsigned long len = listTypeLength(subject), j;
+
+	if(count > len) count = len;
+	if(count == 0) return 0;
+
+	if(subject->encoding == REDIS_ENCODING_ZIPLIST){
+		unsigned char *zl = subject->ptr, *p, *vstr;
+		unsigned int vlen;
+		long long vlong;
+
+		p = ziplistIndex(zl, (where == REDIS_HEAD) ? 0 : -1);
+		for(j = 0; j < count; j++){
+			ziplistGet(p, &vstr, &vlen, &vlong);
+			if(vstr){
+				values[j] = createStringObject((char *)vstr, vlen);
+			}else{
+				values[j] = createStringObjectFromLongLong(vlong);
+			}
+			p = (where == REDIS_HEAD) ? ziplistNext(zl, p) : ziplistPrev(zl, p);
+		}
+		subject->ptr = ziplistDeleteRange(zl, (where == REDIS_HEAD) ? 0 : len - count, count);
+	}else if(subject->encoding == REDIS_ENCODING_LINKEDLIST){
+		list *l = subject->ptr;
+		listNode *ln;
+
+		for(j = 0; j < count; j++){
+			ln = (where == REDIS_HEAD) ? listFirst(l) : listLast(l);
+			values[j] = listNodeValue(ln);
+			incrRefCount(values[j]);
+			listDelNode(l, ln);
+		}
+		if(listTypeListIndex(l)){
+			if(where == REDIS_HEAD)
+				chunkIndexDeleteRange(listTypeListIndex(l), 0, count, listFirst(l));
+			else
+				chunkIndexDeleteRange(listTypeListIndex(l), listLength(l), count, NULL);
+		}
+	}else{
+		redisPanic("Unknown list encoding");
+	}
+	return count;
+}
+
 /**
  * Return the number of nodes
  */
@@ -150,14 +291,15 @@ listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char
 	it->subject = subject;	
 	it->encoding = subject->encoding;
 	it->direction = direction;
+	it->index = index < 0 ? index + (long)listTypeLength(subject) : index;
 	if(subject->encoding == REDIS_ENCODING_ZIPLIST){
-		it->zi = listIndex(subject->ptr, index);
+		it->zi = ziplistIndex(subject->ptr, index);
 	}else if(subject->encoding == REDIS_ENCODING_LINKEDLIST){
-		it->ln = listIndex(subject->ptr, index);
+		it->ln = listTypeIndexNode(subject->ptr, index);
 	}else{
 		redisPanic("Unknown list encoding");	
 	}
-	return li;
+	return it;
 }
 
 /**
@@ -177,6 +319,7 @@ int listTypeNext(listTypeIterator *li, listTypeEntry *entry){
 	redisAssert(li->subject->encoding == li->encoding);
 
 	entry->li = li;
+	entry->index = li->index;
 	if(li->encoding == REDIS_ENCODING_ZIPLIST){
 		//Record current position
 		entry->zi = li->zi;
@@ -197,8 +340,10 @@ int listTypeNext(listTypeIterator *li, listTypeEntry *entry){
 		if(entry->ln != NULL){
 			if(li->direction == REDIS_TAIL){
 				li->ln = li->ln->next;
+				li->index++;
 			}else{
 				li->ln = li->ln->prev;
+				li->index--;
 			}
 			return 1;
 		}	
@@ -209,6 +354,25 @@ int listTypeNext(listTypeIterator *li, listTypeEntry *entry){
 	return 0;
 }
 
+/**
+ * Reply with the ziplist entry at p as a bulk, or a null bulk when p is
+ * NULL. The string or integer is formatted straight into the reply buffer,
+ * no object is created for it. Shared by the list and hash commands.
+ */
+void addReplyBulkZiplistEntry(redisClient *c, unsigned char *p){
+	unsigned char *vstr;
+	unsigned int vlen;
+	long long vlong;
+
+	if(p == NULL || !ziplistGet(p, &vstr, &vlen, &vlong)){
+		addReply(c, shared.nullbulk);
+	}else if(vstr){
+		addReplyBulkCBuffer(c, vstr, vlen);
+	}else{
+		addReplyBulkLongLong(c, vlong);
+	}
+}
+
 /**
  * Return Entry or NULL at the current position of the iterator
  */
@@ -271,11 +435,9 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where){
 		}
 		decrRefCount(value);
 	}else if(li->encoding == REDIS_ENCODING_LINKEDLIST){
-		if(where == REDIS_HEAD){
-			listInsertNode(li->subject->ptr, entry->ln, value, 0);
-		}else{
-			listInsertNode(i->subject->ptr, entry->ln, value, 1);
-		}
+		listTypeLinkedInsert(li->subject->ptr, entry->ln, entry->index, value, where == REDIS_TAIL);
+		//The nodes after the new one moved by one
+		if(li->direction == REDIS_TAIL) li->index++;
 		incrRefCount(value);
 	}else{
 		redisPanic("Unknown list encoding");	
@@ -331,15 +493,18 @@ void listTypeDelete(listTypeEntry *entry){
 			next = entry->ln->prev;
 		}
 		//Remove current node
-		listDelNode(subject->ptr, entry->ln);
-		ln = ln->next;
+		listTypeLinkedDelete(subject->ptr, entry->ln, entry->index);
+		li->ln = next;
+		//The nodes after the removed one moved by one
+		if(li->direction == REDIS_TAIL) li->index--;
 	}else{
 		redisPanic("Unknown list encoding");	
 	}
 }
 
 /**
- * Convert the encoding from ziplist to linked-list
+ * Convert the encoding from ziplist to linked-list, or back from linked-list
+ * to ziplist for the active compaction.
  */
 void listTypeConvert(robj *subject, int enc){
 	
@@ -352,9 +517,7 @@ void listTypeConvert(robj *subject, int enc){
 	//convert to double-linked list
 	if(enc == REDIS_ENCODING_LINKEDLIST){
 		
-		list *l = listCreate();
-		
-		listSetFreeMethod(l, decrRefCountVoid);
+		list *l = listTypeCreateList();
 		
 		//ListType Get returns a robj with increment refcount
 		li = listTypeInitIterator(subject, 0, REDIS_TAIL);
@@ -368,12 +531,73 @@ void listTypeConvert(robj *subject, int enc){
 
 		subject->ptr = l;
 
+	}else if(enc == REDIS_ENCODING_ZIPLIST){
+		list *l = subject->ptr;
+		unsigned int n = listLength(l), *lens = zmalloc(sizeof(unsigned int) * (n ? n : 1)), i = 0;
+		unsigned char **strs = zmalloc(sizeof(unsigned char*) * (n ? n : 1));
+		char (*bufs)[32] = zmalloc(sizeof(*bufs) * (n ? n : 1));
+		listNode *ln;
+		listIter iter;
+
+		redisAssertWithInfo(NULL, subject, subject->encoding == REDIS_ENCODING_LINKEDLIST);
+
+		//The strings point into the values, alive until the ziplist is built,
+		//integers are written out in bufs
+		listRewind(l, &iter);
+		while((ln = listNext(&iter)) != NULL){
+			robj *value = listNodeValue(ln);
+
+			if(sdsEncodedObject(value)){
+				strs[i] = value->ptr;
+				lens[i] = sdslen(value->ptr);
+			}else{
+				lens[i] = ll2string(bufs[i], sizeof(bufs[i]), (long)value->ptr);
+				strs[i] = (unsigned char*)bufs[i];
+			}
+			i++;
+		}
+
+		subject->ptr = ziplistRewrite(ziplistNew(), NULL, NULL, strs, lens, n);
+		subject->encoding = enc;
+		zfree(strs);
+		zfree(lens);
+		zfree(bufs);
+
+		//Releasing the list decrements the values
+		listTypeReleaseList(l);
 	}else{
 		redisPanic("Unknown list encoding");	
 	}
 
 }
 
+/**
+ * Turn a linked list back into a ziplist once it holds no more than
+ * 1/REDIS_COMPACT_RATIO of list_max_ziplist_entries elements, all of them
+ * short enough for the ziplist. The margin keeps a list that shrinks and
+ * grows around the limit from being converted back and forth.
+ *
+ * Returns 1 if the list was converted.
+ */
+int listTypeTryCompaction(robj *subject){
+	listNode *ln;
+	listIter iter;
+
+	if(subject->encoding != REDIS_ENCODING_LINKEDLIST) return 0;
+	if(listTypeLength(subject) > server.list_max_ziplist_entries / REDIS_COMPACT_RATIO) return 0;
+
+	listRewind(subject->ptr, &iter);
+	while((ln = listNext(&iter)) != NULL){
+		robj *value = listNodeValue(ln);
+
+		if(sdsEncodedObject(value) && sdslen(value->ptr) > server.list_max_ziplist_value)
+			return 0;
+	}
+
+	listTypeConvert(subject, REDIS_ENCODING_ZIPLIST);
+	return 1;
+}
+
 /*---------------------------------------------------------
  *		     List   Command
  * --------------------------------------------------------*/
@@ -546,25 +770,9 @@ void lindexCommand(redisClient *c){
 	}
 
 	if(subject->encoding == REDIS_ENCODING_ZIPLIST){
-		unsigned char *p;
-		unsigned char *vstr;
-		unsigned int vlen;
-		long long vlong;
-
-		p = ziplistIndex(subject->ptr, index);
-		if(ziplistGet(p, &vstr, &vlen, &vlong)){
-			if(vstr){
-				value = createStringObject((char *)vstr, vlen);
-			}else{
-				value = createStringObjectFromLongLong(vlong);
-			}
-			addReplyBulk(c, value);
-			decrRefCount(value);
-		}else{
-			addReply(c, shared.nullbulk);
-		}
+		addReplyBulkZiplistEntry(c, ziplistIndex(subject->ptr, index));
 	}else if(subject->encoding == REDIS_ENCODING_LINKEDLIST){
-		listNode n = listIndex(subject->ptr, index);
+		listNode *n = listTypeIndexNode(subject->ptr, index);
 		if(n == NULL){
 			addReply(c, shared.nullbulk);
 		}else{
@@ -615,7 +823,11 @@ void lsetCommand(redisClient *c){
 		server.dirty++;
 
 	}else if(subject->encoding == REDIS_ENCODING_LINKEDLIST){
-		listNode ln = listIndex(subject->ptr, index);
+		listNode *ln = listTypeIndexNode(subject->ptr, index);
+		if(ln == NULL){
+			addReply(c, shared.outofrangeerr);
+			return;
+		}
 		decrRefCount((robj*)listNodeValue(ln));
 
 		//point to the new object
@@ -633,60 +845,62 @@ void lsetCommand(redisClient *c){
 
 /**
  * This is a generic pop command method for the list.
+ *
+ * [LR]POP key [count]
+ *
+ * Without count a single element is replied, with count up to count elements
+ * are popped at once and replied as a multi bulk.
  */
 void popGenericCommand(redisClient *c, int where){
-	
-	robj *subject = lookupKeyReadOrReply(c, c->argv[1], shared.nullbulk);
-	if(subject == NULL || checkType(c, subject, REDIS_LIST)) return;
-	/**
-	 * If this key is existed, then we need to figure out which kind of 
-	 * implemetation.
-	 */
-	robj *value;
-	if(subject->encoding == REDIS_ENCODING_ZIPLIST){
-		unsigned char *p, *vstr;
-		unsigned long vlen;
-		long vlong;
-
-		p = ziplistIndex(subject->ptr, where == REDIS_HEAD ? 0 : -1);
-		if(ziplistGet(p, &vstr, &len, &vlong)){
-				if(vstr){
-					//If it is a string in this ziplist entry
-					value = createStringObject((char *)vstr, vlen);
-				}else{
-					//If it is a long value in the ziplist
-					value = createStringObjectFromLongLong(vlong);
-				}
-		}else{
-			//If there is nothing to pop;
-			addReply(c, shared.nullbulk);
+	char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
+	robj *subject;
+	long count = 0;
+
+	if(c->argc > 3){
+		addReplyError(c, "wrong number of arguments for pop");
+		return;
+	}
+	if(c->argc == 3){
+		if(getLongFromObjectOrReply(c, c->argv[2], &count, NULL) != REDIS_OK) return;
+		if(count < 0){
+			addReplyError(c, "value is out of range, must be positive");
 			return;
 		}
-		
+	}
 
-	}else if(subject->encoding == REDIS_ENCDOING_LINKEDLIST){
-			listNode *ln;
-			if(ln = listIndex(subject->ptr, where == REDIS_HEAD ? 0 : -1){
-				value = listNodeValue(ln);
-				incrRefCount(value);
-				listDelNode(list, ln);
-			}else{
-				//Nothing in the linkedlist
-				addReply(c. shared.nullbulk);
-				return;
-			}
+	subject = lookupKeyWriteOrReply(c, c->argv[1], (c->argc == 3) ? shared.nullmultibulk : shared.nullbulk);
+	if(subject == NULL || checkType(c, subject, REDIS_LIST)) return;
+
+	if(c->argc == 2){
+		robj *value = listTypePop(subject, where);
+
+		//At this part notice, we leave the value refcount to here 
+		//and do the decrRef work after we pass the value to addReply func.
+		addReplyBulk(c, value);
+		decrRefCount(value);
 	}else{
-		redisPanic("Unknown list encoding");	
+		unsigned long len = listTypeLength(subject), popped, j;
+		robj **values;
+
+		if((unsigned long)count > len) count = len;
+		if(count == 0){
+			addReply(c, shared.emptymultibulk);
+			return;
+		}
+
+		values = zmalloc(sizeof(robj*) * count);
+		popped = listTypePopMany(subject, where, count, values);
+		addReplyMultiBulkLen(c, popped);
+		for(j = 0; j < popped; j++){
+			addReplyBulk(c, values[j]);
+			decrRefCount(values[j]);
+		}
+		zfree(values);
 	}
-	//At this part notice, we leave the value refcount to here 
-	//and do the decrRef work after we pass the value to addReply func.
-	addReply(c, value);
-	decrRefCount(value);
 
-	char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
 	notifyKeyspaceEvent(REDIS_NOTIFY_LIST, event, c->argv[1], c->db->id);
 	if(listTypeLength(subject) == 0){
-		notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", c->argv[1]. c->db->id);
+		notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", c->argv[1], c->db->id);
 		dbDelete(c->db, c->argv[1]);
 	}
 	signalModifiedKey(c->db, c->argv[1]);
@@ -724,7 +938,7 @@ void lrangeCommand(redisClient *c){
 	 * Invariant: start >= 0, so the test will be true when end < 0.
 	 * The range is empty when start > end or start >= length
 	 */
-	if(start >= end || start >= llen){
+	if(start > end || start >= llen){
 		addReply(c, shared.emptymultibulk);
 		return;
 	}
@@ -737,27 +951,16 @@ void lrangeCommand(redisClient *c){
 	addReplyMutiBulkLen(c, rangelen);
 
 	if(subject->encoding == REDIS_ENCODING_ZIPLIST){
-		unsigned char *p, *vstr;
-		long vlen;
-		long long vlong;
-		robj *value;
-		p = ziplistIndex(subject->ptr, start);
+		unsigned char *p = ziplistIndex(subject->ptr, start);
+		//The entries go straight from the ziplist to the reply buffer
 		while(rangelen--){
-			ziplistGet(p, &vstr, &vlen, &vlong);		
-			if(vstr){
-				value = createStringObject((char *)vstr, vlen);
-			}else{
-				value = createStringObjectFromLongLong(vlong);
-			}	
-			addReply(c, value);
+			addReplyBulkZiplistEntry(c, p);
 			p = ziplistNext(subject->ptr, p);
 		}
 	}else if(subject->encoding == REDIS_ENCODING_LINKEDLIST){
 		listNode *ln;
-		//If the start point start near the end,
-		//then we start out loop from the tail.
-		if(start > llen/2) start -= llen;
-		ln = listIndex(subject->ptr, start);
+		//The index finds the start in O(log N)
+		ln = listTypeIndexNode(subject->ptr, start);
 		while(rangelen--){
 			addReplyBulk(c, ln->value);
 			ln = ln->next;
@@ -769,7 +972,7 @@ void lrangeCommand(redisClient *c){
 
 void ltrimCommand(redisClient *c){
 
-	long start, end, llen, j, ltrim, rtrim; 
+	long start, end, llen, ltrim, rtrim; 
 	robj *subject = lookupKeyWriteOrReply(c, c->argv[1], shared.ok);
 	
 	if(subject == NULL || checkType(c, subject, REDIS_LIST)) return;
@@ -800,14 +1003,20 @@ void ltrimCommand(redisClient *c){
 		o->ptr = ziplistDeleteRange(zl, -rtrim, rtrim);
 
 	}else if(subject->encoding == REDIS_ENCODING_LINKEDLIST){
-		listNode *next;
-		while(ltrim--){
-			ln = listFirst(subject->ptr);
-			listDelNode(subject->ptr, ln);
+		list *l = subject->ptr;
+
+		//Each side is cut off as a whole run: finding its inner end walks
+		//only the nodes removed, and the run is freed in the background
+		//when it is long. Whole chunks of the index go away at once.
+		if(ltrim){
+			listNode *last = listIndex(l, ltrim-1);
+			lazyfreeListRun(listDetachRange(l, listFirst(l), last, ltrim));
+			if(listTypeListIndex(l)) chunkIndexDeleteRange(listTypeListIndex(l), 0, ltrim, listFirst(l));
 		}
-		while(rtrim--){
-			ln = listLast(subject->ptr);
-			listDelNode(subject->ptr, ln);
+		if(rtrim){
+			listNode *first = listIndex(l, -rtrim);
+			lazyfreeListRun(listDetachRange(l, first, listLast(l), rtrim));
+			if(listTypeListIndex(l)) chunkIndexDeleteRange(listTypeListIndex(l), listLength(l), rtrim, NULL);
 		}
 	}else{
 		redisPanic("Unknown list encoding");	
@@ -991,8 +1200,8 @@ void rpoplpushCommand(redisClient *c){
  */
 void blockForKeys(redisClient *c, robj **keys, int numkeys, mstime_t timeout, robj *target){
 	dictEntry *de;
-	list *l;
-	int j;
+	blockedKey *bk;
+	int j, retval;
 
 	//set the blocking status adn the target
 	c->bpop.timeout = timeout;
@@ -1008,34 +1217,57 @@ void blockForKeys(redisClient *c, robj **keys, int numkeys, mstime_t timeout, ro
 	//Map key: key -> value: client that block by this key.
 	for(j = 0; j < numkeys; j++){
 		/*If the key already exist in the dict then ingore it*/
-		if(dictAdd(c->bpop.keys, keys[j], NULL) != REDIS_OK) continue;
-		//The key object is referenced in the c->bpop map value part,
-		//we incr the reference count.
-		incrRefCount(keys[j]);
+		if(dictFind(c->bpop.keys, keys[j]) != NULL) continue;
 
 		de = dictFind(c->db->blocking_keys, keys[j]);
 		if(de == NULL){
-			//The linked list is not existed, create a new one.
-			l = listCreate();
-			retval = dictAdd(c->db->blocking_keys, keys[j], l);
+			//Nobody is blocked on this key yet, create its entry.
+			bk = zmalloc(sizeof(*bk));
+			bk->db = c->db;
+			bk->key = keys[j];
+			bk->clients = listCreate();
+			bk->ready = 0;
+			retval = dictAdd(c->db->blocking_keys, keys[j], bk);
 			incrRefCount(keys[j]);
 			redisAssertWithInfo(c, keys[j], retval == DICT_OK);
 		}else{
-			l = dictGetVal(de);
+			bk = dictGetVal(de);
 		}
-		//Add the client to the key blocking list
-		listAddNodeTail(l, c);
+		//Add the client to the key blocking list, and remember its node
+		//so that unblocking the client unlinks it in O(1)
+		listAddNodeTail(bk->clients, c);
+		dictAdd(c->bpop.keys, keys[j], listLast(bk->clients));
+		//The key object is referenced in the c->bpop map key part,
+		//we incr the reference count.
+		incrRefCount(keys[j]);
+	}
+
+	//Arm the timeout, 0 blocks forever
+	if(timeout){
+		if(server.bpop_timeouts == NULL)
+			server.bpop_timeouts = timeWheelCreate(TIMEWHEEL_SLOTS, TIMEWHEEL_RESOLUTION, mstime());
+		timeWheelAdd(server.bpop_timeouts, &c->bpop.timeout_entry, timeout, c);
 	}
 	blockClient(c, REDIS_BLOCKED_LIST);
 }
 
+/* Remove the key of bk, that has no blocked client left, from
+ * db->blocking_keys. The dict does not own its values: they are freed here.
+ */
+static void freeBlockedKey(blockedKey *bk){
+	dictDeleteNoFree(bk->db->blocking_keys, bk->key);
+	decrRefCount(bk->key);
+	listRelease(bk->clients);
+	zfree(bk);
+}
+
 /* Unblock a client that's waiting in a blocking operation such as BLPOP 
  * You should never call this function directly but unblockClient() instead 
  */
 void unblockClientWaitingData(redisClient *c){
 	dictEntry *de;
 	dictIterator *di;
-	list *l;
+	blockedKey *bk;
 
 	redisAssertWithInfo(c, NULL, dictSize(c->bpop.key) != 0);
 	/*This client may be waiting for mutpile keys, so we unlock it for ever key*/
@@ -1045,60 +1277,68 @@ void unblockClientWaitingData(redisClient *c){
 		robj *key = dictGetKey(de);
 
 		//Remove this client from the list of clients wating for this key
-		l = dictFetchValue(c->db->blocking_keys, key);
+		bk = dictFetchValue(c->db->blocking_keys, key);
 
-		redisAssertWithInfo(c, key, l != NULL);
+		redisAssertWithInfo(c, key, bk != NULL);
 
-		//Delete client from the wating list
-		listDelNode(l, listSearchKey(l, c)); 
+		//Delete client from the wating list, the node is saved in the
+		//value of c->bpop.keys
+		listDelNode(bk->clients, dictGetVal(de));
 		//If the list is empty we need to remove it to avoid memory waste.
-		if(listLength(l) == 0)
-			dictDelete(c->db->blocking_keys, key);
+		//A key queued in server.ready_keys is freed once it is served.
+		if(listLength(bk->clients) == 0 && !bk->ready) freeBlockedKey(bk);
 	}
 	dictRelease(di);
 
 	/*Cleanup the client structure*/
 	dictEmpty(c->bpop.keys, NULL);
+	if(server.bpop_timeouts)
+		timeWheelRemove(server.bpop_timeouts, &c->bpop.timeout_entry);
+	c->bpop.count = 0;
 	if(c->bpop.target){
 		decrRefCount(c->bpop.target);
 		c->bpop.target = NULL;
 	}
 }
 
+static void blockedClientTimedOut(void *owner){
+	redisClient *c = owner;
+
+	addReply(c, shared.nullmultibulk);
+	unblockClient(c);
+}
+
+/**
+ * Reply to and unblock the clients blocked by lists whose timeout is
+ * reached. Called from the server cron: only the slots of the wheel due
+ * since the last call are visited, not every blocked client.
+ */
+void handleBlockedClientsTimeout(void){
+	if(server.bpop_timeouts == NULL || timeWheelLength(server.bpop_timeouts) == 0) return;
+	timeWheelExpire(server.bpop_timeouts, mstime(), blockedClientTimedOut);
+}
+
 /**
  * If the specificed key has clients blocked waiting for list push, this 
- * function will put the key reference into the server.ready_keys list.
- * Note that db->ready_keys is a hash table that allows us to avoid putting
- * the same key again and again in the list in case of mutiple pushes made by
- * script or in the context of MULTI/EXEC
+ * function will put its blockedKey into the server.ready_keys list.
+ * The ready flag of the blockedKey allows us to avoid putting the same key
+ * again and again in the list in case of mutiple pushes made by script or
+ * in the context of MULTI/EXEC
  */
 void signalListAsReady(redisClient *c, robj *key){
-	readyList *rl;
+	blockedKey *bk;
+
+	/*Nobody is blocked in this db, the common case: no lookup at all*/
+	if(dictSize(c->db->blocking_keys) == 0) return;
 
 	/*If there is no any client block for this key, return*/
-	if(dictFind(c->db->blocking_keys, key) == NULL) return;
+	if((bk = dictFetchValue(c->db->blocking_keys, key)) == NULL) return;
 
 	/*If this key was already signaled? No need to queue it again*/
-	if(dictFind(c->db->ready_keys, key) != NULL) return;
+	if(bk->ready) return;
 
-	/*Now we need to queue this key into server.readyList
-     *We need to create a readList.
-	 *Init this readyList.
-	 *Add this readyList to server.ready_keys.
-	 */
-	rl = zmalloc(sizeof(*rl));
-	rl->key = key;
-	rl->db = c->db;
-	//This is because the key is referenced by rl->key
-	incrRefCount(key);
-	listAddNodeTail(server.ready_keys, rl);
-	/**
-	 * We also add the key in the db->ready_keys dictionary 
-	 * to avoid adding it mutiple times into a list with a
-	 * simple O(1) check.
-	 */
-	incrRefCount(key);
-	redisAssert(dictAdd(c->db->ready_keys, key, NULL) == REDIS_OK);
+	bk->ready = 1;
+	listAddNodeTail(server.ready_keys, bk);
 }
 
 /**
@@ -1170,6 +1410,28 @@ int serveClientBlockedOnList(redisClient *receiver, robj *key, robj *dstkey, red
 	return REDIS_OK;
 }
 
+/**
+ * Like serveClientBlockedOnList(), for a BLMPOP: reply with the
+ * 'count' elements popped at once as [key, [elements]], and propagate them as a
+ * single [LR]POP key count.
+ */
+void serveClientBlockedOnListCount(redisClient *receiver, robj *key, redisDb *db, robj **values, unsigned long count, int where){
+	robj *argv[3];
+	unsigned long j;
+
+	argv[0] = (where == REDIS_HEAD) ? shared.lpop : shared.rpop;
+	argv[1] = key;
+	argv[2] = createStringObjectFromLongLong(count);
+	propagate((where == REDIS_HEAD) ? server.lpopCommand : server.rpopCommand,
+	          db->id, argv, 3, REDIS_PROPAGATE_AOF|REDIS_PROPAGATE_REPL);
+	decrRefCount(argv[2]);
+
+	addReplyMultiBulkLen(receiver, 2);
+	addReplyBulk(receiver, key);
+	addReplyMultiBulkLen(receiver, count);
+	for(j = 0; j < count; j++) addReplyBulk(receiver, values[j]);
+}
+
 /* This function should be called by Redis every time a single command,
  * a MULTI/EXEC block, or a Lua script, terminated its execution after
  * being called by a client.
@@ -1212,26 +1474,20 @@ void handleClientsBlockedOnLists(void){
 			//Get the first node from the ready_keys
 			listNode *ln = listFirst(l);
 
-			//Point to the readyList structure
-			readyList *rl = ln->value;
-
-			/*
-			 *First of all remove this key from db->ready_keys so that
-			 *we can safely call signalListAsReady() against this key. 
-			 */
-			dictDelete(rl->db->ready_keys, rl->key);
+			//Point to the blockedKey structure, that stays flagged as ready
+			//while it is served, so that unblocking its last client does
+			//not free it under our feet
+			blockedKey *bk = listNodeValue(ln);
 
 			/*If the key exists and it is a list, serve blocked clients with data*/
-			robj *o = lookupKeyWrite(rl->db, rl->key);
+			robj *o = lookupKeyWrite(bk->db, bk->key);
 			if(o!= NULL && o.type == REDIS_LIST){
 				/*Now we need to unblock all the clients which is blocked by this list
 				 *All the blocked clients is arrange in the db->blocking_keys value part,
 				 *which is a list of client.
 				 */
-				dictEntry *de;
-				de = dictFind(rl->db->blocking_keys, rl->key);
-				if(de){
-					list *clients = dictGetVal(de);
+				if(listLength(bk->clients) != 0){
+					list *clients = bk->clients;
 					int numclients = listLength(clients);
 
 					while(numclients--){
@@ -1244,10 +1500,27 @@ void handleClientsBlockedOnLists(void){
 
 						//pop the element from the list
 						//Where to pop according to the BLPOP or BRPOP or BRPOPLPUSH
-						int where = (receiver->lastcmd &&
-						             receiver->kastcmd->proc == blpopCommand) ? 
-									 REDIS_HEAD : REDIS_TAIL;
-						robj *value = listTypePop(o, where);
+						int where = receiver->bpop.where;
+						robj *value;
+
+						//BLMPOP takes up to count elements in one go
+						if(receiver->bpop.count > 0 && dstkey == NULL){
+							unsigned long len = listTypeLength(o), popped;
+							robj **values;
+
+							if(len == 0) break;
+							values = zmalloc(sizeof(robj*) * (len < (unsigned long)receiver->bpop.count ?
+							                                 len : (unsigned long)receiver->bpop.count));
+							popped = listTypePopMany(o, where, receiver->bpop.count, values);
+
+							unblockClient(receiver);
+							serveClientBlockedOnListCount(receiver, bk->key, bk->db, values, popped, where);
+							while(popped--) decrRefCount(values[popped]);
+							zfree(values);
+							continue;
+						}
+
+						value = listTypePop(o, where);
 
 						//If there is any element to pop
 						if(value){
@@ -1260,8 +1533,8 @@ void handleClientsBlockedOnLists(void){
 							unblockClient(receiver);
 
 							//put the value to the receiver blocking key
-							if(serveClientBlockedOnList(receiver, rl->key,
-							                             dstkey,rl->db, value,
+							if(serveClientBlockedOnList(receiver, bk->key,
+							                             dstkey,bk->db, value,
 														 where) == REDIS_ERR)
 							{
 								/**
@@ -1280,88 +1553,169 @@ void handleClientsBlockedOnLists(void){
 					}
 				}
 				//If the list is empty then delete it.
-				if(listTypeLength(o) == 0) dbDelete(rl->db, rl->key);
+				if(listTypeLength(o) == 0) dbDelete(bk->db, bk->key);
 				/**
 				 * We do not call signalModifiedKey() as it was already
 				 * called when an elments was push on the list.
 				 */ 
 			}
-			/*Free this item*/
-			decrRefCount(rl->key);
-			zfree(rl);
+			/*The key can be signaled again, or freed if nobody waits on it*/
+			bk->ready = 0;
+			if(listLength(bk->clients) == 0) freeBlockedKey(bk);
 			listDelNode(l, ln);
 		}
 		listRelease(l);
 	}
 }
 
+//Keys probed per dictFindBatch() call by lookupFirstNonEmptyList()
+#define LIST_LOOKUP_BATCH 16
+
+/**
+ * Look the keys up and return the index of the first one holding a non
+ * empty list, stored into *o, or -1 if there is none. Replies with an error
+ * and returns -2 if a key holds another type.
+ *
+ * The keyspace is probed LIST_LOOKUP_BATCH keys at a time with
+ * dictFindBatch(), so the keys that don't exist, the common case for the
+ * blocking pops, cost no separate lookup. The keys that are found still go
+ * through lookupKeyWrite() for the expire and the access time.
+ */
+static int lookupFirstNonEmptyList(redisClient *c, robj **keys, int numkeys, robj **o){
+	const void *names[LIST_LOOKUP_BATCH];
+	dictEntry *found[LIST_LOOKUP_BATCH];
+	int i, j, n;
+
+	for(i = 0; i < numkeys; i += n){
+		n = (numkeys - i < LIST_LOOKUP_BATCH) ? numkeys - i : LIST_LOOKUP_BATCH;
+		for(j = 0; j < n; j++) names[j] = keys[i+j]->ptr;
+		dictFindBatch(c->db->dict, names, found, n);
+
+		for(j = 0; j < n; j++){
+			robj *value;
+
+			if(found[j] == NULL) continue;
+			value = lookupKeyWrite(c->db, keys[i+j]);
+			if(value == NULL) continue;
+			if(value->type != REDIS_LIST){
+				addReply(c, shared.wrongtypeerr);
+				return -2;
+			}
+			if(listTypeLength(value) != 0){
+				*o = value;
+				return i + j;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * Pop up to 'count' elements from the non empty list o at 'key', reply with
+ * [key, [elements]], and rewrite the command as [LR]POP key count for the
+ * propagation.
+ */
+static void listPopManyAndReply(redisClient *c, robj *key, robj *o, int where, long count){
+	char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
+	unsigned long len = listTypeLength(o), popped, j;
+	robj **values, *countobj;
+
+	if((unsigned long)count > len) count = len;
+	values = zmalloc(sizeof(robj*) * count);
+	popped = listTypePopMany(o, where, count, values);
+
+	addReplyMultiBulkLen(c, 2);
+	addReplyBulk(c, key);
+	addReplyMultiBulkLen(c, popped);
+	for(j = 0; j < popped; j++){
+		addReplyBulk(c, values[j]);
+		decrRefCount(values[j]);
+	}
+	zfree(values);
+
+	notifyKeyspaceEvent(REDIS_NOTIFY_LIST, event, key, c->db->id);
+
+	//Delete the empty list
+	if(listTypeLength(o) == 0){
+		dbDelete(c->db, key);
+		notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", key, c->db->id);
+	}
+
+	signalModifiedKey(c->db, key);
+	server.dirty++;
+
+	countobj = createStringObjectFromLongLong(popped);
+	rewriteClientCommandVector(c, 3, (where == REDIS_HEAD) ? shared.lpop : shared.rpop,
+	                           key, countobj);
+	decrRefCount(countobj);
+}
+
+/**
+ * B[LR]POP key [key ...] timeout
+ */
 void blockingPopGenericCommand(redisClient *c, int where){
-	robj *o;
+	robj *o, *key;
 	mstime_t timeout;
-	int j;
+	int j, lastkey = c->argc - 2;
+
+	/* BLPOP/BRPOP take keys then the timeout and nothing else, any of the
+	 * keys may be named "count". Counted blocking pops are served by BLMPOP,
+	 * whose COUNT comes after numkeys and the keys. */
 
 	//Get the timeout
-	if(getTimeoutFromObjectOrReply(c, c->argv[c->argc-1], &timeout, UNIT_SECONDS) != REDIS_OK) return;
+	if(getTimeoutFromObjectOrReply(c, c->argv[lastkey+1], &timeout, UNIT_SECONDS) != REDIS_OK) return;
 
-	//Loop through all the key
-	for(j = 1; j < c->argc - 1; j++){
-		//Get the list key
-		o = lookupKeyWrite(c->db, c->argv[j]);
+	//If we meet a non empty list, we pop it and treat this command like R|LPOP
+	j = lookupFirstNonEmptyList(c, c->argv + 1, lastkey, &o);
+	if(j == -2) return;
+	if(j >= 0){
+		char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
+		robj *value;
 
-		if(o != NULL){
-			if(o->type == REDIS_LIST){
-				addReply(c, shared.wrongtypeerr);
-				return;
-			}else{
-				//If we meet a non empty list, we pop it and treat this command
-				//like R|LPOP
-				if(listTypeLentgh(o) != 0){
-					//Non empty list, this is like a non normal
-					char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
-
-					//Pop value
-					robj *value = listTypePop(o, where);
-
-					redisAssert(value != NULL);
-					//Reply to the client;
-					addReplyMultiBulkLen(c, 2);
-					//Add the pop element list
-					addReplyBulk(c, c->argv[j]);
-					//reply the pop value
-					addReplyBulk(c, value);
-
-					decrRefCount(value);
-
-					notifyKeyspaceEvent(REDIS_NOTIFY_LIST, event, c->argv[j], c->db->id);
-
-					//Delete the empty list
-					if(listTypeLength(o) == 0){
-						dbDelete(c->db, c->argv[j]);
-						notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", c->argv[j], c->db->id);
-					}
+		key = c->argv[j+1];
 
-					signalModifiedKey(c->db, c->argv[j]);
-					server.dirty++;
+		//Pop value
+		value = listTypePop(o, where);
 
-					/*Replicate it as an [LR]pop instead of B[LR]POP*/
-					rewriteClientCommandVector(c, 2, 
-								(where == REDIS_HEAD) ? shared.lpop : shared.rpop, 
-								c->argv[j]);
-					return;
-				}
-			}
+		redisAssert(value != NULL);
+		//Reply to the client;
+		addReplyMultiBulkLen(c, 2);
+		//Add the pop element list
+		addReplyBulk(c, key);
+		//reply the pop value
+		addReplyBulk(c, value);
+
+		decrRefCount(value);
+
+		notifyKeyspaceEvent(REDIS_NOTIFY_LIST, event, key, c->db->id);
+
+		//Delete the empty list
+		if(listTypeLength(o) == 0){
+			dbDelete(c->db, key);
+			notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", key, c->db->id);
 		}
+
+		signalModifiedKey(c->db, key);
+		server.dirty++;
+
+		/*Replicate it as an [LR]pop instead of B[LR]POP*/
+		rewriteClientCommandVector(c, 2, 
+					(where == REDIS_HEAD) ? shared.lpop : shared.rpop, 
+					key);
+		return;
 	}
 
 	//If we are inside a MUTI/EXEC and the list is empty the only thing we can do
 	//is treating it as a timeout.
 	if(c->flags & REDIS_MULTI){
-		addReply(c, shared.nullmutibulk);
+		addReply(c, shared.nullmultibulk);
 		return;
 	}
 
 	/*If the list is empty or the key does not exists we must block*/
-	blockForKeys(c, c->argv + 1, c->argc - 2, timeout, NULL);
+	blockForKeys(c, c->argv + 1, lastkey, timeout, NULL);
+	c->bpop.count = 0;
+	c->bpop.where = where;
 }
 
 void blpopCommand(redisClient *c){
@@ -1388,6 +1742,7 @@ void brpoplpushCommand(redisClient *c){
 
 			}else{
 				blockForKeys(c, c->argv + 1, 1, timeout, c->argv[2]);
+				c->bpop.where = REDIS_TAIL;
 			}
 		}
 	}else{
@@ -1405,4 +1760,90 @@ void brpoplpushCommand(redisClient *c){
 	}
 }
 
+/**
+ * Parse "numkeys key [key ...] LEFT|RIGHT [COUNT count]", numkeys being
+ * c->argv[pos]. Returns REDIS_ERR after replying with an error.
+ */
+static int getMpopArgsOrReply(redisClient *c, int pos, int *numkeys, int *where, long *count){
+	long n;
+	int j;
+
+	if(getLongFromObjectOrReply(c, c->argv[pos], &n, NULL) != REDIS_OK) return REDIS_ERR;
+	if(n <= 0 || n > c->argc - pos - 2){
+		addReplyError(c, "numkeys should be greater than 0 and match the number of keys");
+		return REDIS_ERR;
+	}
 
+	j = pos + 1 + n;
+	if(!strcasecmp(c->argv[j]->ptr, "left")){
+		*where = REDIS_HEAD;
+	}else if(!strcasecmp(c->argv[j]->ptr, "right")){
+		*where = REDIS_TAIL;
+	}else{
+		addReply(c, shared.syntaxerr);
+		return REDIS_ERR;
+	}
+
+	*count = 1;
+	if(++j < c->argc){
+		if(j + 2 != c->argc || strcasecmp(c->argv[j]->ptr, "count")){
+			addReply(c, shared.syntaxerr);
+			return REDIS_ERR;
+		}
+		if(getLongFromObjectOrReply(c, c->argv[j+1], count, NULL) != REDIS_OK) return REDIS_ERR;
+		if(*count <= 0){
+			addReplyError(c, "count should be greater than 0");
+			return REDIS_ERR;
+		}
+	}
+
+	*numkeys = n;
+	return REDIS_OK;
+}
+
+/**
+ * Pop up to count elements from the first non empty list among the keys,
+ * replying with [key, [elements]]. When all the lists are empty, BLMPOP
+ * blocks on all the keys at once, and is served up to count elements at once.
+ */
+static void mpopGenericCommand(redisClient *c, int pos, mstime_t timeout, int blocking){
+	int numkeys, where, j;
+	long count;
+	robj *o;
+
+	if(getMpopArgsOrReply(c, pos, &numkeys, &where, &count) != REDIS_OK) return;
+
+	j = lookupFirstNonEmptyList(c, c->argv + pos + 1, numkeys, &o);
+	if(j == -2) return;
+	if(j >= 0){
+		listPopManyAndReply(c, c->argv[pos+1+j], o, where, count);
+		return;
+	}
+
+	//Nothing to pop, and inside a MULTI/EXEC we can not block either
+	if(!blocking || (c->flags & REDIS_MULTI)){
+		addReply(c, shared.nullmultibulk);
+		return;
+	}
+
+	blockForKeys(c, c->argv + pos + 1, numkeys, timeout, NULL);
+	c->bpop.count = count;
+	c->bpop.where = where;
+}
+
+/**
+ * LMPOP numkeys key [key ...] LEFT|RIGHT [COUNT count]
+ */
+void lmpopCommand(redisClient *c){
+	mpopGenericCommand(c, 1, 0, 0);
+}
+
+/**
+ * BLMPOP timeout numkeys key [key ...] LEFT|RIGHT [COUNT count]
+ */
+void blmpopCommand(redisClient *c){
+	mstime_t timeout;
+
+	if(getTimeoutFromObjectOrReply(c, c->argv[1], &timeout, UNIT_SECONDS) != REDIS_OK) return;
+	mpopGenericCommand(c, 2, timeout, 1);
+}
@@ -1,4 +1,6 @@
 #include "redis.h"
+#include <math.h>
+
 /**-------------------------------------------------------------
  * Set Commands 
  **------------------------------------------------------------*/
@@ -26,32 +28,22 @@ robj *setTypeCreate(robj *value){
 int setTypeAdd(robj *subject, robj *value){
     long long llval;
 
-    if(subject->encoding == REDIS_ENCODING_INTSET){
+    if(subject->encoding == REDIS_ENCODING_INTSET ||
+       subject->encoding == REDIS_ENCODING_ROARING){
         //If it can be represent as a long long.
-        if(isObjectRepresentableAsLongLong(value, &llval) == REDIS_OK){
-            uint8_t success = 0;
-            subject->ptr =  intsetAdd(subject->ptr, llval, &success);
-            if(success){
-                /**This means the add is success and we need to check if
-                 * current total size of the set exceeds the configured 
-                 * maxmum size of set.
-                 */ 
-                if(intsetLen(subject->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(subject, REDIS_HASH);
-                return 1;
-            }
-        }else{
-            //Otherwise we can only treat it as a sds string.
-            setTypeConvert(subject, REDIS_HASH);
-            /**
-             * The set was original intset and the input value can't be represetn as 
-             * a long long type, so in normal, this input value never exist in previous
-             * set and the dictAdd always be true.
-             */ 
-            redisAssertWithInfo(NULL, value, dictAdd(subject->ptr, value, NULL) == DICT_OK);
-            incrRefCount(value);
-            return 1;
-        }
+        if(isObjectRepresentableAsLongLong(value, &llval) == REDIS_OK)
+            return setTypeAddInteger(subject, llval);
+
+        //Otherwise we can only treat it as a sds string.
+        setTypeConvert(subject, REDIS_ENCODING_HT);
+        /**
+         * The set was original intset and the input value can't be represetn as 
+         * a long long type, so in normal, this input value never exist in previous
+         * set and the dictAdd always be true.
+         */ 
+        redisAssertWithInfo(NULL, value, dictAdd(subject->ptr, value, NULL) == DICT_OK);
+        incrRefCount(value);
+        return 1;
     }else if(subject->encoding == REDIS_ENCODING_HT){
         if(dictAdd(subject->ptr, value, NULL) == DICT_OK){
             incrRefCount(value);
@@ -63,6 +55,40 @@ int setTypeAdd(robj *subject, robj *value){
     return 0;
 }
 
+/**
+ * Integer add operation, the integer is not turned into an object unless
+ * the set is a hash table.
+ * If add success return 1, otherwise(the element is already existed) 
+ * return 0.
+ */ 
+int setTypeAddInteger(robj *subject, long long llval){
+
+    if(subject->encoding == REDIS_ENCODING_INTSET){
+        uint8_t success = 0;
+        subject->ptr =  intsetAdd(subject->ptr, llval, &success);
+        if(success){
+            /**This means the add is success and we need to check if
+             * current total size of the set exceeds the configured 
+             * maxmum size of set. A set of integers that big is kept
+             * as a roaring bitmap, unless the integers are too sparse.
+             */ 
+            if(intsetLen(subject->ptr) > server.set_max_intset_entries)
+                setTypeConvertLargeIntset(subject);
+            return 1;
+        }
+    }else if(subject->encoding == REDIS_ENCODING_ROARING){
+        return roaringAdd(subject->ptr, llval);
+    }else if(subject->encoding == REDIS_ENCODING_HT){
+        robj *ele = createStringObjectFromLongLong(llval);
+
+        if(dictAdd(subject->ptr, ele, NULL) == DICT_OK) return 1;
+        decrRefCount(ele);
+    }else{
+        redisPainc("Unknown type");
+    }
+    return 0;
+}
+
 /**
  * Remove operation
  * If remove success return 1, if the element is not existed then return 0;
@@ -76,6 +102,9 @@ int setTypeRemove(robj *setobj, robj *value){
             setobj->ptr = intsetRemove(setobj->ptr, llval, &success);
             if(success) return 1;
         }
+    }else if(setobj->encoding == REDIS_ENCODING_ROARING){
+        if(isObjectRepresentableAsLongLong(value, &llval) == REDIS_OK)
+            return roaringRemove(setobj->ptr, llval);
     }else if(setobj->encoding == REDIS_ENCODING_HT){
           if(dictDelete(setobj->ptr, value) == REDIS_OK){
               //Check if we need to resize the dictionary if necessary
@@ -101,6 +130,10 @@ int setTypeIsMember(robj *subject, robj *value){
         if(isObjectRepresentableAsLongLong(value, &llval) == REDIS_OK){
             return intsetFind(subject->ptr, llval);
         }
+    }else if(subject->encoding == REDIS_ENCODING_ROARING){
+        if(isObjectRepresentableAsLongLong(value, &llval) == REDIS_OK){
+            return roaringContains(subject->ptr, llval);
+        }
     }else{
          redisPainc("Unknown type");
     }
@@ -120,6 +153,8 @@ setTypeIterator *setTypeInitIterator(robj *subject){
         it->di = dictGetIterator(subject->ptr);
     }else if(subject->encoding == REDIS_ENCODING_INTSET){
         it->ii = 0;
+    }else if(subject->encoding == REDIS_ENCODING_ROARING){
+        roaringInitIterator(subject->ptr, &it->ri);
     }else{
          redisPainc("Unknown type");
     }
@@ -145,6 +180,8 @@ void setTypeReleaseIterator(setTypeIterator *si){
  * 
  * When there are no longer elements -1 is returned, Otherwise return the current
  * iterate object encoding.
+ * Only REDIS_ENCODING_HT populates the object pointer, the integer encodings
+ * (intset and roaring) populate the int64_t one.
  * 
  * The return value is not incr the object reference count.
  * Returned objects ref count is not incremented, so this function is copy on write friendly.
@@ -153,6 +190,8 @@ int setTypeNext(setTypeIterator *si, robj **objele, int64_t *llele){
 
     if(si->encoding == REDIS_ENCODING_INTSET){
         if(!intsetGet(si->subject->ptr, si->ii++, llele)) return -1;
+    }else if(si->encoding == REDIS_ENCODING_ROARING){
+        if(!roaringNext(&si->ri, llele)) return -1;
     }else if(si->encoding == REDIS_ENCODING_HT){
         dictEntry *de =  dictNext(si->di);
         if(de == NULL) return -1;
@@ -187,7 +226,8 @@ robj *setTypeNextObject(setTypeIterator *si){
     if(encoding == REDIS_ENCODING_HT){
         incrRefCount(objele);
         return objele;
-    }else if(encoding == REDIS_ENCODING_INTSET){
+    }else if(encoding == REDIS_ENCODING_INTSET ||
+             encoding == REDIS_ENCODING_ROARING){
         return createStringObjectFromLongLong(intele);
     }else if(encoding == -1){
         return NULL;
@@ -215,6 +255,8 @@ int setTypeRandomElement(robj *setobj, robj **objele, int64_t *llele){
 
     if(setobj->encoding == REDIS_ENCODING_INTSET){
         *llele = intsetRandom(setobj->ptr);
+    }else if(setobj->encoding == REDIS_ENCODING_ROARING){
+        *llele = roaringRandom(setobj->ptr);
     }else if(setobj->encoding == REDIS_ENCODING_HT){
         dictEntry *de = dictGetRandomKey(setobj->ptr);
         *objele = de->key;
@@ -230,6 +272,8 @@ int setTypeRandomElement(robj *setobj, robj **objele, int64_t *llele){
 unsigned long setTypeSize(robj *subject){
     if(subject->encoding == REDIS_ENCODING_INTSET){
         return intsetLen(subject->ptr);
+    }else if(subject->encoding == REDIS_ENCODING_ROARING){
+        return roaringCard(subject->ptr);
     }else if(subject->encoding == REDIS_ENCODING_HT){
         return dictSize((dict *)subject->ptr);
     }else{
@@ -240,6 +284,9 @@ unsigned long setTypeSize(robj *subject){
 /**
  * Convert the set to specific encoding.
  * 
+ * An intset can become a hash table or a roaring bitmap, a roaring bitmap
+ * can become a hash table. The active compaction turns small roaring bitmaps
+ * and small hash tables of integers back into intsets.
  * The resulting dict (when converting to a hash table)
  * is presized to hold the number of elements in the origninal set.
  */
@@ -249,28 +296,147 @@ void setTypeConvert(robj *setobj, int enc){
 
     // 确认类型和编码正确
     redisAssertWithInfo(NULL,setobj,setobj->type == REDIS_SET &&
-                             setobj->encoding == REDIS_ENCODING_INTSET);
+                             (setobj->encoding == REDIS_ENCODING_INTSET ||
+                              setobj->encoding == REDIS_ENCODING_ROARING ||
+                              enc == REDIS_ENCODING_INTSET));
 
-    si = setTypeInitIterator(setobj);
     if(enc == REDIS_ENCODING_HT){
         robj *o;
         dict *d = dictCreate(&setDictType, NULL);
         //This means to expand the space able to hold the intset.
-        dictExpand(d, intsetLen(setobj->ptr));
+        dictExpand(d, setTypeSize(setobj));
 
+        si = setTypeInitIterator(setobj);
         while((o = setTypeNextObject(si)) != NULL){
             redisAssertWithInfo(NULL,o,dictAdd(d,o,NULL) == DICT_OK);
         }
         setTypeReleaseIterator(si);
 
+        if(setobj->encoding == REDIS_ENCODING_ROARING)
+            roaringFree(setobj->ptr);
+        else
+            zfree(setobj->ptr);
         setobj->encoding = REDIS_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    }else if(enc == REDIS_ENCODING_ROARING &&
+             setobj->encoding == REDIS_ENCODING_INTSET){
+        roaring *r = roaringNew();
+        int64_t llele;
+        uint32_t pos;
+
+        for(pos = 0; intsetGet(setobj->ptr, pos, &llele); pos++)
+            roaringAdd(r, llele);
+        //Pick the layout of every container once they are all filled
+        roaringOptimize(r);
+
+        zfree(setobj->ptr);
+        setobj->encoding = REDIS_ENCODING_ROARING;
+        setobj->ptr = r;
+    }else if(enc == REDIS_ENCODING_INTSET &&
+             setobj->encoding != REDIS_ENCODING_INTSET){
+        intset *is = intsetNew();
+        int64_t llele;
+
+        if(setobj->encoding == REDIS_ENCODING_ROARING){
+            roaringIterator ri;
+
+            //The values come sorted, every add is an append
+            roaringInitIterator(setobj->ptr, &ri);
+            while(roaringNext(&ri, &llele)) is = intsetAdd(is, llele, NULL);
+            roaringFree(setobj->ptr);
+        }else{
+            dictIterator *di = dictGetIterator(setobj->ptr);
+            dictEntry *de;
+            long long llval;
+
+            while((de = dictNext(di)) != NULL){
+                redisAssertWithInfo(NULL, setobj,
+                    isObjectRepresentableAsLongLong(dictGetKey(de), &llval) == REDIS_OK);
+                is = intsetAdd(is, llval, NULL);
+            }
+            dictReleaseIterator(di);
+            dictRelease(setobj->ptr);
+        }
+        setobj->encoding = REDIS_ENCODING_INTSET;
+        setobj->ptr = is;
     }else{
         redisPainc("Unknown type");
     }
 }
 
+/* Values sampled by setTypeConvertLargeIntset() to estimate the number of
+ * roaring containers, and the fewest values per container worth a bitmap.
+ * A container costs about 64 bytes with its key and its slot, a hash table
+ * member about 56 bytes: below SET_ROARING_MIN_FILL values per container the
+ * bitmap saves little memory and pays a binary search over many keys. */
+#define SET_ROARING_SAMPLES 64
+#define SET_ROARING_MIN_FILL 4
+
+/**
+ * Convert an intset that outgrew set_max_intset_entries to a roaring bitmap
+ * when its values are dense enough, otherwise to a hash table.
+ *
+ * The intset is sorted, so between two sampled positions there are no more
+ * containers than positions nor than distinct high bits. Summing the
+ * smaller of the two over SET_ROARING_SAMPLES evenly spaced samples, the
+ * first and the last value included, bounds the number of containers.
+ */
+void setTypeConvertLargeIntset(robj *setobj){
+    intset *is = setobj->ptr;
+    uint32_t len = intsetLen(is), pos, prev = 0, j;
+    uint64_t containers = 1, keygap;
+    int64_t value, key, prevkey;
+
+    intsetGet(is, 0, &value);
+    prevkey = value >> 16;
+    for(j = 1; j <= SET_ROARING_SAMPLES; j++){
+        pos = (uint32_t)((uint64_t)(len - 1) * j / SET_ROARING_SAMPLES);
+        if(pos == prev) continue;
+
+        intsetGet(is, pos, &value);
+        key = value >> 16;
+        keygap = (uint64_t)key - (uint64_t)prevkey;
+        containers += keygap < pos - prev ? keygap : pos - prev;
+        prev = pos;
+        prevkey = key;
+    }
+
+    if((uint64_t)len < containers * SET_ROARING_MIN_FILL)
+        setTypeConvert(setobj, REDIS_ENCODING_HT);
+    else
+        setTypeConvert(setobj, REDIS_ENCODING_ROARING);
+}
+
+/**
+ * Turn a set back into an intset once it holds no more than
+ * 1/REDIS_COMPACT_RATIO of set_max_intset_entries integers, so that a set
+ * that shrinks and grows around the limit is not converted back and forth.
+ *
+ * Returns 1 if the set was converted.
+ */
+int setTypeTryCompaction(robj *setobj){
+
+    if(setobj->encoding == REDIS_ENCODING_INTSET) return 0;
+    if(setTypeSize(setobj) > server.set_max_intset_entries / REDIS_COMPACT_RATIO) return 0;
+
+    if(setobj->encoding == REDIS_ENCODING_HT){
+        dictIterator *di = dictGetIterator(setobj->ptr);
+        dictEntry *de;
+        long long llval;
+        int integers = 1;
+
+        while(integers && (de = dictNext(di)) != NULL){
+            if(isObjectRepresentableAsLongLong(dictGetKey(de), &llval) != REDIS_OK)
+                integers = 0;
+        }
+        dictReleaseIterator(di);
+        if(!integers) return 0;
+    }
+
+    setTypeConvert(setobj, REDIS_ENCODING_INTSET);
+    return 1;
+}
+
 /*------------------------------------------------------------------
  * Set Command
  *-----------------------------------------------------------------*/ 
@@ -357,7 +523,7 @@ void smoveCommand(redisClient *c){
         return;
     }
 
-    ele = tryObjectEncoding(c->argv[3]);
+    ele = c->argv[3] = tryObjectEncoding(c->argv[3]);
     if(!setTypeRemove(sset, ele)){
         //If remove not success
         addReply(c, shared.czero);
@@ -415,11 +581,179 @@ void scardCommand(redisClient *c){
     addReplyLongLong(c, setTypeSize(set));
 }
 
-void spopCommand(redisCleint *c){
+/* When SPOP pops more than size/SPOP_MOVE_STRATEGY_MUL members of a hash
+ * table, the members that stay are drawn and moved to a new dict instead. */
+#define SPOP_MOVE_STRATEGY_MUL 5
+
+/**
+ * Handle the "SPOP key count" variant. The normal version of the command is
+ * handled by the spopCommand() function itself.
+ * 
+ * An intset flags K random positions and is compacted once with
+ * intsetRetain(), the popped members are shuffled so the reply is not in
+ * ascending order. A hash table draws every member with its own
+ * dictGetRandomKey(), or draws the members to keep when most of the set
+ * goes. The pop is propagated as a single "SREM key member [member ...]".
+ */ 
+void spopWithCountCommand(redisClient *c){
+    long l;
+    unsigned long count, size, j;
+    robj *set, **argv;
+    int argc = 2;
+
+    if(getLongFromObjectOrReply(c, c->argv[2], &l, NULL) != REDIS_OK) return;
+    if(l < 0){
+        addReplyError(c, "value is out of range, must be positive");
+        return;
+    }
+    count = l;
+
+    if((set = lookupKeyWriteOrReply(c, c->argv[1], shared.emptymultibulk)) == NULL ||
+       checkType(c, set, REDIS_SET)) return;
+
+    if(count == 0){
+        addReply(c, shared.emptymultibulk);
+        return;
+    }
+
+    size = setTypeSize(set);
+    if(count > size) count = size;
+
+    //SREM key member [member ...]
+    argv = zmalloc(sizeof(robj*) * (count + 2));
+    argv[0] = createStringObject("SREM", 4);
+    argv[1] = c->argv[1];
+    incrRefCount(c->argv[1]);
+
+    addReplyMultiBulkLen(c, count);
+
+    if(set->encoding == REDIS_ENCODING_INTSET){
+        /**
+         * Flag the positions to pop. When most of the set goes, flag the
+         * positions to keep instead, so the random picks never exceed size/2.
+         */ 
+        int invert = count * 2 > size;
+        unsigned long picks = invert ? size - count : count;
+        uint8_t *keep = zmalloc(size);
+        int64_t *popped = zmalloc(sizeof(int64_t) * count), llele;
+        unsigned long n = 0;
+
+        memset(keep, invert ? 0 : 1, size);
+        while(picks){
+            unsigned long pos = random() % size;
+
+            if(keep[pos] == invert) continue;
+            keep[pos] = invert;
+            picks--;
+        }
+
+        for(j = 0; j < size; j++)
+            if(!keep[j]) intsetGet(set->ptr, j, &popped[n++]);
+
+        //The positions come in ascending order, shuffle them (Fisher-Yates)
+        for(j = count - 1; j > 0; j--){
+            unsigned long k = random() % (j + 1);
+
+            llele = popped[j];
+            popped[j] = popped[k];
+            popped[k] = llele;
+        }
+
+        for(j = 0; j < count; j++){
+            addReplyBulkLongLong(c, popped[j]);
+            argv[argc++] = createStringObjectFromLongLong(popped[j]);
+        }
+        set->ptr = intsetRetain(set->ptr, keep);
+        zfree(popped);
+        zfree(keep);
+    }else if(set->encoding == REDIS_ENCODING_ROARING){
+        /* Every pop shrinks the bitmap, so each rank is drawn among the
+         * members still there. */
+        int64_t llele;
+
+        for(j = 0; j < count; j++){
+            llele = roaringRandom(set->ptr);
+            roaringRemove(set->ptr, llele);
+            addReplyBulkLongLong(c, llele);
+            argv[argc++] = createStringObjectFromLongLong(llele);
+        }
+    }else if(set->encoding == REDIS_ENCODING_HT &&
+             count * SPOP_MOVE_STRATEGY_MUL > size){
+        /* Most of the set goes: draw the members that stay and move them to
+         * a new dict, what is left in the old one is popped. */
+        dict *keep = dictCreate(&setDictType, NULL), *d;
+        unsigned long remaining = size - count;
+        dictIterator *di;
+        dictEntry *de;
+        robj *ele;
+
+        while(remaining--){
+            ele = dictGetKey(dictGetRandomKey(set->ptr));
+            //The delete drops the reference of the old dict
+            incrRefCount(ele);
+            dictDelete(set->ptr, ele);
+            redisAssert(dictAdd(keep, ele, NULL) == DICT_OK);
+        }
+
+        di = dictGetIterator(set->ptr);
+        while((de = dictNext(di)) != NULL){
+            ele = dictGetKey(de);
+            incrRefCount(ele);
+            addReplyBulk(c, ele);
+            argv[argc++] = ele;
+        }
+        dictReleaseIterator(di);
+
+        d = set->ptr;
+        set->ptr = keep;
+        dictRelease(d);
+    }else if(set->encoding == REDIS_ENCODING_HT){
+        //Every member is an independent draw among the ones still there
+        for(j = 0; j < count; j++){
+            robj *ele = dictGetKey(dictGetRandomKey(set->ptr));
+
+            incrRefCount(ele);
+            dictDelete(set->ptr, ele);
+            addReplyBulk(c, ele);
+            argv[argc++] = ele;
+        }
+        if(htNeedsResize(set->ptr)) dictResize(set->ptr);
+    }else{
+        redisPanic("Unknown set encoding");
+    }
+
+    //Send event notification
+    notifyKeyspaceEvent(REDIS_NOTIFY_SET, "spop", c->argv[1], c->db->id);
+
+    /*Replicate this command as an SREM operation with all the members*/
+    replaceClientCommandVector(c, argc, argv);
+
+    //If this set is empty delete it from the database
+    if(setTypeSize(set) == 0){
+        dbDelete(c->db, c->argv[1]);
+
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", c->argv[1], c->db->id);
+    }
+
+    signalModifiedKey(c->db, c->argv[1]);
+
+    server.dirty += count;
+}
+
+void spopCommand(redisClient *c){
     robj *set, *ele, *aux;
     int64_t llele;
     int encoding;
 
+    if(c->argc == 3){
+        spopWithCountCommand(c);
+        return;
+    }
+    if(c->argc > 3){
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+
     if((set = lookupKeyWriteOrReply(c->db, c->argv[1], shared.nullbulk)) == NULL ||
        checkType(c, set, REDIS_SET)) return;
 
@@ -427,6 +761,9 @@ void spopCommand(redisCleint *c){
     if(encoding == REDIS_ENCODING_INTSET){
         ele = createStringObjectFromLongLong(llele);
         set->ptr = intsetRemove(set->ptr, llele, NULL);
+    }else if(encoding == REDIS_ENCODING_ROARING){
+        ele = createStringObjectFromLongLong(llele);
+        roaringRemove(set->ptr, llele);
     }else{
         incrRefCount(ele);
         setTypeRemove(set, ele);
@@ -437,7 +774,7 @@ void spopCommand(redisCleint *c){
 
     /*Replicate this command as an SREM operation*/
     aux = createStringObject("SREM", 4);
-    rewriteClientCommandVecotr(c, 3, aux, c->argv[1], ele);
+    rewriteClientCommandVector(c, 3, aux, c->argv[1], ele);
     decrRefCount(ele);
     decrRefCount(aux);
 
@@ -465,6 +802,48 @@ void spopCommand(redisCleint *c){
  */ 
 #define SRANDMEMBER_SUB_STRATEGY_MUL 3
 
+/**
+ * Up to this count the members sampled from a hash table are deduplicated
+ * with a linear scan of the picks, instead of a temporary dictionary.
+ */
+#define SRANDMEMBER_SMALL_COUNT 64
+
+/**
+ * Return a random double in (0, 1)
+ */
+static double srandUnit(void){
+    return ((double)random() + 1) / ((double)RAND_MAX + 2);
+}
+
+/**
+ * Pick `count` distinct positions among [0, size) uniformly, into `pos`.
+ * This is reservoir sampling with geometric skips (Algorithm L), it only
+ * draws O(count * (1 + log(size/count))) random numbers and never looks at
+ * the positions it skips.
+ */
+static void srandmemberSamplePositions(unsigned long size, unsigned long count, uint64_t *pos){
+    unsigned long i, next = count - 1;
+    double w, skip;
+
+    for(i = 0; i < count; i++) pos[i] = i;
+
+    w = exp(log(srandUnit()) / count);
+    while(1){
+        skip = floor(log(srandUnit()) / log1p(-w));
+        if(skip >= (double)(size - next)) break;
+        next += (unsigned long)skip + 1;
+        if(next >= size) break;
+        pos[random() % count] = next;
+        w *= exp(log(srandUnit()) / count);
+    }
+}
+
+static int srandmemberComparePositions(const void *a, const void *b){
+    uint64_t pa = *(const uint64_t*)a, pb = *(const uint64_t*)b;
+
+    return (pa > pb) - (pa < pb);
+}
+
 void srandmemberWithCountCommand(redisClient *c){
     long l;
     unsigned long count, size;
@@ -472,13 +851,14 @@ void srandmemberWithCountCommand(redisClient *c){
     //In the default, we treat the return set doesn't contains duplicate element;
     int uniq = 1;
 
-    rob *set, *ele;
+    robj *set, *ele;
     int64_t llele;
     int encoding;
+    setTypeIterator *si;
 
     dict *d;
 
-    if(getLongFromObjectOrReply(c, *l, c->argv[2]) != REDIS_OK) return;
+    if(getLongFromObjectOrReply(c, c->argv[2], &l, NULL) != REDIS_OK) return;
 
     if(l >= 0){
         count = l;
@@ -487,7 +867,7 @@ void srandmemberWithCountCommand(redisClient *c){
         count = -l;
     }
 
-    if((set = lookupKeyReadOrReply(c->db, c->argv[1], shared.nullbulk)) == NULL || 
+    if((set = lookupKeyReadOrReply(c, c->argv[1], shared.emptymultibulk)) == NULL || 
        checkType(c, set, REDIS_SET)) return;
 
     //We deal this speical case, if the input count is zero, we return 
@@ -507,9 +887,9 @@ void srandmemberWithCountCommand(redisClient *c){
 
         while(count--){
             encoding = setTypeRandomElement(set, &ele, &llele);
-            if(encoding == REDIS_ENCODING_INTSET){
+            if(encoding != REDIS_ENCODING_HT){
                 addReplyBulkLongLong(c, llele);
-            }else if(encoding == REDIS_ENCODING_HT){
+            }else{
                 addReplyBulk(c, ele);
             }
         }
@@ -521,7 +901,67 @@ void srandmemberWithCountCommand(redisClient *c){
      * Return the whole set.
      */ 
     if(count >= size){
-        //return the whole set
+        addReplyMultiBulkLen(c, size);
+
+        si = setTypeInitIterator(set);
+        while((encoding = setTypeNext(si, &ele, &llele)) != -1){
+            if(encoding != REDIS_ENCODING_HT)
+                addReplyBulkLongLong(c, llele);
+            else
+                addReplyBulk(c, ele);
+        }
+        setTypeReleaseIterator(si);
+        return;
+    }
+
+    /**
+     * Integer sets can be read by position, so `count` distinct positions are
+     * sampled and read directly, whatever the size of the set. A roaring
+     * bitmap reads its positions in order, in a single pass.
+     */ 
+    if(set->encoding != REDIS_ENCODING_HT){
+        uint64_t *pos = zmalloc(sizeof(uint64_t) * count);
+        unsigned long j;
+
+        srandmemberSamplePositions(size, count, pos);
+        addReplyMultiBulkLen(c, count);
+        if(set->encoding == REDIS_ENCODING_INTSET){
+            for(j = 0; j < count; j++){
+                intsetGet(set->ptr, pos[j], &llele);
+                addReplyBulkLongLong(c, llele);
+            }
+        }else{
+            int64_t *values = zmalloc(sizeof(int64_t) * count);
+
+            qsort(pos, count, sizeof(uint64_t), srandmemberComparePositions);
+            roaringSelectMany(set->ptr, pos, values, count);
+            for(j = 0; j < count; j++) addReplyBulkLongLong(c, values[j]);
+            zfree(values);
+        }
+        zfree(pos);
+        return;
+    }
+
+    /**
+     * Small counts out of a large hash table: the picks are few and unlikely
+     * to collide, so duplicates are found scanning the picks themselves.
+     * Members of a dictionary are distinct objects, comparing the pointers
+     * is enough.
+     */ 
+    if(count <= SRANDMEMBER_SMALL_COUNT &&
+       count * SRANDMEMBER_SUB_STRATEGY_MUL <= size){
+        robj *picked[SRANDMEMBER_SMALL_COUNT];
+        unsigned long added = 0, j;
+
+        while(added < count){
+            setTypeRandomElement(set, &ele, &llele);
+            for(j = 0; j < added; j++)
+                if(picked[j] == ele) break;
+            if(j == added) picked[added++] = ele;
+        }
+
+        addReplyMultiBulkLen(c, count);
+        for(j = 0; j < count; j++) addReplyBulk(c, picked[j]);
         return;
     }
 
@@ -530,7 +970,7 @@ void srandmemberWithCountCommand(redisClient *c){
      * unique, the different between 3 & 4 lies is pretty like search something
      * in a double-linked list we start from head or tail.
      */ 
-    d = dictCreate(%setDictType, NULL);
+    d = dictCreate(&setDictType, NULL);
 
 
     /**
@@ -542,18 +982,12 @@ void srandmemberWithCountCommand(redisClient *c){
      * 元素可能会快一点（类似于双向链表，我们的index>len/2，从尾部开始会快一点一个思维）
      */ 
     if(count * SRANDMEMBER_SUB_STRATEGY_MUL > size){
-        setTypeInitIterator *si;
         int retval = REDIS_ERR;
 
         si = setTypeInitIterator(set);
         while((encoding = setTypeNext(si, &ele, &llele)) != -1){
-            if(encoding == REDIS_ENCODING_INTSET){
-                retval = dictAdd(d, createStringObjectFromLongLong(llele), NULL);        
-            }else{
-                retval = dictAdd(d, dupStringObject(ele), NULL);
-            }
-
-            redisAssert(retval == REDIS_OK);
+            retval = dictAdd(d, dupStringObject(ele), NULL);
+            redisAssert(retval == DICT_OK);
         }
 
         setTypeReleaseIterator(si);
@@ -564,19 +998,15 @@ void srandmemberWithCountCommand(redisClient *c){
 
             //Get Random key then delete
             de = dictGetRandomKey(d);
-            dictDelete(d, de->key);
+            dictDelete(d, dictGetKey(de));
             size--;
         }
     }else{
         unsigned long added = 0;
 
         while(added < count){
-            encoding = setTypeRandomElement(set, &ele, &llele);
-            if(encoding == REDIS_ENCODING_INTSET){
-                ele = createStringObjectFromLongLong(llele);
-            }else{
-                ele = dupStringObject(ele);
-            }
+            setTypeRandomElement(set, &ele, &llele);
+            ele = dupStringObject(ele);
 
             if(dictAdd(d, ele, NULL) == DICT_OK)
                 added++;
@@ -593,7 +1023,7 @@ void srandmemberWithCountCommand(redisClient *c){
     di = dictGetIterator(d);
 
     addReplyMultiBulkLen(c, count);
-    while((de = dictNext(d)) != NULL){
+    while((de = dictNext(di)) != NULL){
         addReplyBulk(c, dictGetKey(de));
     }
     dictReleaseIterator(di);
@@ -619,7 +1049,7 @@ void srandmemberCommand(redisClient *c){
 
     encoding = setTypeRandomElement(set, &ele, &llele);
 
-    if(encoding == REDIS_ENCODING_INTSET){
+    if(encoding != REDIS_ENCODING_HT){
         addReplyBulkLongLong(c, llele);
     }else {
         addReplyBulk(c, ele);
@@ -642,39 +1072,345 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2){
     return (o2 ? setTypeSize(o2) : 0) - (o1 ? sizeType(o1) : 0);
 }
 
+/*-----------------------------------------------------------------------------
+ * Batched membership probes
+ *
+ * Intersection and difference both look up the elements of one set into the
+ * other ones. Doing it SET_PROBE_BATCH elements at a time lets a hash table
+ * set be probed with a single dictFindBatch() call, that prefetches all the
+ * buckets before walking the chains.
+ *----------------------------------------------------------------------------*/
+
+#define SET_PROBE_BATCH 16
+
+typedef struct setProbeBatch{
+    //Number of elements in the batch
+    int n;
+    //Number of elements still alive
+    int left;
+    //The elements come from an intset
+    int isint;
+    robj *eles[SET_PROBE_BATCH];
+    int64_t ints[SET_PROBE_BATCH];
+    //Static INT encoded objects used to probe integers into hash tables
+    robj intobjs[SET_PROBE_BATCH];
+    int alive[SET_PROBE_BATCH];
+}setProbeBatch;
+
+/* Read the next batch from the iterator, every element starts alive.
+ * Returns the number of elements read, 0 at the end of the set.
+ */
+static int setProbeBatchRead(setTypeIterator *si, setProbeBatch *b){
+    b->isint = si->encoding != REDIS_ENCODING_HT;
+    for(b->n = 0; b->n < SET_PROBE_BATCH; b->n++){
+        if(setTypeNext(si, &b->eles[b->n], &b->ints[b->n]) == -1) break;
+        b->alive[b->n] = 1;
+    }
+    b->left = b->n;
+    return b->n;
+}
+
+/* Look up the alive elements of the batch into the set 's', the ones whose
+ * membership is not 'want' are marked dead. So want = 1 keeps the members
+ * (intersection) and want = 0 keeps the non members (difference).
+ */
+static void setProbeBatchLookup(setProbeBatch *b, robj *s, int want){
+    const void *keys[SET_PROBE_BATCH];
+    dictEntry *found[SET_PROBE_BATCH];
+    int i, k = 0, member;
+
+    if(s->encoding == REDIS_ENCODING_HT){
+        for(i = 0; i < b->n; i++){
+            if(!b->alive[i]) continue;
+            if(b->isint){
+                b->intobjs[i].type = REDIS_STRING;
+                b->intobjs[i].encoding = REDIS_ENCODING_INT;
+                b->intobjs[i].refcount = 1;
+                b->intobjs[i].ptr = (void*)(long)b->ints[i];
+                keys[k++] = &b->intobjs[i];
+            }else{
+                keys[k++] = b->eles[i];
+            }
+        }
+        dictFindBatch(s->ptr, keys, found, k);
+        for(i = 0, k = 0; i < b->n; i++){
+            if(!b->alive[i]) continue;
+            member = found[k++] != NULL;
+            if(member != want){
+                b->alive[i] = 0;
+                b->left--;
+            }
+        }
+    }else if(s->encoding == REDIS_ENCODING_INTSET ||
+             s->encoding == REDIS_ENCODING_ROARING){
+        for(i = 0; i < b->n; i++){
+            long long llval;
+
+            if(!b->alive[i]) continue;
+            if(!b->isint && isObjectRepresentableAsLongLong(b->eles[i], &llval) != REDIS_OK){
+                //A string is never a member of an integer set
+                member = 0;
+            }else{
+                if(b->isint) llval = b->ints[i];
+                member = (s->encoding == REDIS_ENCODING_INTSET) ?
+                         intsetFind(s->ptr, llval) : roaringContains(s->ptr, llval);
+            }
+            if(member != want){
+                b->alive[i] = 0;
+                b->left--;
+            }
+        }
+    }else{
+        redisPanic("Unknown set encoding");
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Set intersection
+ *
+ * SINTER, SINTERSTORE and SINTERCARD share the kernels below. The kernel is
+ * picked by the encoding and the shape of the input sets:
+ *
+ * 1) Every set is an intset and the smallest one is dense, that is its values
+ *    span at most SET_INTER_BITMAP_DENSITY times its cardinality: the sets are
+ *    turned into bitmaps over the range of the smallest one and ANDed.
+ * 2) Every set is an intset: the smallest set is merged against the others
+ *    with intsetSearchFrom(), which gallops forward from the last position.
+ * 3) Otherwise the elements of the smallest set are probed against the other
+ *    sets SET_PROBE_BATCH at a time, see setProbeBatchLookup().
+ * 4) Every set is a roaring bitmap: the bitmaps are ANDed container by
+ *    container.
+ *
+ * Elements of the intersection are handed to sinterEmit(), that replies with
+ * them, adds them to the destination set, or just counts them.
+ *----------------------------------------------------------------------------*/
+
+#define SET_INTER_BITMAP_DENSITY 8
+#define SET_INTER_BITMAP_MAX_RANGE (1<<24)
+
+/* Where the elements of the intersection go. */
+typedef struct setInterTarget{
+    //Reply with the elements when not NULL
+    redisClient *c;
+    //Add the elements to this set when not NULL
+    robj *dstset;
+    //Number of elements of the intersection seen so far
+    unsigned long card;
+    //Stop when card reaches limit, 0 means no limit
+    unsigned long limit;
+}setInterTarget;
+
+/* Hand an element of the intersection to the target, `eleobj` is used when
+ * `isint` is 0, `intele` otherwise.
+ *
+ * Returns 1 when the limit is reached and the caller should stop.
+ */
+static int sinterEmit(setInterTarget *t, robj *eleobj, int64_t intele, int isint){
+    if(t->c){
+        if(isint)
+            addReplyBulkLongLong(t->c, intele);
+        else
+            addReplyBulk(t->c, eleobj);
+    }else if(t->dstset){
+        if(isint)
+            setTypeAddInteger(t->dstset, intele);
+        else
+            setTypeAdd(t->dstset, eleobj);
+    }
+    t->card++;
+    return t->limit && t->card >= t->limit;
+}
+
+/* Kernel 1, dense intsets. The bitmap covers [min, max] of sets[0], every
+ * other set clears the bits of the values it doesn't hold.
+ *
+ * T = O(R/64 * K + N), R the range of sets[0], N the elements of the other
+ * sets inside that range.
+ */
+static void sinterIntsetBitmap(robj **sets, unsigned long setnum, setInterTarget *t){
+    intset *is = sets[0]->ptr;
+    int64_t min, max, v;
+    uint64_t *bits, *cur, word;
+    uint32_t pos, len;
+    unsigned long j, w, words;
+
+    intsetGet(is, 0, &min);
+    intsetGet(is, intsetLen(is) - 1, &max);
+    words = (unsigned long)((max - min) / 64) + 1;
+    bits = zcalloc(sizeof(uint64_t) * words);
+    cur = zmalloc(sizeof(uint64_t) * words);
+
+    for(pos = 0; intsetGet(is, pos, &v); pos++)
+        bits[(v - min) / 64] |= 1ULL << ((v - min) % 64);
+
+    for(j = 1; j < setnum; j++){
+        int empty = 1;
+
+        if(sets[j] == sets[0]) continue;
+        is = sets[j]->ptr;
+        len = intsetLen(is);
+        memset(cur, 0, sizeof(uint64_t) * words);
+
+        //Only the values inside [min, max] matter
+        pos = 0;
+        intsetSearchFrom(is, min, &pos);
+        for(; pos < len && intsetGet(is, pos, &v) && v <= max; pos++)
+            cur[(v - min) / 64] |= 1ULL << ((v - min) % 64);
+
+        for(w = 0; w < words; w++){
+            bits[w] &= cur[w];
+            if(bits[w]) empty = 0;
+        }
+        if(empty) goto done;
+    }
+
+    for(w = 0; w < words; w++){
+        word = bits[w];
+        while(word){
+            v = min + (int64_t)(w * 64) + __builtin_ctzll(word);
+            if(sinterEmit(t, NULL, v, 1)) goto done;
+            word &= word - 1;
+        }
+    }
+
+done:
+    zfree(bits);
+    zfree(cur);
+}
+
+/* Kernel 2, intsets. Each of the other sets keeps a cursor that only moves
+ * forward, so the whole merge is O(M * K * log(N/M)) with M the size of the
+ * smallest set and N the size of the others.
+ */
+static void sinterIntsetGallop(robj **sets, unsigned long setnum, setInterTarget *t){
+    uint32_t *cursor = zcalloc(sizeof(uint32_t) * setnum);
+    intset *is = sets[0]->ptr;
+    uint32_t pos;
+    unsigned long j;
+    int64_t v;
+
+    for(pos = 0; intsetGet(is, pos, &v); pos++){
+        for(j = 1; j < setnum; j++){
+            intset *other = sets[j]->ptr;
+
+            if(sets[j] == sets[0]) continue;
+            if(!intsetSearchFrom(other, v, &cursor[j])){
+                //Every other value of sets[0] is greater, nothing left to find
+                if(cursor[j] == intsetLen(other)) goto done;
+                break;
+            }
+        }
+        if(j == setnum && sinterEmit(t, NULL, v, 1)) goto done;
+    }
+
+done:
+    zfree(cursor);
+}
+
+/* Kernel 3, the generic probe. Elements of sets[0] are read SET_PROBE_BATCH
+ * at a time and every other set is probed for the whole batch before moving
+ * to the next set.
+ */
+static void sinterProbe(robj **sets, unsigned long setnum, setInterTarget *t){
+    setTypeIterator *si = setTypeInitIterator(sets[0]);
+    setProbeBatch b;
+    int i, stop = 0;
+    unsigned long j;
+
+    while(!stop && setProbeBatchRead(si, &b)){
+        for(j = 1; j < setnum && b.left; j++){
+            if(sets[j] == sets[0]) continue;
+            setProbeBatchLookup(&b, sets[j], 1);
+        }
+
+        for(i = 0; i < b.n && !stop; i++){
+            if(b.alive[i]) stop = sinterEmit(t, b.eles[i], b.ints[i], b.isint);
+        }
+    }
+    setTypeReleaseIterator(si);
+}
+
+/* Kernel 4, roaring bitmaps. The containers of the smallest bitmap are
+ * ANDed with the ones of the same key in the other bitmaps.
+ */
+static void sinterRoaring(robj **sets, unsigned long setnum, setInterTarget *t){
+    roaring *r = roaringDup(sets[0]->ptr);
+    roaringIterator ri;
+    unsigned long j;
+    int64_t v;
+
+    for(j = 1; j < setnum && roaringCard(r); j++)
+        roaringAnd(r, sets[j]->ptr);
+
+    roaringInitIterator(r, &ri);
+    while(roaringNext(&ri, &v)){
+        if(sinterEmit(t, NULL, v, 1)) break;
+    }
+    roaringFree(r);
+}
+
+/* Pick the kernel for the sets, sorted from the smallest to the largest. */
+static void sinterDispatch(robj **sets, unsigned long setnum, setInterTarget *t){
+    unsigned long j;
+    int allintset = 1, allroaring = 1;
+
+    for(j = 0; j < setnum; j++){
+        if(sets[j]->encoding != REDIS_ENCODING_INTSET) allintset = 0;
+        if(sets[j]->encoding != REDIS_ENCODING_ROARING) allroaring = 0;
+    }
+
+    if(allroaring){
+        sinterRoaring(sets, setnum, t);
+    }else if(allintset && setnum > 1){
+        intset *is = sets[0]->ptr;
+        uint32_t len = intsetLen(is);
+        int64_t min, max;
+
+        intsetGet(is, 0, &min);
+        intsetGet(is, len - 1, &max);
+        if((uint64_t)(max - min) < SET_INTER_BITMAP_MAX_RANGE &&
+           (uint64_t)(max - min) < (uint64_t)len * SET_INTER_BITMAP_DENSITY){
+            sinterIntsetBitmap(sets, setnum, t);
+        }else{
+            sinterIntsetGallop(sets, setnum, t);
+        }
+    }else{
+        sinterProbe(sets, setnum, t);
+    }
+}
+
 /**
  * This part is a generic funtion for set intset operation.
  * If the dstkey is not empty, then we need to save the inet set element into the dstKey
  * respect set.
- * The operation is pretty simple, we sort this input sets, use the first one as a privot
- * loop through all the elements in this set and to check if each element is existed.
+ * When cardonly is set (SINTERCARD) only the cardinality is replied, and the
+ * intersection stops as soon as it reaches `limit`, unless limit is 0.
  */ 
-void sinterGenericCommand(redisClient *c, robj **setKeys, unsigned long setnum, robj *dstkey){
+void sinterGenericCommand(redisClient *c, robj **setKeys, unsigned long setnum, robj *dstkey, int cardonly, unsigned long limit){
     
     //Set array
     robj **sets = zmalloc(sizeof(robj *) * setnum);
-
-    setTypeIterator *si;
-    robj *eleobj, *dstset = NULL;
-    int64_t intobj;
+    setInterTarget t;
     void *replylen = NULL;
-    unsigned long j, cardinality = 0;
-    int encoding;
+    unsigned long j;
 
     //Check all the elements in the setKeys if they are existed && objectType is REDIS_SET
     for(j = 0; j < setnum; j++){
         robj *setobj = dstkey ?
-                       lookupKeyWrite(c->db, setkey[j]) : 
-                       lookupKeyRead(c->db, setKey[j]);
+                       lookupKeyWrite(c->db, setKeys[j]) : 
+                       lookupKeyRead(c->db, setKeys[j]);
 
         //If any set is not existed, then this intset operation is give up.
         if(!setobj){
             zfree(sets);
             if(dstkey){ 
                 if(dbDelete(c->db, dstkey)){
-                    signalModifiedKey(c->db, key);
-                    addReply(c, shared.czero);
+                    signalModifiedKey(c->db, dstkey);
+                    server.dirty++;
                 }
+                addReply(c, shared.czero);
+            }else if(cardonly){
+                addReply(c, shared.czero);
             }else{
                 addReply(c, shared.emptymultibulk);
             }
@@ -686,7 +1422,7 @@ void sinterGenericCommand(redisClient *c, robj **setKeys, unsigned long setnum,
             zfree(sets);
             return;
         }
-        setobj[j] = setobj;
+        sets[j] = setobj;
     }
 
     /**
@@ -695,77 +1431,28 @@ void sinterGenericCommand(redisClient *c, robj **setKeys, unsigned long setnum,
      */ 
     qsort(sets, setnum, sizeof(robj*), qsortCompareSetsByCardinality);
 
+    t.c = NULL;
+    t.dstset = NULL;
+    t.card = 0;
+    t.limit = limit;
+
     /* The first thing we should output is the total number of elements...
      * since this is a multi-bulk write, but at this stage we don't know
      * the intersection set size, so we use a trick, append an empty object
      * to the output list and save the pointer to later modify it with the
      * right length */
-    // 因为不知道结果集会有多少个元素，所有没有办法直接设置回复的数量
-    // 这里使用了一个小技巧，直接使用一个 BUFF 列表，
-    // 然后将之后的回复都添加到列表中
-    if (!dstkey) {
-        replylen = addDeferredMultiBulkLength(c);
-    } else {
+    if(dstkey){
         /* If we have a target key where to store the resulting set
-         * create this key with an empty set inside */
-        dstset = createIntsetObject();
-    }
-
-    /**
-     * We use the first element of this set as a privot, choose each
-     * element of it then check if this element in other sets, it
-     * this element exist in all the other sets, then we find a inset.
-     */ 
-    si = setTypeInitIterator(sets[0]);
-
-    while((encoding = setTypeNext(si, &eleobj, &intobj)) != -1){
-        for(j = 1; j < setnum; j++){
-
-            if(s[j] == s[0]) continue;
-
-            if(encoding == REDIS_ENCODING_INTSET){
-                if(s[j]->encoding == REDIS_ENCODING_INTSET && !intsetFind(s[j], intobj)) break;
-
-                else if(s[j]->encoding == REDIS_ENCOIDNG_HT){
-                    eleobj = createStringObjectFromLongLong(intobj);
-                    if(!setTypeIsMember(s[j], eleobj)){
-                        decrRefCount(eleobj);
-                        break;
-                    }
-                    decrRefCount(eleobj);
-                }
-            }else if(encoding == REDIS_ENCODING_HT){
-                if(s[j]->encoding == REDIS_ENCDOING_INTSET && 
-                   eleobj->encoding == REDIS_ENCDOING_INT && 
-                   !intsetFind(s[j], (long)eleobj->ptr)){
-                       break;
-                }else if(s[j]->encoding == REDIS_ENCODING_HT){
-                    if(!setTypeIsMember(s[j], ele)) break;
-                }
-            }
-        }
-            //This means the element exist in all the otherset
-        if(j == setnum){
-            //SINTER command
-            if(!dstkey){
-                if(encoding == REDIS_ENCODING_HT)
-                    addReplyBulk(c, eleobj);
-                else
-                    addReplyBulkLongLong(c, intobj);
-                cardinality++;
-            }else{
-                if(encoding == REDIS_ENCODING_INTSET){
-                    eleobj = createStringObjectFromLongLong(intobj);
-                    setTypeAdd(dstset, eleobj);
-                    decrRefCount(eleobj);
-                }else{
-                    setTypeAdd(dstset, eleobj);
-                }
-            }
-        }
+         * create this key with an empty set inside, the intersection of
+         * integer sets only holds integers */
+        t.dstset = (sets[0]->encoding != REDIS_ENCODING_HT) ?
+                   createIntsetObject() : createSetObject();
+    }else if(!cardonly){
+        replylen = addDeferredMultiBulkLength(c);
+        t.c = c;
     }
 
-    setTypeReleaseIterator(si);
+    sinterDispatch(sets, setnum, &t);
 
     //SETINTERSTORE Command
     if(dstkey){
@@ -774,33 +1461,58 @@ void sinterGenericCommand(redisClient *c, robj **setKeys, unsigned long setnum,
          */ 
         int deleted = dbDelete(c->db, dstkey);
 
-        if(setTypeSize(dstset) > 0){
-            dbAdd(c->db, dstkey, dstset);
-            addReplyLongLong(c, setTypeSize(dstset));
+        if(setTypeSize(t.dstset) > 0){
+            dbAdd(c->db, dstkey, t.dstset);
+            addReplyLongLong(c, setTypeSize(t.dstset));
             notifyKeyspaceEvent(REDIS_NOTIFY_SET, "sinterstore", dstkey, c->db->id);
         }else{
-            decrRefCount(dstset);
+            decrRefCount(t.dstset);
             addReply(c, shared.czero);
             if(deleted){
                 notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",
                 dstkey,c->db->id);
             }
-            signalModifiedKey(c->db, dstkey);
-
-            server.dirty++;
         }
+        signalModifiedKey(c->db, dstkey);
+        server.dirty++;
+    }else if(cardonly){
+        addReplyLongLong(c, t.card);
     }else{
-        setDeferredMultiBulkLength(c,replylen,cardinality);
+        setDeferredMultiBulkLength(c,replylen,t.card);
     }
     zfree(sets);
 }
 
 void sinterCommand(redisClient *c){
-    sinterGenericCommand(c, c->argv+1, c->argc - 1, NULL);
+    sinterGenericCommand(c, c->argv+1, c->argc - 1, NULL, 0, 0);
 }
 
 void sinterstoreCommand(redisClient *c){
-    sinterGenericCommand(c, c->argv+1, c->argc-2, c->argv[1]);
+    sinterGenericCommand(c, c->argv+2, c->argc-2, c->argv[1], 0, 0);
+}
+
+/* SINTERCARD numkeys key [key ...] [LIMIT limit] */
+void sintercardCommand(redisClient *c){
+    long numkeys, limit = 0;
+
+    if(getLongFromObjectOrReply(c, c->argv[1], &numkeys, NULL) != REDIS_OK) return;
+    if(numkeys < 1 || numkeys > c->argc - 2){
+        addReplyError(c, "numkeys should be greater than 0 and not greater than the number of keys");
+        return;
+    }
+
+    if(c->argc == numkeys + 4 && !strcasecmp(c->argv[numkeys+2]->ptr, "limit")){
+        if(getLongFromObjectOrReply(c, c->argv[numkeys+3], &limit, NULL) != REDIS_OK) return;
+        if(limit < 0){
+            addReplyError(c, "LIMIT can't be negative");
+            return;
+        }
+    }else if(c->argc != numkeys + 2){
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+
+    sinterGenericCommand(c, c->argv+2, numkeys, NULL, 1, limit);
 }
 
 //Command Type
@@ -808,32 +1520,163 @@ void sinterstoreCommand(redisClient *c){
 #define REDIS_OP_DIFF 1
 #define REDIS_OP_INTER 2
 
-void sunionDiffGenericCommand(redisClient *c,robj **setkeys, int setnum, robj *dstkey, int op){
+/* SUNION kernel. When every input is an intset the union is an intset too,
+ * built by intsetUnion() with a single allocation. When every input is an
+ * intset or a roaring bitmap the union is a roaring bitmap, the bitmaps are
+ * ORed container by container. Otherwise the result is a hash table
+ * presized for the largest input, so it is decided up front and never
+ * converted while elements are added.
+ */
+static robj *sunionBuild(robj **sets, int setnum){
+    setTypeIterator *si;
+    robj *dstset, *ele;
+    int64_t llele;
+    unsigned long maxcard = 0;
+    int j, n = 0, encoding, allintset = 1, allint = 1;
 
-    robj **sets = zmalloc(sizeof(robj*) * setnum);
+    for(j = 0; j < setnum; j++){
+        if(!sets[j]) continue;
+        if(sets[j]->encoding != REDIS_ENCODING_INTSET) allintset = 0;
+        if(sets[j]->encoding == REDIS_ENCODING_HT) allint = 0;
+        if(setTypeSize(sets[j]) > maxcard) maxcard = setTypeSize(sets[j]);
+    }
 
-    setTypeIterator *si;
-    robj *ele, *dstset = NULL;
-    robj *setobj = NULL;
-    int j, cardinality = 0;
-    int diff_algo = 1;
+    if(allintset){
+        intset **is = zmalloc(sizeof(intset*) * setnum);
 
-    //Check all the input set and put then into the sets object.
+        for(j = 0; j < setnum; j++){
+            if(sets[j]) is[n++] = sets[j]->ptr;
+        }
+        dstset = createObject(REDIS_SET, intsetUnion(is, n));
+        dstset->encoding = REDIS_ENCODING_INTSET;
+        zfree(is);
+        return dstset;
+    }
+
+    if(allint){
+        roaring *r = roaringNew();
+
+        for(j = 0; j < setnum; j++){
+            if(!sets[j]) continue;
+            if(sets[j]->encoding == REDIS_ENCODING_ROARING){
+                roaringOr(r, sets[j]->ptr);
+            }else{
+                uint32_t pos;
+
+                for(pos = 0; intsetGet(sets[j]->ptr, pos, &llele); pos++)
+                    roaringAdd(r, llele);
+            }
+        }
+        roaringOptimize(r);
+        dstset = createObject(REDIS_SET, r);
+        dstset->encoding = REDIS_ENCODING_ROARING;
+        //A union that fits an intset is stored as one
+        if(roaringCard(r) <= server.set_max_intset_entries)
+            setTypeConvert(dstset, REDIS_ENCODING_INTSET);
+        return dstset;
+    }
+
+    dstset = createSetObject();
+    dictExpand(dstset->ptr, maxcard);
     for(j = 0; j < setnum; j++){
-        setobj = dstkey ?
-                 lookupKeyWrite(c, setkeys[j]) :
-                 lookupKeyRead(c, setkeys[j]);
-        if(setobj == NULL) {
-            sets[j] = NULL;
-            continue;
+        if(!sets[j]) continue;
+
+        si = setTypeInitIterator(sets[j]);
+        while((encoding = setTypeNext(si, &ele, &llele)) != -1){
+            if(encoding != REDIS_ENCODING_HT){
+                ele = createStringObjectFromLongLong(llele);
+                if(dictAdd(dstset->ptr, ele, NULL) != DICT_OK) decrRefCount(ele);
+            }else if(dictAdd(dstset->ptr, ele, NULL) == DICT_OK){
+                incrRefCount(ele);
+            }
         }
+        setTypeReleaseIterator(si);
+    }
+    return dstset;
+}
 
-        if(checkType(c, setobj, REDIS_SET)) {
-            zfree(sets);
-            return;
+/* SDIFF kernel. The difference is a subset of sets[0], so it takes the
+ * encoding of sets[0]:
+ *
+ * 1) sets[0] is an intset: intsetDiff() merges it against the other intsets
+ *    with a single allocation, then the survivors are probed against the
+ *    other sets in batches and the set is compacted with intsetRetain().
+ * 2) sets[0] is a roaring bitmap: the other bitmaps are subtracted container
+ *    by container, the members of the other sets are removed one by one.
+ * 3) sets[0] is a hash table: either its elements are probed against the
+ *    other sets in batches (algorithm 1), or it is copied and the elements of
+ *    the other sets are removed from the copy (algorithm 2).
+ */
+static robj *sdiffBuild(robj **sets, int setnum){
+    setTypeIterator *si;
+    setProbeBatch b;
+    robj *dstset, *ele;
+    int64_t llele;
+    int i, j, n = 0, encoding, probe = 0;
+
+    if(!sets[0]) return createIntsetObject();
+
+    if(sets[0]->encoding == REDIS_ENCODING_INTSET){
+        intset **is = zmalloc(sizeof(intset*) * setnum);
+
+        for(j = 1; j < setnum; j++){
+            if(!sets[j]) continue;
+            if(sets[j]->encoding == REDIS_ENCODING_INTSET)
+                is[n++] = sets[j]->ptr;
+            else
+                probe = 1;
+        }
+        dstset = createObject(REDIS_SET, intsetDiff(sets[0]->ptr, is, n));
+        dstset->encoding = REDIS_ENCODING_INTSET;
+        zfree(is);
+
+        if(probe && intsetLen(dstset->ptr)){
+            uint8_t *keep = zmalloc(intsetLen(dstset->ptr));
+            uint32_t pos = 0;
+
+            si = setTypeInitIterator(dstset);
+            while(setProbeBatchRead(si, &b)){
+                for(j = 1; j < setnum && b.left; j++){
+                    if(sets[j] && sets[j]->encoding != REDIS_ENCODING_INTSET)
+                        setProbeBatchLookup(&b, sets[j], 0);
+                }
+                for(i = 0; i < b.n; i++) keep[pos++] = b.alive[i];
+            }
+            setTypeReleaseIterator(si);
+            dstset->ptr = intsetRetain(dstset->ptr, keep);
+            zfree(keep);
         }
+        return dstset;
+    }
 
-        sets[j] = setobj;
+    if(sets[0]->encoding == REDIS_ENCODING_ROARING){
+        roaring *r = roaringDup(sets[0]->ptr);
+
+        for(j = 1; j < setnum && roaringCard(r); j++){
+            if(!sets[j]) continue;
+            if(sets[j]->encoding == REDIS_ENCODING_ROARING){
+                roaringAndNot(r, sets[j]->ptr);
+                continue;
+            }
+
+            si = setTypeInitIterator(sets[j]);
+            while((encoding = setTypeNext(si, &ele, &llele)) != -1){
+                long long llval;
+
+                if(encoding != REDIS_ENCODING_HT)
+                    roaringRemove(r, llele);
+                else if(isObjectRepresentableAsLongLong(ele, &llval) == REDIS_OK)
+                    roaringRemove(r, llval);
+            }
+            setTypeReleaseIterator(si);
+        }
+        roaringOptimize(r);
+        dstset = createObject(REDIS_SET, r);
+        dstset->encoding = REDIS_ENCODING_ROARING;
+        //Most of sets[0] may be gone, what is left can fit an intset
+        if(roaringCard(r) <= server.set_max_intset_entries)
+            setTypeConvert(dstset, REDIS_ENCODING_INTSET);
+        return dstset;
     }
 
     /**
@@ -847,74 +1690,42 @@ void sunionDiffGenericCommand(redisClient *c,robj **setkeys, int setnum, robj *d
      * There need a way to figure out when we need to choose 1 when we
      * choose 2.
      */ 
-    if(op == REDIS_OP_DIFF && set[0]){
-        long long algo_one_work = 0, alog_two_work = 0;
+    long long algo_one_work = 0, algo_two_work = 0;
 
-        for(j = 0; j < setnum; j++){
-            if(!set[j]) continue;
+    for(j = 0; j < setnum; j++){
+        if(!sets[j]) continue;
 
-            algo_one_work += setTypeSize(set[0]);
-            alog_two_work += setTypeSize(set[j]);
-        }
+        algo_one_work += setTypeSize(sets[0]);
+        algo_two_work += setTypeSize(sets[j]);
+    }
 
-        /**Alogrithm 1 has better constant time and perform less operation.
-         * If there are element in common.
-         */ 
-        algo_one_work /= 2;
-        diff_algo = (algo_one_work <= alog_two_work) ? 1 : 2;
+    /**Alogrithm 1 has better constant time and perform less operation.
+     * If there are element in common.
+     */ 
+    algo_one_work /= 2;
+    dstset = createSetObject();
+
+    if(algo_one_work <= algo_two_work){
         /* With algorithm 1 it is better to order the sets to subtract
          * by decreasing size, so that we are more likely to find
          * duplicated elements ASAP. */
         // 如果使用的是算法 1 ，那么最好对 sets[0] 以外的其他集合进行排序
         // 这样有助于优化算法的性能
-        if(diff_algo == 1 && setnum > 1){
+        if(setnum > 1)
             qsort(sets+1, setnum - 1, sizeof(robj*), qsortCompareSetsByRevCardinality);
-        }
-    }
-
-    /**
-     * We need a temo object set to store out union. If the dstKey is not NULL,
-     * then the set will be used to save the result object respect to the key.
-     */ 
-    dstset = createIntsetObject();
-
-    if(op == REDIS_OP_UNION){
-        for(j = 0; j < setnum; j++){
-            if(sets[j] == NULL) continue;
 
-            si = setTypeInitIterator(set[j]);
-            while((ele = setTypeNextObject(si) != NULL){
-                if(setTypeAdd(dstset, ele)) cardinality++;
-                decrRefCount(ele);
+        si = setTypeInitIterator(sets[0]);
+        while(setProbeBatchRead(si, &b)){
+            for(j = 1; j < setnum && b.left; j++){
+                if(sets[j]) setProbeBatchLookup(&b, sets[j], 0);
             }
-            setTypeReleaseIterator(si);
-        }
-    }else if(op == REDIS_OP_DIFF && set[0] && diff_algo == 1){
-        /* We perform the diff by iterating all the elements of the first set,
-         * and only adding it to the target set if the element does not exist
-         * into all the other sets.
-         */ 
-
-        /* This way we perform at max N*M operations, where N is the size of
-         * the first set, and M the number of sets. 
-         */ 
-        si = setTypeInitIterator(si[0]);
-        while((ele = setTypeNextObject(si)) != NULL){
-
-            for(j = 1; j < setnum; j++){
-                if(!set[j]) continue;
-                if(set[j] == set[0]) continue;
-                if(setTypeIsMember(sets[j], ele)) break;
+            for(i = 0; i < b.n; i++){
+                if(b.alive[i] && dictAdd(dstset->ptr, b.eles[i], NULL) == DICT_OK)
+                    incrRefCount(b.eles[i]);
             }
-
-            if(j == setnum){
-                setTypeAdd(dstset, ele);
-                cardinality++;
-            }
-            decrRefCount(ele);
         }
         setTypeReleaseIterator(si);
-    }else if(op == REDIS_OP_DIFF && set[0] && diff_algo == 2){
+    }else{
         /* DIFF Algorithm 2:
          *
          * 差集算法 2 ：
@@ -929,32 +1740,83 @@ void sunionDiffGenericCommand(redisClient *c,robj **setkeys, int setnum, robj *d
          *
          * 算法复杂度为 O(N) ，N 为所有集合的基数之和。
          */
-        for(j = 0; j < setnum; j++){
-            if(!set[j]) continue;
-
-            si = setTypeInitIterator(s[j]);
-            while((ele = setTypeNext(si)) != NULL){
-                if(j == 0){
-                    if(setTypeAdd(dstset, ele)) cardinality++;
-                }else{
-                    if(setTypeRemove(dstset, ele)) cardinality--;
+        dictExpand(dstset->ptr, setTypeSize(sets[0]));
+        si = setTypeInitIterator(sets[0]);
+        while(setTypeNext(si, &ele, &llele) != -1){
+            if(dictAdd(dstset->ptr, ele, NULL) == DICT_OK) incrRefCount(ele);
+        }
+        setTypeReleaseIterator(si);
+
+        for(j = 1; j < setnum && dictSize((dict*)dstset->ptr); j++){
+            if(!sets[j]) continue;
+
+            si = setTypeInitIterator(sets[j]);
+            while((encoding = setTypeNext(si, &ele, &llele)) != -1){
+                robj intobj;
+
+                if(encoding != REDIS_ENCODING_HT){
+                    intobj.type = REDIS_STRING;
+                    intobj.encoding = REDIS_ENCODING_INT;
+                    intobj.refcount = 1;
+                    intobj.ptr = (void*)(long)llele;
+                    ele = &intobj;
                 }
-                decrRefCount(ele);
+                dictDelete(dstset->ptr, ele);
             }
             setTypeReleaseIterator(si);
+        }
+    }
+    return dstset;
+}
+
+void sunionDiffGenericCommand(redisClient *c,robj **setkeys, int setnum, robj *dstkey, int op){
+
+    robj **sets = zmalloc(sizeof(robj*) * setnum);
+
+    setTypeIterator *si;
+    robj *ele, *dstset = NULL;
+    robj *setobj = NULL;
+    int64_t llele;
+    int j, encoding;
 
-            if(cardinality == 0) break;
+    //Check all the input set and put then into the sets object.
+    for(j = 0; j < setnum; j++){
+        setobj = dstkey ?
+                 lookupKeyWrite(c->db, setkeys[j]) :
+                 lookupKeyRead(c->db, setkeys[j]);
+        if(setobj == NULL) {
+            sets[j] = NULL;
+            continue;
         }
+
+        if(checkType(c, setobj, REDIS_SET)) {
+            zfree(sets);
+            return;
+        }
+
+        sets[j] = setobj;
     }
 
+    /**
+     * The result set is built by the kernel with its final encoding. If the
+     * dstKey is not NULL, then the set will be used to save the result object
+     * respect to the key.
+     */ 
+    if(op == REDIS_OP_UNION)
+        dstset = sunionBuild(sets, setnum);
+    else
+        dstset = sdiffBuild(sets, setnum);
+
     if(!dstkey){
-        addReplyMultiBulkLen(c, cardinality);
+        addReplyMultiBulkLen(c, setTypeSize(dstset));
 
         //Loop all the elements in the set
         si = setTypeInitIterator(dstset);
-        while((ele = setTypeNextObject(si)) != NULL){
-            addReplyBulk(c, ele);
-            decrRefCount(ele);
+        while((encoding = setTypeNext(si, &ele, &llele)) != -1){
+            if(encoding != REDIS_ENCODING_HT)
+                addReplyBulkLongLong(c, llele);
+            else
+                addReplyBulk(c, ele);
         }
         setTypeReleaseIterator(si);
         decrRefCount(dstset);
@@ -963,7 +1825,13 @@ void sunionDiffGenericCommand(redisClient *c,robj **setkeys, int setnum, robj *d
 
         //If the result set is not empty, that means we need
         //to store the result into the dstkey respect value.
-        if(setType(dstset) > 0){
+        if(setTypeSize(dstset) > 0){
+            /* A union of intsets may be longer than an intset is allowed
+             * to be, it is converted once, now that it is complete. */
+            if(dstset->encoding == REDIS_ENCODING_INTSET &&
+               intsetLen(dstset->ptr) > server.set_max_intset_entries)
+                setTypeConvertLargeIntset(dstset);
+
             dbAdd(c->db, dstkey, dstset);
             addReplyLongLong(c, setTypeSize(dstset));
             notifyKeyspaceEvent(REDIS_NOTIFY_SET,
@@ -987,7 +1855,7 @@ void sunionstoreCommand(redisClient *c){
     sunionDiffGenericCommand(c, c->argv+2, c->argc - 2, c->argv[1], REDIS_OP_UNION);
 }
 
-void sdiffstoreCommand(redisClient *c){
+void sdiffCommand(redisClient *c){
     sunionDiffGenericCommand(c, c->argv+1, c->argc - 1, NULL, REDIS_OP_DIFF);
 }
 
@@ -143,26 +143,36 @@ void setnxCommand(redisClient *c){
 
 /* Set existed command */
 void setexCommand(redisClient *c){
-	c->argv[2] = tryObjectEncoding(c->argv[2]);
+	c->argv[3] = tryObjectEncoding(c->argv[3]);
 	setGenericCommand(c, REDIS_SET_NO_FLAGS, c->argv[1], c->argv[3], c->argv[2], UNIT_SECONDS, NULL, NULL);
 
 }
 
 /** Milliseconds set command**/
 void psetexCommand(redisClient *c){
-	c->argv[3] = tryObjectEncoding(c->argv[2]);
+	c->argv[3] = tryObjectEncoding(c->argv[3]);
 	setGenericCommand(c, REDIS_SET_NO_FLAGS, c->argv[1], c->argv[3], c->argv[2], UNIT_MILLSECONDS, NULL, NULL);
 }
 
 int getGenericCommand(redisClient *c){
+	void *v;
 	robj *o;
 
 	//Try to get the value corresponding to the key
 	//If the value is not existed, return NULL
-	if((o = lookupKeyReadOrReply(c, c->argv[1], shared.nullbulk)) == NULL) 
+	if((v = lookupKeyReadRaw(c->db, c->argv[1])) == NULL){
+		addReply(c, shared.nullbulk);
+		return REDIS_OK;
+	}
+
+	//A small string packed into the entry is replied without an object
+	if(dbValueIsPacked(v)){
+		addReplyBulkPackedValue(c, v);
 		return REDIS_OK;
+	}
 
 	//The value is existed
+	o = v;
 	if(o->type != REDIS_STRING){
 		addReply(c, shared.wrongtypeerr);
 		return REDIS_ERR;
@@ -318,15 +328,19 @@ void mgetCommand(redisClient *c){
 	addReplyMultiBulkLen(c, c->argc-1);
 	for(j = 1; j < c->argc; j++){
 		//find the value by key
-		robj *o = lookupKeyRead(c->db, c->argv[j]);
-		if(o == NULL){
+		void *v = lookupKeyReadRaw(c->db, c->argv[j]);
+		if(v == NULL){
 			//The value is not exist, send reply to client
 			addReply(c, shared.nullbulk);
+		}else if(dbValueIsPacked(v)){
+			addReplyBulkPackedValue(c, v);
 		}else{
+			robj *o = v;
+
 			if(o->type != REDIS_STRING){
 				addReply(c, shared.nullbulk);
 			}else{
-				addReply(c, o);
+				addReplyBulk(c, o);
 			}
 		}
 	}
@@ -387,14 +401,23 @@ void msetnxCommand(redisClient *c){
 
 void incrDecrCommand(redisClient *c, long long incr){
 	long long value, oldvalue;
+	void *v, *packed;
 	robj *o, *new;
 
-	o = lookupKeyWrite(c->db, c->argv[1]);
-	//get the value object
+	//get the value, a counter is usually packed into the entry
+	v = lookupKeyWriteRaw(c->db, c->argv[1]);
+	o = (v != NULL && !dbValueIsPacked(v)) ? v : NULL;
 	if(o != NULL && checkType(c, o, REDIS_STRING)) return;
 
 	//Get value object and put it into the value variable.If failed then return error msg
-	if(getLongLongFromObjectOrReply(c, o ,&value, NULL) != REDIS_OK) return;
+	if(v != NULL && dbValueIsPacked(v)){
+		if(dbPackedValueGetLongLong(v, &value) != REDIS_OK){
+			addReplyError(c, "value is not an integer or out of range");
+			return;
+		}
+	}else if(getLongLongFromObjectOrReply(c, o ,&value, NULL) != REDIS_OK){
+		return;
+	}
 
 	//to do the operation check to prevent from overflow
 	oldvalue = value;
@@ -406,11 +429,20 @@ void incrDecrCommand(redisClient *c, long long incr){
 
 	//If the operation would not cause overflow then do the operation
 	value += incr;
-	new = createStringObjectFromLongLong(value);
-	if(o){
-		doOverwrite(c->db, c->argv[1], new);
+
+	//The new value is packed too when it fits, no object is created
+	if((packed = dbPackLongLong(value)) != NULL){
+		new = NULL;
+		if(v)
+			dbOverWritePacked(c->db, c->argv[1], packed);
+		else
+			dbAddPacked(c->db, c->argv[1], packed);
 	}else{
-		dnAdd(c->db, c->argv[1], new);
+		new = createStringObjectFromLongLong(value);
+		if(v)
+			dbOverWrite(c->db, c->argv[1], new);
+		else
+			dbAdd(c->db, c->argv[1], new);
 	}
 	
 	//Send msg to the databse
@@ -423,9 +455,13 @@ void incrDecrCommand(redisClient *c, long long incr){
 	server.dirty++;
 
 	//Reply
-	addReply(c, shared.colon);
-	addReply(c, new);
-	addReply(c, shared.crlf);
+	if(new){
+		addReply(c, shared.colon);
+		addReply(c, new);
+		addReply(c, shared.crlf);
+	}else{
+		addReplyLongLong(c, value);
+	}
 }
 
 void incrCommand(redisClient *c){
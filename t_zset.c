@@ -8,10 +8,10 @@ static int zslLexValueLteMax(robj *value, zlexrangespec *spec);
  * score is score
  */
 zskiplistNode *zslCreateNode(int level, double score, robj *obj){
-	
 	//allocate the mem space
-	zskiplistNode *zn = zmalloc(sizeof(*zn) + level * sizeof(struct zskiplistLevel));
+	zskiplistNode *zn = zmalloc(ZSL_NODE_SIZE(level));
 
+	zn->height = level;
 	zn->score = score;
 	zn->obj = obj;
 	return zn;
@@ -31,8 +31,8 @@ zskiplist *zslCreate(void){
 	//init the head node
 	zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL, 0, NULL);
 	for(j = 0; j < ZSKIPLIST_MAXLEVEL; j++){
-		zsl->header->level[j].forward = NULL;
-		zsl->header->level[j].span = 0;
+		ZSL_FORWARD(zsl->header, j) = NULL;
+		ZSL_SPAN(zsl->header, j) = 0;
 	}
 	zsl->header->backward = NULL;
 
@@ -47,21 +47,21 @@ zskiplist *zslCreate(void){
  */
 void zslFreeNode(zskiplistNode *node){
 	decrRefCount(node->obj);
-	zfree(node);	
+	zfree(node);
 }
 
 /**
  * Free the whole skiplist and all nodes inside
  */
 void zslFree(zskiplist *zsl){
-	zskiplistNode *next, *node = zsl->header->level[0].forward;
+	zskiplistNode *next, *node = ZSL_FORWARD(zsl->header, 0);
 	
 	//Free the header
 	zfree(zsl->header);
 
 	//Release all nodes
 	while(node){
-		next = node->level[0].forward;
+		next = ZSL_FORWARD(node, 0);
 		zslFreeNode(node);
 		node = next;
 	}
@@ -104,12 +104,12 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj){
 		rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
 
 		//Move forward
-		while(x->level[i].forward &&
-			(x->level[i].forward->score < score ||
-			(x->level[i].forward->score == score && 
-			 compareStringObject(x->level[i].forward->obj, obj) < 0))){
-			rank[i] += x->level[i].span;
-			x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) &&
+			(ZSL_FORWARD(x, i)->score < score ||
+			(ZSL_FORWARD(x, i)->score == score && 
+			 compareStringObject(ZSL_FORWARD(x, i)->obj, obj) < 0))){
+			rank[i] += ZSL_SPAN(x, i);
+			x = ZSL_FORWARD(x, i);
 		}
 		update[i] = x;
 	}
@@ -131,7 +131,7 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj){
 		for(i = zsl->level; i < level; i++){
 			rank[i]= 0;
 			update[i] = zsl->header;
-			update[i]->level[i].span = zsl->length;
+			ZSL_SPAN(update[i], i) = zsl->length;
 		}
 		
 		zsl->level = level;
@@ -145,23 +145,23 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj){
 		//to the next node of the previous node, then update the previous
 		//node to point to the inserted node.The different point is
 		//the skiplist has mutiple-level.
-		x->level[i].forward = update[i]->level[i].forward;
-		update[i]->level[i].forward = x;
+		ZSL_FORWARD(x, i) = ZSL_FORWARD(update[i], i);
+		ZSL_FORWARD(update[i], i) = x;
 
 		//update span covered by update[i] as x is inserted here.
-		x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+		ZSL_SPAN(x, i) = ZSL_SPAN(update[i], i) - (rank[0] - rank[i]);
 
-		update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+		ZSL_SPAN(update[i], i) = (rank[0] - rank[i]) + 1;
 	}	
 
 	for(i = level; i < zsl->level; i++){
-		update[i]->level[i].span++;
+		ZSL_SPAN(update[i], i)++;
 	}
 
 	//set the backward pointer for the new node
 	x->backward = (update[0] == zsl->header) ? NULL : update[0];
-	if(x->level[0].forward)
-		x->level[0].forward->backward = x;
+	if(ZSL_FORWARD(x, 0))
+		ZSL_FORWARD(x, 0)->backward = x;
 	else
 		zsl->tail = x;
 
@@ -170,6 +170,45 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj){
 	return x;
 }
 
+/* Append a new node after the tail of the skiplist. This is used to bulk
+ * build a skiplist from elements that are already in order, so there is no
+ * need to search for the insert position.
+ *
+ * `last` and `lastrank` hold, for every level, the last node of the level and
+ * its rank. Before the first append they must be set to zsl->header and 0 for
+ * all the ZSKIPLIST_MAXLEVEL levels.
+ *
+ * T = O(1)
+ */
+zskiplistNode *zslAppend(zskiplist *zsl, zskiplistNode **last, unsigned long *lastrank, double score, robj *obj){
+	zskiplistNode *x;
+	int i, level = zslRandomLevel();
+	unsigned long rank = zsl->length + 1;
+
+	if(level > zsl->level) zsl->level = level;
+	x = zslCreateNode(level, score, obj);
+
+	for(i = 0; i < level; i++){
+		ZSL_FORWARD(x, i) = NULL;
+		ZSL_SPAN(x, i) = 0;
+		ZSL_FORWARD(last[i], i) = x;
+		ZSL_SPAN(last[i], i) = rank - lastrank[i];
+		last[i] = x;
+		lastrank[i] = rank;
+	}
+
+	//The levels x doesn't reach now have one more element before the end
+	for(i = level; i < zsl->level; i++){
+		ZSL_SPAN(last[i], i)++;
+	}
+
+	x->backward = zsl->tail;
+	zsl->tail = x;
+	zsl->length++;
+
+	return x;
+}
+
 /**
  * Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank
  * T = O(1)
@@ -179,22 +218,22 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj){
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update){
 	int i;
 	for(i = 0; i < zsl->level; i++){
-		if(update[i]->level[i].forward == x){
-			update[i]->level[i].span += x->level[i].span - 1;
-			update[i]->level[i].forward = x->level[i].forward;
+		if(ZSL_FORWARD(update[i], i) == x){
+			ZSL_SPAN(update[i], i) += ZSL_SPAN(x, i) - 1;
+			ZSL_FORWARD(update[i], i) = ZSL_FORWARD(x, i);
 		}else{
-			update[i]->level[i].span -= 1;
+			ZSL_SPAN(update[i], i) -= 1;
 		}
 	}
 
 	//update the head and tail pointer
-	if(x->level[0].forward){
-		x->level[0].forward->backward = x->backward;
+	if(ZSL_FORWARD(x, 0)){
+		ZSL_FORWARD(x, 0)->backward = x->backward;
 	}else{
 		zsl->tail = x->backward;
 	}
 	//update the level and length varaible if necessary
-	while(zsl->level > 1 && zsl->header->level[zsl->level - 1].forward == NULL){
+	while(zsl->level > 1 && ZSL_FORWARD(zsl->header, zsl->level - 1) == NULL){
 		zsl->level--;
 	}
 	zsl->length--;
@@ -211,15 +250,15 @@ int zslDelete(zskiplist *zsl, double score, robj *obj){
 	int i;
 	x = zsl->header;
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward && 
-		      (x->level[i].forward->score < score || 
-		      (x->level[i].forward->score == score && 
-		       compareStringObject(x->level[i].forward->obj, obj) < 0))){
-			x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) && 
+		      (ZSL_FORWARD(x, i)->score < score || 
+		      (ZSL_FORWARD(x, i)->score == score && 
+		       compareStringObject(ZSL_FORWARD(x, i)->obj, obj) < 0))){
+			x = ZSL_FORWARD(x, i);
 		}
 		update[i] = x;
 	}
-	x = x->level[0].forward;
+	x = ZSL_FORWARD(x, 0);
 	/**
 	 * Delete them only when the score and object is the same as
 	 * the require node.
@@ -283,16 +322,16 @@ zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range){
 	if(!zslInRange(zsl, range)) return NULL;
 	x = zsl->header;
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward &&
-		      !zslValueGteMin(x->level[i].forward->score, range))
-			x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) &&
+		      !zslValueGteMin(ZSL_FORWARD(x, i)->score, range))
+			x = ZSL_FORWARD(x, i);
 	}
 
 	/**
 	 * Because we already check the zsl is in the range, 
-	 * so the x->level[0].forward is always exist
+	 * so the ZSL_FORWARD(x, 0) is always exist
 	 */
-	x = x->level[0].forward;
+	x = ZSL_FORWARD(x, 0);
 	
 	//Check to see if score <= max
 	if(!zslValueLteMax(x->score, range)) return NULL;
@@ -312,9 +351,9 @@ zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range){
 	if(!zslInRange(zsl, range)) return NULL;
 	x= zsl->header;
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward && 
-		      zslValueLteMax(x->level[i].forward->score, range))
-			x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) && 
+		      zslValueLteMax(ZSL_FORWARD(x, i)->score, range))
+			x = ZSL_FORWARD(x, i);
 	}
 	if(!zslValueGteMin(x->score, range)) return NULL;
 	return x;
@@ -336,18 +375,18 @@ unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dic
 	int i ;
 	x = zsl->header;
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward && (
+		while(ZSL_FORWARD(x, i) && (
 		      range->minex ?
-		      x->level[i].forward->score <= range->min : 
-		      x->level[i].forward->score < range->min))
-			x = x->level[i].forward;
+		      ZSL_FORWARD(x, i)->score <= range->min : 
+		      ZSL_FORWARD(x, i)->score < range->min))
+			x = ZSL_FORWARD(x, i);
 		update[i] = x;
 	}
 	//The loop stop at the element which next is greater or greater equals than
 	//the range min
-	x = x->level[0].forward;
+	x = ZSL_FORWARD(x, 0);
 	while(x && (range->maxex ? x->score < range->max : x->score <= range->max )){
-		zskiplistNode *next = x->level[0].forward;
+		zskiplistNode *next = ZSL_FORWARD(x, 0);
 		
 		//delete the current node from the skiplist
 		zslDeleteNode(zsl, x, update);
@@ -369,15 +408,15 @@ unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *di
 
 	x = zsl->header;
 	for(i = zsl->level -1; i >=0; i--){
-		while(x->level[i].forward && 
-		      !zslLexValueGteMin(x->level[i].forward->obj, range))
-				x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) && 
+		      !zslLexValueGteMin(ZSL_FORWARD(x, i)->obj, range))
+				x = ZSL_FORWARD(x, i);
 		update[i] = x;
 	}
 
-	x = x->level[0].forward;
+	x = ZSL_FORWARD(x, 0);
 	while(x && zslLexValueLteMax(x->obj, range)){
-		zskiplistNode *next = x->level[0].forward;
+		zskiplistNode *next = ZSL_FORWARD(x, 0);
 
 		zslDeleteNode(zsl, x, update);
 
@@ -407,17 +446,17 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
 
 	x = zsl->header;
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward && (tranversed + x->level[i].span < start)){
-			tranversed += x->level[i].span;
-			x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) && (tranversed + ZSL_SPAN(x, i) < start)){
+			tranversed += ZSL_SPAN(x, i);
+			x = ZSL_FORWARD(x, i);
 		}
 		update[i] = x;
 	}
 	tranversed++;
-	x = x->level[0].forward;
+	x = ZSL_FORWARD(x, 0);
 	//Delete all the node in the given rank
 	while(x && tranversed <= end){
-		zskiplistNode *next = x->level[0].forward;
+		zskiplistNode *next = ZSL_FORWARD(x, 0);
 		zskDeleteNode(zsl, x, update);
 		dictDelete(dict, x->obj);
 		zslFreeNode(x);
@@ -442,16 +481,17 @@ unsigned long zslGetRank(zskiplist *zsl, double score, robj *o){
 	
 	x = zsl->header;
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward &&
-		     (x->level[i].forward->score < score || 
-		     (compareStringObjects(x->level[i].forward->obj, o) <= 0))){
-			rank += x->level[i].span;
-			x = x->level[i].forward;
-		}
-		if(x-> obj && equalsStringObject(x->obj, o))
+		while(ZSL_FORWARD(x, i) &&
+		     (ZSL_FORWARD(x, i)->score < score || 
+		     (ZSL_FORWARD(x, i)->score == score &&
+		      compareStringObjects(ZSL_FORWARD(x, i)->obj, o) <= 0))){
+			rank += ZSL_SPAN(x, i);
+			x = ZSL_FORWARD(x, i);
+		}
+		if(x->obj && equalStringObjects(x->obj, o))
 			return rank;
-		return 0;
 	}
+	return 0;
 }
 
 /* Finds an element by its rank. The rank argument needs to be 1-based. 
@@ -472,10 +512,10 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
     for (i = zsl->level-1; i >= 0; i--) {
 
         // 遍历跳跃表并累积越过的节点数量
-        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
+        while (ZSL_FORWARD(x, i) && (traversed + ZSL_SPAN(x, i)) <= rank)
         {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
+            traversed += ZSL_SPAN(x, i);
+            x = ZSL_FORWARD(x, i);
         }
 
         // 如果越过的节点数量已经等于 rank
@@ -665,7 +705,7 @@ int zslIsInLexRange(zskiplist *zsl, zlexrangespec *range){
 	x = zsl->tail;
 	if(x == NULL || !zslLexValueGteMin(x->obj, range)) return 0;
 
-	x= zsl->header->level[0].forward;
+	x= ZSL_FORWARD(zsl->header, 0);
 	if(x == NULL || !zslLexValueLteMax(x->obj, range)) return 0;
 
 	return 1;
@@ -682,11 +722,11 @@ zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range){
 	
 	x = zsl->header;
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward &&
-		      !zslLexValueGteMin(x->level[i].forward->obj, range))
-			  x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) &&
+		      !zslLexValueGteMin(ZSL_FORWARD(x, i)->obj, range))
+			  x = ZSL_FORWARD(x, i);
 	}
-	x = x->level[0].forward;
+	x = ZSL_FORWARD(x, 0);
 	//This is an inner zskiplistNode, x can not be null
 	redisAssert(x != NULL);
 
@@ -707,9 +747,9 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range){
 	x = zsl->header;
 
 	for(i = zsl->level - 1; i >= 0; i--){
-		while(x->level[i].forward &&
-		      !zslLexValueLteMax(x->level[i].forward->obj, range))
-			  x = x->level[i].forward;
+		while(ZSL_FORWARD(x, i) &&
+		      !zslLexValueLteMax(ZSL_FORWARD(x, i)->obj, range))
+			  x = ZSL_FORWARD(x, i);
 	}
 
 	/*This is an inner range, so this node can not be NULL*/
@@ -724,6 +764,10 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range){
  **************************************************************************/ 
 /**
  * get the sptr pointer pointed score
+ *
+ * Scores are written with the ziplist binary double encoding, so the common
+ * case is a plain 8 bytes load. Ziplists loaded from older RDB files still
+ * hold scores as strings or integers, these are parsed as before.
  */ 
 double zzlGetScore(unsigned char *sptr){
 	unsigned char *vstr;
@@ -734,6 +778,9 @@ double zzlGetScore(unsigned char *sptr){
 
 	redisAssert(sptr != NULL);
 
+	//Fast path, the score is a binary double
+	if(ziplistGetDouble(sptr, &score)) return score;
+
 	//Get the value from the ziplist
 	redisAssert(ziplistGet(sptr, &vstr, &vlen, &vlong));
 
@@ -1005,6 +1052,183 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range){
 	return NULL;
 }
 
+/*------------------------------------------------------------------------------
+ * Ziplist offset index
+ *-----------------------------------------------------------------------------*/
+
+/* Counting the elements of a ziplist in a range only needs the position of the
+ * first and of the last element in range, but the ziplist can only be walked
+ * entry by entry. So a ziplist encoded sorted set gets an offset index, the
+ * i-th slot of which is the offset of the i-th element from the head of the
+ * ziplist, and both bounds are found with a binary search.
+ *
+ * The index belongs to the object, see zsetIndex(). It is built lazily by
+ * the first range count, and only its first 'valid' slots are trusted: a
+ * write into the ziplist moves the elements after the written one only, so
+ * it just cuts the valid prefix at that element, and the next count walks
+ * the ziplist from there. Appending elements, the usual case with growing
+ * scores, leaves the whole index valid.
+ */
+typedef struct zzlIndex{
+	//Number of leading slots describing the current ziplist
+	unsigned int valid;
+	//Number of slots allocated
+	unsigned int size;
+	//Offset of every element entry
+	uint32_t offsets[];
+}zzlIndex;
+
+/* Free the index of the sorted set, if any. */
+void zzlIndexRelease(robj *zobj){
+	if(zsetIndex(zobj) == NULL) return;
+	zfree(zsetIndex(zobj));
+	zsetIndex(zobj) = NULL;
+}
+
+/* Forget the offsets from the element at position `pos` on. Must be called
+ * before the ziplist is modified at that position.
+ */
+static void zzlIndexTruncate(robj *zobj, unsigned int pos){
+	zzlIndex *idx = zsetIndex(zobj);
+
+	if(idx != NULL && idx->valid > pos) idx->valid = pos;
+}
+
+static double zzlIndexGetScore(unsigned char *zl, zzlIndex *idx, unsigned int i){
+	unsigned char *sptr = ziplistNext(zl, zl + idx->offsets[i]);
+
+	redisAssert(sptr != NULL);
+	return zzlGetScore(sptr);
+}
+
+/* Forget the offsets from the first element whose score is not below `score`
+ * on, which is where an element of that score is inserted or deleted. Must
+ * be called before the ziplist is modified.
+ *
+ * T = O(log N)
+ */
+static void zzlIndexTruncateScore(robj *zobj, double score){
+	zzlIndex *idx = zsetIndex(zobj);
+	unsigned int lo = 0, hi, mid;
+
+	if(idx == NULL || idx->valid == 0) return;
+
+	hi = idx->valid;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(zzlIndexGetScore(zobj->ptr, idx, mid) < score)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	idx->valid = lo;
+}
+
+/* Return the index of the sorted set, walking the ziplist from the end of
+ * the valid prefix to complete it.
+ *
+ * T = O(1) when valid, O(N - valid) otherwise.
+ */
+static zzlIndex *zzlIndexGet(robj *zobj){
+	unsigned char *zl = zobj->ptr, *eptr, *sptr;
+	zzlIndex *idx = zsetIndex(zobj);
+	unsigned int len = zzlLength(zl), i;
+
+	if(idx == NULL || idx->size < len){
+		size_t bytes = sizeof(*idx) + sizeof(uint32_t) * len;
+
+		idx = idx ? zrealloc(idx, bytes) : zmalloc(bytes);
+		if(zsetIndex(zobj) == NULL) idx->valid = 0;
+		idx->size = len;
+		zsetIndex(zobj) = idx;
+	}
+	if(idx->valid > len) idx->valid = len;
+	if(idx->valid == len) return idx;
+
+	//Restart from the element following the last valid one
+	i = idx->valid;
+	if(i == 0){
+		eptr = ziplistIndex(zl, 0);
+	}else{
+		sptr = ziplistNext(zl, zl + idx->offsets[i-1]);
+		redisAssert(sptr != NULL);
+		eptr = ziplistNext(zl, sptr);
+	}
+	while(eptr != NULL){
+		sptr = ziplistNext(zl, eptr);
+		redisAssert(sptr != NULL);
+		idx->offsets[i++] = eptr - zl;
+		eptr = ziplistNext(zl, sptr);
+	}
+	redisAssert(i == len);
+	idx->valid = len;
+	return idx;
+}
+
+/* Return the number of elements of the ziplist whose score is in range.
+ * If `first` is not NULL the 0-based rank of the first element in range is
+ * stored in it.
+ *
+ * zslValueGteMin() is false then true and zslValueLteMax() is true then
+ * false along the ziplist, so both bounds can be found by binary search.
+ *
+ * T = O(log N) once the index is built.
+ */
+unsigned long zzlCountInRange(robj *zobj, zrangespec *range, unsigned long *first){
+	zzlIndex *idx = zzlIndexGet(zobj);
+	unsigned char *zl = zobj->ptr;
+	unsigned int lo = 0, hi = idx->valid, mid, start;
+
+	//Find the first element with score >= min
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(zslValueGteMin(zzlIndexGetScore(zl, idx, mid), range))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	start = lo;
+	if(first) *first = start;
+
+	//Find the first element with score > max, starting from the lower bound
+	hi = idx->valid;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(zslValueLteMax(zzlIndexGetScore(zl, idx, mid), range))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - start;
+}
+
+/* Same as zzlCountInRange but for a lexicographic range. */
+unsigned long zzlCountInLexRange(robj *zobj, zlexrangespec *range, unsigned long *first){
+	zzlIndex *idx = zzlIndexGet(zobj);
+	unsigned char *zl = zobj->ptr;
+	unsigned int lo = 0, hi = idx->valid, mid, start;
+
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(zzlLexValueGteMin(zl + idx->offsets[mid], range))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	start = lo;
+	if(first) *first = start;
+
+	hi = idx->valid;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(zzlLexValueLteMax(zl + idx->offsets[mid], range))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - start;
+}
+
 /* From the ziplist find the ele member, and store it score into variable `score`.
  * If success return pointer points to ele, otherwise return NULL.
  */
@@ -1051,19 +1275,16 @@ unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr){
  */ 
 unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, robj *ele, double score){
 	unsigned char *sptr;
-	char scorebuf[128];
-	int scorelen;
 	size_t offset;
 
 	redisAssertWithInfo(NULL, ele, sdsEncodedObject(ele));
-	scorelen = d2string(scorebuf, sizeof(scorebuf), score);
 
 	//Insert into the tail
 	if(eptr == NULL){
 		//Insert data into the tail
-		ziplistPush(zl, ele->ptr, sdslen(ele->ptr), ZIPLIST_TAIL);
-		//Insert score into the tail
-		ziplistPush(zl, (unsigned char *)scorebuf, scorelen, ZIPLIST_TAIL);
+		zl = ziplistPush(zl, ele->ptr, sdslen(ele->ptr), ZIPLIST_TAIL);
+		//Insert score into the tail, as a binary double
+		zl = ziplistPushDouble(zl, score, ZIPLIST_TAIL);
 	}else{
 		//Because the zl may changes when we insert something into the ziplist, 
 		//but the relative position never changes. So we remeber the relative 
@@ -1074,7 +1295,7 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, robj *ele, do
 
 		//Insert the score after the element
 		redisAssertWithInfo(NULL, ele, (sptr = ziplistNext(zl, eptr)) != NULL);
-		zl = ziplistInsert(zl, sptr, (unsigned char *)scorebuf, scorelen); 
+		zl = ziplistInsertDouble(zl, sptr, score);
 	}
 	return zl;
 }
@@ -1239,7 +1460,7 @@ void zsetConvert(robj *zobj, int encoding){
 		//Loop through the ziplist
 		while(eptr != NULL){
 			score = zzlGetScore(sptr);
-			ziplistGet(zl, &vstr, &len, &vlong);
+			ziplistGet(eptr, &vstr, &len, &vlong);
 			if(vstr){
 				ele = createStringObject((char *)vstr, len);
 			}else{
@@ -1255,6 +1476,7 @@ void zsetConvert(robj *zobj, int encoding){
 			zzlNext(zl, &eptr, &sptr);
 		}
 
+		zzlIndexRelease(zobj);
 		zfree(zobj->ptr);
 
 		zobj->ptr = zs;
@@ -1273,7 +1495,7 @@ void zsetConvert(robj *zobj, int encoding){
 		//to loop through the skiplist
 		dictRelease(zs->dict);
 
-		node = zs->zsl->header->level[0].forward;
+		node = ZSL_FORWARD(zs->zsl->header, 0);
 
 		//Free the header of the skiplist
 		zfree(zs->zsl->header);
@@ -1287,7 +1509,7 @@ void zsetConvert(robj *zobj, int encoding){
 			zl = zzlInsertAt(zl, NULL, ele, node->score);
 			decrRefCount(ele);
 
-			next = node->level[0].forward;
+			next = ZSL_FORWARD(node, 0);
 			zslFreeNode(node);
 			node = next;
 		}
@@ -1301,6 +1523,31 @@ void zsetConvert(robj *zobj, int encoding){
     }
 }
 
+/* Turn a skiplist back into a ziplist once it holds no more than
+ * 1/REDIS_COMPACT_RATIO of zset_max_ziplist_entries elements, all of them
+ * short enough for the ziplist. The margin keeps a sorted set that shrinks
+ * and grows around the limit from being converted back and forth.
+ *
+ * Returns 1 if the sorted set was converted.
+ */
+int zsetTryCompaction(robj *zobj){
+	zskiplistNode *node;
+	zset *zs;
+
+	if(zobj->encoding != REDIS_ENCODING_SKIPLIST) return 0;
+
+	zs = zobj->ptr;
+	if(zs->zsl->length > server.zset_max_ziplist_entries / REDIS_COMPACT_RATIO) return 0;
+
+	for(node = ZSL_FORWARD(zs->zsl->header, 0); node != NULL; node = ZSL_FORWARD(node, 0)){
+		if(sdsEncodedObject(node->obj) && sdslen(node->obj->ptr) > server.zset_max_ziplist_value)
+			return 0;
+	}
+
+	zsetConvert(zobj, REDIS_ENCODING_ZIPLIST);
+	return 1;
+}
+
 /*-------------------------------------------------------------------------------------
  * Sorted set commands
  *------------------------------------------------------------------------------------*/
@@ -1370,6 +1617,7 @@ void zaddGenericCommand(redisClient *c, int incr){
 				}
 
 				if(score != curscore){
+					zzlIndexTruncateScore(zobj, score < curscore ? score : curscore);
 					zobj->ptr = zzlDelete(zobj->ptr, eptr);
 					zobj->ptr = zzlInsert(zobj->ptr, ele, score);
 					server.dirty++;
@@ -1380,6 +1628,7 @@ void zaddGenericCommand(redisClient *c, int incr){
 				//If this element is not existed, then we insert them directly,
 				//because the zzlInsert already handle the operation to put them into
 				//the right position.
+				zzlIndexTruncateScore(zobj, score);
 				zobj->ptr = zzlInsert(zobj->ptr, ele, score);
 				//Check is we have exceed the limit of the ziplist implements
 				if(zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
@@ -1395,7 +1644,7 @@ void zaddGenericCommand(redisClient *c, int incr){
 			zset *zs = zobj->ptr;
 			zskiplistNode *znode;
 			dictEntry *de;
-			ele = tryObjectEncoding(c->argv[3 + j*2]);
+			ele = c->argv[3 + j*2] = tryObjectEncoding(c->argv[3 + j*2]);
 
 			de = dictFind(zs->dict, ele);
 			//Check if the element is existed.
@@ -1478,7 +1727,10 @@ void zremCommand(redisClient *c){
 	for(j = 2; j < c->argc; j++){
 		if(zobj->encoding == REDIS_ENCODING_ZIPLIST){
 			unsigned char *eptr;
-			if((eptr = zzlFind(zobj->ptr, c->argv[j], NULL)) != NULL){
+			double score;
+
+			if((eptr = zzlFind(zobj->ptr, c->argv[j], &score)) != NULL){
+				zzlIndexTruncateScore(zobj, score);
 				zobj->ptr= zzlDelete(zobj->ptr, eptr);
 				deleted++;
 
@@ -1581,12 +1833,15 @@ void zremrangeGenericCommand(redisClient *c, int rangeType){
 		switch (rangetype)
 		{
 			case ZRANGE_RANK:
+				zzlIndexTruncate(zobj, start);
 				zobj->ptr = zzlDeleteRangeByRank(zobj->ptr, start+1, end+1, &deleted);
 				break;
 			case ZRANGE_SCORE:
+				zzlIndexTruncateScore(zobj, range.min);
 				zobj->ptr = zzlDeleteRangeByScore(zobj->ptr, range, &delete);
 				break;
 			case ZRANGE_LEX:
+				zzlIndexTruncate(zobj, 0);
 				zobj->ptr = zzlDeleteRangeByLex(zobj->ptr, lexrange, &deleted);
 				break;
 		}
@@ -1767,7 +2022,7 @@ void zuiInitIterator(zsetopsrc *op){
             }
 		}else if(op->encoding == REDIS_ENCODING_SKIPLIST){
 			it->sl.zs = op->subject->ptr;
-			it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+			it->sl.node = ZSL_FORWARD(it->sl.zs->zsl->header, 0);
 		}else{
 			redisPanic("Unknown zset encoding");
 		}
@@ -1905,7 +2160,7 @@ int zuiNext(zsetopsrc *op, zsetopval *val){
 			val->ele =  it->sl.node->obj;
 			val->score = it->sl.node->score;
 
-			it->sl.node = it->sl.node->level[0].forward;
+			it->sl.node = ZSL_FORWARD(it->sl.node, 0);
 		}else{
 			redisPanic("Unknown zset encoding");
 		}
@@ -2321,6 +2576,18 @@ void zinterstoreCommand(redisClient *c){
 }
 
 /*This command use to implemented ZRANGE and ZREVRANGE */
+/* Emit a skiplist member as a bulk reply. The bytes are copied straight from
+ * the member into the client buffer, integer encoded members are formatted
+ * in place, so no decoded object is created per element as addReplyBulk()
+ * would do.
+ */
+static void zsetReplyMember(redisClient *c, robj *ele){
+	if(sdsEncodedObject(ele))
+		addReplyBulkCBuffer(c, ele->ptr, sdslen(ele->ptr));
+	else
+		addReplyBulkLongLong(c, (long)ele->ptr);
+}
+
 void zrangeGenericCommand(redisClient *c, int reverse){
 	robj *key = c->argv[1];
 	robj *zobj;
@@ -2418,7 +2685,7 @@ void zrangeGenericCommand(redisClient *c, int reverse){
 			if(start > 0)
 				ln = zslGetElementByRank(zsl, llen - start);
 		}else{
-			ln = zsl->header->level[0].forward;
+			ln = ZSL_FORWARD(zsl->header, 0);
 			if(start > 0)
 				//zsl start from 1
 				ln = zslGetElementByRank(zsl, start+1);
@@ -2427,10 +2694,10 @@ void zrangeGenericCommand(redisClient *c, int reverse){
 		while(rangelen--){
 			redisAssertWithInfo(c, zobj, ln != NULL);
 			ele = ln->obj;
-			addReplyBulk(c, ele);
+			zsetReplyMember(c, ele);
 			if(withscores)
 				addReplyDouble(c, ln->score);
-			ln = reverse ? ln->backward : ln->level[0].forward;
+			ln = reverse ? ln->backward : ZSL_FORWARD(ln, 0);
 		}
 
 	}else{
@@ -2586,7 +2853,7 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse){
 			if(reverse)
 				zn = zn->backward;
 			else
-				zn = zn->level[0].forward;
+				zn = ZSL_FORWARD(zn, 0);
 		}
 
 		while(ln && limit--){
@@ -2597,7 +2864,7 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse){
 				if(!zslValueLteMax(ln->score, &range)) break;
 		
 			rangelen++;
-			addReplyBulk(c, zn->obj);
+			zsetReplyMember(c, zn->obj);
 
 			if(withscores)
 				addReplyDouble(c, ln->score);
@@ -2605,7 +2872,7 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse){
 			if(reverse)
 				zn = zn->backward;
 			else
-				zn = zn->level[0].forward;
+				zn = ZSL_FORWARD(zn, 0);
 		}
 	}else{
 		redisPanic("Unknown sotred set encoding");
@@ -2624,11 +2891,70 @@ void zrevrangebyscoreCommand(redisClient *c){
 	genericZrangebyscoreCommand(c, 1);
 }
 
+/* Return the number of elements of the sorted set with a score in range, and
+ * if `first` is not NULL store the 0-based rank of the first of them in it.
+ *
+ * On ziplists both bounds are binary searched on the offset index. On
+ * skiplists the count is the distance between the rank of the first and the
+ * rank of the last element in range, if there is a first element in range
+ * there is a last one as well.
+ *
+ * T = O(log N)
+ */
+unsigned long zsetRankRangeByScore(robj *zobj, zrangespec *range, unsigned long *first){
+	unsigned long count = 0;
+
+	if(zobj->encoding == REDIS_ENCODING_ZIPLIST){
+		count = zzlCountInRange(zobj, range, first);
+	}else if(zobj->encoding == REDIS_ENCODING_SKIPLIST){	
+		zskiplist *zsl = ((zset*)zobj->ptr)->zsl;
+		zskiplistNode *fn, *ln;
+		unsigned long rank;
+
+		fn = zslFirstInRange(zsl, range);
+		if(fn != NULL){
+			ln = zslLastInRange(zsl, range);
+			redisAssertWithInfo(NULL, zobj, ln != NULL);
+			rank = zslGetRank(zsl, fn->score, fn->obj);
+			count = zslGetRank(zsl, ln->score, ln->obj) - rank + 1;
+			if(first) *first = rank - 1;
+		}
+	}else{
+		redisPanic("Unknown sotred set encoding");
+	}
+	return count;
+}
+
+/* Same as zsetRankRangeByScore but for a lexicographic range. */
+unsigned long zsetRankRangeByLex(robj *zobj, zlexrangespec *range, unsigned long *first){
+	unsigned long count = 0;
+
+	if(zobj->encoding == REDIS_ENCODING_ZIPLIST){
+		count = zzlCountInLexRange(zobj, range, first);
+	}else if(zobj->encoding == REDIS_ENCODING_SKIPLIST){
+		zskiplist *zsl = ((zset*)zobj->ptr)->zsl;
+		zskiplistNode *fn, *ln;
+		unsigned long rank;
+
+		fn = zslFirstInLexRange(zsl, range);
+		if(fn != NULL){
+			ln = zslLastInLexRange(zsl, range);
+			redisAssertWithInfo(NULL, zobj, ln != NULL);
+			rank = zslGetRank(zsl, fn->score, fn->obj);
+			count = zslGetRank(zsl, ln->score, ln->obj) - rank + 1;
+			if(first) *first = rank - 1;
+		}
+	}else{
+		redisPanic("Unknown sotred set encoding");
+	}
+	return count;
+}
+
 void zcountCommand(redisClient *c){
 	robj *key = c->argv[1];
 	robj *zobj;
 	zrangespec range;
-	int count = 0;
+	unsigned long count = 0;
 
 	//Parse the range arguments
 	if(zslParseRange(c->argv[2], c->argv[3], &range) != REDIS_OK){
@@ -2637,74 +2963,10 @@ void zcountCommand(redisClient *c){
 	}
 
 	/*Look up the sorted set */
-	if((zobj = lookupKeyReadOrReply(c, key, shared;czero)) == NULL || 
+	if((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL || 
 	   checkType(c, zobj, REDIS_ZSET)) return;
 
-	if(zobj->encoding == REDIS_ENCODING_ZIPLIST){
-		unsigned char *zl = zobj->ptr;
-		unsigned char *eptr, *sptr;
-		double score;
-
-		eptr = zzlFirstInRange(zl, &range);
-
-		//No element in this range
-		if(eptr == NULL){
-			addReply(c, shared.czero);
-			return;
-		}
-
-		sptr = zzlNext(zl, eptr);
-		score = zzlGetScore(sptr);
-		redisAssertWithInfo(c, zobj, zslValueLteMax(score, &range));
-		
-		while(eptr){
-			score = zzlGetScore(sptr);
-			if(!zslValueLteMax(score, &range)){
-				break;
-			}else{
-				count++;
-				zzlNext(zl, &eptr, &sptr);
-			}
-		}
-
-	}else if(zobj->encoding == REDIS_ENCODING_SKIPLIST){	
-		zset *zs = zobj->ptr;
-		zskiplist *zsl = zs->zsl;
-		zskiplistNode *zn;
-		unsigned long rank;
-
-		//Locate to the first element that is in the range
-		zn = zslFirstInRange(zsl, &range);
-
-		//If the zn is not NULL it means at least there is a element in the range
-		if(zn != NULL){
-			rank = zslGetRank(zsl, zn->score, zn->obj);
-
-			count = (zsl->length - (rank - 1));
-
-			//Find the last element in the range
-			zn = zslLastInRange(zsl, &range);
-
-			/*Use rank of the element, if any, to determine the actual count */
-			if(zn != NULL){
-				rank = zslGetRank(zsl, zn->score, zn->obj);
-
-				//Caculate the distance between frist element in range and last element in range
-				count -= (zsl->length - rank);
-			}
-		}
-		/* 	不得不说在跳表删除元素这里有很多的小细节需要注意,其实他也可以通过，获取到第一个
-		 *  在区间内的元素开始，依次遍历，直到找到一个不再范围内的元素为止。 但是这里他用了另一种方式
-		 *  来完成这个任务。首先他获取到第一个在这个区间内元素的rank， rank是从1开始的。
-		 *  那么从 该元素开始到结尾 有多少个元素呢？ zsl->length - (rank - 1) eg: zsl->length = 5, rank = 1;
-		 *  那么其实就是说 在计算从当前元素开始到结尾有多少元素时，需要的是rank - 1，随后我们只要找到最后一个在这个区间
-		 *  中的元素两者做减法就ok了不是吗？由于在求解最后一个在该区间rank值，到结尾有多少个元素，不包括最后一个在该区间
-		 *  的元素本身, zsl->length - (rank - 1) + 1，减1的理由和之前一样， 加1是因为当前元素不再区间内。 
-		 */
-	}else{
-		redisPanic("Unknown sotred set encoding");
-	}
-
+	count = zsetRankRangeByScore(zobj, &range, NULL);
 	addReplyLongLong(c, count);
 }
 
@@ -2712,7 +2974,7 @@ void zlexcountCommand(redisClient *c){
 	robj *key = c->argv[1];
 	robj *zobj;
 	zlexrangespec range;
-	int count = 0;
+	unsigned long count = 0;
 
 	//Parse the input into zlexrangespec
 	if(zslParseLexRange(c->argv[2], c->argv[3], &range) != REDIS_OK){
@@ -2728,51 +2990,7 @@ void zlexcountCommand(redisClient *c){
 			return;
 		}
 
-	if(zobj->encoding == REDIS_ENCODING_ZIPLIST){
-		unsigned char *zl = zobj->ptr;
-		unsigned char *eptr, *sptr;
-
-		eptr = zzlFirstInLexRange(zl, &range);
-
-		//No element in this range
-		if(eptr == NULL){
-			zslFreeLexRange(&range);
-			addRely(c, shared.czero);
-			return;
-		}
-
-		sptr = ziplistNext(zl, eptr);
-		redisAssertWithInfo(c, zobj, zzlLexValueLteMax(eptr, &range));
-
-		while(eptr){
-			if(!zzlLexValueLteMax(eptr, &range))
-				break;
-			count++;
-			zzlNext(zl, &eptr, &sptr);
-		}
-	}else if(zobj->encoding == REDIS_ENCODING_SKIPLIST){
-		zset *zs = zobj->ptr;
-		zskiplistNode *zn;
-		zskiplist *zsl = zs->zsl;
-		unsigned long rank;
-
-		zn = zslFirstInLexRange(zsl, &range);
-
-		if(zn != NULL){
-			rank = zslGetRank(zsl, zn->score, zn->obj);
-			count = zsl->length - (rank - 1);
-
-			zn = zslLastInLexRange(zsl, &range);
-
-			if(zn != NULL){
-				rank = zslGetRank(zsl, zn->score, zn->obj);
-				count -= (zsl->length - rank);
-			}
-		}
-
-	}else{
-		redisPanic("Unknown sotred set encoding");
-	}	
+	count = zsetRankRangeByLex(zobj, &range, NULL);
 	zslFreeLexRange(&range);
 	addReplyLongLong(c, count);
 }
@@ -2896,7 +3114,7 @@ void genericZrangebylexCommand(redisClient *c, int reverse){
 			if(reverse)
 				zn = zn->backward;
 			else
-				zn = zn->level[0].forward;
+				zn = ZSL_FORWARD(zn, 0);
 		}
 
 		while(zn && limit--){
@@ -2906,12 +3124,12 @@ void genericZrangebylexCommand(redisClient *c, int reverse){
 				if(!zslValueLteMax(zn->obj, &range)) break;
 
 			rangelen++;
-			addReplyBulk(c, zn->obj);
+			zsetReplyMember(c, zn->obj);
 
 			if(reverse)
 				zn = zn->backward;
 			else
-				zn = zn->level[0].forward;
+				zn = ZSL_FORWARD(zn, 0);
 		}
 
 	}else{
@@ -2929,6 +3147,255 @@ void zrevrangebylexCommand(redisClient *c){
 	genericZrangebylexCommand(c, 1);
 }
 
+/* Copy `count` elements of the sorted set `zobj`, starting at the 0-based
+ * rank `first`, into a new sorted set object.
+ *
+ * The elements come out of the source in order, so the target encoding is
+ * chosen up front and the target is built by appending: a ziplist with one
+ * push per element and score, or a skiplist whose nodes are linked after
+ * the tail by zslAppend() without searching. Skiplist members are shared
+ * with the source instead of copied.
+ */
+static robj *zsetCopyRange(robj *zobj, unsigned long first, unsigned long count){
+	int ziplist = count <= server.zset_max_ziplist_entries;
+	robj *dstobj;
+	unsigned long j;
+
+	//Members of a skiplist may be too long for a ziplist target
+	if(ziplist && zobj->encoding == REDIS_ENCODING_SKIPLIST){
+		zskiplistNode *ln = zslGetElementByRank(((zset*)zobj->ptr)->zsl, first+1);
+
+		for(j = 0; j < count && ziplist; j++){
+			if(sdsEncodedObject(ln->obj) &&
+			   sdslen(ln->obj->ptr) > server.zset_max_ziplist_value)
+				ziplist = 0;
+			ln = ZSL_FORWARD(ln, 0);
+		}
+	}
+
+	if(ziplist){
+		unsigned char *dzl = ziplistNew();
+		unsigned char buf[32];
+		unsigned char *vstr;
+		unsigned int vlen;
+		long long vlong;
+
+		if(zobj->encoding == REDIS_ENCODING_ZIPLIST){
+			unsigned char *zl = zobj->ptr;
+			unsigned char *eptr = ziplistIndex(zl, first*2), *sptr;
+
+			redisAssertWithInfo(NULL, zobj, eptr != NULL);
+			sptr = ziplistNext(zl, eptr);
+			for(j = 0; j < count; j++){
+				redisAssertWithInfo(NULL, zobj, ziplistGet(eptr, &vstr, &vlen, &vlong));
+				if(vstr == NULL){
+					vlen = ll2string((char*)buf, sizeof(buf), vlong);
+					vstr = buf;
+				}
+				dzl = ziplistPush(dzl, vstr, vlen, ZIPLIST_TAIL);
+				dzl = ziplistPushDouble(dzl, zzlGetScore(sptr), ZIPLIST_TAIL);
+				zzlNext(zl, &eptr, &sptr);
+			}
+		}else{
+			zskiplistNode *ln = zslGetElementByRank(((zset*)zobj->ptr)->zsl, first+1);
+
+			for(j = 0; j < count; j++){
+				robj *ele = ln->obj;
+
+				if(sdsEncodedObject(ele)){
+					vstr = ele->ptr;
+					vlen = sdslen(ele->ptr);
+				}else{
+					vlen = ll2string((char*)buf, sizeof(buf), (long)ele->ptr);
+					vstr = buf;
+				}
+				dzl = ziplistPush(dzl, vstr, vlen, ZIPLIST_TAIL);
+				dzl = ziplistPushDouble(dzl, ln->score, ZIPLIST_TAIL);
+				ln = ZSL_FORWARD(ln, 0);
+			}
+		}
+		dstobj = createZsetObjectFromZiplist(dzl);
+	}else{
+		zskiplistNode *last[ZSKIPLIST_MAXLEVEL];
+		unsigned long lastrank[ZSKIPLIST_MAXLEVEL];
+		zset *dzs;
+		zskiplistNode *node;
+		robj *ele;
+		double score;
+		int i;
+
+		dstobj = createZsetObject();
+		dzs = dstobj->ptr;
+		for(i = 0; i < ZSKIPLIST_MAXLEVEL; i++){
+			last[i] = dzs->zsl->header;
+			lastrank[i] = 0;
+		}
+
+		if(zobj->encoding == REDIS_ENCODING_ZIPLIST){
+			unsigned char *zl = zobj->ptr;
+			unsigned char *eptr = ziplistIndex(zl, first*2), *sptr;
+
+			redisAssertWithInfo(NULL, zobj, eptr != NULL);
+			sptr = ziplistNext(zl, eptr);
+			for(j = 0; j < count; j++){
+				ele = ziplistGetObject(eptr);
+				score = zzlGetScore(sptr);
+				node = zslAppend(dzs->zsl, last, lastrank, score, ele);
+				redisAssertWithInfo(NULL, ele, dictAdd(dzs->dict, ele, &node->score) == DICT_OK);
+				//Referenced by both the skiplist and the dictionary
+				incrRefCount(ele);
+				zzlNext(zl, &eptr, &sptr);
+			}
+		}else{
+			zskiplistNode *ln = zslGetElementByRank(((zset*)zobj->ptr)->zsl, first+1);
+
+			for(j = 0; j < count; j++){
+				ele = ln->obj;
+				node = zslAppend(dzs->zsl, last, lastrank, ln->score, ele);
+				redisAssertWithInfo(NULL, ele, dictAdd(dzs->dict, ele, &node->score) == DICT_OK);
+				incrRefCount(ele);
+				incrRefCount(ele);
+				ln = ZSL_FORWARD(ln, 0);
+			}
+		}
+	}
+	return dstobj;
+}
+
+/* ZRANGESTORE dst src min max [BYSCORE|BYLEX] [REV] [LIMIT offset count]
+ *
+ * Store the range of `src` that ZRANGE with the same arguments would reply
+ * into `dst`, and reply with the number of elements stored. Like the other
+ * ranged commands, REV swaps the meaning of min and max for BYSCORE and
+ * BYLEX.
+ */
+void zrangestoreCommand(redisClient *c){
+	robj *dstkey = c->argv[1];
+	robj *key = c->argv[2];
+	robj *zobj, *dstobj;
+	zrangespec range;
+	zlexrangespec lexrange;
+	int byscore = 0, bylex = 0, reverse = 0, haslimit = 0, touched = 0;
+	int minidx, maxidx, j;
+	long offset = 0, limit = -1, start = 0, end = -1;
+	unsigned long first = 0, count = 0;
+
+	//Parse the options
+	for(j = 5; j < c->argc; j++){
+		int leftargs = c->argc - j - 1;
+
+		if(!strcasecmp(c->argv[j]->ptr, "byscore")){
+			byscore = 1;
+		}else if(!strcasecmp(c->argv[j]->ptr, "bylex")){
+			bylex = 1;
+		}else if(!strcasecmp(c->argv[j]->ptr, "rev")){
+			reverse = 1;
+		}else if(!strcasecmp(c->argv[j]->ptr, "limit") && leftargs >= 2){
+			if(getLongFromObjectOrReply(c, c->argv[j+1], &offset, NULL) != REDIS_OK ||
+			   getLongFromObjectOrReply(c, c->argv[j+2], &limit, NULL) != REDIS_OK) return;
+			haslimit = 1;
+			j += 2;
+		}else{
+			addReply(c, shared.syntaxerr);
+			return;
+		}
+	}
+	if(byscore && bylex){
+		addReply(c, shared.syntaxerr);
+		return;
+	}
+	if(haslimit && !byscore && !bylex){
+		addReplyError(c, "LIMIT is only supported in combination with either BYSCORE or BYLEX");
+		return;
+	}
+
+	minidx = reverse ? 4 : 3;
+	maxidx = reverse ? 3 : 4;
+
+	//Parse the range
+	if(byscore){
+		if(zslParseRange(c->argv[minidx], c->argv[maxidx], &range) != REDIS_OK){
+			addReplyError(c, "min or max is not a float");
+			return;
+		}
+	}else if(bylex){
+		if(zslParseLexRange(c->argv[minidx], c->argv[maxidx], &lexrange) != REDIS_OK){
+			addReplyError(c, "min or max not valid string range item");
+			return;
+		}
+	}else{
+		if(getLongFromObjectOrReply(c, c->argv[3], &start, NULL) != REDIS_OK ||
+		   getLongFromObjectOrReply(c, c->argv[4], &end, NULL) != REDIS_OK) return;
+	}
+
+	zobj = lookupKeyRead(c->db, key);
+	if(zobj != NULL && checkType(c, zobj, REDIS_ZSET)){
+		if(bylex) zslFreeLexRange(&lexrange);
+		return;
+	}
+
+	/* Turn every kind of range into the 0-based rank of its first element
+	 * and its length, in the natural order of the sorted set. */
+	if(zobj != NULL){
+		if(byscore){
+			count = zsetRankRangeByScore(zobj, &range, &first);
+		}else if(bylex){
+			count = zsetRankRangeByLex(zobj, &lexrange, &first);
+		}else{
+			long llen = zsetLength(zobj);
+
+			if(start < 0) start += llen;
+			if(end < 0) end += llen;
+			if(start < 0) start = 0;
+			if(start <= end && start < llen){
+				if(end >= llen) end = llen - 1;
+				count = end - start + 1;
+				//ZREVRANGE indexes count from the tail
+				first = reverse ? llen - 1 - end : start;
+			}
+		}
+	}
+	if(bylex) zslFreeLexRange(&lexrange);
+
+	/* Apply LIMIT in the direction of the walk, with REV both the offset and
+	 * the count are taken from the tail of the range. */
+	if(offset < 0 || (unsigned long)offset >= count){
+		count = 0;
+	}else{
+		count -= offset;
+		if(!reverse) first += offset;
+		if(limit >= 0 && (unsigned long)limit < count){
+			if(reverse) first += count - limit;
+			count = limit;
+		}
+	}
+
+	/* Build the result before dstkey is deleted: dstkey may be the source
+	 * key itself, and deleting it releases zobj, maybe in the lazy free
+	 * thread. An empty range gives no object and just deletes dstkey. */
+	dstobj = count ? zsetCopyRange(zobj, first, count) : NULL;
+
+	//If the dstkey is existed, delete it.
+	if(dbDelete(c->db, dstkey)){
+		signalModifiedKey(c->db, dstkey);
+		touched = 1;
+		server.dirty++;
+	}
+
+	if(dstobj){
+		dbAdd(c->db, dstkey, dstobj);
+		addReplyLongLong(c, count);
+
+		if(!touched) signalModifiedKey(c->db, dstkey);
+		notifyKeyspaceEvent(REDIS_NOTIFY_ZSET, "zrangestore", dstkey, c->db->id);
+		server.dirty++;
+	}else{
+		addReply(c, shared.czero);
+		if(touched)
+			notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", dstkey, c->db->id);
+	}
+}
+
 void zcardCommand(redisClient *c){
 	robj *key = c->argv[1];
 	robj *zobj;
@@ -3069,6 +3536,56 @@ void zscanCommand(redisClient *c) {
     scanGenericCommand(c,o,cursor);
 }
 
+#ifdef REDIS_TEST
+/**
+ * Add members past zset_max_ziplist_entries the way ZADD does, and check
+ * that every member and its score survived the conversion to a skiplist.
+ * Half the members are integers, that the ziplist stores as such.
+ */
+int zsetTest(int argc, char **argv){
+	robj *zobj = createZsetZiplistObject(), *ele;
+	unsigned long j, count;
+	char buf[32];
+	dictEntry *de;
+	zset *zs;
+
+	REDIS_NOTUSED(argc);
+	REDIS_NOTUSED(argv);
+
+	if(server.zset_max_ziplist_entries == 0) server.zset_max_ziplist_entries = 128;
+	count = server.zset_max_ziplist_entries + 1;
+
+	for(j = 0; j < count; j++){
+		if(j % 2)
+			ele = createStringObjectFromLongLong(j);
+		else
+			ele = createStringObject(buf, snprintf(buf, sizeof(buf), "member:%lu", j));
+		zobj->ptr = zzlInsert(zobj->ptr, ele, (double)j);
+		decrRefCount(ele);
+		if(zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
+			zsetConvert(zobj, REDIS_ENCODING_SKIPLIST);
+	}
+
+	redisAssert(zobj->encoding == REDIS_ENCODING_SKIPLIST);
+	zs = zobj->ptr;
+	redisAssert(zs->zsl->length == count && dictSize(zs->dict) == count);
+	for(j = 0; j < count; j++){
+		if(j % 2)
+			ele = createStringObjectFromLongLong(j);
+		else
+			ele = createStringObject(buf, snprintf(buf, sizeof(buf), "member:%lu", j));
+		de = dictFind(zs->dict, ele);
+		redisAssert(de != NULL && *(double*)dictGetVal(de) == (double)j);
+		decrRefCount(ele);
+	}
+
+	decrRefCount(zobj);
+	printf("ZADD past zset_max_ziplist_entries keeps the members: OK\n");
+	return 0;
+}
+#endif
+
+
 
 
 
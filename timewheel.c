@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "timewheel.h"
+#include "zmalloc.h"
+
+/**
+ * Create a wheel of 'size' slots, a power of two, of 'resolution'
+ * milliseconds each, starting at the unix time 'now' in milliseconds.
+ */
+timeWheel *timeWheelCreate(unsigned long size, long long resolution, long long now){
+	timeWheel *tw = zmalloc(sizeof(*tw));
+	unsigned long j;
+
+	assert(size > 0 && (size & (size-1)) == 0 && resolution > 0);
+
+	tw->slots = zmalloc(sizeof(timeWheelEntry*) * size);
+	for(j = 0; j < size; j++) tw->slots[j] = NULL;
+	tw->size = size;
+	tw->resolution = resolution;
+	tw->tick = now / resolution;
+	tw->count = 0;
+	return tw;
+}
+
+/**
+ * Free the wheel. The entries belong to their owners and are not freed.
+ */
+void timeWheelRelease(timeWheel *tw){
+	if(tw == NULL) return;
+	zfree(tw->slots);
+	zfree(tw);
+}
+
+/**
+ * Arm the entry e, that must not be in the wheel, for the deadline 'when'.
+ * A deadline already in the past goes to the slot expired next.
+ *
+ * T = O(1)
+ */
+void timeWheelAdd(timeWheel *tw, timeWheelEntry *e, long long when, void *owner){
+	long long tick = when / tw->resolution;
+	unsigned long slot;
+
+	assert(e->slot == -1);
+
+	if(tick < tw->tick) tick = tw->tick;
+	slot = (unsigned long)tick & (tw->size-1);
+
+	e->when = when;
+	e->owner = owner;
+	e->prev = NULL;
+	e->next = tw->slots[slot];
+	if(e->next) e->next->prev = e;
+	tw->slots[slot] = e;
+	e->slot = slot;
+	tw->count++;
+}
+
+/**
+ * Disarm the entry e. Does nothing if it is not in the wheel, so that
+ * the owner can always call it on cleanup.
+ *
+ * T = O(1)
+ */
+void timeWheelRemove(timeWheel *tw, timeWheelEntry *e){
+	if(e->slot == -1) return;
+
+	if(e->prev)
+		e->prev->next = e->next;
+	else
+		tw->slots[e->slot] = e->next;
+	if(e->next) e->next->prev = e->prev;
+
+	e->prev = e->next = NULL;
+	e->slot = -1;
+	tw->count--;
+}
+
+/**
+ * Remove every entry whose deadline is not after 'now', calling proc()
+ * with its owner. The entry is already out of the wheel when proc() is
+ * called, so proc() may add it again or remove it safely, but it must not
+ * remove other entries.
+ *
+ * Returns the number of entries expired.
+ *
+ * T = O(S + M), S being the slots of the ticks elapsed, at most the size
+ * of the wheel, and M the entries sitting in them.
+ */
+unsigned long timeWheelExpire(timeWheel *tw, long long now, void (*proc)(void *owner)){
+	long long end = now / tw->resolution, t, last;
+	unsigned long expired = 0;
+
+	if(end < tw->tick) return 0;
+
+	//After a full turn every slot has been visited once
+	last = end;
+	if(end - tw->tick >= (long long)tw->size) last = tw->tick + tw->size - 1;
+
+	for(t = tw->tick; t <= last; t++){
+		unsigned long slot = (unsigned long)t & (tw->size-1);
+		timeWheelEntry *e = tw->slots[slot], *next;
+
+		while(e != NULL){
+			next = e->next;
+			if(e->when <= now){
+				timeWheelRemove(tw, e);
+				proc(e->owner);
+				expired++;
+			}
+			e = next;
+		}
+	}
+
+	//The current tick is not over yet: deadlines later in it are still
+	//in its slot, which is visited again by the next call
+	tw->tick = end;
+	return expired;
+}
@@ -0,0 +1,63 @@
+#ifndef __TIMEWHEEL_H
+#define __TIMEWHEEL_H
+
+/**
+ * A hashed timing wheel of deadlines in milliseconds.
+ *
+ * Time is cut in ticks of 'resolution' milliseconds, and a deadline goes
+ * to the slot of its tick modulo the number of slots. Expiring the due
+ * entries only visits the slots of the ticks elapsed since the last call,
+ * instead of every entry. An entry further away than a turn of the wheel
+ * stays in its slot, and is skipped until its own turn comes.
+ *
+ * The entries are embedded into the structures waiting for a deadline, so
+ * that adding or removing one allocates nothing and takes O(1).
+ */
+#define TIMEWHEEL_SLOTS 1024        /* Must be a power of two */
+#define TIMEWHEEL_RESOLUTION 10     /* Milliseconds per slot */
+
+typedef struct timeWheelEntry{
+	struct timeWheelEntry *prev, *next;
+
+	//Deadline, unix time in milliseconds
+	long long when;
+
+	//The structure the entry is embedded into
+	void *owner;
+
+	//Slot holding the entry, -1 when it is not in the wheel
+	long slot;
+}timeWheelEntry;
+
+typedef struct timeWheel{
+	timeWheelEntry **slots;
+
+	//Number of slots, a power of two
+	unsigned long size;
+
+	//Milliseconds per slot
+	long long resolution;
+
+	//First tick not expired yet
+	long long tick;
+
+	//Number of entries
+	unsigned long count;
+}timeWheel;
+
+#define timeWheelEntryInit(e) do{ \
+	(e)->prev = (e)->next = NULL; \
+	(e)->owner = NULL; \
+	(e)->when = 0; \
+	(e)->slot = -1; \
+}while(0)
+
+#define timeWheelLength(tw) ((tw)->count)
+
+timeWheel *timeWheelCreate(unsigned long size, long long resolution, long long now);
+void timeWheelRelease(timeWheel *tw);
+void timeWheelAdd(timeWheel *tw, timeWheelEntry *e, long long when, void *owner);
+void timeWheelRemove(timeWheel *tw, timeWheelEntry *e);
+unsigned long timeWheelExpire(timeWheel *tw, long long now, void (*proc)(void *owner));
+
+#endif
@@ -4,5 +4,6 @@
 #include "sds.h"
 
 int string2ll(const char *s, size_t slen, long long *value);
+int ll2string(char *s, size_t len, long long value);
 
 #endif
@@ -37,6 +37,14 @@
 #define ZIP_INT_24B  (0xc0|3<<4)
 #define ZIP_INT_8B   0xfe
 
+/**
+ * Binary double encoding, the content is the 8 bytes IEEE 754 value stored
+ * little endian. zipTryEncoding() never picks it, it is only written by
+ * ziplistPushDouble() and ziplistInsertDouble(), which lets sorted sets
+ * read scores back without parsing a string.
+ */
+#define ZIP_FLOAT_64B (0xc0|0x08)
+
 /**
  * 4 bit integer immediate encoding
  */
@@ -139,6 +147,7 @@ static unsigned int zipIntSize(unsigned char encoding){
 		case ZIP_INT_24B: return 3;
 		case ZIP_INT_32B: return 4;
 		case ZIP_INT_64B: return 8;
+		case ZIP_FLOAT_64B: return 8;
 		default: return 0; /* 4 bits immediate */
 	}
 	assert(NULL);
@@ -567,9 +576,12 @@ static unsigned char *__ziplistDelete(unsigned char *zl, unsigned char *p, unsig
 /**
  * Insert  item at "p".
  *
+ * When 'dval' is not NULL the item is the double it points to, saved with
+ * the ZIP_FLOAT_64B encoding, and 's' / 'slen' are ignored.
+ *
  * T = O(N ^ 2)
  */
-static unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen){
+static unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen, double *dval){
 	//caculate the current ziplist length
 	size_t curlen = intrev32ifbe(ZIPLIST_BYTES(zl)), reqlen , prevlen = 0;
 	size_t offset = 0;
@@ -600,7 +612,10 @@ static unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsig
 	 * entry ----- encoding, we use a very intuitive way, we first try to convert the input string into 
 	 * a number, if failed it means we can not use an number to represent this input in the ziplist.
 	 */
-	if(zipTryEncoding(s, slen, &value, &encoding)){
+	if(dval != NULL){
+		encoding = ZIP_FLOAT_64B;
+		reqlen = zipIntSize(encoding);
+	}else if(zipTryEncoding(s, slen, &value, &encoding)){
 		//If the input can be represent as a number, we use the function to determine how many space
 		//we need to hold the content
 		req = zipIntSize(encoding);
@@ -671,6 +686,9 @@ static unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsig
 
 	if(ZIP_IS_STR(encoding)){
 		memcpy(p, s, slen);
+	}else if(encoding == ZIP_FLOAT_64B){
+		memcpy(p, dval, sizeof(double));
+		memrev64ifbe(p);
 	}else{
 		zipSaveInteger(p, value, encoding);
 	}
@@ -691,7 +709,20 @@ unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int sle
 	unsigned char *p;
 	p = (where == ZIPLIST_HEAD) ? ZIPLIST_ENTRY_HEAD(zl) : ZIPLIST_ENTRY_END(zl);
 	
-	return __ziplistInsert(zl, p, s, slen);
+	return __ziplistInsert(zl, p, s, slen, NULL);
+}
+
+/**
+ * Push the double 'd' into the ziplist, using the binary double encoding.
+ *
+ * T = O(N ^ 2)
+ */
+unsigned char *ziplistPushDouble(unsigned char *zl, double d, int where){
+
+	unsigned char *p;
+	p = (where == ZIPLIST_HEAD) ? ZIPLIST_ENTRY_HEAD(zl) : ZIPLIST_ENTRY_END(zl);
+
+	return __ziplistInsert(zl, p, NULL, 0, &d);
 }
 
 /**
@@ -782,6 +813,8 @@ unsigned int ziplistGet(unsigned char *p, unsigned char **sstr, unsigned int *sl
 	if(sstr) *sstr = NULL;
 
 	entry = zipEntry(p);
+	//Binary doubles can't be returned as string or integer, use ziplistGetDouble()
+	assert(entry.encoding != ZIP_FLOAT_64B);
 	if(ZIP_IS_STR(entry.encoding)){
 		if(sstr){
 			*slen = entry.len;
@@ -802,7 +835,80 @@ unsigned int ziplistGet(unsigned char *p, unsigned char **sstr, unsigned int *sl
  * if p points to a entry, insert the new entry before the entry (p points to)
  */
 unsigned char *ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen){
-	return __ziplistInsert(zl, p, s, slen);
+	return __ziplistInsert(zl, p, s, slen, NULL);
+}
+
+/**
+ * Insert the double 'd' at "p", using the binary double encoding.
+ */
+unsigned char *ziplistInsertDouble(unsigned char *zl, unsigned char *p, double d){
+	return __ziplistInsert(zl, p, NULL, 0, &d);
+}
+
+/**
+ * If the entry pointed by 'p' uses the binary double encoding store its
+ * value in '*dval' and return 1, otherwise return 0 and leave '*dval' alone.
+ *
+ * Only the encoding byte is decoded, no zlentry is built.
+ *
+ * T = O(1)
+ */
+unsigned int ziplistGetDouble(unsigned char *p, double *dval){
+	unsigned int prevlensize;
+
+	if(p == NULL || p[0] == ZIP_END) return 0;
+
+	ZIP_DECODE_PREVLENSIZE(p, prevlensize);
+	if(p[prevlensize] != ZIP_FLOAT_64B) return 0;
+
+	memcpy(dval, p+prevlensize+1, sizeof(double));
+	memrev64ifbe(dval);
+	return 1;
+}
+
+/**
+ * Overwrite the integer entry pointed by 'p' with 'value', in place.
+ *
+ * This only works when the entry is integer encoded and 'value' fits the
+ * width of its encoding. A 4 bit immediate can only become another 4 bit
+ * immediate. The entry keeps its size, so nothing moves and neither the
+ * next entry nor the ziplist header need an update.
+ *
+ * Returns 1 if the entry was overwritten, 0 if the caller has to delete
+ * and insert the entry instead.
+ *
+ * T = O(1)
+ */
+unsigned int ziplistReplaceInteger(unsigned char *p, long long value){
+	unsigned int prevlensize;
+	unsigned char encoding;
+	int fits;
+
+	if(p == NULL || p[0] == ZIP_END) return 0;
+
+	ZIP_DECODE_PREVLENSIZE(p, prevlensize);
+	encoding = p[prevlensize];
+	if(ZIP_IS_STR(encoding)) return 0;
+
+	//The value is part of the encoding byte
+	if(encoding >= ZIP_INT_IMM_MIN && encoding <= ZIP_INT_IMM_MAX){
+		if(value < 0 || value > 12) return 0;
+		p[prevlensize] = ZIP_INT_IMM_MIN + value;
+		return 1;
+	}
+
+	switch(encoding){
+		case ZIP_INT_8B: fits = value >= INT8_MIN && value <= INT8_MAX; break;
+		case ZIP_INT_16B: fits = value >= INT16_MIN && value <= INT16_MAX; break;
+		case ZIP_INT_24B: fits = value >= INT24_MIN && value <= INT24_MAX; break;
+		case ZIP_INT_32B: fits = value >= INT32_MIN && value <= INT32_MAX; break;
+		case ZIP_INT_64B: fits = 1; break;
+		default: return 0; /* binary double */
+	}
+	if(!fits) return 0;
+
+	zipSaveInteger(p+prevlensize+1, value, encoding);
+	return 1;
 }
 
 /**
@@ -841,6 +947,114 @@ unsigned char *ziplistDeleteRange(unsigned char *zl, unsigned int index, unsigne
 	return (p == NULL) ? zl : __ziplistDelete(zl, p, num);
 }
 
+/**
+ * Returns the bytes of an entry holding s/slen after an entry of prevlen
+ * bytes. The entry is written at p unless p is NULL.
+ */
+static unsigned int zipWriteEntry(unsigned char *p, unsigned int prevlen, unsigned char *s, unsigned int slen){
+	unsigned char encoding = 0;
+	long long value = 0;
+	unsigned int headerlen, contentlen;
+
+	if(zipTryEncoding(s, slen, &value, &encoding)){
+		contentlen = zipIntSize(encoding);
+	}else{
+		contentlen = slen;
+	}
+
+	if(p == NULL){
+		return zipPrevEncodeLength(NULL, prevlen) + zipEncodeLength(NULL, encoding, slen) + contentlen;
+	}
+
+	headerlen = zipPrevEncodeLength(p, prevlen);
+	headerlen += zipEncodeLength(p+headerlen, encoding, slen);
+	if(ZIP_IS_STR(encoding)){
+		memcpy(p+headerlen, s, slen);
+	}else{
+		zipSaveInteger(p+headerlen, value, encoding);
+	}
+	return headerlen + contentlen;
+}
+
+/**
+ * Rewrite the ziplist with a single allocation.
+ *
+ * The entry i of zl is replaced by repl[i]/rlen[i] when repl is not NULL
+ * and repl[i] is not NULL, every other entry keeps its encoding and content.
+ * Then the 'count' entries of app/alen are appended.
+ *
+ * Doing the same with ziplistDelete()/ziplistInsert()/ziplistPush() costs a
+ * realloc and a move of the tail for every entry, here the final size is
+ * computed first and every entry is written once.
+ *
+ * The old ziplist is freed, the new one returned.
+ *
+ * T = O(N)
+ */
+unsigned char *ziplistRewrite(unsigned char *zl, unsigned char **repl, unsigned int *rlen, unsigned char **app, unsigned int *alen, unsigned int count){
+	unsigned char *p, *dst, *nzl;
+	size_t bytes = ZIPLIST_HEADER_SIZE + 1, tail = ZIPLIST_HEADER_SIZE;
+	unsigned int prevlen = 0, rawlen, bodylen, i, j;
+	zlentry entry;
+
+	/*First pass: the size of the new ziplist*/
+	p = ZIPLIST_ENTRY_HEAD(zl);
+	for(i = 0; p[0] != ZIP_END; i++){
+		entry = zipEntry(p);
+		if(repl != NULL && repl[i] != NULL){
+			rawlen = zipWriteEntry(NULL, prevlen, repl[i], rlen[i]);
+		}else{
+			//Only the prevlen field may change its size
+			bodylen = entry.headersize - entry.prevrawlensize + entry.len;
+			rawlen = zipPrevEncodeLength(NULL, prevlen) + bodylen;
+		}
+		bytes += rawlen;
+		prevlen = rawlen;
+		p += entry.headersize + entry.len;
+	}
+	for(j = 0; j < count; j++){
+		rawlen = zipWriteEntry(NULL, prevlen, app[j], alen[j]);
+		bytes += rawlen;
+		prevlen = rawlen;
+	}
+
+	/*Second pass: write the entries*/
+	nzl = zmalloc(bytes);
+	dst = ZIPLIST_ENTRY_HEAD(nzl);
+	prevlen = 0;
+	p = ZIPLIST_ENTRY_HEAD(zl);
+	for(i = 0; p[0] != ZIP_END; i++){
+		entry = zipEntry(p);
+		tail = dst - nzl;
+		if(repl != NULL && repl[i] != NULL){
+			rawlen = zipWriteEntry(dst, prevlen, repl[i], rlen[i]);
+		}else{
+			bodylen = entry.headersize - entry.prevrawlensize + entry.len;
+			rawlen = zipPrevEncodeLength(dst, prevlen);
+			memcpy(dst+rawlen, p+entry.prevrawlensize, bodylen);
+			rawlen += bodylen;
+		}
+		dst += rawlen;
+		prevlen = rawlen;
+		p += entry.headersize + entry.len;
+	}
+	for(j = 0; j < count; j++){
+		tail = dst - nzl;
+		rawlen = zipWriteEntry(dst, prevlen, app[j], alen[j]);
+		dst += rawlen;
+		prevlen = rawlen;
+	}
+
+	i += count;
+	ZIPLIST_BYTES(nzl) = intrev32ifbe(bytes);
+	ZIPLIST_TAIL_OFFSET(nzl) = intrev32ifbe(tail);
+	ZIPLIST_LENGTH(nzl) = intrev16ifbe(i < UINT16_MAX ? i : UINT16_MAX);
+	nzl[bytes-1] = ZIP_END;
+
+	zfree(zl);
+	return nzl;
+}
+
 /** 
  * Compare entry pointer 'p' with 'etnry.Return 1 if equal.
  *
@@ -860,7 +1074,7 @@ unsigned int ziplistCompare(unsigned char *p, unsigned char *sstr, unsigned int
 		}else{
 			return 0;
 		}	
-	}else{
+	}else if(entry.encoding != ZIP_FLOAT_64B){
 		//If the encoding indicate it is a number, so try to
 		//convert sstr  to a long long type, it may failded, beacause
 		//the sstr may not be represent in a 64bit number.
@@ -935,7 +1149,7 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
 			if(ZIP_IS_STR(encoding)){
 				if(len == vlen && memcpy(q, vstr, vlen) == 0)
 					return p;
-			}else{
+			}else if(encoding != ZIP_FLOAT_64B){
 				//This means current entry store a number 
 				//so we need try to convert the vstr to a number and do the comparsion.
 				//We use the vencoding as a flag to indicate whether we have done the convertion